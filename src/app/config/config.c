@@ -98,6 +98,7 @@
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
+#include "feature/nodelist/node_select.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -365,6 +366,7 @@ static const config_var_t option_vars_[] = {
   V(CircuitsAvailableTimeout,    INTERVAL, "0"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-1.0"), /*negative:'Use default'*/
+  V(CircuitPriorityPolicy,       STRING,   "EWMA"),
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
 #if defined(HAVE_MODULE_RELAY) || defined(TOR_UNIT_TESTS)
   /* The unit tests expect the ClientOnly default to be 0. */
@@ -544,6 +546,7 @@ static const config_var_t option_vars_[] = {
   VAR_D("HSLayer3Nodes",         ROUTERSET,  HSLayer3Nodes,  NULL),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
   V_IMMUTABLE(KeepBindCapabilities,        AUTOBOOL, "auto"),
+  V(KernelTLS,                   BOOL,     "0"),
   VAR("Log",                     LINELIST, Logs,             NULL),
   V(LogMessageDomains,           BOOL,     "0"),
   V(LogTimeGranularity,          MSEC_INTERVAL, "1 second"),
@@ -634,6 +637,7 @@ static const config_var_t option_vars_[] = {
   V(RejectPlaintextPorts,        CSV,      ""),
   V(RelayBandwidthBurst,         MEMUNIT,  "0"),
   V(RelayBandwidthRate,          MEMUNIT,  "0"),
+  V(RelayCryptoOffload,          BOOL,     "0"),
   V(RephistTrackTime,            INTERVAL, "24 hours"),
   V_IMMUTABLE(RunAsDaemon,       BOOL,     "0"),
   V(ReducedExitPolicy,           BOOL,     "0"),
@@ -654,6 +658,8 @@ static const config_var_t option_vars_[] = {
   OBSOLETE("SchedulerMaxFlushCells__"),
   V(KISTSchedRunInterval,        MSEC_INTERVAL, "0 msec"),
   V(KISTSockBufSizeFactor,       DOUBLE,   "1.0"),
+  V(KISTNotsentLowat,            BOOL,     "0"),
+  V(KISTAdaptiveRunInterval,     BOOL,     "0"),
   V(Schedulers,                  CSV,      "KIST,KISTLite,Vanilla"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   OBSOLETE("SocksListenAddress"),
@@ -681,6 +687,7 @@ static const config_var_t option_vars_[] = {
   VAR("UseEntryGuards",          BOOL,     UseEntryGuards_option, "1"),
   OBSOLETE("UseEntryGuardsAsDirGuards"),
   V(UseGuardFraction,            AUTOBOOL, "auto"),
+  V(UseIOUring,                  BOOL,     "0"),
   V(VanguardsLiteEnabled,        AUTOBOOL, "auto"),
   V(UseMicrodescriptors,         AUTOBOOL, "auto"),
   OBSOLETE("UseNTorHandshake"),
@@ -2264,6 +2271,10 @@ options_act,(const or_options_t *old_options))
   /* Change the cell EWMA settings */
   cmux_ewma_set_options(options, networkstatus_get_latest_consensus());
 
+  /* Don't keep path selection weights that we computed under our old
+   * options. */
+  node_select_invalidate();
+
   /* Update the BridgePassword's hashed version as needed.  We store this as a
    * digest so that we can do side-channel-proof comparisons on it.
    */
@@ -3376,6 +3387,12 @@ options_validate_cb(const void *old_options_, void *options_, char **msg)
     REJECT("TransPort is disabled in this build.");
 #endif /* defined(USE_TRANSPARENT) */
 
+  if (options->CircuitPriorityPolicy &&
+      strcasecmp(options->CircuitPriorityPolicy, "EWMA") &&
+      strcasecmp(options->CircuitPriorityPolicy, "LogEWMA")) {
+    REJECT("CircuitPriorityPolicy must be EWMA or LogEWMA.");
+  }
+
   if (options->TokenBucketRefillInterval <= 0
       || options->TokenBucketRefillInterval > 1000) {
     REJECT("TokenBucketRefillInterval must be between 1 and 1000 inclusive.");
@@ -7393,7 +7410,9 @@ parse_outbound_addresses(or_options_t *options, int validate_only, char **msg)
 
 /** Load one of the geoip files, <a>family</a> determining which
  * one. <a>default_fname</a> is used if on Windows and
- * <a>fname</a> equals "<default>". */
+ * <a>fname</a> equals "<default>".  We keep a packed copy of the file in
+ * our cache directory, so that we don't need to parse it every time we
+ * start. */
 static void
 config_load_geoip_file_(sa_family_t family,
                         const char *fname,
@@ -7402,6 +7421,8 @@ config_load_geoip_file_(sa_family_t family,
   const or_options_t *options = get_options();
   const char *msg = "";
   int severity = options_need_geoip_info(options, &msg) ? LOG_WARN : LOG_INFO;
+  char *cache_fname = get_cachedir_fname(family == AF_INET ?
+                                         "cached-geoip" : "cached-geoip6");
   int r;
 
 #ifdef _WIN32
@@ -7413,12 +7434,13 @@ config_load_geoip_file_(sa_family_t family,
     tor_asprintf(&free_fname, "%s\\%s", conf_root, default_fname);
     fname = free_fname;
   }
-  r = geoip_load_file(family, fname, severity);
+  r = geoip_load_file_with_cache(family, fname, cache_fname, severity);
   tor_free(free_fname);
 #else /* !defined(_WIN32) */
   (void)default_fname;
-  r = geoip_load_file(family, fname, severity);
+  r = geoip_load_file_with_cache(family, fname, cache_fname, severity);
 #endif /* defined(_WIN32) */
+  tor_free(cache_fname);
 
   if (r < 0 && severity == LOG_WARN) {
     log_warn(LD_GENERAL, "%s", msg);
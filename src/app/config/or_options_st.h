@@ -398,6 +398,12 @@ struct or_options_t {
   struct smartlist_t *AutomapHostsSuffixes;
   int KeepalivePeriod; /**< How often do we send padding cells to keep
                         * connections alive? */
+  /** If true, ask the kernel to encrypt the TLS records that we send on OR
+   * connections. */
+  int KernelTLS;
+  /** If true, read and write connections in batches with io_uring, where we
+   * can. */
+  int UseIOUring;
   int SocksTimeout; /**< How long do we let a socks connection wait
                      * unattached before we fail it? */
   int LearnCircuitBuildTimeout; /**< If non-zero, we attempt to learn a value
@@ -431,6 +437,9 @@ struct or_options_t {
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** If true, decrypt exit-ward relay cells on the cpuworker threads rather
+   * than in the main thread. */
+  int RelayCryptoOffload;
   struct config_line_t *RendConfigLines; /**< List of configuration lines
                                           * for rendezvous services. */
   char *ClientOnionAuthDir; /**< Directory to keep client
@@ -883,6 +892,10 @@ struct or_options_t {
    */
   double CircuitPriorityHalflife;
 
+  /** Which circuitmux policy new channels use to weight circuits by their
+   * cell counts: "EWMA" or "LogEWMA". */
+  char *CircuitPriorityPolicy;
+
   /** Set to true if the TestingTorNetwork configuration option is set.
    * This is used so that options_validate() has a chance to realize that
    * the defaults have changed. */
@@ -1048,6 +1061,16 @@ struct or_options_t {
   /** A multiplier for the KIST per-socket limit calculation. */
   double KISTSockBufSizeFactor;
 
+  /** If true, KIST bounds each socket's unsent data with TCP_NOTSENT_LOWAT
+   * and asks the kernel for TCP info at most about once per round trip,
+   * instead of on every scheduling run. */
+  int KISTNotsentLowat;
+
+  /** If true, KIST adapts its run interval to how long cells wait in their
+   * circuit queues and how full the kernel outqueues are, starting from
+   * KISTSchedRunInterval. */
+  int KISTAdaptiveRunInterval;
+
   /** The list of scheduler type string ordered by priority that is first one
    * has to be tried first. Default: KIST,KISTLite,Vanilla */
   struct smartlist_t *Schedulers;
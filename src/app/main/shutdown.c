@@ -22,10 +22,13 @@
 #include "core/or/channeltls.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitmux_ewma.h"
+#include "core/or/circuitmux_logewma.h"
 #include "core/or/circuitpadding.h"
 #include "core/or/conflux_pool.h"
 #include "core/or/connection_edge.h"
+#include "core/or/connection_or.h"
 #include "core/or/dos.h"
+#include "core/or/relay.h"
 #include "core/or/scheduler.h"
 #include "feature/client/addressmap.h"
 #include "feature/client/bridges.h"
@@ -129,6 +132,7 @@ tor_free_all(int postfork)
   channel_free_all();
   connection_free_all();
   connection_edge_free_all();
+  connection_or_free_all();
   scheduler_free_all();
   nodelist_free_all();
   microdesc_free_all();
@@ -139,8 +143,10 @@ tor_free_all(int postfork)
   hs_free_all();
   dos_free_all();
   circuitmux_ewma_free_all();
+  circuitmux_logewma_free_all();
   accounting_free_all();
   circpad_free_all();
+  cell_pools_free_all();
 
   if (!postfork) {
     config_free_all();
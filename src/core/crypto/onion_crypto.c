@@ -412,6 +412,79 @@ onion_skin_server_handshake(int type,
   return r;
 }
 
+/** Perform the server side of each of the <b>n</b> circuit-creation
+ * handshakes in <b>handshakes</b>, using the keys in <b>keys</b>, and set
+ * the result of each one as onion_skin_server_handshake() would.
+ *
+ * The ntor handshakes in the batch do their scalar multiplications
+ * together, which is cheaper than doing them one handshake at a time.  We
+ * do the others one at a time. */
+void
+onion_skin_server_handshake_batch(onion_server_handshake_t *handshakes,
+                                  int n,
+                                  const server_onion_keys_t *keys)
+{
+  onion_server_handshake_t *ntor[NTOR_SERVER_MAX_BATCH];
+  const uint8_t *skins[NTOR_SERVER_MAX_BATCH];
+  uint8_t *replies[NTOR_SERVER_MAX_BATCH];
+  uint8_t keys_tmp[NTOR_SERVER_MAX_BATCH][MAX_KEYS_TMP_LEN];
+  uint8_t *keys_tmp_ptrs[NTOR_SERVER_MAX_BATCH];
+  int results[NTOR_SERVER_MAX_BATCH];
+  size_t key_out_len = 0;
+  int i, n_ntor = 0;
+
+  for (i = 0; i < n; ++i) {
+    onion_server_handshake_t *hs = &handshakes[i];
+    /* We can only batch ntor handshakes that want the same amount of key
+     * material. */
+    if (hs->type == ONION_HANDSHAKE_TYPE_NTOR &&
+        hs->reply_out_maxlen >= NTOR_REPLY_LEN &&
+        hs->onionskin_len >= NTOR_ONIONSKIN_LEN &&
+        n_ntor < NTOR_SERVER_MAX_BATCH &&
+        (n_ntor == 0 || hs->key_out_len == key_out_len)) {
+      tor_assert(hs->key_out_len + DIGEST_LEN <= MAX_KEYS_TMP_LEN);
+      memset(hs->negotiated_params_out, 0,
+             sizeof(*hs->negotiated_params_out));
+      key_out_len = hs->key_out_len;
+      ntor[n_ntor] = hs;
+      skins[n_ntor] = hs->onion_skin;
+      replies[n_ntor] = hs->reply_out;
+      keys_tmp_ptrs[n_ntor] = keys_tmp[n_ntor];
+      ++n_ntor;
+    } else {
+      hs->result = onion_skin_server_handshake(hs->type,
+                                   hs->onion_skin, hs->onionskin_len,
+                                   keys, hs->ns_params,
+                                   hs->reply_out, hs->reply_out_maxlen,
+                                   hs->keys_out, hs->key_out_len,
+                                   hs->rend_nonce_out,
+                                   hs->negotiated_params_out);
+    }
+  }
+  if (n_ntor == 0)
+    return;
+
+  onion_skin_ntor_server_handshake_batch(n_ntor, skins,
+                                         keys->curve25519_key_map,
+                                         keys->junk_keypair,
+                                         keys->my_identity,
+                                         replies, keys_tmp_ptrs,
+                                         key_out_len + DIGEST_LEN,
+                                         results);
+  for (i = 0; i < n_ntor; ++i) {
+    onion_server_handshake_t *hs = ntor[i];
+    if (results[i] < 0) {
+      /* no need to memwipe here, since the output will never be used */
+      hs->result = -1;
+      continue;
+    }
+    memcpy(hs->keys_out, keys_tmp[i], key_out_len);
+    memcpy(hs->rend_nonce_out, keys_tmp[i]+key_out_len, DIGEST_LEN);
+    hs->result = NTOR_REPLY_LEN;
+  }
+  memwipe(keys_tmp, 0, n_ntor * sizeof(keys_tmp[0]));
+}
+
 /**
  * Takes a param response message from the exit, compares it to our
  * consensus parameters for sanity, and creates output parameters
@@ -50,6 +50,26 @@ int onion_skin_server_handshake(int type,
                       uint8_t *keys_out, size_t key_out_len,
                       uint8_t *rend_nonce_out,
                       circuit_params_t *negotiated_params_out);
+/** The arguments and result of one onion_skin_server_handshake() call, for
+ * onion_skin_server_handshake_batch(). */
+typedef struct onion_server_handshake_t {
+  int type;
+  const uint8_t *onion_skin;
+  size_t onionskin_len;
+  const circuit_params_t *ns_params;
+  uint8_t *reply_out;
+  size_t reply_out_maxlen;
+  uint8_t *keys_out;
+  size_t key_out_len;
+  uint8_t *rend_nonce_out;
+  circuit_params_t *negotiated_params_out;
+  /** Set to what onion_skin_server_handshake() would return. */
+  int result;
+} onion_server_handshake_t;
+
+void onion_skin_server_handshake_batch(onion_server_handshake_t *handshakes,
+                                       int n,
+                                       const server_onion_keys_t *keys);
 int onion_skin_client_handshake(int type,
                       const onion_handshake_state_t *handshake_state,
                       const uint8_t *reply, size_t reply_len,
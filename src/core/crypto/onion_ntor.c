@@ -22,6 +22,7 @@
 
 #define ONION_NTOR_PRIVATE
 
+#include "lib/cc/ctassert.h"
 #include "lib/crypt_ops/crypto_cipher.h"
 #include "lib/crypt_ops/crypto_digest.h"
 #include "lib/crypt_ops/crypto_hkdf.h"
@@ -154,96 +155,184 @@ onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
                                  uint8_t *key_out,
                                  size_t key_out_len)
 {
-  const tweakset_t *T = &proto1_tweaks;
-  /* Sensitive stack-allocated material. Kept in an anonymous struct to make
-   * it easy to wipe. */
-  struct {
-    uint8_t secret_input[SECRET_INPUT_LEN];
-    uint8_t auth_input[AUTH_INPUT_LEN];
-    curve25519_public_key_t pubkey_X;
-    curve25519_secret_key_t seckey_y;
-    curve25519_public_key_t pubkey_Y;
-    uint8_t verify[DIGEST256_LEN];
-  } s;
-  uint8_t *si = s.secret_input, *ai = s.auth_input;
+  int result;
+  onion_skin_ntor_server_handshake_batch(1, &onion_skin, private_keys,
+                                         junk_keys, my_node_id,
+                                         &handshake_reply_out, &key_out,
+                                         key_out_len, &result);
+  return result;
+}
+
+/** Sensitive material for one handshake in
+ * onion_skin_ntor_server_handshake_batch().  Kept in a struct to make it
+ * easy to wipe. */
+typedef struct ntor_server_scratch_t {
+  uint8_t secret_input[SECRET_INPUT_LEN];
+  uint8_t auth_input[AUTH_INPUT_LEN];
+  curve25519_public_key_t pubkey_X;
+  curve25519_secret_key_t seckey_y;
+  curve25519_public_key_t pubkey_Y;
+  uint8_t verify[DIGEST256_LEN];
+  /** Our onion keypair that the client named, or NULL if we can't go on
+   * with this handshake. */
   const curve25519_keypair_t *keypair_bB;
+} ntor_server_scratch_t;
+
+/** Helper for onion_skin_ntor_server_handshake_batch(): once we have the
+ * results of both scalar multiplications at the start of
+ * <b>s</b>->secret_input, finish the handshake, writing the reply into
+ * <b>handshake_reply_out</b> and <b>key_out_len</b> bytes of key material
+ * into <b>key_out</b>.  Return 0 on success, -1 on failure. */
+static int
+ntor_server_handshake_finish(ntor_server_scratch_t *s,
+                             const uint8_t *my_node_id,
+                             uint8_t *handshake_reply_out,
+                             uint8_t *key_out,
+                             size_t key_out_len)
+{
+  const tweakset_t *T = &proto1_tweaks;
+  const curve25519_keypair_t *keypair_bB = s->keypair_bB;
+  uint8_t *si = s->secret_input, *ai = s->auth_input;
   int bad;
 
-  /* Decode the onion skin */
-  /* XXXX Does this possible early-return business threaten our security? */
-  if (tor_memneq(onion_skin, my_node_id, DIGEST_LEN))
-    return -1;
-  /* Note that on key-not-found, we go through with this operation anyway,
-   * using "junk_keys". This will result in failed authentication, but won't
-   * leak whether we recognized the key. */
-  keypair_bB = dimap_search(private_keys, onion_skin + DIGEST_LEN,
-                            (void*)junk_keys);
-  if (!keypair_bB)
-    return -1;
-
-  memcpy(s.pubkey_X.public_key, onion_skin+DIGEST_LEN+DIGEST256_LEN,
-         CURVE25519_PUBKEY_LEN);
-
-  /* Make y, Y */
-  curve25519_secret_key_generate(&s.seckey_y, 0);
-  curve25519_public_key_generate(&s.pubkey_Y, &s.seckey_y);
-
-  /* NOTE: If we ever use a group other than curve25519, or a different
-   * representation for its points, we may need to perform different or
-   * additional checks on X here and on Y in the client handshake, or lose our
-   * security properties. What checks we need would depend on the properties
-   * of the group and its representation.
-   *
-   * In short: if you use anything other than curve25519, this aspect of the
-   * code will need to be reconsidered carefully. */
-
-  /* build secret_input */
-  curve25519_handshake(si, &s.seckey_y, &s.pubkey_X);
   bad = safe_mem_is_zero(si, CURVE25519_OUTPUT_LEN);
   si += CURVE25519_OUTPUT_LEN;
-  curve25519_handshake(si, &keypair_bB->seckey, &s.pubkey_X);
   bad |= safe_mem_is_zero(si, CURVE25519_OUTPUT_LEN);
   si += CURVE25519_OUTPUT_LEN;
 
   APPEND(si, my_node_id, DIGEST_LEN);
   APPEND(si, keypair_bB->pubkey.public_key, CURVE25519_PUBKEY_LEN);
-  APPEND(si, s.pubkey_X.public_key, CURVE25519_PUBKEY_LEN);
-  APPEND(si, s.pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
+  APPEND(si, s->pubkey_X.public_key, CURVE25519_PUBKEY_LEN);
+  APPEND(si, s->pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
   APPEND(si, PROTOID, PROTOID_LEN);
-  tor_assert(si == s.secret_input + sizeof(s.secret_input));
+  tor_assert(si == s->secret_input + sizeof(s->secret_input));
 
   /* Compute hashes of secret_input */
-  h_tweak(s.verify, s.secret_input, sizeof(s.secret_input), T->t_verify);
+  h_tweak(s->verify, s->secret_input, sizeof(s->secret_input), T->t_verify);
 
   /* Compute auth_input */
-  APPEND(ai, s.verify, DIGEST256_LEN);
+  APPEND(ai, s->verify, DIGEST256_LEN);
   APPEND(ai, my_node_id, DIGEST_LEN);
   APPEND(ai, keypair_bB->pubkey.public_key, CURVE25519_PUBKEY_LEN);
-  APPEND(ai, s.pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
-  APPEND(ai, s.pubkey_X.public_key, CURVE25519_PUBKEY_LEN);
+  APPEND(ai, s->pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
+  APPEND(ai, s->pubkey_X.public_key, CURVE25519_PUBKEY_LEN);
   APPEND(ai, PROTOID, PROTOID_LEN);
   APPEND(ai, SERVER_STR, SERVER_STR_LEN);
-  tor_assert(ai == s.auth_input + sizeof(s.auth_input));
+  tor_assert(ai == s->auth_input + sizeof(s->auth_input));
 
   /* Build the reply */
-  memcpy(handshake_reply_out, s.pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
+  memcpy(handshake_reply_out, s->pubkey_Y.public_key, CURVE25519_PUBKEY_LEN);
   h_tweak(handshake_reply_out+CURVE25519_PUBKEY_LEN,
-          s.auth_input, sizeof(s.auth_input),
+          s->auth_input, sizeof(s->auth_input),
           T->t_mac);
 
   /* Generate the key material */
   crypto_expand_key_material_rfc5869_sha256(
-                           s.secret_input, sizeof(s.secret_input),
+                           s->secret_input, sizeof(s->secret_input),
                            (const uint8_t*)T->t_key, strlen(T->t_key),
                            (const uint8_t*)T->m_expand, strlen(T->m_expand),
                            key_out, key_out_len);
 
-  /* Wipe all of our local state */
-  memwipe(&s, 0, sizeof(s));
-
   return bad ? -1 : 0;
 }
 
+/**
+ * Perform the server side of <b>n</b> ntor handshakes at once, as
+ * onion_skin_ntor_server_handshake() would for each i < n with
+ * <b>onion_skins</b>[i], <b>handshake_replies_out</b>[i], and
+ * <b>keys_out</b>[i].  Set <b>results_out</b>[i] to 0 on success and -1 on
+ * failure.  <b>n</b> must be no more than NTOR_SERVER_MAX_BATCH.
+ *
+ * Every handshake needs two curve25519 scalar multiplications of the
+ * client's key.  We do all of them for the whole batch in one call to
+ * curve25519_handshake_batch(), so that they can share their field
+ * inversions.
+ */
+void
+onion_skin_ntor_server_handshake_batch(int n,
+                               const uint8_t *const *onion_skins,
+                               const di_digest256_map_t *private_keys,
+                               const curve25519_keypair_t *junk_keys,
+                               const uint8_t *my_node_id,
+                               uint8_t *const *handshake_replies_out,
+                               uint8_t *const *keys_out,
+                               size_t key_out_len,
+                               int *results_out)
+{
+  ntor_server_scratch_t *scratch;
+  uint8_t *outputs[NTOR_SERVER_MAX_BATCH*2];
+  const curve25519_secret_key_t *skeys[NTOR_SERVER_MAX_BATCH*2];
+  const curve25519_public_key_t *pkeys[NTOR_SERVER_MAX_BATCH*2];
+  int i, n_mults = 0;
+
+  CTASSERT(NTOR_SERVER_MAX_BATCH*2 <= CURVE25519_HANDSHAKE_MAX_BATCH);
+  tor_assert(n >= 0);
+  tor_assert(n <= NTOR_SERVER_MAX_BATCH);
+  if (n == 0)
+    return;
+  scratch = tor_calloc(n, sizeof(ntor_server_scratch_t));
+
+  for (i = 0; i < n; ++i) {
+    ntor_server_scratch_t *s = &scratch[i];
+    const uint8_t *onion_skin = onion_skins[i];
+    results_out[i] = -1;
+
+    /* Decode the onion skin */
+    /* XXXX Does this possible early-return business threaten our security? */
+    if (tor_memneq(onion_skin, my_node_id, DIGEST_LEN))
+      continue;
+    /* Note that on key-not-found, we go through with this operation anyway,
+     * using "junk_keys". This will result in failed authentication, but won't
+     * leak whether we recognized the key. */
+    s->keypair_bB = dimap_search(private_keys, onion_skin + DIGEST_LEN,
+                                 (void*)junk_keys);
+    if (!s->keypair_bB)
+      continue;
+
+    memcpy(s->pubkey_X.public_key, onion_skin+DIGEST_LEN+DIGEST256_LEN,
+           CURVE25519_PUBKEY_LEN);
+
+    /* Make y, Y */
+    curve25519_secret_key_generate(&s->seckey_y, 0);
+    curve25519_public_key_generate(&s->pubkey_Y, &s->seckey_y);
+
+    /* NOTE: If we ever use a group other than curve25519, or a different
+     * representation for its points, we may need to perform different or
+     * additional checks on X here and on Y in the client handshake, or lose
+     * our security properties. What checks we need would depend on the
+     * properties of the group and its representation.
+     *
+     * In short: if you use anything other than curve25519, this aspect of
+     * the code will need to be reconsidered carefully. */
+
+    /* The start of secret_input is the results of our two scalar
+     * multiplications: y*X, then b*X. */
+    outputs[n_mults] = s->secret_input;
+    skeys[n_mults] = &s->seckey_y;
+    pkeys[n_mults] = &s->pubkey_X;
+    ++n_mults;
+    outputs[n_mults] = s->secret_input + CURVE25519_OUTPUT_LEN;
+    skeys[n_mults] = &s->keypair_bB->seckey;
+    pkeys[n_mults] = &s->pubkey_X;
+    ++n_mults;
+  }
+
+  curve25519_handshake_batch(outputs, skeys, pkeys, n_mults);
+
+  for (i = 0; i < n; ++i) {
+    if (scratch[i].keypair_bB) {
+      results_out[i] = ntor_server_handshake_finish(&scratch[i], my_node_id,
+                                                    handshake_replies_out[i],
+                                                    keys_out[i],
+                                                    key_out_len);
+    }
+  }
+
+  /* Wipe all of our local state */
+  memwipe(scratch, 0, n * sizeof(ntor_server_scratch_t));
+  tor_free(scratch);
+}
+
 /**
  * Perform the final client side of the ntor handshake, using the state in
  * <b>handshake_state</b> and the server's NTOR_REPLY_LEN-byte reply in
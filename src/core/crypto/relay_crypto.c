@@ -194,16 +194,43 @@ relay_decrypt_cell(circuit_t *circ, cell_t *cell,
     /* We're in the middle. Decrypt one layer. */
     relay_crypto_t *crypto = &TO_OR_CIRCUIT(circ)->crypto;
 
-    relay_crypt_one_payload(crypto->f_crypto, cell->payload);
-
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
-      /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(crypto->f_digest, cell)) {
-        *recognized = 1;
-        return 0;
-      }
-    }
+    if (relay_decrypt_one_outbound(crypto->f_crypto, crypto->f_digest, cell))
+      *recognized = 1;
+  }
+  return 0;
+}
+
+/** Decrypt one layer of <b>cell</b>, travelling away from the origin through
+ * a relay whose forward state is <b>cipher</b> and <b>digest</b>.  Return 1
+ * if the cell is recognized (and update <b>digest</b> accordingly), else
+ * return 0.
+ *
+ * This function touches nothing but its arguments, so it is safe to call
+ * from a worker thread, as long as no other thread is using <b>cipher</b> or
+ * <b>digest</b> at the same time.
+ */
+int
+relay_decrypt_one_outbound(crypto_cipher_t *cipher, crypto_digest_t *digest,
+                           cell_t *cell)
+{
+  relay_crypt_one_payload(cipher, cell->payload);
+  return relay_check_recognized_outbound(digest, cell);
+}
+
+/** As relay_decrypt_one_outbound(), for a <b>cell</b> whose layer of
+ * encryption has already been removed (for example, by
+ * crypto_cipher_crypt_inplace_multi()): return 1 if the cell is recognized
+ * with the forward digest <b>digest</b>, and 0 otherwise. */
+int
+relay_check_recognized_outbound(crypto_digest_t *digest, cell_t *cell)
+{
+  relay_header_t rh;
+
+  relay_header_unpack(&rh, cell->payload);
+  if (rh.recognized == 0) {
+    /* it's possibly recognized. have to check digest to be sure. */
+    if (relay_digest_matches(digest, cell))
+      return 1;
   }
   return 0;
 }
@@ -19,6 +19,10 @@ int relay_crypto_init(relay_crypto_t *crypto,
 int relay_decrypt_cell(circuit_t *circ, cell_t *cell,
                        cell_direction_t cell_direction,
                        crypt_path_t **layer_hint, char *recognized);
+int relay_decrypt_one_outbound(crypto_cipher_t *cipher,
+                               crypto_digest_t *digest,
+                               cell_t *cell);
+int relay_check_recognized_outbound(crypto_digest_t *digest, cell_t *cell);
 void relay_encrypt_cell_outbound(cell_t *cell, origin_circuit_t *or_circ,
                             crypt_path_t *layer_hint);
 void relay_encrypt_cell_inbound(cell_t *cell, or_circuit_t *or_circ);
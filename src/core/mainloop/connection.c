@@ -69,6 +69,7 @@
 #include "app/config/config.h"
 #include "app/config/resolve_addr.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
 #include "core/or/channel.h"
@@ -199,6 +200,8 @@ const tor_addr_t *conn_get_outbound_address(sa_family_t family,
                   const or_options_t *options, unsigned int conn_type);
 static void reenable_blocked_connection_init(const or_options_t *options);
 static void reenable_blocked_connection_schedule(void);
+static void connection_bw_blocked_add(connection_t *conn);
+static void connection_bw_blocked_remove(connection_t *conn);
 
 /** The last addresses that our network interface seemed to have been
  * binding to.  We use this as one way to detect when our IP changes.
@@ -618,6 +621,7 @@ entry_connection_new(int type, int socket_family)
    * no rate limiting. */
   token_bucket_rw_init(&ENTRY_TO_EDGE_CONN(entry_conn)->bucket, INT32_MAX,
                        INT32_MAX, monotime_coarse_get_stamp());
+  connection_ap_schedule_expiry(entry_conn);
   return entry_conn;
 }
 
@@ -738,6 +742,7 @@ connection_init(time_t now, connection_t *conn, int type, int socket_family)
 
   conn->s = TOR_INVALID_SOCKET; /* give it a default of 'not used' */
   conn->conn_array_index = -1; /* also default to 'not used' */
+  conn->bw_blocked_index = -1;
   conn->global_identifier = n_connections_allocated++;
 
   conn->type = type;
@@ -842,6 +847,9 @@ connection_free_minimal(connection_t *conn)
              (int)connection_get_outbuf_len(conn));
   }
 
+  connection_uring_forget(conn);
+  connection_bw_blocked_remove(conn);
+
   if (!connection_is_listener(conn)) {
     buf_free(conn->inbuf);
     buf_free(conn->outbuf);
@@ -896,6 +904,9 @@ connection_free_minimal(connection_t *conn)
       or_conn->chan = NULL;
     }
   }
+  if (conn->type == CONN_TYPE_OR || conn->type == CONN_TYPE_EXT_OR) {
+    connection_or_free_expiry(TO_OR_CONN(conn));
+  }
   if (conn->type == CONN_TYPE_AP) {
     entry_connection_t *entry_conn = TO_ENTRY_CONN(conn);
     tor_str_wipe_and_free(entry_conn->chosen_exit_name);
@@ -908,6 +919,7 @@ connection_free_minimal(connection_t *conn)
     if (entry_conn->sending_optimistic_data) {
       buf_free(entry_conn->sending_optimistic_data);
     }
+    connection_ap_free_expiry(entry_conn);
   }
   if (CONN_IS_EDGE(conn)) {
     hs_ident_edge_conn_free(TO_EDGE_CONN(conn)->hs_ident);
@@ -3482,7 +3494,7 @@ connection_bucket_get_share(int base, int priority,
 }
 
 /** How many bytes at most can we read onto this connection? */
-static ssize_t
+ssize_t
 connection_bucket_read_limit(connection_t *conn, time_t now)
 {
   int base = RELAY_PAYLOAD_SIZE;
@@ -3751,6 +3763,7 @@ connection_read_bw_exhausted(connection_t *conn, bool is_global_bw)
   if (!CONN_IS_EDGE(conn) || !TO_EDGE_CONN(conn)->xoff_received) {
     conn->read_blocked_on_bw = 1;
     connection_stop_reading(conn);
+    connection_bw_blocked_add(conn);
     reenable_blocked_connection_schedule();
   }
 }
@@ -3767,64 +3780,87 @@ connection_write_bw_exhausted(connection_t *conn, bool is_global_bw)
   (void)is_global_bw;
   conn->write_blocked_on_bw = 1;
   connection_stop_writing(conn);
+  connection_bw_blocked_add(conn);
   reenable_blocked_connection_schedule();
 }
 
-/** If we have exhausted our global buckets, or the buckets for conn,
- * stop reading. */
-void
-connection_consider_empty_read_buckets(connection_t *conn)
+/** If one of the token buckets that limit reading on <b>conn</b> is empty,
+ * return a string saying which one, and set *<b>is_global_out</b> to
+ * whether it is a global bucket.  Otherwise return NULL. */
+static const char *
+connection_read_bucket_empty_reason(connection_t *conn, bool *is_global_out)
 {
-  int is_global = 1;
-  const char *reason;
+  *is_global_out = true;
 
   if (CONN_IS_EDGE(conn) &&
              token_bucket_rw_get_read(&TO_EDGE_CONN(conn)->bucket) <= 0) {
-    reason = "edge connection read bucket exhausted. Pausing.";
-    is_global = false;
+    *is_global_out = false;
+    return "edge connection read bucket exhausted. Pausing.";
   } else if (!connection_is_rate_limited(conn)) {
-    return; /* Always okay. */
+    return NULL; /* Always okay. */
   } else if (token_bucket_rw_get_read(&global_bucket) <= 0) {
-    reason = "global read bucket exhausted. Pausing.";
+    return "global read bucket exhausted. Pausing.";
   } else if (connection_counts_as_relayed_traffic(conn, approx_time()) &&
              token_bucket_rw_get_read(&global_relayed_bucket) <= 0) {
-    reason = "global relayed read bucket exhausted. Pausing.";
+    return "global relayed read bucket exhausted. Pausing.";
   } else if (connection_speaks_cells(conn) &&
              conn->state == OR_CONN_STATE_OPEN &&
              token_bucket_rw_get_read(&TO_OR_CONN(conn)->bucket) <= 0) {
-    reason = "connection read bucket exhausted. Pausing.";
-    is_global = false;
-  } else {
-    return; /* all good, no need to stop it */
+    *is_global_out = false;
+    return "connection read bucket exhausted. Pausing.";
   }
-
-  LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
-  connection_read_bw_exhausted(conn, is_global);
+  return NULL; /* all good, no need to stop it */
 }
 
-/** If we have exhausted our global buckets, or the buckets for conn,
- * stop writing. */
-void
-connection_consider_empty_write_buckets(connection_t *conn)
+/** As connection_read_bucket_empty_reason(), but for the buckets that limit
+ * writing on <b>conn</b>. */
+static const char *
+connection_write_bucket_empty_reason(connection_t *conn, bool *is_global_out)
 {
-  const char *reason;
+  *is_global_out = true;
 
   if (!connection_is_rate_limited(conn))
-    return; /* Always okay. */
+    return NULL; /* Always okay. */
 
-  bool is_global = true;
   if (token_bucket_rw_get_write(&global_bucket) <= 0) {
-    reason = "global write bucket exhausted. Pausing.";
+    return "global write bucket exhausted. Pausing.";
   } else if (connection_counts_as_relayed_traffic(conn, approx_time()) &&
              token_bucket_rw_get_write(&global_relayed_bucket) <= 0) {
-    reason = "global relayed write bucket exhausted. Pausing.";
+    return "global relayed write bucket exhausted. Pausing.";
   } else if (connection_speaks_cells(conn) &&
              conn->state == OR_CONN_STATE_OPEN &&
              token_bucket_rw_get_write(&TO_OR_CONN(conn)->bucket) <= 0) {
-    reason = "connection write bucket exhausted. Pausing.";
-    is_global = false;
-  } else
-    return; /* all good, no need to stop it */
+    *is_global_out = false;
+    return "connection write bucket exhausted. Pausing.";
+  }
+  return NULL; /* all good, no need to stop it */
+}
+
+/** If we have exhausted our global buckets, or the buckets for conn,
+ * stop reading. */
+void
+connection_consider_empty_read_buckets(connection_t *conn)
+{
+  bool is_global;
+  const char *reason = connection_read_bucket_empty_reason(conn, &is_global);
+
+  if (!reason)
+    return;
+
+  LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
+  connection_read_bw_exhausted(conn, is_global);
+}
+
+/** If we have exhausted our global buckets, or the buckets for conn,
+ * stop writing. */
+void
+connection_consider_empty_write_buckets(connection_t *conn)
+{
+  bool is_global;
+  const char *reason = connection_write_bucket_empty_reason(conn, &is_global);
+
+  if (!reason)
+    return;
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
   connection_write_bw_exhausted(conn, is_global);
@@ -3912,41 +3948,120 @@ connection_bucket_refill_single(connection_t *conn, uint32_t now_ts)
  */
 static mainloop_event_t *reenable_blocked_connections_ev = NULL;
 
+/**
+ * List of the connections that may be blocked on read or write because of
+ * bandwidth, so that we don't have to look at every connection to find
+ * them.  Every connection whose read_blocked_on_bw or write_blocked_on_bw is
+ * set is in it; a connection in it knows its index in bw_blocked_index.
+ */
+static smartlist_t *bw_blocked_conns = NULL;
+
 /** True iff reenable_blocked_connections_ev is currently scheduled. */
 static int reenable_blocked_connections_is_scheduled = 0;
 
 /** Delay after which to run reenable_blocked_connections_ev. */
 static struct timeval reenable_blocked_connections_delay;
 
+/** Add <b>conn</b> to bw_blocked_conns, if it isn't there already. */
+static void
+connection_bw_blocked_add(connection_t *conn)
+{
+  if (conn->bw_blocked_index >= 0)
+    return;
+  if (!bw_blocked_conns)
+    bw_blocked_conns = smartlist_new();
+  conn->bw_blocked_index = smartlist_len(bw_blocked_conns);
+  smartlist_add(bw_blocked_conns, conn);
+}
+
+/** Remove <b>conn</b> from bw_blocked_conns, if it is there. */
+static void
+connection_bw_blocked_remove(connection_t *conn)
+{
+  const int idx = conn->bw_blocked_index;
+
+  if (idx < 0)
+    return;
+  if (BUG(!bw_blocked_conns) ||
+      BUG(smartlist_get(bw_blocked_conns, idx) != conn)) {
+    conn->bw_blocked_index = -1;
+    return;
+  }
+  /* Move the last connection into conn's slot. */
+  smartlist_del(bw_blocked_conns, idx);
+  if (idx < smartlist_len(bw_blocked_conns)) {
+    connection_t *moved = smartlist_get(bw_blocked_conns, idx);
+    moved->bw_blocked_index = idx;
+  }
+  conn->bw_blocked_index = -1;
+}
+
 /**
- * Re-enable all connections that were previously blocked on read or write.
- * This event is scheduled after enough time has elapsed to be sure
- * that the buckets will refill when the connections have something to do.
+ * Re-enable the connections that were previously blocked on read or write,
+ * and whose token buckets have refilled since.  This event is scheduled
+ * after enough time has elapsed to be sure that the buckets will refill when
+ * the connections have something to do.
+ *
+ * We only look at the connections in bw_blocked_conns, and check their
+ * buckets from the top down, as connection_consider_empty_read_buckets()
+ * does: the global buckets, the relayed traffic buckets, and the
+ * connection's own bucket.  If one of them is still empty, the connection
+ * would block again as soon as it tried to use it, so it stays blocked
+ * until the next run of this event.
  */
-static void
+STATIC void
 reenable_blocked_connections_cb(mainloop_event_t *ev, void *arg)
 {
+  const uint32_t now_ts = monotime_coarse_get_stamp();
+  smartlist_t *blocked = bw_blocked_conns;
+  bool is_global;
   (void)ev;
   (void)arg;
-  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+
+  reenable_blocked_connections_is_scheduled = 0;
+  if (!blocked)
+    return;
+
+  /* The connections that stay blocked go on a new list. */
+  bw_blocked_conns = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(blocked, connection_t *, conn) {
+    conn->bw_blocked_index = -1;
+    if (conn->conn_array_index < 0) {
+      /* Not in the connection array (any more): leave it alone. */
+      if (conn->read_blocked_on_bw || conn->write_blocked_on_bw)
+        connection_bw_blocked_add(conn);
+      continue;
+    }
+
+    connection_bucket_refill_single(conn, now_ts);
+
     /* For conflux, we noticed logs of connection_start_reading() called
      * multiple times while we were blocked from a previous XOFF, and this
      * was log was correlated with stalls during ssh uploads. So we added
      * this additional check, to avoid connection_start_reading() without
      * getting an XON. The most important piece is always allowing
      * the read_blocked_on_bw to get cleared, either way. */
-    if (conn->read_blocked_on_bw == 1 &&
-        (!CONN_IS_EDGE(conn) || !TO_EDGE_CONN(conn)->xoff_received)) {
-      connection_start_reading(conn);
+    if (conn->read_blocked_on_bw == 1) {
+      if (CONN_IS_EDGE(conn) && TO_EDGE_CONN(conn)->xoff_received) {
+        conn->read_blocked_on_bw = 0;
+      } else if (!connection_read_bucket_empty_reason(conn, &is_global)) {
+        connection_start_reading(conn);
+        conn->read_blocked_on_bw = 0;
+      }
     }
-    conn->read_blocked_on_bw = 0;
-    if (conn->write_blocked_on_bw == 1) {
+    if (conn->write_blocked_on_bw == 1 &&
+        !connection_write_bucket_empty_reason(conn, &is_global)) {
       connection_start_writing(conn);
       conn->write_blocked_on_bw = 0;
     }
+
+    if (conn->read_blocked_on_bw || conn->write_blocked_on_bw)
+      connection_bw_blocked_add(conn);
   } SMARTLIST_FOREACH_END(conn);
+  smartlist_free(blocked);
 
-  reenable_blocked_connections_is_scheduled = 0;
+  if (smartlist_len(bw_blocked_conns))
+    reenable_blocked_connection_schedule();
 }
 
 /**
@@ -4250,11 +4365,20 @@ connection_buf_read_from_socket(connection_t *conn, ssize_t *max_to_read,
   } else {
     /* !connection_speaks_cells, !conn->linked_conn. */
     int reached_eof = 0;
-    CONN_LOG_PROTECT(conn,
-                     result = buf_read_from_socket(conn->inbuf, conn->s,
-                                                   at_most,
-                                                   &reached_eof,
-                                                   socket_error));
+    if (connection_uring_take_read_result(conn, &result, &reached_eof,
+                                          socket_error)) {
+      /* We've already read these bytes in an io_uring batch, whose limit
+       * might have been a little different. */
+      if (result > at_most)
+        at_most = result;
+      more_to_read = 0;
+    } else {
+      CONN_LOG_PROTECT(conn,
+                       result = buf_read_from_socket(conn->inbuf, conn->s,
+                                                     at_most,
+                                                     &reached_eof,
+                                                     socket_error));
+    }
     if (reached_eof)
       conn->inbuf_reached_eof = 1;
 
@@ -4582,9 +4706,11 @@ connection_handle_write_impl(connection_t *conn, int force)
      * or something. */
     result = (int)(initial_size-buf_datalen(conn->outbuf));
   } else {
-    CONN_LOG_PROTECT(conn,
-                     result = buf_flush_to_socket(conn->outbuf, conn->s,
-                                                  max_to_write));
+    if (!connection_uring_take_write_result(conn, &result)) {
+      CONN_LOG_PROTECT(conn,
+                       result = buf_flush_to_socket(conn->outbuf, conn->s,
+                                                    max_to_write));
+    }
     if (result < 0) {
       if (CONN_IS_EDGE(conn))
         connection_edge_end_errno(TO_EDGE_CONN(conn));
@@ -5949,6 +6075,11 @@ connection_free_all(void)
 
   mainloop_event_free(reenable_blocked_connections_ev);
   reenable_blocked_connections_is_scheduled = 0;
+  if (bw_blocked_conns) {
+    SMARTLIST_FOREACH(bw_blocked_conns, connection_t *, conn,
+                      conn->bw_blocked_index = -1);
+    smartlist_free(bw_blocked_conns);
+  }
   memset(&reenable_blocked_connections_delay, 0, sizeof(struct timeval));
 }
 
@@ -227,6 +227,7 @@ int retry_all_listeners(struct smartlist_t *new_conns,
 void connection_mark_all_noncontrol_listeners(void);
 void connection_mark_all_noncontrol_connections(void);
 
+ssize_t connection_bucket_read_limit(struct connection_t *conn, time_t now);
 ssize_t connection_bucket_write_limit(struct connection_t *conn, time_t now);
 bool connection_dir_is_global_write_low(const struct connection_t *conn,
                                         size_t attempt);
@@ -390,6 +391,9 @@ MOCK_DECL(STATIC int,connection_connect_sockaddr,
                                              int *socket_error));
 MOCK_DECL(STATIC void, kill_conn_list_for_oos, (struct smartlist_t *conns));
 MOCK_DECL(STATIC struct smartlist_t *, pick_oos_victims, (int n));
+struct mainloop_event_t;
+STATIC void reenable_blocked_connections_cb(struct mainloop_event_t *ev,
+                                            void *arg);
 
 #endif /* defined(CONNECTION_PRIVATE) */
 
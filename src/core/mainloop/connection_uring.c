@@ -0,0 +1,366 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file connection_uring.c
+ * \brief Read and write many connections with one system call.
+ *
+ * Ordinarily, when libevent tells us that a connection is readable or
+ * writable, conn_read_callback() or conn_write_callback() reads or writes
+ * it right away, with at least one system call apiece.  When UseIOUring is
+ * set, we queue the connection here instead.  Once libevent has run the
+ * callbacks for every connection that became ready on this pass through
+ * the loop, we do all of their reads and writes with a single call to
+ * io_uring_enter() (see buffers_uring.c), and then handle each connection
+ * just as its callback would have, with the result already in hand.
+ *
+ * Only connections that move data straight between a buffer and a socket
+ * can take part.  Linked connections have no socket, so we leave those
+ * alone.
+ *
+ * We leave OR connections alone too.  They read and write through their
+ * tor_tls_t, which talks to the socket itself; to batch them, we would have
+ * to give TLS a memory BIO, and copy every byte once more on its way
+ * through.  That isn't worth it: in "bench buf_uring", batching saves about
+ * 1 usec per socket for each round of 4 KB in each direction, while AES
+ * alone on those bytes, a lower bound on what TLS does with them, costs
+ * about 1.4 usec, and the relay crypto on the 16 cells that they carry
+ * another 2.5 usec or so (about 155 nsec per cell in "bench
+ * cell_ops").  Batching would save well under a tenth of the work that
+ * each OR connection does, before paying for the extra copy.
+ **/
+
+#define CONNECTION_URING_PRIVATE
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
+#include "core/mainloop/mainloop.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/net/buffers_uring.h"
+#include "lib/sandbox/sandbox.h"
+
+#include "core/or/connection_st.h"
+
+/** How many reads and writes can we hand to the kernel at once? */
+#define CONNECTION_URING_ENTRIES 1024
+
+/** What we know about a connection's io_uring reads and writes. */
+typedef struct connection_uring_state_t {
+  /** True iff we should read (write) this connection in the next batch. */
+  bool read_queued;
+  bool write_queued;
+  /** Our position in uring_queue and uring_running, or -1 if we're not
+   * there. */
+  int queue_idx;
+  int running_idx;
+  /** Our operations on the ring in the current batch, or -1. */
+  int read_idx;
+  int write_idx;
+  /** True iff a batch has read (written) this connection, and we haven't
+   * yet handled the result. */
+  bool read_done;
+  bool write_done;
+  /** The results from the batch, as for buf_read_from_socket() and
+   * buf_flush_to_socket(). */
+  bool read_eof;
+  int read_result;
+  int read_error;
+  int write_result;
+  int write_error;
+} connection_uring_state_t;
+
+/** The ring we use for every batch, or NULL if we haven't made it yet. */
+static buf_uring_t *the_uring = NULL;
+/** True iff we couldn't make a ring, or it broke. */
+static bool uring_failed = false;
+/** The connections to read or write in the next batch, in the order that
+ * libevent told us about them.  Entries are set to NULL if their connection
+ * is freed. */
+static smartlist_t *uring_queue = NULL;
+/** The connections in the batch that we're handling right now.  Entries are
+ * set to NULL if their connection is freed. */
+static smartlist_t *uring_running = NULL;
+/** Event to run the next batch, once every ready connection is queued. */
+static mainloop_event_t *uring_batch_event = NULL;
+
+/** Return the ring to use for reads and writes, creating it if we need to.
+ * Return NULL if we can't use io_uring. */
+static buf_uring_t *
+get_uring(void)
+{
+  if (!the_uring && !uring_failed) {
+    the_uring = buf_uring_new(CONNECTION_URING_ENTRIES);
+    if (the_uring) {
+      log_notice(LD_NET, "Reading and writing connections in batches with "
+                 "io_uring.");
+    } else {
+      log_notice(LD_NET, "UseIOUring is set, but we can't use io_uring "
+                 "here. Using ordinary reads and writes instead.");
+      uring_failed = true;
+    }
+  }
+  return the_uring;
+}
+
+/** Return true iff we can read and write <b>conn</b> in io_uring
+ * batches. */
+static bool
+connection_uring_can_use(connection_t *conn)
+{
+  if (!get_options()->UseIOUring || sandbox_is_active())
+    return false;
+  if (conn->marked_for_close || conn->linked || !SOCKET_OK(conn->s) ||
+      connection_is_listener(conn) || connection_speaks_cells(conn) ||
+      connection_state_is_connecting(conn))
+    return false;
+  return get_uring() != NULL;
+}
+
+/** Called when libevent tells us that <b>conn</b> is readable, or writable
+ * if <b>is_write</b> is true.  If we can handle that in the next io_uring
+ * batch, queue it and return 1.  Otherwise return 0, and the caller should
+ * handle it now. */
+int
+connection_uring_queue(connection_t *conn, bool is_write)
+{
+  connection_uring_state_t *st;
+
+  if (!connection_uring_can_use(conn))
+    return 0;
+
+  if (!conn->uring) {
+    conn->uring = tor_malloc_zero(sizeof(connection_uring_state_t));
+    conn->uring->queue_idx = conn->uring->running_idx = -1;
+  }
+  st = conn->uring;
+  if (!uring_queue)
+    uring_queue = smartlist_new();
+  if (st->queue_idx < 0) {
+    st->queue_idx = smartlist_len(uring_queue);
+    smartlist_add(uring_queue, conn);
+  }
+  if (is_write)
+    st->write_queued = true;
+  else
+    st->read_queued = true;
+
+  if (!uring_batch_event)
+    uring_batch_event = mainloop_event_new(connection_uring_run_batch, NULL);
+  mainloop_event_activate(uring_batch_event);
+  return 1;
+}
+
+/** Run every operation on <b>ring</b>, and record their results for the
+ * connections in <b>conns</b> between <b>from</b> (inclusive) and
+ * <b>to</b> (exclusive). */
+static void
+connection_uring_run_ring(buf_uring_t *ring, smartlist_t *conns,
+                          int from, int to)
+{
+  int i, r = buf_uring_run(ring);
+
+  for (i = from; i < to; ++i) {
+    connection_t *conn = smartlist_get(conns, i);
+    connection_uring_state_t *st;
+    if (!conn)
+      continue;
+    st = conn->uring;
+    /* Even if the batch failed, some operations may have finished. */
+    if (st->read_idx >= 0 && buf_uring_op_is_done(ring, st->read_idx)) {
+      int eof = 0, err = 0;
+      st->read_result = buf_uring_get_read_result(ring, st->read_idx,
+                                                  &eof, &err);
+      st->read_eof = eof;
+      st->read_error = err;
+      st->read_done = true;
+    }
+    if (st->write_idx >= 0 && buf_uring_op_is_done(ring, st->write_idx)) {
+      st->write_result = buf_uring_get_flush_result(ring, st->write_idx,
+                                                    &st->write_error);
+      st->write_done = true;
+    }
+    st->read_idx = st->write_idx = -1;
+  }
+  buf_uring_clear(ring);
+
+  if (r < 0) {
+    log_warn(LD_BUG, "io_uring batch failed. Using ordinary reads and "
+             "writes from now on.");
+    buf_uring_free(the_uring);
+    uring_failed = true;
+  }
+}
+
+/** Do the reads and writes for every connection in <b>conns</b> with as
+ * few calls to io_uring_enter() as we can. */
+static void
+connection_uring_do_io(buf_uring_t *ring, smartlist_t *conns)
+{
+  const time_t now = approx_time();
+  int i, first = 0, n_ops = 0;
+
+  for (i = 0; i < smartlist_len(conns); ++i) {
+    connection_t *conn = smartlist_get(conns, i);
+    connection_uring_state_t *st;
+
+    if (n_ops + 2 > CONNECTION_URING_ENTRIES) {
+      connection_uring_run_ring(ring, conns, first, i);
+      if (uring_failed)
+        return;
+      first = i;
+      n_ops = 0;
+    }
+
+    if (!conn)
+      continue;
+    st = conn->uring;
+    st->read_idx = st->write_idx = -1;
+    if (conn->marked_for_close || !SOCKET_OK(conn->s))
+      continue;
+    if (st->read_queued && connection_is_reading(conn)) {
+      ssize_t at_most = connection_bucket_read_limit(conn, now);
+      const ssize_t maximum = BUF_MAX_LEN - buf_datalen(conn->inbuf);
+      if (at_most > maximum)
+        at_most = maximum;
+      if (at_most > 0) {
+        st->read_idx = buf_uring_add_read(ring, conn->inbuf, conn->s,
+                                          at_most);
+        n_ops += st->read_idx >= 0;
+      }
+    }
+    if (st->write_queued && connection_is_writing(conn)) {
+      ssize_t max_to_write = connection_bucket_write_limit(conn, now);
+      if (max_to_write > (ssize_t) buf_datalen(conn->outbuf))
+        max_to_write = buf_datalen(conn->outbuf);
+      if (max_to_write > 0) {
+        st->write_idx = buf_uring_add_flush(ring, conn->outbuf, conn->s,
+                                            max_to_write);
+        n_ops += st->write_idx >= 0;
+      }
+    }
+  }
+  connection_uring_run_ring(ring, conns, first, smartlist_len(conns));
+}
+
+/** Mainloop callback: read and write every queued connection, then handle
+ * the results. */
+STATIC void
+connection_uring_run_batch(mainloop_event_t *ev, void *arg)
+{
+  buf_uring_t *ring = get_uring();
+  int i;
+  (void) ev;
+  (void) arg;
+
+  if (!uring_queue || BUG(uring_running))
+    return;
+  uring_running = uring_queue;
+  uring_queue = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(uring_running, connection_t *, conn) {
+    if (conn) {
+      conn->uring->running_idx = conn->uring->queue_idx;
+      conn->uring->queue_idx = -1;
+    }
+  } SMARTLIST_FOREACH_END(conn);
+
+  if (ring)
+    connection_uring_do_io(ring, uring_running);
+
+  /* Handling one connection can free others, so check each time that the
+   * connection is still here. */
+  for (i = 0; i < smartlist_len(uring_running); ++i) {
+    connection_t *conn = smartlist_get(uring_running, i);
+    connection_uring_state_t *st;
+    if (!conn)
+      continue;
+    st = conn->uring;
+    if (st->read_queued) {
+      st->read_queued = false;
+      if (connection_is_reading(conn) || conn->marked_for_close)
+        conn_handle_readable(conn);
+      if (smartlist_get(uring_running, i) != conn)
+        continue;
+    }
+    if (st->write_queued) {
+      st->write_queued = false;
+      if (connection_is_writing(conn))
+        conn_handle_writable(conn);
+      if (smartlist_get(uring_running, i) != conn)
+        continue;
+    }
+    /* The data is in the buffers whether we looked at the results or
+     * not. */
+    st->read_done = st->write_done = false;
+    st->running_idx = -1;
+  }
+  smartlist_free(uring_running);
+}
+
+/** If a batch has already read from <b>conn</b>, return true, and set
+ * *<b>result_out</b>, *<b>reached_eof</b>, and *<b>socket_error</b> as
+ * buf_read_from_socket() would have.  Otherwise return false. */
+bool
+connection_uring_take_read_result(connection_t *conn, int *result_out,
+                                  int *reached_eof, int *socket_error)
+{
+  connection_uring_state_t *st = conn->uring;
+  if (!st || !st->read_done)
+    return false;
+  st->read_done = false;
+  *result_out = st->read_result;
+  if (st->read_eof)
+    *reached_eof = 1;
+  if (st->read_result < 0 && socket_error)
+    *socket_error = st->read_error;
+  return true;
+}
+
+/** If a batch has already written to <b>conn</b>, return true, and set
+ * *<b>result_out</b> (and errno, on error) as buf_flush_to_socket() would
+ * have.  Otherwise return false. */
+bool
+connection_uring_take_write_result(connection_t *conn, int *result_out)
+{
+  connection_uring_state_t *st = conn->uring;
+  if (!st || !st->write_done)
+    return false;
+  st->write_done = false;
+  *result_out = st->write_result;
+  if (st->write_result < 0)
+    errno = st->write_error;
+  return true;
+}
+
+/** Called when we're about to free <b>conn</b>: remove it from any batch,
+ * and free its io_uring state. */
+void
+connection_uring_forget(connection_t *conn)
+{
+  connection_uring_state_t *st = conn->uring;
+  if (!st)
+    return;
+  if (st->queue_idx >= 0) {
+    tor_assert(smartlist_get(uring_queue, st->queue_idx) == conn);
+    smartlist_set(uring_queue, st->queue_idx, NULL);
+  }
+  if (st->running_idx >= 0) {
+    tor_assert(smartlist_get(uring_running, st->running_idx) == conn);
+    smartlist_set(uring_running, st->running_idx, NULL);
+  }
+  tor_free(conn->uring);
+}
+
+/** Release all storage held for io_uring batches. */
+void
+connection_uring_free_all(void)
+{
+  mainloop_event_free(uring_batch_event);
+  if (uring_queue) {
+    SMARTLIST_FOREACH(uring_queue, connection_t *, conn,
+                      if (conn) conn->uring->queue_idx = -1);
+  }
+  smartlist_free(uring_queue);
+  buf_uring_free(the_uring);
+  uring_failed = false;
+}
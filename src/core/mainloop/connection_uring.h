@@ -0,0 +1,25 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file connection_uring.h
+ * \brief Header file for connection_uring.c.
+ **/
+
+#ifndef TOR_CONNECTION_URING_H
+#define TOR_CONNECTION_URING_H
+
+int connection_uring_queue(connection_t *conn, bool is_write);
+bool connection_uring_take_read_result(connection_t *conn, int *result_out,
+                                       int *reached_eof, int *socket_error);
+bool connection_uring_take_write_result(connection_t *conn, int *result_out);
+void connection_uring_forget(connection_t *conn);
+void connection_uring_free_all(void);
+
+#ifdef CONNECTION_URING_PRIVATE
+struct mainloop_event_t;
+STATIC void connection_uring_run_batch(struct mainloop_event_t *ev,
+                                       void *arg);
+#endif /* defined(CONNECTION_URING_PRIVATE) */
+
+#endif /* !defined(TOR_CONNECTION_URING_H) */
@@ -17,7 +17,16 @@
  *      <li>for calculating diffs and compressing them in consdiffmgr.c.
  *      <li>and for solving onion service PoW challenges in pow.c.
  *  </ul>
+ *
+ * We hand onionskins to the threads in batches: when a flood of CREATE
+ * cells arrives, we collect the handshakes that we accept on one pass
+ * through the main loop, and give each thread a share of them in a single
+ * work item.  That way we queue one workqueue_entry_t, and get one reply,
+ * per batch rather than per handshake.  We still time and count every
+ * handshake separately.
  **/
+
+#define CPUWORKER_PRIVATE
 #include "core/or/or.h"
 #include "core/or/channel.h"
 #include "core/or/circuitlist.h"
@@ -34,7 +43,9 @@
 #include "feature/stats/rephist.h"
 #include "feature/relay/router.h"
 #include "feature/nodelist/networkstatus.h"
+#include "lib/evloop/compat_libevent.h"
 #include "lib/evloop/workqueue.h"
+#include "lib/intmath/muldiv.h"
 #include "core/crypto/onion_crypto.h"
 
 #include "core/or/or_circuit_st.h"
@@ -222,6 +233,19 @@ typedef struct cpuworker_job_u_t {
   } u;
 } cpuworker_job_t;
 
+/** A batch of onionskin jobs that one worker thread handles together. */
+typedef struct cpuworker_batch_t {
+  /** How many entries of <b>jobs</b> are in use? */
+  int n_jobs;
+  /** The jobs in this batch, in the order that we accepted them. */
+  cpuworker_job_t *jobs[CPUWORKER_MAX_BATCH];
+} cpuworker_batch_t;
+
+/** Jobs that we have accepted, but not yet handed to the threadpool. */
+static smartlist_t *unqueued_jobs = NULL;
+/** Event to hand the jobs in unqueued_jobs to the threadpool. */
+static mainloop_event_t *flush_jobs_event = NULL;
+
 static workqueue_reply_t
 update_state_threadfn(void *state_, void *work_)
 {
@@ -361,11 +385,11 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
 }
 
-/** Handle a reply from the worker threads. */
+/** Handle the answer that a worker thread has given for one onionskin
+ * job. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+cpuworker_onion_handshake_handle_reply(cpuworker_job_t *job)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
 
@@ -412,8 +436,7 @@ cpuworker_onion_handshake_replyfn(void *work_)
      * pending. Instead, it got left for us to free so that we wouldn't freak
      * out when the job->circ field wound up pointing to nothing. */
     log_debug(LD_OR, "Circuit died while reply was pending. Freeing memory.");
-    circ->base_.magic = 0;
-    tor_free(circ);
+    circuit_release_dead_worker_ref(circ);
     goto done_processing;
   }
 
@@ -460,49 +483,43 @@ cpuworker_onion_handshake_replyfn(void *work_)
   memwipe(&rpl, 0, sizeof(rpl));
   memwipe(job, 0, sizeof(*job));
   tor_free(job);
-  queue_pending_tasks();
 }
 
-/** Implementation function for onion handshake requests. */
-static workqueue_reply_t
-cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+/** Handle a reply from the worker threads: the answers for a batch of
+ * onionskins. */
+static void
+cpuworker_onion_batch_replyfn(void *work_)
 {
-  worker_state_t *state = state_;
-  cpuworker_job_t *job = work_;
+  cpuworker_batch_t *batch = work_;
+  int i;
 
-  /* variables for onion processing */
-  server_onion_keys_t *onion_keys = state->onion_keys;
-  cpuworker_request_t req;
-  cpuworker_reply_t rpl;
-
-  memcpy(&req, &job->u.request, sizeof(req));
+  /* Until we reach its job, each circuit keeps its workqueue_entry, so that
+   * if answering an earlier job frees it, it is left for us to free. */
+  for (i = 0; i < batch->n_jobs; ++i) {
+    cpuworker_onion_handshake_handle_reply(batch->jobs[i]);
+  }
+  tor_free(batch);
+  queue_pending_tasks();
+}
 
-  tor_assert(req.magic == CPUWORKER_REQUEST_MAGIC);
-  memset(&rpl, 0, sizeof(rpl));
+/** In a worker thread, finish the reply for <b>job</b>, whose request was
+ * <b>req</b>: <b>n</b> is what onion_skin_server_handshake() returned for
+ * it, and <b>rpl</b> holds its output.  If the request was timed, say that
+ * it took <b>n_usec</b> microseconds. */
+static workqueue_reply_t
+cpuworker_onion_handshake_finish(cpuworker_job_t *job,
+                                 const cpuworker_request_t *req,
+                                 cpuworker_reply_t *rpl,
+                                 int n, uint32_t n_usec)
+{
+  const create_cell_t *cc = &req->create_cell;
+  created_cell_t *cell_out = &rpl->created_cell;
 
-  const create_cell_t *cc = &req.create_cell;
-  created_cell_t *cell_out = &rpl.created_cell;
-  struct timeval tv_start = {0,0}, tv_end;
-  int n;
-  rpl.timed = req.timed;
-  rpl.started_at = req.started_at;
-  rpl.handshake_type = cc->handshake_type;
-  if (req.timed)
-    tor_gettimeofday(&tv_start);
-  n = onion_skin_server_handshake(cc->handshake_type,
-                                  cc->onionskin, cc->handshake_len,
-                                  onion_keys,
-                                  &req.circ_ns_params,
-                                  cell_out->reply,
-                                  sizeof(cell_out->reply),
-                                  rpl.keys, CPATH_KEY_MATERIAL_LEN,
-                                  rpl.rend_auth_material,
-                                  &rpl.circ_params);
   if (n < 0) {
     /* failure */
     log_debug(LD_OR,"onion_skin_server_handshake failed.");
-    memset(&rpl, 0, sizeof(rpl));
-    rpl.success = 0;
+    memset(rpl, 0, sizeof(*rpl));
+    rpl->success = 0;
   } else {
     /* success */
     log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
@@ -518,27 +535,161 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
       tor_assert(0);
       return WQ_RPL_SHUTDOWN;
     }
-    rpl.success = 1;
+    rpl->success = 1;
   }
 
-  rpl.magic = CPUWORKER_REPLY_MAGIC;
-  if (req.timed) {
+  rpl->magic = CPUWORKER_REPLY_MAGIC;
+  if (req->timed)
+    rpl->n_usec = n_usec;
+
+  memcpy(&job->u.reply, rpl, sizeof(*rpl));
+  return WQ_RPL_REPLY;
+}
+
+/** Implementation function for a batch of onion handshake requests.  We
+ * hand all of them to onion_skin_server_handshake_batch() at once, so that
+ * their ntor handshakes can share the cost of their scalar
+ * multiplications. */
+static workqueue_reply_t
+cpuworker_onion_batch_threadfn(void *state_, void *work_)
+{
+  worker_state_t *state = state_;
+  cpuworker_batch_t *batch = work_;
+  const int n_jobs = batch->n_jobs;
+  /* Each job's reply overwrites its request, so we work on copies. */
+  cpuworker_request_t *req = tor_calloc(n_jobs, sizeof(cpuworker_request_t));
+  cpuworker_reply_t *rpl = tor_calloc(n_jobs, sizeof(cpuworker_reply_t));
+  onion_server_handshake_t hs[CPUWORKER_MAX_BATCH];
+  struct timeval tv_start = {0,0}, tv_end;
+  workqueue_reply_t r = WQ_RPL_REPLY;
+  uint32_t n_usec = 0;
+  bool timed = false;
+  int i;
+
+  for (i = 0; i < n_jobs; ++i) {
+    const create_cell_t *cc = &req[i].create_cell;
+    memcpy(&req[i], &batch->jobs[i]->u.request, sizeof(req[i]));
+    tor_assert(req[i].magic == CPUWORKER_REQUEST_MAGIC);
+    rpl[i].timed = req[i].timed;
+    rpl[i].started_at = req[i].started_at;
+    rpl[i].handshake_type = cc->handshake_type;
+    timed |= req[i].timed;
+
+    memset(&hs[i], 0, sizeof(hs[i]));
+    hs[i].type = cc->handshake_type;
+    hs[i].onion_skin = cc->onionskin;
+    hs[i].onionskin_len = cc->handshake_len;
+    hs[i].ns_params = &req[i].circ_ns_params;
+    hs[i].reply_out = rpl[i].created_cell.reply;
+    hs[i].reply_out_maxlen = sizeof(rpl[i].created_cell.reply);
+    hs[i].keys_out = rpl[i].keys;
+    hs[i].key_out_len = CPATH_KEY_MATERIAL_LEN;
+    hs[i].rend_nonce_out = rpl[i].rend_auth_material;
+    hs[i].negotiated_params_out = &rpl[i].circ_params;
+  }
+
+  if (timed)
+    tor_gettimeofday(&tv_start);
+  onion_skin_server_handshake_batch(hs, n_jobs, state->onion_keys);
+  if (timed) {
+    /* The handshakes shared their work, so each one gets an equal share of
+     * the time. */
     struct timeval tv_diff;
     int64_t usec;
     tor_gettimeofday(&tv_end);
     timersub(&tv_end, &tv_start, &tv_diff);
     usec = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
+    usec /= n_jobs;
     if (usec < 0 || usec > MAX_BELIEVABLE_ONIONSKIN_DELAY)
-      rpl.n_usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
+      n_usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
     else
-      rpl.n_usec = (uint32_t) usec;
+      n_usec = (uint32_t) usec;
   }
 
-  memcpy(&job->u.reply, &rpl, sizeof(rpl));
+  for (i = 0; i < n_jobs && r == WQ_RPL_REPLY; ++i) {
+    r = cpuworker_onion_handshake_finish(batch->jobs[i], &req[i], &rpl[i],
+                                         hs[i].result, n_usec);
+  }
 
-  memwipe(&req, 0, sizeof(req));
-  memwipe(&rpl, 0, sizeof(req));
-  return WQ_RPL_REPLY;
+  memwipe(req, 0, n_jobs * sizeof(cpuworker_request_t));
+  memwipe(rpl, 0, n_jobs * sizeof(cpuworker_reply_t));
+  tor_free(req);
+  tor_free(rpl);
+  return r;
+}
+
+/** Return how many onionskins to put in each work item, when we have
+ * <b>n_jobs</b> to hand to <b>n_threads</b> threads.  We want every thread
+ * to get a share, but no batch to be larger than CPUWORKER_MAX_BATCH. */
+STATIC int
+cpuworker_get_batch_size(int n_jobs, int n_threads)
+{
+  int size;
+  if (n_threads < 1)
+    n_threads = 1;
+  size = CEIL_DIV(n_jobs, n_threads);
+  return CLAMP(1, size, CPUWORKER_MAX_BATCH);
+}
+
+/** Queue <b>batch</b> on the threadpool, and tell its circuits about it.
+ * Return 0 on success, -1 on failure. */
+static int
+cpuworker_queue_batch(cpuworker_batch_t *batch)
+{
+  workqueue_entry_t *queue_entry;
+  int i;
+
+  queue_entry = cpuworker_queue_work(WQ_PRI_HIGH,
+                                     cpuworker_onion_batch_threadfn,
+                                     cpuworker_onion_batch_replyfn,
+                                     batch);
+  if (!queue_entry)
+    return -1;
+
+  log_debug(LD_OR, "Queued %d onionskins (qe=%p)", batch->n_jobs,
+            queue_entry);
+  for (i = 0; i < batch->n_jobs; ++i) {
+    batch->jobs[i]->circ->workqueue_entry = queue_entry;
+  }
+  return 0;
+}
+
+/** Mainloop callback: hand every job in unqueued_jobs to the threadpool, in
+ * batches. */
+static void
+cpuworker_flush_jobs_cb(mainloop_event_t *ev, void *arg)
+{
+  smartlist_t *jobs = unqueued_jobs;
+  int i, j, size;
+  (void) ev;
+  (void) arg;
+
+  if (!jobs)
+    return;
+  unqueued_jobs = NULL;
+
+  size = cpuworker_get_batch_size(smartlist_len(jobs),
+                                  cpuworker_get_n_threads());
+  for (i = 0; i < smartlist_len(jobs); i += size) {
+    cpuworker_batch_t *batch = tor_malloc_zero(sizeof(cpuworker_batch_t));
+    for (j = i; j < smartlist_len(jobs) && j < i + size; ++j) {
+      batch->jobs[batch->n_jobs++] = smartlist_get(jobs, j);
+    }
+    if (cpuworker_queue_batch(batch) < 0) {
+      log_warn(LD_BUG, "Couldn't queue work on threadpool");
+      for (j = 0; j < batch->n_jobs; ++j) {
+        cpuworker_job_t *job = batch->jobs[j];
+        circuit_mark_for_close(TO_CIRCUIT(job->circ),
+                               END_CIRC_REASON_INTERNAL);
+        memwipe(job, 0xe0, sizeof(*job));
+        tor_free(job);
+        tor_assert(total_pending_tasks > 0);
+        --total_pending_tasks;
+      }
+      tor_free(batch);
+    }
+  }
+  smartlist_free(jobs);
 }
 
 /** Take pending tasks from the queue and assign them to cpuworkers. */
@@ -584,7 +735,6 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
   cpuworker_job_t *job;
   cpuworker_request_t req;
   int should_time;
@@ -632,21 +782,17 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
   memwipe(&req, 0, sizeof(req));
 
   ++total_pending_tasks;
-  queue_entry = threadpool_queue_work_priority(threadpool,
-                                      WQ_PRI_HIGH,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
-  if (!queue_entry) {
-    log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
-    return -1;
-  }
 
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
+  /* Hand the job to the threadpool once we've seen every CREATE cell that
+   * arrived on this pass through the main loop. */
+  if (!unqueued_jobs)
+    unqueued_jobs = smartlist_new();
+  smartlist_add(unqueued_jobs, job);
+  if (!flush_jobs_event)
+    flush_jobs_event = mainloop_event_new(cpuworker_flush_jobs_cb, NULL);
+  mainloop_event_activate(flush_jobs_event);
 
-  circ->workqueue_entry = queue_entry;
+  log_debug(LD_OR, "Accepted task %p (circ=%p)", job, job->circ);
 
   return 0;
 }
@@ -656,18 +802,57 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
 void
 cpuworker_cancel_circ_handshake(or_circuit_t *circ)
 {
-  cpuworker_job_t *job;
-  if (circ->workqueue_entry == NULL)
-    return;
+  cpuworker_batch_t *batch;
+  cpuworker_job_t *job = NULL;
+  int i;
+
+  if (unqueued_jobs) {
+    /* Maybe we haven't handed the job to the threadpool yet. */
+    SMARTLIST_FOREACH_BEGIN(unqueued_jobs, cpuworker_job_t *, j) {
+      if (j->circ == circ) {
+        job = j;
+        SMARTLIST_DEL_CURRENT_KEEPORDER(unqueued_jobs, j);
+        break;
+      }
+    } SMARTLIST_FOREACH_END(j);
+  }
 
-  job = workqueue_entry_cancel(circ->workqueue_entry);
-  if (job) {
-    /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    tor_free(job);
-    tor_assert(total_pending_tasks > 0);
-    --total_pending_tasks;
-    /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
-    circ->workqueue_entry = NULL;
+  if (!job && circ->workqueue_entry) {
+    batch = workqueue_entry_cancel(circ->workqueue_entry);
+    /* if (!batch), this is done in cpuworker_onion_batch_replyfn. */
+    if (!batch)
+      return;
+    /* It successfully cancelled: take our job out of the batch, and queue
+     * the others again. */
+    for (i = 0; i < batch->n_jobs; ++i) {
+      if (batch->jobs[i]->circ == circ) {
+        job = batch->jobs[i];
+        memmove(&batch->jobs[i], &batch->jobs[i+1],
+                sizeof(batch->jobs[0]) * (batch->n_jobs - i - 1));
+        --batch->n_jobs;
+        break;
+      }
+    }
+    if (batch->n_jobs == 0 || cpuworker_queue_batch(batch) < 0) {
+      if (BUG(batch->n_jobs)) {
+        /* We couldn't queue the others again: try on the next flush. */
+        if (!unqueued_jobs)
+          unqueued_jobs = smartlist_new();
+        for (i = 0; i < batch->n_jobs; ++i) {
+          batch->jobs[i]->circ->workqueue_entry = NULL;
+          smartlist_add(unqueued_jobs, batch->jobs[i]);
+        }
+        mainloop_event_activate(flush_jobs_event);
+      }
+      tor_free(batch);
+    }
   }
+
+  if (!job)
+    return;
+  memwipe(job, 0xe0, sizeof(*job));
+  tor_free(job);
+  tor_assert(total_pending_tasks > 0);
+  --total_pending_tasks;
+  circ->workqueue_entry = NULL;
 }
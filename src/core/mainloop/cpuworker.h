@@ -38,5 +38,13 @@ void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
 
 unsigned int cpuworker_get_n_threads(void);
 
+/** The largest number of onionskins that we hand to a worker thread in a
+ * single work item. */
+#define CPUWORKER_MAX_BATCH 8
+
+#ifdef CPUWORKER_PRIVATE
+STATIC int cpuworker_get_batch_size(int n_jobs, int n_threads);
+#endif
+
 #endif /* !defined(TOR_CPUWORKER_H) */
 
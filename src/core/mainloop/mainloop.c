@@ -53,6 +53,7 @@
 #include "app/config/statefile.h"
 #include "app/main/ntmain.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
 #include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/netstatus.h"
@@ -897,6 +898,18 @@ conn_read_callback(evutil_socket_t fd, short event, void *_conn)
     connection_stop_reading(conn);
   }
 
+  if (connection_uring_queue(conn, false))
+    return; /* We'll read in the next batch. */
+
+  conn_handle_readable(conn);
+}
+
+/** Read from <b>conn</b>, which libevent has told us is readable, and
+ * handle the results.  Called from conn_read_callback(), or from
+ * connection_uring.c when it has done the read itself. */
+MOCK_IMPL(void,
+conn_handle_readable,(connection_t *conn))
+{
   if (connection_handle_read(conn) < 0) {
     if (!conn->marked_for_close) {
 #ifndef _WIN32
@@ -930,6 +943,18 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
 
   /* assert_connection_ok(conn, time(NULL)); */
 
+  if (connection_uring_queue(conn, true))
+    return; /* We'll write in the next batch. */
+
+  conn_handle_writable(conn);
+}
+
+/** Write to <b>conn</b>, which libevent has told us is writable, and
+ * handle the results.  Called from conn_write_callback(), or from
+ * connection_uring.c when it has done the write itself. */
+MOCK_IMPL(void,
+conn_handle_writable,(connection_t *conn))
+{
   if (connection_handle_write(conn, 0) < 0) {
     if (!conn->marked_for_close) {
       /* this connection is broken. remove it. */
@@ -1160,8 +1185,10 @@ directory_info_has_arrived(time_t now, int from_cache, int suppress_logs)
 
 /** Perform regular maintenance tasks for a single connection.  This
  * function gets run once per second per connection by run_scheduled_events.
+ * Closing idle OR connections is up to connection_or_expire_idle(), which
+ * runs just before.
  */
-static void
+STATIC void
 run_connection_housekeeping(int i, time_t now)
 {
   cell_t cell;
@@ -1169,7 +1196,6 @@ run_connection_housekeeping(int i, time_t now)
   const or_options_t *options = get_options();
   or_connection_t *or_conn;
   channel_t *chan = NULL;
-  int have_any_circuits;
   int past_keepalive =
     now >= conn->timestamp_last_write_allowed + options->KeepalivePeriod;
 
@@ -1209,8 +1235,8 @@ run_connection_housekeeping(int i, time_t now)
   if (!connection_speaks_cells(conn))
     return; /* we're all done here, the rest is just for OR conns */
 
-  /* If we haven't flushed to an OR connection for a while, then either nuke
-     the connection or send a keepalive, depending. */
+  /* If we haven't flushed to an OR connection for a while, send a
+   * keepalive. */
 
   or_conn = TO_OR_CONN(conn);
   tor_assert(conn->outbuf);
@@ -1218,64 +1244,13 @@ run_connection_housekeeping(int i, time_t now)
   chan = TLS_CHAN_TO_BASE(or_conn->chan);
   tor_assert(chan);
 
-  if (channel_num_circuits(chan) != 0) {
-    have_any_circuits = 1;
+  if (channel_num_circuits(chan) != 0)
     chan->timestamp_last_had_circuits = now;
-  } else {
-    have_any_circuits = 0;
-  }
-
-  if (channel_is_bad_for_new_circs(TLS_CHAN_TO_BASE(or_conn->chan)) &&
-      ! have_any_circuits) {
-    /* It's bad for new circuits, and has no unmarked circuits on it:
-     * mark it now. */
-    log_info(LD_OR,
-             "Expiring non-used OR connection to fd %d (%s:%d) [Too old].",
-             (int)conn->s, fmt_and_decorate_addr(&conn->addr), conn->port);
-    if (conn->state == OR_CONN_STATE_CONNECTING)
-      connection_or_connect_failed(TO_OR_CONN(conn),
-                                   END_OR_CONN_REASON_TIMEOUT,
-                                   "Tor gave up on the connection");
-    connection_or_close_normally(TO_OR_CONN(conn), 1);
-  } else if (!connection_state_is_open(conn)) {
-    if (past_keepalive) {
-      /* We never managed to actually get this connection open and happy. */
-      log_info(LD_OR,"Expiring non-open OR connection to fd %d (%s:%d).",
-               (int)conn->s, fmt_and_decorate_addr(&conn->addr), conn->port);
-      connection_or_close_normally(TO_OR_CONN(conn), 0);
-    }
-  } else if (we_are_hibernating() &&
-             ! have_any_circuits &&
-             !connection_get_outbuf_len(conn)) {
-    /* We're hibernating or shutting down, there's no circuits, and nothing to
-     * flush.*/
-    log_info(LD_OR,"Expiring non-used OR connection to fd %d (%s:%d) "
-             "[Hibernating or exiting].",
-             (int)conn->s, fmt_and_decorate_addr(&conn->addr), conn->port);
-    connection_or_close_normally(TO_OR_CONN(conn), 1);
-  } else if (!have_any_circuits &&
-             now - or_conn->idle_timeout >=
-                                         chan->timestamp_last_had_circuits) {
-    log_info(LD_OR,"Expiring non-used OR connection %"PRIu64" to fd %d "
-             "(%s:%d) [no circuits for %d; timeout %d; %scanonical].",
-             (chan->global_identifier),
-             (int)conn->s, fmt_and_decorate_addr(&conn->addr), conn->port,
-             (int)(now - chan->timestamp_last_had_circuits),
-             or_conn->idle_timeout,
-             or_conn->is_canonical ? "" : "non");
-    connection_or_close_normally(TO_OR_CONN(conn), 0);
-  } else if (
-      now >= or_conn->timestamp_lastempty + options->KeepalivePeriod*10 &&
-      now >=
-          conn->timestamp_last_write_allowed + options->KeepalivePeriod*10) {
-    log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,
-           "Expiring stuck OR connection to fd %d (%s:%d). (%d bytes to "
-           "flush; %d seconds since last write)",
-           (int)conn->s, fmt_and_decorate_addr(&conn->addr), conn->port,
-           (int)connection_get_outbuf_len(conn),
-           (int)(now-conn->timestamp_last_write_allowed));
-    connection_or_close_normally(TO_OR_CONN(conn), 0);
-  } else if (past_keepalive && !connection_get_outbuf_len(conn)) {
+
+  if (!connection_state_is_open(conn))
+    return;
+
+  if (past_keepalive && !connection_get_outbuf_len(conn)) {
     /* send a padding cell */
     log_fn(LOG_DEBUG,LD_OR,"Sending keepalive to (%s:%d)",
            fmt_and_decorate_addr(&conn->addr), conn->port);
@@ -1287,6 +1262,21 @@ run_connection_housekeeping(int i, time_t now)
   }
 }
 
+/** Perform the once-a-second maintenance tasks for all connections: close
+ * the OR connections that need closing, then run
+ * run_connection_housekeeping() on every connection. */
+void
+run_all_connection_housekeeping(time_t now)
+{
+  int i;
+
+  channel_update_bad_for_new_circs(NULL, 0);
+  connection_or_expire_idle(now);
+  for (i=0;i<smartlist_len(connection_array);i++) {
+    run_connection_housekeeping(i, now);
+  }
+}
+
 /** Honor a NEWNYM request: make future requests unlinkable to past
  * requests. */
 static void
@@ -1756,11 +1746,7 @@ second_elapsed_callback(time_t now, const or_options_t *options)
   }
 
   /* 5. We do housekeeping for each connection... */
-  channel_update_bad_for_new_circs(NULL, 0);
-  int i;
-  for (i=0;i<smartlist_len(connection_array);i++) {
-    run_connection_housekeeping(i, now);
-  }
+  run_all_connection_housekeeping(now);
 
   /* Run again in a second. */
   return 1;
@@ -1815,7 +1801,7 @@ rotate_x509_certificate_callback(time_t now, const or_options_t *options)
 
   /* We also make sure to rotate the TLS connections themselves if they've
    * been up for too long -- but that's done via is_bad_for_new_circs in
-   * run_connection_housekeeping() above. */
+   * run_all_connection_housekeeping() above. */
   return MAX_SSL_KEY_LIFETIME_INTERNAL;
 }
 
@@ -2581,6 +2567,7 @@ tor_mainloop_free_all(void)
   mainloop_event_free(handle_deferred_signewnym_ev);
   mainloop_event_free(scheduled_shutdown_ev);
   mainloop_event_free(rescan_periodic_events_ev);
+  connection_uring_free_all();
 
 #ifdef HAVE_SYSTEMD_209
   periodic_timer_free(systemd_watchdog_timer);
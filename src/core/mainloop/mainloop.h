@@ -52,9 +52,12 @@ int tor_event_loop_shutdown_is_pending(void);
 void connection_stop_reading_from_linked_conn(connection_t *conn);
 
 MOCK_DECL(int, connection_count_moribund, (void));
+MOCK_DECL(void, conn_handle_readable, (connection_t *conn));
+MOCK_DECL(void, conn_handle_writable, (connection_t *conn));
 
 void directory_all_unreachable(time_t now);
 void directory_info_has_arrived(time_t now, int from_cache, int suppress_logs);
+void run_all_connection_housekeeping(time_t now);
 
 void ip_address_changed(int on_client_conn);
 void dns_servers_relaunch_checks(void);
@@ -100,6 +103,7 @@ extern struct token_bucket_rw_t global_relayed_bucket;
 #ifdef MAINLOOP_PRIVATE
 STATIC int run_main_loop_until_done(void);
 STATIC void close_closeable_connections(void);
+STATIC void run_connection_housekeeping(int i, time_t now);
 STATIC void teardown_periodic_events(void);
 STATIC int get_my_roles(const or_options_t *);
 STATIC int check_network_participation_callback(time_t now,
@@ -69,6 +69,7 @@
 #include "core/or/status.h"
 #include "core/or/trace_probes_circuit.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/cpuworker.h"
 #include "app/config/config.h"
 #include "core/or/connection_edge.h"
 #include "core/or/connection_or.h"
@@ -91,6 +92,7 @@
 #include "core/or/policies.h"
 #include "core/or/relay.h"
 #include "core/crypto/relay_crypto.h"
+#include "core/or/relay_crypto_offload.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/stats/predict_ports.h"
 #include "feature/stats/bwhist.h"
@@ -1155,7 +1157,7 @@ circuit_free_(circuit_t *circ)
   circid_t n_circ_id = 0;
   void *mem;
   size_t memlen;
-  int should_free = 1;
+  int n_worker_refs = 0;
   if (!circ)
     return;
 
@@ -1227,7 +1229,14 @@ circuit_free_(circuit_t *circ)
     memlen = sizeof(or_circuit_t);
     tor_assert(circ->magic == OR_CIRCUIT_MAGIC);
 
-    should_free = (ocirc->workqueue_entry == NULL);
+    /* Up to two worker jobs can be using this circuit: a cpuworker with its
+     * onionskin, and a relay crypto job with its forward crypto state.
+     * Cancel both if we can, and count the ones that are still running. */
+    cpuworker_cancel_circ_handshake(ocirc);
+    if (ocirc->workqueue_entry)
+      ++n_worker_refs;
+    if (relay_crypto_offload_circuit_free(ocirc))
+      ++n_worker_refs;
 
     relay_crypto_clear(&ocirc->crypto);
 
@@ -1287,20 +1296,35 @@ circuit_free_(circuit_t *circ)
    * the actual memory free. */
   tor_trace(TR_SUBSYS(circuit), TR_EV(free), circ);
 
-  if (should_free) {
+  if (n_worker_refs == 0) {
     memwipe(mem, 0xAA, memlen); /* poison memory */
     tor_free(mem);
   } else {
-    /* If we made it here, this is an or_circuit_t that still has a pending
-     * cpuworker request which we weren't able to cancel.  Instead, set up
-     * the magic value so that when the reply comes back, we'll know to discard
-     * the reply and free this structure.
+    /* If we made it here, this is an or_circuit_t that still has pending
+     * worker requests which we weren't able to cancel.  Instead, set up
+     * the magic value so that when the replies come back, we'll know to
+     * discard them, and the last one will free this structure.
      */
     memwipe(mem, 0xAA, memlen);
     circ->magic = DEAD_CIRCUIT_MAGIC;
+    ((or_circuit_t *) mem)->n_dead_worker_refs = n_worker_refs;
   }
 }
 
+/** Called when a worker thread replies about <b>circ</b>, which was freed
+ * while the worker was using it: see circuit_free_().  Free the memory
+ * once every such worker has replied. */
+void
+circuit_release_dead_worker_ref(or_circuit_t *circ)
+{
+  tor_assert(circ->base_.magic == DEAD_CIRCUIT_MAGIC);
+  tor_assert(circ->n_dead_worker_refs > 0);
+  if (--circ->n_dead_worker_refs > 0)
+    return;
+  circ->base_.magic = 0;
+  tor_free(circ);
+}
+
 /** Deallocate the linked list circ-><b>cpath</b>, and remove the cpath from
  * <b>circ</b>. */
 void
@@ -2767,6 +2791,8 @@ circuits_handle_oom(size_t current_allocation)
     }
     marked_circuit_free_cells(circ);
     freed = marked_circuit_free_stream_bytes(circ);
+    if (! CIRCUIT_IS_ORIGIN(circ))
+      freed += relay_crypto_offload_free_pending(TO_OR_CIRCUIT(circ));
 
     ++n_circuits_killed;
 
@@ -37,6 +37,7 @@
 #include "core/or/or.h"
 #include "core/or/circuitmux.h"
 #include "core/or/circuitmux_ewma.h"
+#include "core/or/circuitmux_logewma.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "lib/crypt_ops/crypto_util.h"
 #include "feature/nodelist/networkstatus.h"
@@ -119,6 +120,10 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
  */
 static double ewma_scale_factor = 0.1;
 
+/** The policy that new channels should use: either ewma_policy or
+ * logewma_policy, depending on CircuitPriorityPolicy. */
+static circuitmux_policy_t *configured_policy = &ewma_policy;
+
 /*** EWMA circuitmux_policy_t method table ***/
 
 circuitmux_policy_t ewma_policy = {
@@ -614,6 +619,14 @@ cmux_ewma_set_options(const or_options_t *options,
                                         EWMA_TICK_LEN_MIN,
                                         EWMA_TICK_LEN_MAX);
 
+  cmux_logewma_set_halflife(halflife);
+  if (options && options->CircuitPriorityPolicy &&
+      !strcasecmp(options->CircuitPriorityPolicy, "LogEWMA")) {
+    configured_policy = &logewma_policy;
+  } else {
+    configured_policy = &ewma_policy;
+  }
+
   /* convert halflife into halflife-per-tick. */
   halflife /= ewma_tick_len;
   /* compute per-tick scale factor. */
@@ -624,6 +637,13 @@ cmux_ewma_set_options(const or_options_t *options,
            source, ewma_scale_factor, ewma_tick_len);
 }
 
+/** Return the circuitmux policy that new channels should use. */
+circuitmux_policy_t *
+cmux_ewma_get_configured_policy(void)
+{
+  return configured_policy;
+}
+
 /** Return the multiplier necessary to convert the value of a cell sent in
  * 'from_tick' to one sent in 'to_tick'. */
 static inline double
@@ -727,4 +747,5 @@ void
 circuitmux_ewma_free_all(void)
 {
   ewma_ticks_initialized = 0;
+  configured_policy = &ewma_policy;
 }
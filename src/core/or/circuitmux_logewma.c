@@ -0,0 +1,409 @@
+/* Copyright (c) 2012-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circuitmux_logewma.c
+ * \brief Log-domain EWMA circuit selection as a circuitmux_t policy
+ *
+ * This policy picks the same circuits as the one in circuitmux_ewma.c: the
+ * active circuit with the lowest exponentially weighted count of the cells
+ * it has sent.  It differs in how it keeps those counts comparable as they
+ * decay.
+ *
+ * The EWMA policy keeps every count on a circuitmux relative to the start
+ * of the current tick, so that whenever a tick passes it has to rescale the
+ * count of every active circuit on the circuitmux.  Here, instead, we weight
+ * a cell sent at time T by exp(D(T)), where D is a "decay clock" that
+ * advances by ln(2) every halflife and is shared by all circuitmuxes.  Such
+ * weights would overflow quickly, so we store the natural logarithm of each
+ * circuit's count instead.  Since the passage of time doesn't change the
+ * relative weight of cells already sent, nothing needs to be rescaled when
+ * time passes: the order of the priority queue stays valid, and the cost of
+ * a tick is zero.  Sending cells costs a log() and an exp().
+ *
+ * Because all circuitmuxes share the same clock, the head circuits of two
+ * circuitmuxes are also exactly comparable, which isn't quite true for the
+ * EWMA policy when their queues were last rescaled on different ticks.
+ *
+ * The decay clock grows linearly with uptime.  At the default halflife, a
+ * double keeps a precision of better than one part in a million for
+ * thousands of years.
+ *
+ * This module should be used through the interfaces in circuitmux.c, which it
+ * implements.
+ **/
+
+#define CIRCUITMUX_LOGEWMA_PRIVATE
+
+#include "orconfig.h"
+
+#include <math.h>
+
+#include "core/or/or.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_logewma.h"
+#include "lib/crypt_ops/crypto_util.h"
+
+/** The natural logarithm of 2. */
+#define LOG_TWO 0.69314718055994529
+
+/** Default halflife, in seconds, until cmux_logewma_set_halflife() is
+ * called.  Matches the default for CircuitPriorityHalflifeMsec. */
+#define LOGEWMA_DEFAULT_HALFLIFE 30.0
+
+/** True iff we have started the decay clock. */
+static int decay_clock_initialized = 0;
+/** When did we last change the decay rate? */
+static monotime_coarse_t decay_clock_base_time;
+/** What was the value of the decay clock at decay_clock_base_time? */
+static double decay_clock_base_value = 0.0;
+/** How fast does the decay clock advance, per second? */
+static double decay_rate = LOG_TWO / LOGEWMA_DEFAULT_HALFLIFE;
+
+static int compare_logewma_entries(const void *p1, const void *p2);
+
+/** Return the current value of the decay clock: a cell sent now weighs
+ * exp(logewma_get_decay()). */
+STATIC double
+logewma_get_decay(void)
+{
+  monotime_coarse_t now;
+  int64_t msec;
+
+  if (!decay_clock_initialized) {
+    monotime_coarse_get(&decay_clock_base_time);
+    decay_clock_base_value = 0.0;
+    decay_clock_initialized = 1;
+  }
+  monotime_coarse_get(&now);
+  msec = monotime_coarse_diff_msec(&decay_clock_base_time, &now);
+  return decay_clock_base_value + decay_rate * ((double)msec / 1000.0);
+}
+
+/** Return log(exp(<b>log_a</b>) + exp(<b>log_b</b>)), without overflowing.
+ * Either argument may be -INFINITY, but not both. */
+STATIC double
+logewma_add_log(double log_a, double log_b)
+{
+  if (log_a < log_b) {
+    double tmp = log_a;
+    log_a = log_b;
+    log_b = tmp;
+  }
+  return log_a + log1p(exp(log_b - log_a));
+}
+
+/** Set the halflife, in seconds, of the cell counts kept by this policy.
+ * Counts recorded before the change stay comparable with the ones recorded
+ * after it; only the rate at which they decay from now on changes. */
+void
+cmux_logewma_set_halflife(double halflife)
+{
+  double decay;
+
+  if (BUG(!(halflife > 0.0)))
+    return;
+
+  decay = logewma_get_decay();
+  monotime_coarse_get(&decay_clock_base_time);
+  decay_clock_base_value = decay;
+  decay_rate = LOG_TWO / halflife;
+}
+
+/** Helper for sorting logewma_entry_t values in their priority queue. */
+static int
+compare_logewma_entries(const void *p1, const void *p2)
+{
+  const logewma_entry_t *e1 = p1, *e2 = p2;
+
+  if (e1->log_count < e2->log_count)
+    return -1;
+  else if (e1->log_count > e2->log_count)
+    return 1;
+  else
+    return 0;
+}
+
+/** Given a logewma_entry_t, return a pointer to the circuit containing it. */
+static circuit_t *
+logewma_entry_to_circuit(logewma_entry_t *entry)
+{
+  logewma_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(entry);
+  cdata = SUBTYPE_P(entry, logewma_policy_circ_data_t, entry);
+
+  return cdata->circ;
+}
+
+/**
+ * Allocate a logewma_policy_data_t and upcast it to a
+ * circuitmux_policy_data_t; this is called when setting the policy on a
+ * circuitmux_t to logewma_policy.
+ */
+static circuitmux_policy_data_t *
+logewma_alloc_cmux_data(circuitmux_t *cmux)
+{
+  logewma_policy_data_t *pol = NULL;
+
+  tor_assert(cmux);
+
+  pol = tor_malloc_zero(sizeof(*pol));
+  pol->base_.magic = LOGEWMA_POL_DATA_MAGIC;
+  pol->active_circuit_pqueue = smartlist_new();
+
+  return TO_CMUX_POL_DATA(pol);
+}
+
+/**
+ * Free a logewma_policy_data_t allocated with logewma_alloc_cmux_data().
+ */
+static void
+logewma_free_cmux_data(circuitmux_t *cmux,
+                       circuitmux_policy_data_t *pol_data)
+{
+  logewma_policy_data_t *pol = NULL;
+
+  tor_assert(cmux);
+  if (!pol_data) return;
+
+  pol = TO_LOGEWMA_POL_DATA(pol_data);
+
+  smartlist_free(pol->active_circuit_pqueue);
+  memwipe(pol, 0xda, sizeof(logewma_policy_data_t));
+  tor_free(pol);
+}
+
+/**
+ * Allocate a logewma_policy_circ_data_t and upcast it to a
+ * circuitmux_policy_circ_data_t; this is called when attaching a circuit to
+ * a circuitmux_t with logewma_policy.
+ */
+static circuitmux_policy_circ_data_t *
+logewma_alloc_circ_data(circuitmux_t *cmux,
+                        circuitmux_policy_data_t *pol_data,
+                        circuit_t *circ,
+                        cell_direction_t direction,
+                        unsigned int cell_count)
+{
+  logewma_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(direction == CELL_DIRECTION_OUT ||
+             direction == CELL_DIRECTION_IN);
+  (void)cell_count;
+
+  cdata = tor_malloc_zero(sizeof(*cdata));
+  cdata->base_.magic = LOGEWMA_POL_CIRC_DATA_MAGIC;
+  cdata->circ = circ;
+  cdata->entry.log_count = -INFINITY;
+  cdata->entry.heap_index = -1;
+  cdata->entry.is_for_p_chan = (direction == CELL_DIRECTION_IN);
+
+  return TO_CMUX_POL_CIRC_DATA(cdata);
+}
+
+/**
+ * Free a logewma_policy_circ_data_t allocated with logewma_alloc_circ_data().
+ */
+static void
+logewma_free_circ_data(circuitmux_t *cmux,
+                       circuitmux_policy_data_t *pol_data,
+                       circuit_t *circ,
+                       circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  logewma_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(circ);
+  tor_assert(pol_data);
+
+  if (!pol_circ_data) return;
+
+  cdata = TO_LOGEWMA_POL_CIRC_DATA(pol_circ_data);
+  memwipe(cdata, 0xdc, sizeof(logewma_policy_circ_data_t));
+  tor_free(cdata);
+}
+
+/**
+ * Handle circuit activation; this inserts the circuit's entry into the
+ * active_circuit_pqueue.  Unlike the EWMA policy, we don't need to rescale
+ * it first.
+ */
+static void
+logewma_notify_circ_active(circuitmux_t *cmux,
+                           circuitmux_policy_data_t *pol_data,
+                           circuit_t *circ,
+                           circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  logewma_policy_data_t *pol = NULL;
+  logewma_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_LOGEWMA_POL_DATA(pol_data);
+  cdata = TO_LOGEWMA_POL_CIRC_DATA(pol_circ_data);
+  tor_assert(cdata->entry.heap_index == -1);
+
+  smartlist_pqueue_add(pol->active_circuit_pqueue,
+                       compare_logewma_entries,
+                       offsetof(logewma_entry_t, heap_index),
+                       &cdata->entry);
+}
+
+/**
+ * Handle circuit deactivation; this removes the circuit's entry from the
+ * active_circuit_pqueue.
+ */
+static void
+logewma_notify_circ_inactive(circuitmux_t *cmux,
+                             circuitmux_policy_data_t *pol_data,
+                             circuit_t *circ,
+                             circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  logewma_policy_data_t *pol = NULL;
+  logewma_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_LOGEWMA_POL_DATA(pol_data);
+  cdata = TO_LOGEWMA_POL_CIRC_DATA(pol_circ_data);
+  tor_assert(cdata->entry.heap_index != -1);
+
+  smartlist_pqueue_remove(pol->active_circuit_pqueue,
+                          compare_logewma_entries,
+                          offsetof(logewma_entry_t, heap_index),
+                          &cdata->entry);
+}
+
+/**
+ * Add <b>n_cells</b> cells, sent now, to this circuit's count, and move it
+ * to its new place in the queue.
+ */
+static void
+logewma_notify_xmit_cells(circuitmux_t *cmux,
+                          circuitmux_policy_data_t *pol_data,
+                          circuit_t *circ,
+                          circuitmux_policy_circ_data_t *pol_circ_data,
+                          unsigned int n_cells)
+{
+  logewma_policy_data_t *pol = NULL;
+  logewma_policy_circ_data_t *cdata = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+  tor_assert(n_cells > 0);
+
+  pol = TO_LOGEWMA_POL_DATA(pol_data);
+  cdata = TO_LOGEWMA_POL_CIRC_DATA(pol_circ_data);
+
+  cdata->entry.log_count =
+    logewma_add_log(cdata->entry.log_count,
+                    log((double)n_cells) + logewma_get_decay());
+
+  /* Since we just sent on this circuit, it should be at the head of the
+   * queue.  Its count only grew, so it can only move down from there. */
+  tor_assert(smartlist_get(pol->active_circuit_pqueue, 0) == &cdata->entry);
+  smartlist_pqueue_update(pol->active_circuit_pqueue,
+                          compare_logewma_entries,
+                          offsetof(logewma_entry_t, heap_index),
+                          &cdata->entry);
+}
+
+/**
+ * Pick the preferred circuit to send from: the one with the lowest weighted
+ * cell count.
+ */
+static circuit_t *
+logewma_pick_active_circuit(circuitmux_t *cmux,
+                            circuitmux_policy_data_t *pol_data)
+{
+  logewma_policy_data_t *pol = NULL;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+
+  pol = TO_LOGEWMA_POL_DATA(pol_data);
+
+  if (smartlist_len(pol->active_circuit_pqueue) == 0)
+    return NULL;
+
+  return logewma_entry_to_circuit(smartlist_get(pol->active_circuit_pqueue,
+                                                0));
+}
+
+/**
+ * Compare two log-domain EWMA cmuxes, and return -1, 0 or 1 to indicate
+ * which should be more preferred - see circuitmux_compare_muxes() of
+ * circuitmux.c.
+ */
+static int
+logewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
+                 circuitmux_t *cmux_2, circuitmux_policy_data_t *pol_data_2)
+{
+  logewma_policy_data_t *p1 = NULL, *p2 = NULL;
+  const logewma_entry_t *e1 = NULL, *e2 = NULL;
+
+  tor_assert(cmux_1);
+  tor_assert(pol_data_1);
+  tor_assert(cmux_2);
+  tor_assert(pol_data_2);
+
+  p1 = TO_LOGEWMA_POL_DATA(pol_data_1);
+  p2 = TO_LOGEWMA_POL_DATA(pol_data_2);
+
+  if (p1 == p2)
+    return 0;
+
+  if (smartlist_len(p1->active_circuit_pqueue) > 0)
+    e1 = smartlist_get(p1->active_circuit_pqueue, 0);
+  if (smartlist_len(p2->active_circuit_pqueue) > 0)
+    e2 = smartlist_get(p2->active_circuit_pqueue, 0);
+
+  if (e1 && e2) {
+    /* Both cmuxes share the decay clock, so their counts are comparable. */
+    return compare_logewma_entries(e1, e2);
+  } else if (e1) {
+    return -1;
+  } else if (e2) {
+    return 1;
+  } else {
+    return 0;
+  }
+}
+
+/*** Log-domain EWMA circuitmux_policy_t method table ***/
+
+circuitmux_policy_t logewma_policy = {
+  /*.alloc_cmux_data =*/ logewma_alloc_cmux_data,
+  /*.free_cmux_data =*/ logewma_free_cmux_data,
+  /*.alloc_circ_data =*/ logewma_alloc_circ_data,
+  /*.free_circ_data =*/ logewma_free_circ_data,
+  /*.notify_circ_active =*/ logewma_notify_circ_active,
+  /*.notify_circ_inactive =*/ logewma_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL, /* We don't need this either */
+  /*.notify_xmit_cells =*/ logewma_notify_xmit_cells,
+  /*.pick_active_circuit =*/ logewma_pick_active_circuit,
+  /*.cmp_cmux =*/ logewma_cmp_cmux
+};
+
+/**
+ * Drop all resources held by circuitmux_logewma.c, and deinitialize the
+ * module. */
+void
+circuitmux_logewma_free_all(void)
+{
+  decay_clock_initialized = 0;
+  decay_clock_base_value = 0.0;
+  decay_rate = LOG_TWO / LOGEWMA_DEFAULT_HALFLIFE;
+}
@@ -0,0 +1,107 @@
+/* Copyright (c) 2012-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circuitmux_logewma.h
+ * \brief Header file for circuitmux_logewma.c
+ **/
+
+#ifndef TOR_CIRCUITMUX_LOGEWMA_H
+#define TOR_CIRCUITMUX_LOGEWMA_H
+
+#include "core/or/or.h"
+#include "core/or/circuitmux.h"
+
+/* The public log-domain EWMA policy callbacks object. */
+extern circuitmux_policy_t logewma_policy;
+
+void cmux_logewma_set_halflife(double halflife);
+
+void circuitmux_logewma_free_all(void);
+
+#ifdef CIRCUITMUX_LOGEWMA_PRIVATE
+
+typedef struct logewma_entry_t logewma_entry_t;
+typedef struct logewma_policy_data_t logewma_policy_data_t;
+typedef struct logewma_policy_circ_data_t logewma_policy_circ_data_t;
+
+/**
+ * A logewma_entry_t keeps track of how many cells a circuit has sent
+ * recently, like a cell_ewma_t does, but stores the natural logarithm of
+ * that count, scaled to a single instant shared by every circuitmux.
+ */
+struct logewma_entry_t {
+  /** The log of the circuit's weighted cell count, where a cell sent at
+   * decay time D (see logewma_get_decay()) has weight exp(D).  This is
+   * -INFINITY if the circuit has never sent a cell. */
+  double log_count;
+  /** True iff this is the cell count for a circuit's previous
+   * channel. */
+  unsigned int is_for_p_chan : 1;
+  /** The position of the circuit within the circuitmux's priority queue. */
+  int heap_index;
+};
+
+struct logewma_policy_data_t {
+  circuitmux_policy_data_t base_;
+
+  /**
+   * Priority queue of logewma_entry_t for circuits with queued cells waiting
+   * for room to free up on the channel that owns this circuitmux.  Kept in
+   * heap order according to log_count.
+   */
+  smartlist_t *active_circuit_pqueue;
+};
+
+struct logewma_policy_circ_data_t {
+  circuitmux_policy_circ_data_t base_;
+
+  /** The weighted cell count for the cells flushed from this circuit onto
+   * this circuitmux. */
+  logewma_entry_t entry;
+
+  /** Pointer back to the circuit_t this is for. */
+  circuit_t *circ;
+};
+
+#define LOGEWMA_POL_DATA_MAGIC 0x5c01e3a9U
+#define LOGEWMA_POL_CIRC_DATA_MAGIC 0x0b4f6dd2U
+
+/**
+ * Downcast a circuitmux_policy_data_t to a logewma_policy_data_t and assert
+ * if the cast is impossible.
+ */
+static inline logewma_policy_data_t *
+TO_LOGEWMA_POL_DATA(circuitmux_policy_data_t *pol)
+{
+  if (!pol) return NULL;
+  else {
+    tor_assertf(pol->magic == LOGEWMA_POL_DATA_MAGIC,
+                "Mismatch: %"PRIu32" != %"PRIu32,
+                pol->magic, LOGEWMA_POL_DATA_MAGIC);
+    return DOWNCAST(logewma_policy_data_t, pol);
+  }
+}
+
+/**
+ * Downcast a circuitmux_policy_circ_data_t to a logewma_policy_circ_data_t
+ * and assert if the cast is impossible.
+ */
+static inline logewma_policy_circ_data_t *
+TO_LOGEWMA_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
+{
+  if (!pol) return NULL;
+  else {
+    tor_assertf(pol->magic == LOGEWMA_POL_CIRC_DATA_MAGIC,
+                "Mismatch: %"PRIu32" != %"PRIu32,
+                pol->magic, LOGEWMA_POL_CIRC_DATA_MAGIC);
+    return DOWNCAST(logewma_policy_circ_data_t, pol);
+  }
+}
+
+STATIC double logewma_get_decay(void);
+STATIC double logewma_add_log(double log_a, double log_b);
+
+#endif /* defined(CIRCUITMUX_LOGEWMA_PRIVATE) */
+
+#endif /* !defined(TOR_CIRCUITMUX_LOGEWMA_H) */
@@ -545,11 +545,14 @@ circuit_expire_building(void)
 
   bool fixed_time = circuit_build_times_disabled(get_options());
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *,victim) {
+  /* Only circuits that originate here can be building: on a relay, that's
+   * far fewer than all of the circuits. */
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_origin_circuit_list(),
+                          origin_circuit_t *, origin_victim) {
+    circuit_t *victim = TO_CIRCUIT(origin_victim);
     struct timeval cutoff;
 
-    if (!CIRCUIT_IS_ORIGIN(victim) || /* didn't originate here */
-        victim->marked_for_close)     /* don't mess with marked circs */
+    if (victim->marked_for_close)     /* don't mess with marked circs */
       continue;
 
     /* If we haven't yet started the first hop, it means we don't have
@@ -816,7 +819,7 @@ circuit_expire_building(void)
       circuit_mark_for_close(victim, END_CIRC_REASON_TIMEOUT);
 
     pathbias_count_timeout(TO_ORIGIN_CIRCUIT(victim));
-  } SMARTLIST_FOREACH_END(victim);
+  } SMARTLIST_FOREACH_END(origin_victim);
 }
 
 /**
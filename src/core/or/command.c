@@ -49,6 +49,7 @@
 #include "core/or/dos.h"
 #include "core/or/onion.h"
 #include "core/or/relay.h"
+#include "core/or/relay_crypto_offload.h"
 #include "feature/control/control_events.h"
 #include "feature/hibernate/hibernate.h"
 #include "feature/nodelist/describe.h"
@@ -658,9 +659,16 @@ command_process_destroy_cell(cell_t *cell, channel_t *chan)
       cell->circ_id == TO_OR_CIRCUIT(circ)->p_circ_id) {
     /* The destroy came from behind so nullify its p_chan. Close the circuit
      * with a DESTROYED reason so we don't propagate along the path forward the
-     * reason which could be used as a side channel. */
+     * reason which could be used as a side channel.
+     *
+     * Relay cells that arrived before the destroy may still be waiting for
+     * a worker thread: they go first, and if a worker is busy with them,
+     * it closes the circuit when it is done. */
+    if (relay_crypto_offload_hold_destroy(TO_OR_CIRCUIT(circ)))
+      return;
     circuit_set_p_circid_chan(TO_OR_CIRCUIT(circ), 0, NULL);
-    circuit_mark_for_close(circ, END_CIRC_REASON_DESTROYED);
+    if (!circ->marked_for_close)
+      circuit_mark_for_close(circ, END_CIRC_REASON_DESTROYED);
   } else { /* the destroy came from ahead */
     circuit_set_n_circid_chan(circ, 0, NULL);
     if (CIRCUIT_IS_ORIGIN(circ)) {
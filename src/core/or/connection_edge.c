@@ -117,6 +117,7 @@
 #include "core/or/half_edge_st.h"
 #include "core/or/socks_request_st.h"
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/timers.h"
 
 #ifdef HAVE_LINUX_TYPES_H
 #include <linux/types.h>
@@ -1172,138 +1173,252 @@ compute_retry_timeout(entry_connection_t *conn)
   return 15;
 }
 
-/** Find all general-purpose AP streams waiting for a response that sent their
- * begin/resolve cell too long ago. Detach from their current circuit, and
- * mark their current circuit as unsuitable for new streams. Then call
- * connection_ap_handshake_attach_circuit() to attach to a new circuit (if
- * available) or launch a new one.
- *
- * For rendezvous streams, simply give up after SocksTimeout seconds (with no
- * retry attempt).
- */
-void
-connection_ap_expire_beginning(void)
+/** Timer wheel, in seconds of wall-clock time, on which every AP stream has
+ * a timer for the next time connection_ap_check_expiry() should look at
+ * it. */
+static tor_timer_wheel_t *ap_expiry_wheel = NULL;
+/** The time of the current run of ap_expiry_wheel. */
+static time_t ap_expiry_now = 0;
+
+/** Return the time at which connection_ap_check_expiry() should next look at
+ * <b>entry_conn</b>, or 0 if it doesn't need to.  That's never later than
+ * the time at which the stream would time out, if nothing else happens to
+ * it, and never earlier than a second after <b>now</b>. */
+static time_t
+connection_ap_next_expiry(entry_connection_t *entry_conn, time_t now)
 {
-  edge_connection_t *conn;
-  entry_connection_t *entry_conn;
+  const connection_t *base_conn = ENTRY_TO_CONN(entry_conn);
+  const or_options_t *options = get_options();
+  time_t when;
+
+  if (base_conn->marked_for_close || base_conn->state == AP_CONN_STATE_OPEN)
+    return 0;
+
+  if (AP_CONN_STATE_IS_UNATTACHED(base_conn->state)) {
+    when = base_conn->timestamp_created + options->SocksTimeout;
+  } else {
+    const circuit_t *circ =
+      circuit_get_by_edge_conn(ENTRY_TO_EDGE_CONN(entry_conn));
+    int cutoff = compute_retry_timeout(entry_conn);
+    if (circ && circ->purpose == CIRCUIT_PURPOSE_C_REND_JOINED)
+      cutoff = MAX(cutoff, options->SocksTimeout);
+    when = base_conn->timestamp_last_read_allowed + cutoff;
+  }
+
+  /* Streams that are past their deadline but that we didn't expire (e.g.
+   * because they wait on an onion service with PoW defenses), and streams
+   * whose deadline moves (e.g. because they read data), get looked at once
+   * per second, as they all used to be. */
+  return MAX(when, now + 1);
+}
+
+/** If <b>entry_conn</b> has been waiting too long for its circuit or for a
+ * reply to its begin or resolve cell, give up on it or retry it on another
+ * circuit. */
+static void
+connection_ap_check_expiry(entry_connection_t *entry_conn, time_t now)
+{
+  edge_connection_t *conn = ENTRY_TO_EDGE_CONN(entry_conn);
+  connection_t *base_conn = ENTRY_TO_CONN(entry_conn);
   circuit_t *circ;
-  time_t now = time(NULL);
   const or_options_t *options = get_options();
   int severity;
   int cutoff;
   int seconds_idle, seconds_since_born;
-  smartlist_t *conns = get_connection_array();
 
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, base_conn) {
-    if (base_conn->type != CONN_TYPE_AP || base_conn->marked_for_close)
-      continue;
-    entry_conn = TO_ENTRY_CONN(base_conn);
-    conn = ENTRY_TO_EDGE_CONN(entry_conn);
-    /* if it's an internal linked connection, don't yell its status. */
-    severity = (tor_addr_is_null(&base_conn->addr) && !base_conn->port)
-      ? LOG_INFO : LOG_NOTICE;
-    seconds_idle = (int)( now - base_conn->timestamp_last_read_allowed );
-    seconds_since_born = (int)( now - base_conn->timestamp_created );
-
-    if (base_conn->state == AP_CONN_STATE_OPEN)
-      continue;
+  /* Streams that aren't in the connection array (yet) are none of our
+   * business. */
+  if (base_conn->conn_array_index < 0)
+    return;
+  if (base_conn->marked_for_close || base_conn->state == AP_CONN_STATE_OPEN)
+    return;
 
-    /* We already consider SocksTimeout in
-     * connection_ap_handshake_attach_circuit(), but we need to consider
-     * it here too because controllers that put streams in controller_wait
-     * state never ask Tor to attach the circuit. */
-    if (AP_CONN_STATE_IS_UNATTACHED(base_conn->state)) {
-      /* If this is a connection to an HS with PoW defenses enabled, we need to
-       * wait longer than the usual Socks timeout. */
-      if (seconds_since_born >= options->SocksTimeout &&
-          !entry_conn->hs_with_pow_conn) {
-        log_fn(severity, LD_APP,
-            "Tried for %d seconds to get a connection to %s:%d. "
-            "Giving up. (%s)",
-            seconds_since_born,
-            safe_str_client(entry_conn->socks_request->address),
-            entry_conn->socks_request->port,
-            conn_state_to_string(CONN_TYPE_AP, base_conn->state));
-        connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
-      }
-      continue;
+  /* if it's an internal linked connection, don't yell its status. */
+  severity = (tor_addr_is_null(&base_conn->addr) && !base_conn->port)
+    ? LOG_INFO : LOG_NOTICE;
+  seconds_idle = (int)( now - base_conn->timestamp_last_read_allowed );
+  seconds_since_born = (int)( now - base_conn->timestamp_created );
+
+  /* We already consider SocksTimeout in
+   * connection_ap_handshake_attach_circuit(), but we need to consider
+   * it here too because controllers that put streams in controller_wait
+   * state never ask Tor to attach the circuit. */
+  if (AP_CONN_STATE_IS_UNATTACHED(base_conn->state)) {
+    /* If this is a connection to an HS with PoW defenses enabled, we need to
+     * wait longer than the usual Socks timeout. */
+    if (seconds_since_born >= options->SocksTimeout &&
+        !entry_conn->hs_with_pow_conn) {
+      log_fn(severity, LD_APP,
+          "Tried for %d seconds to get a connection to %s:%d. "
+          "Giving up. (%s)",
+          seconds_since_born,
+          safe_str_client(entry_conn->socks_request->address),
+          entry_conn->socks_request->port,
+          conn_state_to_string(CONN_TYPE_AP, base_conn->state));
+      connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
     }
+    return;
+  }
 
-    /* We're in state connect_wait or resolve_wait now -- waiting for a
-     * reply to our relay cell. See if we want to retry/give up. */
+  /* We're in state connect_wait or resolve_wait now -- waiting for a
+   * reply to our relay cell. See if we want to retry/give up. */
 
-    cutoff = compute_retry_timeout(entry_conn);
-    if (seconds_idle < cutoff)
-      continue;
-    circ = circuit_get_by_edge_conn(conn);
-    if (!circ) { /* it's vanished? */
-      log_info(LD_APP,"Conn is waiting (address %s), but lost its circ.",
-               safe_str_client(entry_conn->socks_request->address));
+  cutoff = compute_retry_timeout(entry_conn);
+  if (seconds_idle < cutoff)
+    return;
+  circ = circuit_get_by_edge_conn(conn);
+  if (!circ) { /* it's vanished? */
+    log_info(LD_APP,"Conn is waiting (address %s), but lost its circ.",
+             safe_str_client(entry_conn->socks_request->address));
+    connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
+    return;
+  }
+  if (circ->purpose == CIRCUIT_PURPOSE_C_REND_JOINED) {
+    if (seconds_idle >= options->SocksTimeout) {
+      log_fn(severity, LD_REND,
+             "Rend stream is %d seconds late. Giving up on address"
+             " '%s.onion'.",
+             seconds_idle,
+             safe_str_client(entry_conn->socks_request->address));
+      /* Roll back path bias use state so that we probe the circuit
+       * if nothing else succeeds on it */
+      pathbias_mark_use_rollback(TO_ORIGIN_CIRCUIT(circ));
+
+      connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
       connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
-      continue;
-    }
-    if (circ->purpose == CIRCUIT_PURPOSE_C_REND_JOINED) {
-      if (seconds_idle >= options->SocksTimeout) {
-        log_fn(severity, LD_REND,
-               "Rend stream is %d seconds late. Giving up on address"
-               " '%s.onion'.",
-               seconds_idle,
-               safe_str_client(entry_conn->socks_request->address));
-        /* Roll back path bias use state so that we probe the circuit
-         * if nothing else succeeds on it */
-        pathbias_mark_use_rollback(TO_ORIGIN_CIRCUIT(circ));
-
-        connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
-        connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
-      }
-      continue;
     }
+    return;
+  }
 
-    if (circ->purpose != CIRCUIT_PURPOSE_C_GENERAL &&
-        circ->purpose != CIRCUIT_PURPOSE_CONFLUX_LINKED &&
-        circ->purpose != CIRCUIT_PURPOSE_CONTROLLER &&
-        circ->purpose != CIRCUIT_PURPOSE_C_HSDIR_GET &&
-        circ->purpose != CIRCUIT_PURPOSE_S_HSDIR_POST &&
-        circ->purpose != CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT &&
-        circ->purpose != CIRCUIT_PURPOSE_PATH_BIAS_TESTING) {
-      log_warn(LD_BUG, "circuit->purpose == CIRCUIT_PURPOSE_C_GENERAL failed. "
-               "The purpose on the circuit was %s; it was in state %s, "
-               "path_state %s.",
-               circuit_purpose_to_string(circ->purpose),
-               circuit_state_to_string(circ->state),
-               CIRCUIT_IS_ORIGIN(circ) ?
-                pathbias_state_to_string(TO_ORIGIN_CIRCUIT(circ)->path_state) :
-                "none");
-    }
-    log_fn(cutoff < 15 ? LOG_INFO : severity, LD_APP,
-           "We tried for %d seconds to connect to '%s' using exit %s."
-           " Retrying on a new circuit.",
-           seconds_idle,
-           safe_str_client(entry_conn->socks_request->address),
-           conn->cpath_layer ?
-             extend_info_describe(conn->cpath_layer->extend_info):
-             "*unnamed*");
-    /* send an end down the circuit */
-    connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
-    /* un-mark it as ending, since we're going to reuse it */
-    conn->edge_has_sent_end = 0;
-    conn->end_reason = 0;
-    /* make us not try this circuit again, but allow
-     * current streams on it to survive if they can */
-    mark_circuit_unusable_for_new_conns(TO_ORIGIN_CIRCUIT(circ));
-
-    /* give our stream another 'cutoff' seconds to try */
-    conn->base_.timestamp_last_read_allowed += cutoff;
-    if (entry_conn->num_socks_retries < 250) /* avoid overflow */
-      entry_conn->num_socks_retries++;
-    /* move it back into 'pending' state, and try to attach. */
-    if (connection_ap_detach_retriable(entry_conn, TO_ORIGIN_CIRCUIT(circ),
-                                       END_STREAM_REASON_TIMEOUT)<0) {
-      if (!base_conn->marked_for_close)
-        connection_mark_unattached_ap(entry_conn,
-                                      END_STREAM_REASON_CANT_ATTACH);
-    }
-  } SMARTLIST_FOREACH_END(base_conn);
+  if (circ->purpose != CIRCUIT_PURPOSE_C_GENERAL &&
+      circ->purpose != CIRCUIT_PURPOSE_CONFLUX_LINKED &&
+      circ->purpose != CIRCUIT_PURPOSE_CONTROLLER &&
+      circ->purpose != CIRCUIT_PURPOSE_C_HSDIR_GET &&
+      circ->purpose != CIRCUIT_PURPOSE_S_HSDIR_POST &&
+      circ->purpose != CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT &&
+      circ->purpose != CIRCUIT_PURPOSE_PATH_BIAS_TESTING) {
+    log_warn(LD_BUG, "circuit->purpose == CIRCUIT_PURPOSE_C_GENERAL failed. "
+             "The purpose on the circuit was %s; it was in state %s, "
+             "path_state %s.",
+             circuit_purpose_to_string(circ->purpose),
+             circuit_state_to_string(circ->state),
+             CIRCUIT_IS_ORIGIN(circ) ?
+              pathbias_state_to_string(TO_ORIGIN_CIRCUIT(circ)->path_state) :
+              "none");
+  }
+  log_fn(cutoff < 15 ? LOG_INFO : severity, LD_APP,
+         "We tried for %d seconds to connect to '%s' using exit %s."
+         " Retrying on a new circuit.",
+         seconds_idle,
+         safe_str_client(entry_conn->socks_request->address),
+         conn->cpath_layer ?
+           extend_info_describe(conn->cpath_layer->extend_info):
+           "*unnamed*");
+  /* send an end down the circuit */
+  connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
+  /* un-mark it as ending, since we're going to reuse it */
+  conn->edge_has_sent_end = 0;
+  conn->end_reason = 0;
+  /* make us not try this circuit again, but allow
+   * current streams on it to survive if they can */
+  mark_circuit_unusable_for_new_conns(TO_ORIGIN_CIRCUIT(circ));
+
+  /* give our stream another 'cutoff' seconds to try */
+  conn->base_.timestamp_last_read_allowed += cutoff;
+  if (entry_conn->num_socks_retries < 250) /* avoid overflow */
+    entry_conn->num_socks_retries++;
+  /* move it back into 'pending' state, and try to attach. */
+  if (connection_ap_detach_retriable(entry_conn, TO_ORIGIN_CIRCUIT(circ),
+                                     END_STREAM_REASON_TIMEOUT)<0) {
+    if (!base_conn->marked_for_close)
+      connection_mark_unattached_ap(entry_conn,
+                                    END_STREAM_REASON_CANT_ATTACH);
+  }
+}
+
+/** Schedule the expiry timer of <b>entry_conn</b> on ap_expiry_wheel for
+ * the next time connection_ap_check_expiry() should look at it, given
+ * <b>now</b>, or disable it if it doesn't need to. */
+static void
+connection_ap_schedule_expiry_at(entry_connection_t *entry_conn, time_t now)
+{
+  const time_t when = connection_ap_next_expiry(entry_conn, now);
+
+  if (!when) {
+    if (entry_conn->expiry_timer && ap_expiry_wheel)
+      timer_wheel_disable(ap_expiry_wheel, entry_conn->expiry_timer);
+    return;
+  }
+  if (!ap_expiry_wheel)
+    ap_expiry_wheel = timer_wheel_new((uint64_t) now);
+  timer_wheel_schedule(ap_expiry_wheel, entry_conn->expiry_timer,
+                       (uint64_t) when);
+}
+
+/** Timer callback: the expiry timer of the AP stream <b>arg</b> is due. */
+static void
+connection_ap_expiry_cb(tor_timer_t *timer, void *arg,
+                        const struct monotime_t *now_mono)
+{
+  entry_connection_t *entry_conn = arg;
+  (void) timer;
+  (void) now_mono;
+
+  connection_ap_check_expiry(entry_conn, ap_expiry_now);
+  connection_ap_schedule_expiry_at(entry_conn, ap_expiry_now);
+}
+
+/** Make sure that connection_ap_expire_beginning() looks at
+ * <b>entry_conn</b> no later than when it may need to expire it.  Call this
+ * whenever that could be sooner than before: when the stream is created,
+ * and when it starts waiting for a reply to a begin or resolve cell. */
+void
+connection_ap_schedule_expiry(entry_connection_t *entry_conn)
+{
+  if (!entry_conn->expiry_timer)
+    entry_conn->expiry_timer = timer_new(connection_ap_expiry_cb, entry_conn);
+  connection_ap_schedule_expiry_at(entry_conn, approx_time());
+}
+
+/** Release the expiry timer of <b>entry_conn</b>, which is about to be
+ * freed. */
+void
+connection_ap_free_expiry(entry_connection_t *entry_conn)
+{
+  if (!entry_conn->expiry_timer)
+    return;
+  if (ap_expiry_wheel)
+    timer_wheel_disable(ap_expiry_wheel, entry_conn->expiry_timer);
+  timer_free(entry_conn->expiry_timer);
+}
+
+/** Find all general-purpose AP streams waiting for a response that sent their
+ * begin/resolve cell too long ago. Detach from their current circuit, and
+ * mark their current circuit as unsuitable for new streams. Then call
+ * connection_ap_handshake_attach_circuit() to attach to a new circuit (if
+ * available) or launch a new one.
+ *
+ * For rendezvous streams, simply give up after SocksTimeout seconds (with no
+ * retry attempt).
+ *
+ * Only the streams whose expiry timer is due are looked at: see
+ * connection_ap_schedule_expiry().
+ */
+void
+connection_ap_expire_beginning(void)
+{
+  connection_ap_expire_beginning_at(time(NULL));
+}
+
+/** As connection_ap_expire_beginning(), but take the current time to be
+ * <b>now</b>. */
+STATIC void
+connection_ap_expire_beginning_at(time_t now)
+{
+  if (!ap_expiry_wheel)
+    return;
+  ap_expiry_now = now;
+  timer_wheel_run(ap_expiry_wheel, (uint64_t) now);
 }
 
 /**
@@ -1603,6 +1718,9 @@ connection_entry_set_controller_wait(entry_connection_t *conn)
 {
   CONNECTION_AP_EXPECT_NONPENDING(conn);
   ENTRY_TO_CONN(conn)->state = AP_CONN_STATE_CONTROLLER_WAIT;
+  /* Controllers that never attach the stream rely on
+   * connection_ap_expire_beginning() to give up on it. */
+  connection_ap_schedule_expiry(conn);
   control_event_stream_status(conn, STREAM_EVENT_CONTROLLER_WAIT, 0);
 }
 
@@ -3328,6 +3446,7 @@ connection_ap_handshake_send_begin,(entry_connection_t *ap_conn))
   edge_conn->package_window = STREAMWINDOW_START;
   edge_conn->deliver_window = STREAMWINDOW_START;
   base_conn->state = AP_CONN_STATE_CONNECT_WAIT;
+  connection_ap_schedule_expiry(ap_conn);
   log_info(LD_APP,"Address/port sent, ap socket "TOR_SOCKET_T_FORMAT
            ", n_circ_id %u",
            base_conn->s, (unsigned)circ->base_.n_circ_id);
@@ -3431,6 +3550,7 @@ connection_ap_handshake_send_resolve(entry_connection_t *ap_conn)
     base_conn->address = tor_addr_to_str_dup(&base_conn->addr);
   }
   base_conn->state = AP_CONN_STATE_RESOLVE_WAIT;
+  connection_ap_schedule_expiry(ap_conn);
   log_info(LD_APP,"Address sent for resolve, ap socket "TOR_SOCKET_T_FORMAT
            ", n_circ_id %u",
            base_conn->s, (unsigned)circ->base_.n_circ_id);
@@ -4770,4 +4890,5 @@ connection_edge_free_all(void)
   smartlist_free(pending_entry_connections);
   pending_entry_connections = NULL;
   mainloop_event_free(attach_pending_entry_connections_ev);
+  timer_wheel_free(ap_expiry_wheel);
 }
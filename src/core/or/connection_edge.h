@@ -134,6 +134,8 @@ int connection_edge_is_rendezvous_stream(const edge_connection_t *conn);
 int connection_ap_can_use_exit(const entry_connection_t *conn,
                                const node_t *exit);
 void connection_ap_expire_beginning(void);
+void connection_ap_schedule_expiry(entry_connection_t *entry_conn);
+void connection_ap_free_expiry(entry_connection_t *entry_conn);
 void connection_ap_rescan_and_attach_pending(void);
 void connection_ap_attach_pending(int retry);
 void connection_ap_mark_as_pending_circuit_(entry_connection_t *entry_conn,
@@ -306,6 +308,7 @@ STATIC void connection_half_edge_add(const edge_connection_t *conn,
 STATIC struct half_edge_t *connection_half_edge_find_stream_id(
                                      const smartlist_t *half_conns,
                                      streamid_t stream_id);
+STATIC void connection_ap_expire_beginning_at(time_t now);
 #endif /* defined(CONNECTION_EDGE_PRIVATE) */
 
 #endif /* !defined(TOR_CONNECTION_EDGE_H) */
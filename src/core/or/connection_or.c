@@ -68,6 +68,7 @@
 #include "core/or/congestion_control_common.h"
 #include "feature/dirauth/authmode.h"
 #include "feature/hs/hs_service.h"
+#include "feature/hibernate/hibernate.h"
 
 #include "core/or/cell_st.h"
 #include "core/or/cell_queue_st.h"
@@ -80,6 +81,7 @@
 #include "lib/crypt_ops/crypto_format.h"
 
 #include "lib/tls/tortls.h"
+#include "lib/evloop/timers.h"
 
 #include "core/or/orconn_event.h"
 
@@ -95,6 +97,8 @@ static void connection_or_tls_renegotiated_cb(tor_tls_t *tls, void *_conn);
 static unsigned int
 connection_or_is_bad_for_new_circs(or_connection_t *or_conn);
 static void connection_or_mark_bad_for_new_circs(or_connection_t *or_conn);
+static void connection_or_expiry_cb(tor_timer_t *timer, void *arg,
+                                    const struct monotime_t *now_mono);
 
 static void connection_or_check_canonicity(or_connection_t *conn,
                                            int started_here);
@@ -905,6 +909,238 @@ connection_or_set_canonical(or_connection_t *or_conn,
           or_conn->chan ?
           (TLS_CHAN_TO_BASE(or_conn->chan)->global_identifier):0,
           or_conn->idle_timeout);
+  connection_or_schedule_expiry(or_conn);
+}
+
+/** Timer wheel, in seconds of wall-clock time, on which every OR connection
+ * has a timer for the next time connection_or_check_expiry() should look at
+ * it. */
+static tor_timer_wheel_t *or_expiry_wheel = NULL;
+/** The time of the current run of or_expiry_wheel. */
+static time_t or_expiry_now = 0;
+/** True iff we were hibernating at the last run of or_expiry_wheel. */
+static int or_expiry_was_hibernating = 0;
+
+/** Return the time at which connection_or_check_expiry() should next look at
+ * <b>or_conn</b>, or 0 if it doesn't need to.  That's never later than the
+ * time at which we would close the connection, if nothing else happens to
+ * it, and never earlier than a second after <b>now</b>. */
+static time_t
+connection_or_next_expiry(or_connection_t *or_conn, time_t now)
+{
+  connection_t *conn = TO_CONN(or_conn);
+  const or_options_t *options = get_options();
+  channel_t *chan;
+  time_t when;
+
+  if (conn->marked_for_close)
+    return 0;
+  /* Extended ORPort connections may become OR connections; connections
+   * that aren't in the connection array or don't have a channel yet will
+   * soon. */
+  if (conn->type != CONN_TYPE_OR || conn->conn_array_index < 0 ||
+      !or_conn->chan)
+    return now + 1;
+
+  /* Connections that are bad for new circuits close as soon as their last
+   * circuit does, and so do all idle connections while we hibernate: look
+   * at those once per second, as they all used to be. */
+  chan = TLS_CHAN_TO_BASE(or_conn->chan);
+  if (channel_is_bad_for_new_circs(chan) || we_are_hibernating())
+    return now + 1;
+
+  if (!connection_state_is_open(conn)) {
+    when = conn->timestamp_last_write_allowed + options->KeepalivePeriod;
+  } else {
+    const time_t last_had_circuits =
+      channel_num_circuits(chan) ? now : chan->timestamp_last_had_circuits;
+    const time_t stuck =
+      MAX(or_conn->timestamp_lastempty, conn->timestamp_last_write_allowed)
+      + options->KeepalivePeriod*10;
+    when = MIN(last_had_circuits + or_conn->idle_timeout, stuck);
+  }
+
+  /* The timestamps above only move forward: a connection whose deadline
+   * has moved since we scheduled it gets looked at again later. */
+  return MAX(when, now + 1);
+}
+
+/** If <b>or_conn</b> has had no circuits for too long, is bad for new
+ * circuits and has none, never opened, or is stuck, close it. */
+static void
+connection_or_check_expiry(or_connection_t *or_conn, time_t now)
+{
+  connection_t *conn = TO_CONN(or_conn);
+  const or_options_t *options = get_options();
+  channel_t *chan;
+  int have_any_circuits;
+  int past_keepalive =
+    now >= conn->timestamp_last_write_allowed + options->KeepalivePeriod;
+
+  if (conn->type != CONN_TYPE_OR || conn->conn_array_index < 0)
+    return;
+  if (conn->marked_for_close || !or_conn->chan)
+    return;
+
+  tor_assert(conn->outbuf);
+  chan = TLS_CHAN_TO_BASE(or_conn->chan);
+
+  if (!connection_get_outbuf_len(conn))
+    or_conn->timestamp_lastempty = now;
+
+  if (channel_num_circuits(chan) != 0) {
+    have_any_circuits = 1;
+    chan->timestamp_last_had_circuits = now;
+  } else {
+    have_any_circuits = 0;
+  }
+
+  if (channel_is_bad_for_new_circs(chan) && ! have_any_circuits) {
+    /* It's bad for new circuits, and has no unmarked circuits on it:
+     * mark it now. */
+    log_info(LD_OR,
+             "Expiring non-used OR connection to fd %d (%s:%d) [Too old].",
+             (int)conn->s, fmt_and_decorate_addr(&conn->addr), conn->port);
+    if (conn->state == OR_CONN_STATE_CONNECTING)
+      connection_or_connect_failed(or_conn,
+                                   END_OR_CONN_REASON_TIMEOUT,
+                                   "Tor gave up on the connection");
+    connection_or_close_normally(or_conn, 1);
+  } else if (!connection_state_is_open(conn)) {
+    if (past_keepalive) {
+      /* We never managed to actually get this connection open and happy. */
+      log_info(LD_OR,"Expiring non-open OR connection to fd %d (%s:%d).",
+               (int)conn->s, fmt_and_decorate_addr(&conn->addr), conn->port);
+      connection_or_close_normally(or_conn, 0);
+    }
+  } else if (we_are_hibernating() &&
+             ! have_any_circuits &&
+             !connection_get_outbuf_len(conn)) {
+    /* We're hibernating or shutting down, there's no circuits, and nothing to
+     * flush.*/
+    log_info(LD_OR,"Expiring non-used OR connection to fd %d (%s:%d) "
+             "[Hibernating or exiting].",
+             (int)conn->s, fmt_and_decorate_addr(&conn->addr), conn->port);
+    connection_or_close_normally(or_conn, 1);
+  } else if (!have_any_circuits &&
+             now - or_conn->idle_timeout >=
+                                         chan->timestamp_last_had_circuits) {
+    log_info(LD_OR,"Expiring non-used OR connection %"PRIu64" to fd %d "
+             "(%s:%d) [no circuits for %d; timeout %d; %scanonical].",
+             (chan->global_identifier),
+             (int)conn->s, fmt_and_decorate_addr(&conn->addr), conn->port,
+             (int)(now - chan->timestamp_last_had_circuits),
+             or_conn->idle_timeout,
+             or_conn->is_canonical ? "" : "non");
+    connection_or_close_normally(or_conn, 0);
+  } else if (
+      now >= or_conn->timestamp_lastempty + options->KeepalivePeriod*10 &&
+      now >=
+          conn->timestamp_last_write_allowed + options->KeepalivePeriod*10) {
+    log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,
+           "Expiring stuck OR connection to fd %d (%s:%d). (%d bytes to "
+           "flush; %d seconds since last write)",
+           (int)conn->s, fmt_and_decorate_addr(&conn->addr), conn->port,
+           (int)connection_get_outbuf_len(conn),
+           (int)(now-conn->timestamp_last_write_allowed));
+    connection_or_close_normally(or_conn, 0);
+  }
+}
+
+/** Schedule the expiry timer of <b>or_conn</b> on or_expiry_wheel for
+ * <b>when</b>, given <b>now</b>, or disable it if <b>when</b> is 0. */
+static void
+connection_or_set_expiry_timer(or_connection_t *or_conn, time_t when,
+                               time_t now)
+{
+  if (!when) {
+    if (or_conn->expiry_timer && or_expiry_wheel)
+      timer_wheel_disable(or_expiry_wheel, or_conn->expiry_timer);
+    return;
+  }
+  if (!or_conn->expiry_timer)
+    or_conn->expiry_timer = timer_new(connection_or_expiry_cb, or_conn);
+  if (!or_expiry_wheel)
+    or_expiry_wheel = timer_wheel_new((uint64_t) now);
+  timer_wheel_schedule(or_expiry_wheel, or_conn->expiry_timer,
+                       (uint64_t) when);
+}
+
+/** Timer callback: the expiry timer of the OR connection <b>arg</b> is
+ * due. */
+static void
+connection_or_expiry_cb(tor_timer_t *timer, void *arg,
+                        const struct monotime_t *now_mono)
+{
+  or_connection_t *or_conn = arg;
+  (void) timer;
+  (void) now_mono;
+
+  connection_or_check_expiry(or_conn, or_expiry_now);
+  connection_or_set_expiry_timer(or_conn,
+                          connection_or_next_expiry(or_conn, or_expiry_now),
+                          or_expiry_now);
+}
+
+/** Make sure that connection_or_expire_idle() looks at <b>or_conn</b> no
+ * later than when it may need to close it.  Call this whenever that could be
+ * sooner than before: when the connection is created or opened, when its
+ * idle timeout changes, and when it becomes bad for new circuits. */
+void
+connection_or_schedule_expiry(or_connection_t *or_conn)
+{
+  const time_t now = approx_time();
+
+  connection_or_set_expiry_timer(or_conn,
+                                 connection_or_next_expiry(or_conn, now), now);
+}
+
+/** Release the expiry timer of <b>or_conn</b>, which is about to be
+ * freed. */
+void
+connection_or_free_expiry(or_connection_t *or_conn)
+{
+  if (!or_conn->expiry_timer)
+    return;
+  if (or_expiry_wheel)
+    timer_wheel_disable(or_expiry_wheel, or_conn->expiry_timer);
+  timer_free(or_conn->expiry_timer);
+}
+
+/** Close the OR connections that have had no circuits for longer than their
+ * idle timeout, that are bad for new circuits and have none, that never
+ * opened, or that are stuck, given that the time is <b>now</b>.
+ *
+ * Only the connections whose expiry timer is due are looked at: see
+ * connection_or_schedule_expiry().  Sending keepalives and padding is up to
+ * run_connection_housekeeping().
+ */
+void
+connection_or_expire_idle(time_t now)
+{
+  const int hibernating = we_are_hibernating();
+
+  if (hibernating && !or_expiry_was_hibernating) {
+    /* We close idle connections sooner while hibernating. */
+    SMARTLIST_FOREACH(get_connection_array(), connection_t *, conn, {
+      if (conn->type == CONN_TYPE_OR && !conn->marked_for_close)
+        connection_or_set_expiry_timer(TO_OR_CONN(conn), now, now);
+    });
+  }
+  or_expiry_was_hibernating = hibernating;
+
+  if (!or_expiry_wheel)
+    return;
+  or_expiry_now = now;
+  timer_wheel_run(or_expiry_wheel, (uint64_t) now);
+}
+
+/** Release all storage held by the OR connection expiry timers. */
+void
+connection_or_free_all(void)
+{
+  timer_wheel_free(or_expiry_wheel);
+  or_expiry_was_hibernating = 0;
 }
 
 /** If we don't necessarily know the router we're connecting to, but we
@@ -1017,8 +1253,10 @@ connection_or_mark_bad_for_new_circs(or_connection_t *or_conn)
 {
   tor_assert(or_conn);
 
-  if (or_conn->chan)
+  if (or_conn->chan) {
     channel_mark_bad_for_new_circs(TLS_CHAN_TO_BASE(or_conn->chan));
+    connection_or_schedule_expiry(or_conn);
+  }
 }
 
 /** How old do we let a connection to an OR get before deciding it's
@@ -1677,6 +1915,8 @@ connection_tls_start_handshake,(or_connection_t *conn, int receiving))
     log_warn(LD_BUG,"tor_tls_new failed. Closing.");
     return -1;
   }
+  if (get_options()->KernelTLS)
+    tor_tls_enable_ktls(conn->tls);
   tor_tls_set_logged_address(conn->tls,
                              connection_describe_peer(TO_CONN(conn)));
 
@@ -2284,6 +2524,7 @@ connection_or_set_state_open(or_connection_t *conn)
   or_handshake_state_free(conn->handshake_state);
   conn->handshake_state = NULL;
   connection_start_reading(TO_CONN(conn));
+  connection_or_schedule_expiry(conn);
 
   return 0;
 }
@@ -2406,6 +2647,7 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
       const int wide_circ_ids = conn->wide_circ_ids;
       size_t cell_network_size = get_cell_network_size(conn->wide_circ_ids);
       char buf[CELL_MAX_NETWORK_SIZE];
+      const char *packed;
       cell_t cell;
       if (connection_get_inbuf_len(TO_CONN(conn))
           < cell_network_size) /* whole response available? */
@@ -2416,11 +2658,19 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
         channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
 
       circuit_build_times_network_is_live(get_circuit_build_times_mutable());
-      connection_buf_get_bytes(buf, cell_network_size, TO_CONN(conn));
 
       /* retrieve cell info from buf (create the host-order struct from the
-       * network-order string) */
-      cell_unpack(&cell, buf, wide_circ_ids);
+       * network-order string).  Usually the whole cell is in the first
+       * chunk of the inbuf, and we can unpack it from there; we only need to
+       * copy it out first when it spans two chunks. */
+      packed = buf_peek_contiguous(conn->base_.inbuf, cell_network_size);
+      if (packed) {
+        cell_unpack(&cell, packed, wide_circ_ids);
+        buf_drain(conn->base_.inbuf, cell_network_size);
+      } else {
+        connection_buf_get_bytes(buf, cell_network_size, TO_CONN(conn));
+        cell_unpack(&cell, buf, wide_circ_ids);
+      }
 
       channel_tls_handle_cell(&cell, conn);
     }
@@ -61,6 +61,10 @@ MOCK_DECL(int,connection_tls_start_handshake,(or_connection_t *conn,
 int connection_tls_continue_handshake(or_connection_t *conn);
 void connection_or_set_canonical(or_connection_t *or_conn,
                                  int is_canonical);
+void connection_or_schedule_expiry(or_connection_t *or_conn);
+void connection_or_free_expiry(or_connection_t *or_conn);
+void connection_or_expire_idle(time_t now);
+void connection_or_free_all(void);
 
 int connection_init_or_handshake_state(or_connection_t *conn,
                                        int started_here);
@@ -99,9 +99,15 @@ struct connection_t {
    * or has no socket. */
   tor_socket_t s;
   int conn_array_index; /**< Index into the global connection array. */
+  /** Index into the list of connections that are blocked on bandwidth, or
+   * -1 if this connection isn't in it. */
+  int bw_blocked_index;
 
   struct event *read_event; /**< Libevent event structure. */
   struct event *write_event; /**< Libevent event structure. */
+  /** If we have ever read or written this connection in an io_uring batch,
+   * the state for doing so.  See connection_uring.c. */
+  struct connection_uring_state_t *uring;
   struct buf_t *inbuf; /**< Buffer holding data read over this connection. */
   struct buf_t *outbuf; /**< Buffer holding data to write over this
                          * connection. */
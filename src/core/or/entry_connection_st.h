@@ -14,6 +14,8 @@
 
 #include "core/or/edge_connection_st.h"
 
+struct timeout;
+
 /** Subtype of edge_connection_t for an "entry connection" -- that is, a SOCKS
  * connection, a DNS request, a TransPort connection or a NATD connection */
 struct entry_connection_t {
@@ -100,6 +102,11 @@ struct entry_connection_t {
   /** True iff this is a connection to a HS that has PoW defenses enabled,
    * so we know not to apply the usual SOCKS timeout. */
   unsigned int hs_with_pow_conn : 1;
+
+  /** Timer (a tor_timer_t) for the next time connection_ap_expire_beginning()
+   * should check whether this stream has waited too long.  See
+   * connection_ap_schedule_expiry(). */
+  struct timeout *expiry_timer;
 };
 
 /** Cast a entry_connection_t subtype pointer to a edge_connection_t **/
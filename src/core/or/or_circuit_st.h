@@ -28,6 +28,24 @@ struct or_circuit_t {
    * a cpuworker and is waiting for a response. Used to decide whether it is
    * safe to free a circuit or if it is still in use by a cpuworker. */
   struct workqueue_entry_t *workqueue_entry;
+  /** If a worker thread is decrypting exit-ward cells for this circuit, the
+   * job that it is working on.  Used only in relay_crypto_offload.c. */
+  struct relay_crypto_job_t *relay_crypto_job;
+  /** Exit-ward relay cells (as cell_t *) that are waiting for a worker
+   * thread to decrypt them, in order of arrival.  Used only in
+   * relay_crypto_offload.c. */
+  smartlist_t *relay_crypto_pending;
+  /** How many cells at the start of relay_crypto_pending have already had
+   * our layer of encryption removed? */
+  int relay_crypto_n_decrypted;
+  /** True iff a DESTROY cell has arrived from behind while a worker was
+   * still decrypting the relay cells before it: we close the circuit once
+   * those cells are handled.  Used only in relay_crypto_offload.c. */
+  unsigned int relay_crypto_destroy_held : 1;
+  /** Once this circuit has been freed (and its magic set to
+   * DEAD_CIRCUIT_MAGIC), the number of worker thread jobs that were still
+   * using it.  The reply of the last one frees the memory. */
+  int n_dead_worker_refs;
 
   /** The circuit_id used in the previous (backward) hop of this circuit. */
   circid_t p_circ_id;
@@ -16,6 +16,7 @@
 #include "lib/evloop/token_bucket.h"
 
 struct tor_tls_t;
+struct timeout;
 
 /** Subtype of connection_t for an "OR connection" -- that is, one that speaks
  * cells over TLS. */
@@ -93,6 +94,10 @@ struct or_connection_t {
                           * circuits on it before we close it? Based on
                           * IDLE_CIRCUIT_TIMEOUT_{NON,}CANONICAL and
                           * on is_canonical, randomized. */
+  /** Timer (a tor_timer_t) for the next time connection_or_expire_idle()
+   * should check whether to close this connection.  See
+   * connection_or_schedule_expiry(). */
+  struct timeout *expiry_timer;
   or_handshake_state_t *handshake_state; /**< If we are setting this connection
                                           * up, state information to do so. */
 
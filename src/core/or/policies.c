@@ -21,6 +21,7 @@
 #include "feature/client/bridges.h"
 #include "app/config/config.h"
 #include "core/or/policies.h"
+#include "core/or/policy_trie.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
@@ -2900,6 +2901,36 @@ short_policy_is_reject_star(const short_policy_t *policy)
           policy->entries[0].max_port == 65535);
 }
 
+/** Decide whether addr:port is probably or definitely accepted or rejected by
+ * the exit policy of <b>router</b>.  See compare_tor_addr_to_addr_policy for
+ * details on addr/port interpretation.
+ *
+ * When both addr and port are known and the policy is long, we answer from
+ * a compiled copy of the policy, which we build the first time we need it.
+ */
+addr_policy_result_t
+compare_tor_addr_to_router_exit_policy(const tor_addr_t *addr, uint16_t port,
+                                       const routerinfo_t *router)
+{
+  const smartlist_t *policy = router->exit_policy;
+
+  if (policy && port && addr && !tor_addr_is_null(addr) &&
+      smartlist_len(policy) >= ADDR_POLICY_TRIE_MIN_RULES) {
+    if (!router->exit_policy_trie_built) {
+      /* The compiled policy is only a cache of exit_policy, which never
+       * changes once the routerinfo is built, so it's safe to fill in
+       * through a const pointer. */
+      routerinfo_t *mutable_router = (routerinfo_t *) router;
+      mutable_router->exit_policy_trie = addr_policy_trie_new(policy);
+      mutable_router->exit_policy_trie_built = 1;
+    }
+    if (router->exit_policy_trie)
+      return addr_policy_trie_lookup(router->exit_policy_trie, addr, port);
+  }
+
+  return compare_tor_addr_to_addr_policy(addr, port, policy);
+}
+
 /** Decide whether addr:port is probably or definitely accepted or rejected by
  * <b>node</b>.  See compare_tor_addr_to_addr_policy for details on addr/port
  * interpretation. */
@@ -2923,7 +2954,7 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
   }
 
   if (node->ri) {
-    return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
+    return compare_tor_addr_to_router_exit_policy(addr, port, node->ri);
   } else if (node->md) {
     if (node->md->exit_policy == NULL)
       return ADDR_POLICY_REJECTED;
@@ -117,6 +117,9 @@ addr_policy_t *addr_policy_get_canonical_entry(addr_policy_t *ent);
 int addr_policies_eq(const smartlist_t *a, const smartlist_t *b);
 MOCK_DECL(addr_policy_result_t, compare_tor_addr_to_addr_policy,
     (const tor_addr_t *addr, uint16_t port, const smartlist_t *policy));
+addr_policy_result_t compare_tor_addr_to_router_exit_policy(
+                              const tor_addr_t *addr, uint16_t port,
+                              const routerinfo_t *router);
 addr_policy_result_t compare_tor_addr_to_node_policy(const tor_addr_t *addr,
                               uint16_t port, const node_t *node);
 
@@ -0,0 +1,475 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file policy_trie.c
+ * \brief Compile address policies into a form that is fast to look up.
+ *
+ * An address policy (see policies.c) is a list of accept and reject rules,
+ * each matching an address prefix and a range of ports; the first rule that
+ * matches an addr:port decides what happens to it.  Walking the list costs
+ * time linear in its length, which adds up for exits with long policies,
+ * since they check their own policy on every stream they open.
+ *
+ * Here we compile a policy into a prefix trie.  Each rule lives in the trie
+ * node for its address prefix, and each trie node records, for each range of
+ * ports, the first of its rules that covers that range.  To find the first
+ * rule matching an addr:port, we follow the path for the address down from
+ * the root, look up the port at each node on the path that holds any rules,
+ * and take the earliest rule that we found.
+ *
+ * Only the trie nodes that hold rules matter for a lookup, and a policy
+ * usually has rules of only a handful of prefix lengths.  So rather than
+ * storing the links of the trie, we store it one level at a time: each level
+ * is a sorted array of the prefixes of that length that hold rules, and
+ * finding the node on our path at a given level is a binary search.  A
+ * lookup in a policy of N rules with L different prefix lengths thus costs
+ * O(L log N) instead of O(N).
+ **/
+
+#include "core/or/or.h"
+#include "core/or/policy_trie.h"
+
+#include "core/or/addr_policy_st.h"
+
+/** An address prefix, as a 128-bit big-endian number.  IPv4 addresses
+ * occupy the top 32 bits. */
+typedef struct policy_trie_key_t {
+  uint64_t hi;
+  uint64_t lo;
+} policy_trie_key_t;
+
+/** A range of ports, and the first rule of some trie node that covers it. */
+typedef struct policy_trie_range_t {
+  uint16_t prt_min;
+  uint16_t prt_max;
+  /** Index within the policy of the rule. */
+  uint32_t rule;
+} policy_trie_range_t;
+
+/** A node of the trie that holds at least one rule. */
+typedef struct policy_trie_node_t {
+  /** The prefix of this node, with the bits past its level cleared. */
+  policy_trie_key_t prefix;
+  /** Index within the trie's ranges array of this node's first port range.
+   * The ranges of a node are disjoint and sorted. */
+  uint32_t first_range;
+  /** Number of port ranges for this node. */
+  uint32_t n_ranges;
+} policy_trie_node_t;
+
+/** All the nodes of the trie at one depth that hold rules. */
+typedef struct policy_trie_level_t {
+  /** The length in bits of the prefixes at this level. */
+  maskbits_t bits;
+  /** The lowest index of any rule held at this level. */
+  uint32_t min_rule;
+  /** Number of entries in nodes. */
+  int n_nodes;
+  /** The nodes at this level, sorted by prefix. */
+  policy_trie_node_t *nodes;
+} policy_trie_level_t;
+
+/** The levels of the trie for one address family. */
+typedef struct policy_trie_family_t {
+  int n_levels;
+  /** The levels that hold rules, sorted by min_rule. */
+  policy_trie_level_t *levels;
+} policy_trie_family_t;
+
+/** A compiled address policy. */
+struct addr_policy_trie_t {
+  /** Number of rules in the original policy. */
+  int n_rules;
+  /** For each rule in the original policy, true iff it accepts. */
+  uint8_t *accepts;
+  /** The trie for IPv4 rules. */
+  policy_trie_family_t ipv4;
+  /** The trie for IPv6 rules. */
+  policy_trie_family_t ipv6;
+  /** The port ranges of every node of both tries. */
+  policy_trie_range_t *ranges;
+};
+
+/** A rule of the policy we're compiling, placed in the trie. */
+typedef struct policy_trie_entry_t {
+  sa_family_t family;
+  maskbits_t bits;
+  policy_trie_key_t prefix;
+  uint32_t rule;
+  uint16_t prt_min;
+  uint16_t prt_max;
+} policy_trie_entry_t;
+
+/** Return <b>key</b> with all but its first <b>bits</b> bits cleared. */
+static inline policy_trie_key_t
+policy_trie_key_mask(policy_trie_key_t key, maskbits_t bits)
+{
+  if (bits == 0) {
+    key.hi = key.lo = 0;
+  } else if (bits < 64) {
+    key.hi &= UINT64_MAX << (64 - bits);
+    key.lo = 0;
+  } else if (bits == 64) {
+    key.lo = 0;
+  } else if (bits < 128) {
+    key.lo &= UINT64_MAX << (128 - bits);
+  }
+  return key;
+}
+
+/** Return -1, 0, or 1 as <b>a</b> sorts before, equal to, or after
+ * <b>b</b>. */
+static inline int
+policy_trie_key_cmp(const policy_trie_key_t *a, const policy_trie_key_t *b)
+{
+  if (a->hi != b->hi)
+    return a->hi < b->hi ? -1 : 1;
+  if (a->lo != b->lo)
+    return a->lo < b->lo ? -1 : 1;
+  return 0;
+}
+
+/** Set *<b>key_out</b> to the key for <b>addr</b>.  Return 0 on success, or
+ * -1 if <b>addr</b> is neither IPv4 nor IPv6. */
+static int
+policy_trie_key_from_addr(const tor_addr_t *addr, policy_trie_key_t *key_out)
+{
+  switch (tor_addr_family(addr)) {
+    case AF_INET:
+      key_out->hi = ((uint64_t) tor_addr_to_ipv4h(addr)) << 32;
+      key_out->lo = 0;
+      return 0;
+    case AF_INET6: {
+      const uint8_t *a = tor_addr_to_in6_addr8(addr);
+      key_out->hi = tor_ntohll(get_uint64(a));
+      key_out->lo = tor_ntohll(get_uint64(a + 8));
+      return 0;
+    }
+    default:
+      return -1;
+  }
+}
+
+/** qsort helper: order policy_trie_entry_t by family, prefix length,
+ * prefix, and finally rule index. */
+static int
+compare_policy_trie_entries_(const void *a_, const void *b_)
+{
+  const policy_trie_entry_t *a = a_, *b = b_;
+  int r;
+  if (a->family != b->family)
+    return a->family < b->family ? -1 : 1;
+  if (a->bits != b->bits)
+    return a->bits < b->bits ? -1 : 1;
+  if ((r = policy_trie_key_cmp(&a->prefix, &b->prefix)))
+    return r;
+  if (a->rule != b->rule)
+    return a->rule < b->rule ? -1 : 1;
+  return 0;
+}
+
+/** qsort helper: order uint32_t values. */
+static int
+compare_uint32_(const void *a_, const void *b_)
+{
+  const uint32_t a = *(const uint32_t *)a_, b = *(const uint32_t *)b_;
+  return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+/** qsort helper: order policy_trie_level_t by min_rule. */
+static int
+compare_policy_trie_levels_(const void *a_, const void *b_)
+{
+  const policy_trie_level_t *a = a_, *b = b_;
+  return compare_uint32_(&a->min_rule, &b->min_rule);
+}
+
+/** Append a port range to the array *<b>ranges</b>, which has
+ * *<b>n_ranges</b> entries and room for *<b>cap</b>, growing it as needed.
+ * If the range continues the last one in the array, which belongs to a
+ * node whose first range is at <b>first_range</b>, and has the same rule,
+ * extend that one instead. */
+static void
+policy_trie_add_range(policy_trie_range_t **ranges, uint32_t *n_ranges,
+                      uint32_t *cap, uint32_t first_range,
+                      uint32_t prt_min, uint32_t prt_max, uint32_t rule)
+{
+  if (*n_ranges > first_range) {
+    policy_trie_range_t *last = &(*ranges)[*n_ranges - 1];
+    if (last->rule == rule && (uint32_t)last->prt_max + 1 == prt_min) {
+      last->prt_max = (uint16_t) prt_max;
+      return;
+    }
+  }
+  if (*n_ranges == *cap) {
+    *cap *= 2;
+    *ranges = tor_reallocarray(*ranges, *cap, sizeof(policy_trie_range_t));
+  }
+  policy_trie_range_t *r = &(*ranges)[(*n_ranges)++];
+  r->prt_min = (uint16_t) prt_min;
+  r->prt_max = (uint16_t) prt_max;
+  r->rule = rule;
+}
+
+/** Given the <b>n</b> entries at <b>entries</b>, which all belong to the
+ * same trie node and are sorted by rule index, append to *<b>ranges</b> the
+ * disjoint port ranges that each one is the first to cover.  Return the
+ * number of ranges added. */
+static uint32_t
+policy_trie_build_ranges(const policy_trie_entry_t *entries, int n,
+                         policy_trie_range_t **ranges, uint32_t *n_ranges,
+                         uint32_t *cap)
+{
+  const uint32_t first_range = *n_ranges;
+  uint32_t *bounds = tor_calloc(2 * n, sizeof(uint32_t));
+  int n_bounds = 0, i, j;
+
+  /* Every range of ports between two consecutive bounds is covered either
+   * entirely or not at all by each entry. */
+  for (i = 0; i < n; ++i) {
+    bounds[n_bounds++] = entries[i].prt_min;
+    bounds[n_bounds++] = (uint32_t) entries[i].prt_max + 1;
+  }
+  qsort(bounds, n_bounds, sizeof(uint32_t), compare_uint32_);
+
+  for (i = 0; i + 1 < n_bounds; ++i) {
+    const uint32_t lo = bounds[i], hi = bounds[i+1] - 1;
+    if (bounds[i] == bounds[i+1])
+      continue;
+    for (j = 0; j < n; ++j) {
+      if (entries[j].prt_min <= lo && hi <= entries[j].prt_max) {
+        policy_trie_add_range(ranges, n_ranges, cap, first_range,
+                              lo, hi, entries[j].rule);
+        break;
+      }
+    }
+  }
+
+  tor_free(bounds);
+  return *n_ranges - first_range;
+}
+
+/** Build the levels of <b>fam</b> from the <b>n</b> entries at
+ * <b>entries</b>, which are all of the same family and sorted with
+ * compare_policy_trie_entries_(). */
+static void
+policy_trie_build_family(policy_trie_family_t *fam,
+                         const policy_trie_entry_t *entries, int n,
+                         policy_trie_range_t **ranges, uint32_t *n_ranges,
+                         uint32_t *cap)
+{
+  int i = 0;
+
+  fam->levels = tor_calloc(n ? n : 1, sizeof(policy_trie_level_t));
+  while (i < n) {
+    policy_trie_level_t *level = &fam->levels[fam->n_levels++];
+    int level_end = i;
+    while (level_end < n && entries[level_end].bits == entries[i].bits)
+      ++level_end;
+
+    level->bits = entries[i].bits;
+    level->min_rule = UINT32_MAX;
+    level->nodes = tor_calloc(level_end - i, sizeof(policy_trie_node_t));
+    while (i < level_end) {
+      policy_trie_node_t *node = &level->nodes[level->n_nodes];
+      int node_end = i;
+      while (node_end < level_end &&
+             !policy_trie_key_cmp(&entries[node_end].prefix,
+                                  &entries[i].prefix))
+        ++node_end;
+
+      node->prefix = entries[i].prefix;
+      node->first_range = *n_ranges;
+      node->n_ranges = policy_trie_build_ranges(&entries[i], node_end - i,
+                                                ranges, n_ranges, cap);
+      if (node->n_ranges) {
+        ++level->n_nodes;
+        if (entries[i].rule < level->min_rule)
+          level->min_rule = entries[i].rule;
+      }
+      i = node_end;
+    }
+    if (!level->n_nodes) {
+      /* No rule at this level covers any port. */
+      tor_free(level->nodes);
+      --fam->n_levels;
+    }
+  }
+
+  /* Lookups visit the levels in this order, so that they can stop as soon
+   * as no level left could hold a rule earlier than the best one so far. */
+  qsort(fam->levels, fam->n_levels, sizeof(policy_trie_level_t),
+        compare_policy_trie_levels_);
+}
+
+/** Compile the address policy <b>policy</b>, a list of addr_policy_t, and
+ * return the result.  Return NULL if the policy has any rule that we can't
+ * compile: that is, one that matches neither IPv4 nor IPv6 addresses.
+ *
+ * The compiled policy doesn't refer to <b>policy</b>, but won't reflect any
+ * changes made to it later. */
+addr_policy_trie_t *
+addr_policy_trie_new(const smartlist_t *policy)
+{
+  addr_policy_trie_t *trie = NULL;
+  policy_trie_entry_t *entries;
+  policy_trie_range_t *ranges;
+  uint32_t n_ranges = 0, cap = 16;
+  int n_entries = 0, n_ipv4;
+
+  tor_assert(policy);
+
+  entries = tor_calloc(smartlist_len(policy) ? smartlist_len(policy) : 1,
+                       sizeof(policy_trie_entry_t));
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, p) {
+    policy_trie_entry_t *e = &entries[n_entries];
+    const sa_family_t family = tor_addr_family(&p->addr);
+    if (family != AF_INET && family != AF_INET6)
+      goto done;
+    if (p->prt_min > p->prt_max) {
+      /* This rule can't match anything. */
+      continue;
+    }
+    e->family = family;
+    e->bits = MIN(p->maskbits, family == AF_INET ? 32 : 128);
+    policy_trie_key_from_addr(&p->addr, &e->prefix);
+    e->prefix = policy_trie_key_mask(e->prefix, e->bits);
+    e->rule = p_sl_idx;
+    e->prt_min = p->prt_min;
+    e->prt_max = p->prt_max;
+    ++n_entries;
+  } SMARTLIST_FOREACH_END(p);
+
+  qsort(entries, n_entries, sizeof(policy_trie_entry_t),
+        compare_policy_trie_entries_);
+  for (n_ipv4 = 0; n_ipv4 < n_entries; ++n_ipv4) {
+    if (entries[n_ipv4].family != AF_INET)
+      break;
+  }
+
+  trie = tor_malloc_zero(sizeof(addr_policy_trie_t));
+  trie->n_rules = smartlist_len(policy);
+  trie->accepts = tor_calloc(trie->n_rules ? trie->n_rules : 1,
+                             sizeof(uint8_t));
+  SMARTLIST_FOREACH(policy, const addr_policy_t *, p,
+    trie->accepts[p_sl_idx] = (p->policy_type == ADDR_POLICY_ACCEPT));
+
+  ranges = tor_calloc(cap, sizeof(policy_trie_range_t));
+  policy_trie_build_family(&trie->ipv4, entries, n_ipv4,
+                           &ranges, &n_ranges, &cap);
+  policy_trie_build_family(&trie->ipv6, entries + n_ipv4,
+                           n_entries - n_ipv4, &ranges, &n_ranges, &cap);
+  trie->ranges = ranges;
+
+ done:
+  tor_free(entries);
+  return trie;
+}
+
+/** Release all storage held in <b>fam</b>. */
+static void
+policy_trie_family_clear(policy_trie_family_t *fam)
+{
+  int i;
+  for (i = 0; i < fam->n_levels; ++i)
+    tor_free(fam->levels[i].nodes);
+  tor_free(fam->levels);
+}
+
+/** Release all storage held by <b>trie</b>. */
+void
+addr_policy_trie_free_(addr_policy_trie_t *trie)
+{
+  if (!trie)
+    return;
+  policy_trie_family_clear(&trie->ipv4);
+  policy_trie_family_clear(&trie->ipv6);
+  tor_free(trie->accepts);
+  tor_free(trie->ranges);
+  tor_free(trie);
+}
+
+/** Return the node at <b>level</b> whose prefix is <b>prefix</b>, or NULL
+ * if there is none. */
+static const policy_trie_node_t *
+policy_trie_level_find(const policy_trie_level_t *level,
+                       const policy_trie_key_t *prefix)
+{
+  int lo = 0, hi = level->n_nodes;
+  while (lo < hi) {
+    const int mid = lo + (hi - lo) / 2;
+    const int r = policy_trie_key_cmp(&level->nodes[mid].prefix, prefix);
+    if (r == 0)
+      return &level->nodes[mid];
+    else if (r < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+/** Return the range of <b>node</b> in <b>trie</b> that holds <b>port</b>,
+ * or NULL if there is none. */
+static const policy_trie_range_t *
+policy_trie_node_find(const addr_policy_trie_t *trie,
+                      const policy_trie_node_t *node, uint16_t port)
+{
+  const policy_trie_range_t *ranges = trie->ranges + node->first_range;
+  int lo = 0, hi = (int) node->n_ranges;
+  while (lo < hi) {
+    const int mid = lo + (hi - lo) / 2;
+    if (port < ranges[mid].prt_min)
+      hi = mid;
+    else if (port > ranges[mid].prt_max)
+      lo = mid + 1;
+    else
+      return &ranges[mid];
+  }
+  return NULL;
+}
+
+/** Decide whether <b>addr</b>:<b>port</b> is accepted or rejected by the
+ * compiled policy <b>trie</b>.  Both the address and the port must be known;
+ * the answer is then always the same as compare_tor_addr_to_addr_policy()
+ * would give for the original policy. */
+addr_policy_result_t
+addr_policy_trie_lookup(const addr_policy_trie_t *trie,
+                        const tor_addr_t *addr, uint16_t port)
+{
+  const policy_trie_family_t *fam;
+  policy_trie_key_t key;
+  uint32_t best = UINT32_MAX;
+  int i;
+
+  tor_assert(trie);
+  tor_assert(addr);
+
+  if (policy_trie_key_from_addr(addr, &key) < 0) {
+    /* No rule matches addresses of other families. */
+    return ADDR_POLICY_ACCEPTED;
+  }
+  fam = tor_addr_family(addr) == AF_INET ? &trie->ipv4 : &trie->ipv6;
+
+  for (i = 0; i < fam->n_levels; ++i) {
+    const policy_trie_level_t *level = &fam->levels[i];
+    const policy_trie_node_t *node;
+    const policy_trie_range_t *range;
+    policy_trie_key_t prefix;
+
+    if (level->min_rule >= best)
+      break;
+    prefix = policy_trie_key_mask(key, level->bits);
+    if (!(node = policy_trie_level_find(level, &prefix)))
+      continue;
+    if ((range = policy_trie_node_find(trie, node, port)) &&
+        range->rule < best)
+      best = range->rule;
+  }
+
+  /* accept all by default. */
+  if (best == UINT32_MAX)
+    return ADDR_POLICY_ACCEPTED;
+  return trie->accepts[best] ? ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+}
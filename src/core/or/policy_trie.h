@@ -0,0 +1,29 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file policy_trie.h
+ * \brief Header file for policy_trie.c.
+ **/
+
+#ifndef TOR_POLICY_TRIE_H
+#define TOR_POLICY_TRIE_H
+
+#include "core/or/policies.h"
+
+/** Policies with fewer rules than this aren't worth compiling: walking
+ * them is as fast as looking them up in a trie. */
+#define ADDR_POLICY_TRIE_MIN_RULES 16
+
+typedef struct addr_policy_trie_t addr_policy_trie_t;
+
+addr_policy_trie_t *addr_policy_trie_new(const smartlist_t *policy);
+void addr_policy_trie_free_(addr_policy_trie_t *trie);
+#define addr_policy_trie_free(trie) \
+  FREE_AND_NULL(addr_policy_trie_t, addr_policy_trie_free_, (trie))
+
+addr_policy_result_t addr_policy_trie_lookup(const addr_policy_trie_t *trie,
+                                             const tor_addr_t *addr,
+                                             uint16_t port);
+
+#endif /* !defined(TOR_POLICY_TRIE_H) */
@@ -58,6 +58,7 @@
 #include "core/or/circuitpadding.h"
 #include "core/or/extendinfo.h"
 #include "lib/compress/compress.h"
+#include "lib/memarea/mempool.h"
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
 #include "core/or/connection_edge.h"
@@ -78,6 +79,7 @@
 #include "core/or/reasons.h"
 #include "core/or/relay.h"
 #include "core/crypto/relay_crypto.h"
+#include "core/or/relay_crypto_offload.h"
 #include "feature/rend/rendcommon.h"
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/routerlist.h"
@@ -233,10 +235,8 @@ int
 circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction)
 {
-  channel_t *chan = NULL;
   crypt_path_t *layer_hint=NULL;
   char recognized=0;
-  int reason;
 
   tor_assert(cell);
   tor_assert(circ);
@@ -245,6 +245,11 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
   if (circ->marked_for_close)
     return 0;
 
+  /* If we can, hand the cell to a worker thread for decryption; we'll pick
+   * up where we left off in circuit_receive_decrypted_relay_cell(). */
+  if (relay_crypto_offload_cell(circ, cell, cell_direction))
+    return 0;
+
   if (relay_decrypt_cell(circ, cell, cell_direction, &layer_hint, &recognized)
       < 0) {
     log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
@@ -252,6 +257,26 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
     return -END_CIRC_REASON_INTERNAL;
   }
 
+  return circuit_receive_decrypted_relay_cell(cell, circ, cell_direction,
+                                              layer_hint, recognized);
+}
+
+/** Second half of circuit_receive_relay_cell(): handle a relay <b>cell</b>
+ * on <b>circ</b> that has already had its layer of crypto removed.  If
+ * <b>recognized</b> is set, the cell is for us, at the hop
+ * <b>layer_hint</b>; otherwise, pass it on.
+ *
+ * Return -<b>reason</b> on failure.
+ */
+MOCK_IMPL(int,
+circuit_receive_decrypted_relay_cell,(cell_t *cell, circuit_t *circ,
+                                      cell_direction_t cell_direction,
+                                      crypt_path_t *layer_hint,
+                                      char recognized))
+{
+  channel_t *chan = NULL;
+  int reason;
+
   circuit_update_channel_usage(circ, cell);
 
   if (recognized) {
@@ -2681,23 +2706,48 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
   return 0;
 }
 
-/** The total number of cells we have allocated. */
-static size_t total_cells_allocated = 0;
+/** How many cells do we allocate from the system at once? */
+#define CELL_POOL_ITEMS_PER_CHUNK 128
+/** How many chunks of cells with nothing in them do we keep around for
+ * reuse? */
+#define CELL_POOL_MAX_EMPTY_CHUNKS 8
+/** How many destroy cells do we allocate from the system at once? */
+#define DESTROY_CELL_POOL_ITEMS_PER_CHUNK 256
+/** How many chunks of destroy cells with nothing in them do we keep around
+ * for reuse? */
+#define DESTROY_CELL_POOL_MAX_EMPTY_CHUNKS 2
+
+/** Pool from which we allocate all packed_cell_t objects. */
+static mp_pool_t *cell_pool = NULL;
+/** Pool from which we allocate all destroy_cell_t objects. */
+static mp_pool_t *destroy_cell_pool = NULL;
 
 /** Release storage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
-  --total_cells_allocated;
-  tor_free(cell);
+  mp_pool_release(cell);
 }
 
 /** Allocate and return a new packed_cell_t. */
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
-  ++total_cells_allocated;
-  return tor_malloc_zero(sizeof(packed_cell_t));
+  packed_cell_t *cell;
+  if (PREDICT_UNLIKELY(!cell_pool)) {
+    cell_pool = mp_pool_new(sizeof(packed_cell_t), CELL_POOL_ITEMS_PER_CHUNK,
+                            CELL_POOL_MAX_EMPTY_CHUNKS);
+  }
+  cell = mp_pool_get(cell_pool);
+  memset(cell, 0, sizeof(packed_cell_t));
+  return cell;
+}
+
+/** Return the number of packed cells that are currently allocated. */
+static size_t
+cell_pool_get_n_used(void)
+{
+  return cell_pool ? mp_pool_get_n_used(cell_pool) : 0;
 }
 
 /** Return a packed cell used outside by channel_t lower layer */
@@ -2725,7 +2775,28 @@ dump_cell_pool_usage(int severity)
   SMARTLIST_FOREACH_END(c);
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
-          n_cells, n_circs, (int)total_cells_allocated - n_cells);
+          n_cells, n_circs, (int)cell_pool_get_n_used() - n_cells);
+  if (cell_pool) {
+    size_t allocated, used;
+    mp_pool_get_stats(cell_pool, &allocated, &used);
+    tor_log(severity, LD_MM,
+            "Cell pool: %"TOR_PRIuSZ" bytes allocated, %"TOR_PRIuSZ
+            " bytes in use, %"TOR_PRIuSZ" bytes in empty chunks.",
+            allocated, used, mp_pool_get_empty_allocation(cell_pool));
+  }
+}
+
+/** Release all the memory held by the cell pools, if no cells are
+ * using it. */
+void
+cell_pools_free_all(void)
+{
+  /* If anything still holds a cell, leave the pool alone: freeing it would
+   * turn a leak into a use-after-free. */
+  if (cell_pool && mp_pool_get_n_used(cell_pool) == 0)
+    mp_pool_free(cell_pool);
+  if (destroy_cell_pool && mp_pool_get_n_used(destroy_cell_pool) == 0)
+    mp_pool_free(destroy_cell_pool);
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
@@ -2813,7 +2884,7 @@ destroy_cell_queue_clear(destroy_cell_queue_t *queue)
   destroy_cell_t *cell;
   while ((cell = TOR_SIMPLEQ_FIRST(&queue->head))) {
     TOR_SIMPLEQ_REMOVE_HEAD(&queue->head, next);
-    tor_free(cell);
+    destroy_cell_free(cell);
   }
   TOR_SIMPLEQ_INIT(&queue->head);
   queue->n = 0;
@@ -2832,13 +2903,37 @@ destroy_cell_queue_pop(destroy_cell_queue_t *queue)
   return cell;
 }
 
+/** Allocate and return a new destroy_cell_t. */
+static destroy_cell_t *
+destroy_cell_new(void)
+{
+  destroy_cell_t *cell;
+  if (PREDICT_UNLIKELY(!destroy_cell_pool)) {
+    destroy_cell_pool = mp_pool_new(sizeof(destroy_cell_t),
+                                    DESTROY_CELL_POOL_ITEMS_PER_CHUNK,
+                                    DESTROY_CELL_POOL_MAX_EMPTY_CHUNKS);
+  }
+  cell = mp_pool_get(destroy_cell_pool);
+  memset(cell, 0, sizeof(destroy_cell_t));
+  return cell;
+}
+
+/** Release storage held by <b>cell</b>. */
+void
+destroy_cell_free_(destroy_cell_t *cell)
+{
+  if (!cell)
+    return;
+  mp_pool_release(cell);
+}
+
 /** Append a destroy cell for <b>circid</b> to <b>queue</b>. */
 void
 destroy_cell_queue_append(destroy_cell_queue_t *queue,
                           circid_t circid,
                           uint8_t reason)
 {
-  destroy_cell_t *cell = tor_malloc_zero(sizeof(destroy_cell_t));
+  destroy_cell_t *cell = destroy_cell_new();
   cell->circid = circid;
   cell->reason = reason;
   /* Not yet used, but will be required for OOM handling. */
@@ -2860,7 +2955,7 @@ destroy_cell_to_packed_cell(destroy_cell_t *inp, int wide_circ_ids)
   cell.payload[0] = inp->reason;
   cell_pack(packed, &cell, wide_circ_ids);
 
-  tor_free(inp);
+  destroy_cell_free(inp);
   return packed;
 }
 
@@ -2872,11 +2967,41 @@ packed_cell_mem_cost(void)
   return sizeof(packed_cell_t);
 }
 
-/* DOCDOC */
+/** Return the number of bytes that the cell pools are holding in reserve,
+ * with no cells in them. */
+static size_t
+cell_pools_get_empty_allocation(void)
+{
+  size_t total = 0;
+  if (cell_pool)
+    total += mp_pool_get_empty_allocation(cell_pool);
+  if (destroy_cell_pool)
+    total += mp_pool_get_empty_allocation(destroy_cell_pool);
+  return total;
+}
+
+/** Give all the empty chunks in the cell pools back to the system.  Return
+ * the number of bytes released. */
+static size_t
+cell_pools_release_empty(void)
+{
+  size_t removed = 0;
+  if (cell_pool)
+    removed += mp_pool_clean(cell_pool, 0);
+  if (destroy_cell_pool)
+    removed += mp_pool_clean(destroy_cell_pool, 0);
+  return removed;
+}
+
+/** Return the number of bytes used by queued cells, plus the memory that
+ * the cell pools are keeping in reserve, plus the copies of the cells that
+ * are waiting for a worker thread to decrypt them. */
 size_t
 cell_queues_get_total_allocation(void)
 {
-  return total_cells_allocated * packed_cell_mem_cost();
+  return cell_pool_get_n_used() * packed_cell_mem_cost() +
+    cell_pools_get_empty_allocation() +
+    relay_crypto_offload_get_total_allocation();
 }
 
 /** How long after we've been low on memory should we try to conserve it? */
@@ -2917,6 +3042,12 @@ cell_queues_check_size(void)
       /* Note this overload down */
       rep_hist_note_overload(OVERLOAD_GENERAL);
 
+      /* Memory that the cell pools are holding for later is the cheapest
+       * thing to give up. */
+      removed = cell_pools_release_empty();
+      oom_stats_n_bytes_removed_cell += removed;
+      alloc -= removed;
+
       /* If we're spending over 20% of the memory limit on hidden service
        * descriptors, free them until we're down to 10%. Do the same for geoip
        * client cache. */
@@ -2952,6 +3083,8 @@ cell_queues_check_size(void)
       }
       removed = circuits_handle_oom(alloc);
       oom_stats_n_bytes_removed_cell += removed;
+      /* Don't keep the cells we just freed around for later. */
+      cell_pools_release_empty();
       return 1;
     }
   }
@@ -3213,6 +3346,8 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
      */
     cell = cell_queue_pop(queue);
 
+    scheduler_kist_note_queue_delay(cell);
+
     /* Calculate the exact time that this cell has spent in the queue. */
     if (get_options()->CellStatistics ||
         get_options()->TestingEnableCellStatsEvent) {
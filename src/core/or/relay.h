@@ -24,6 +24,9 @@ uint32_t relay_get_param_max_circuit_cell_queue_size(
                                      const networkstatus_t *ns);
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
+MOCK_DECL(int, circuit_receive_decrypted_relay_cell,
+          (cell_t *cell, circuit_t *circ, cell_direction_t cell_direction,
+           crypt_path_t *layer_hint, char recognized));
 size_t cell_queues_get_total_allocation(void);
 
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
@@ -60,6 +63,7 @@ extern uint64_t oom_stats_n_bytes_removed_geoip;
 extern uint64_t oom_stats_n_bytes_removed_hsdir;
 
 void dump_cell_pool_usage(int severity);
+void cell_pools_free_all(void);
 size_t packed_cell_mem_cost(void);
 
 int have_been_under_memory_pressure(void);
@@ -68,6 +72,9 @@ int have_been_under_memory_pressure(void);
 void packed_cell_free_(packed_cell_t *cell);
 #define packed_cell_free(cell) \
   FREE_AND_NULL(packed_cell_t, packed_cell_free_, (cell))
+void destroy_cell_free_(destroy_cell_t *cell);
+#define destroy_cell_free(cell) \
+  FREE_AND_NULL(destroy_cell_t, destroy_cell_free_, (cell))
 
 void cell_queue_init(cell_queue_t *queue);
 void cell_queue_clear(cell_queue_t *queue);
@@ -0,0 +1,447 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relay_crypto_offload.c
+ * \brief Decrypt relay cells on the cpuworker threadpool.
+ *
+ * Ordinarily, circuit_receive_relay_cell() removes a layer of encryption
+ * from every relay cell in the main thread, which limits a busy relay to the
+ * AES and digest throughput of a single core.  When RelayCryptoOffload is
+ * set, we instead hand the cells that travel away from the origin on an
+ * or_circuit_t to the threadpool in cpuworker.c.
+ *
+ * To keep the cells on each circuit in order, a circuit has at most one job
+ * in flight: cells that arrive while it is running wait on the circuit's
+ * relay_crypto_pending list, and go out together as the next job.  That
+ * list is bounded: once RELAY_CRYPTO_PENDING_MAX cells are waiting, we take
+ * back the job if no worker has started it, and decrypt everything in the
+ * main thread instead.  The copies of the cells count towards
+ * MaxMemInQueues, like the cells on circuit queues.  Nothing but the worker
+ * touches the circuit's forward cipher and digest while the job is
+ * running.
+ *
+ * The worker removes our layer from all of its cells with one batched
+ * keystream computation, but stops checking digests at the first cell that
+ * it recognizes.  That way, when we handle that cell in the main thread (and
+ * maybe record its digest for a SENDME), the forward digest is exactly what
+ * it would have been if we had decrypted the cell ourselves.  The remaining
+ * cells go back to the head of the pending list, marked as already
+ * decrypted.
+ *
+ * A DESTROY cell from behind must not overtake the relay cells that came
+ * before it on the same channel.  If a worker is busy with those cells, we
+ * hold the DESTROY on the circuit, drop any relay cells that follow it, and
+ * close the circuit once the worker's reply has been handled.
+ *
+ * We don't offload the cells that travel toward the origin: relays can
+ * originate cells in that direction themselves (for example, padding or
+ * EXTENDED2 cells), and those need the backward crypto state in the main
+ * thread.
+ **/
+
+#define RELAY_CRYPTO_OFFLOAD_PRIVATE
+#include "core/or/or.h"
+#include "app/config/config.h"
+#include "core/crypto/relay_crypto.h"
+#include "core/mainloop/cpuworker.h"
+#include "core/or/circuitlist.h"
+#include "core/or/relay.h"
+#include "core/or/relay_crypto_offload.h"
+#include "lib/crypt_ops/crypto_cipher.h"
+#include "lib/crypt_ops/crypto_util.h"
+
+#include "core/or/cell_st.h"
+#include "core/or/or_circuit_st.h"
+
+static void relay_crypto_job_launch(or_circuit_t *circ);
+
+/** How many cells have we copied for offloading, and not freed yet? */
+STATIC size_t relay_crypto_n_cells_allocated = 0;
+
+/** Free every cell in <b>cells</b>, and <b>cells</b> itself. */
+static void
+relay_crypto_cells_free(smartlist_t *cells)
+{
+  if (!cells)
+    return;
+  tor_assert(relay_crypto_n_cells_allocated >= (size_t) smartlist_len(cells));
+  relay_crypto_n_cells_allocated -= smartlist_len(cells);
+  SMARTLIST_FOREACH(cells, cell_t *, c, {
+    memwipe(c, 0, sizeof(*c));
+    tor_free(c);
+  });
+  smartlist_free(cells);
+}
+
+#define relay_crypto_job_free(job) \
+  FREE_AND_NULL(relay_crypto_job_t, relay_crypto_job_free_, (job))
+
+/** Release all storage held by <b>job</b>, but not its crypto state. */
+static void
+relay_crypto_job_free_(relay_crypto_job_t *job)
+{
+  if (!job)
+    return;
+  relay_crypto_cells_free(job->cells);
+  tor_free(job);
+}
+
+/** Return true iff we should hand cells on <b>circ</b> travelling in
+ * <b>cell_direction</b> to a worker thread. */
+static int
+relay_crypto_should_offload(const circuit_t *circ,
+                            cell_direction_t cell_direction)
+{
+  if (cell_direction != CELL_DIRECTION_OUT || CIRCUIT_IS_ORIGIN(circ))
+    return 0;
+
+  const or_circuit_t *or_circ = CONST_TO_OR_CIRCUIT(circ);
+  /* If we have already offloaded some cells, the rest must follow them, or
+   * they could get out of order. */
+  if (or_circ->relay_crypto_job ||
+      (or_circ->relay_crypto_pending &&
+       smartlist_len(or_circ->relay_crypto_pending)))
+    return 1;
+
+  return get_options()->RelayCryptoOffload && cpuworker_get_n_threads() > 0;
+}
+
+/** Take the pending cells on <b>circ</b> away from it, and return a new job
+ * to decrypt them. */
+static relay_crypto_job_t *
+relay_crypto_job_new(or_circuit_t *circ)
+{
+  relay_crypto_job_t *job = tor_malloc_zero(sizeof(relay_crypto_job_t));
+  job->circ = circ;
+  job->cipher = circ->crypto.f_crypto;
+  job->digest = circ->crypto.f_digest;
+  job->cells = circ->relay_crypto_pending;
+  job->n_decrypted = circ->relay_crypto_n_decrypted;
+  circ->relay_crypto_pending = NULL;
+  circ->relay_crypto_n_decrypted = 0;
+  return job;
+}
+
+/** Decrypt and handle every pending cell on <b>circ</b> in the main thread.
+ * Requires that no worker is using the circuit's crypto state. */
+static void
+relay_crypto_process_inline(or_circuit_t *circ)
+{
+  tor_assert(!circ->relay_crypto_job);
+
+  while (circ->relay_crypto_pending &&
+         smartlist_len(circ->relay_crypto_pending) &&
+         !TO_CIRCUIT(circ)->marked_for_close) {
+    relay_crypto_job_t *job = relay_crypto_job_new(circ);
+    circ->relay_crypto_job = job;
+    relay_crypto_job_threadfn(NULL, job);
+    relay_crypto_job_finish(job);
+  }
+}
+
+/** Handle a DESTROY cell that we held on <b>circ</b> until its earlier
+ * relay cells were handled, as command_process_destroy_cell() would
+ * have. */
+static void
+relay_crypto_close_destroyed(or_circuit_t *circ)
+{
+  circ->relay_crypto_destroy_held = 0;
+  circuit_set_p_circid_chan(circ, 0, NULL);
+  if (!TO_CIRCUIT(circ)->marked_for_close)
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_DESTROYED);
+}
+
+/** Called when <b>circ</b> has too many pending cells.  If we can take its
+ * job back from the threadpool, put the job's cells back at the head of
+ * the pending list, and handle all of them in the main thread.  Return 0 on
+ * success, and -1 if a worker is already running the job. */
+static int
+relay_crypto_reclaim_job(or_circuit_t *circ)
+{
+  relay_crypto_job_t *job = circ->relay_crypto_job;
+
+  if (job) {
+    if (!workqueue_entry_cancel(job->workqueue_entry))
+      return -1;
+    /* Cells only wait on the pending list with n_decrypted set while no job
+     * is in flight. */
+    tor_assert(circ->relay_crypto_n_decrypted == 0);
+    smartlist_add_all(job->cells, circ->relay_crypto_pending);
+    smartlist_free(circ->relay_crypto_pending);
+    circ->relay_crypto_pending = job->cells;
+    circ->relay_crypto_n_decrypted = job->n_decrypted;
+    job->cells = NULL;
+    circ->relay_crypto_job = NULL;
+    relay_crypto_job_free(job);
+  }
+
+  relay_crypto_process_inline(circ);
+  return 0;
+}
+
+/** Consider handing <b>cell</b>, which arrived on <b>circ</b> in direction
+ * <b>cell_direction</b>, to a worker thread for decryption.  If we do so,
+ * we take a copy of the cell and return 1; the cell will be handled later,
+ * in circuit_receive_decrypted_relay_cell().  Otherwise return 0, and the
+ * caller should decrypt the cell itself. */
+int
+relay_crypto_offload_cell(circuit_t *circ, const cell_t *cell,
+                          cell_direction_t cell_direction)
+{
+  if (!relay_crypto_should_offload(circ, cell_direction))
+    return 0;
+
+  or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+  if (or_circ->relay_crypto_destroy_held) {
+    /* The other side has already destroyed this circuit. */
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Dropping a relay cell that arrived after a DESTROY cell.");
+    return 1;
+  }
+  if (!or_circ->relay_crypto_pending)
+    or_circ->relay_crypto_pending = smartlist_new();
+  smartlist_add(or_circ->relay_crypto_pending,
+                tor_memdup(cell, sizeof(cell_t)));
+  ++relay_crypto_n_cells_allocated;
+
+  const int n_pending = smartlist_len(or_circ->relay_crypto_pending);
+  if (n_pending >= RELAY_CRYPTO_PENDING_MAX &&
+      relay_crypto_reclaim_job(or_circ) < 0 &&
+      n_pending >= RELAY_CRYPTO_PENDING_HARD_MAX) {
+    /* A worker is busy with this circuit, and the other side has sent us
+     * more cells than its circuit window allows. */
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Too many relay cells waiting for decryption on a circuit. "
+           "Closing.");
+    circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
+    return 1;
+  }
+
+  relay_crypto_job_launch(or_circ);
+  return 1;
+}
+
+/** If <b>circ</b> has pending cells and no job in flight, queue all of the
+ * pending cells as a new job. */
+static void
+relay_crypto_job_launch(or_circuit_t *circ)
+{
+  relay_crypto_job_t *job;
+
+  if (circ->relay_crypto_job || !circ->relay_crypto_pending ||
+      smartlist_len(circ->relay_crypto_pending) == 0 ||
+      TO_CIRCUIT(circ)->marked_for_close)
+    return;
+
+  job = relay_crypto_job_new(circ);
+
+  job->workqueue_entry = cpuworker_queue_work(WQ_PRI_HIGH,
+                                              relay_crypto_job_threadfn,
+                                              relay_crypto_job_replyfn,
+                                              job);
+  if (!job->workqueue_entry) {
+    log_warn(LD_BUG, "Couldn't queue relay crypto work on threadpool");
+    relay_crypto_job_free(job);
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_INTERNAL);
+    return;
+  }
+  circ->relay_crypto_job = job;
+}
+
+/** Worker function: decrypt the cells in a relay_crypto_job_t, stopping
+ * after the first one that we recognize. */
+STATIC workqueue_reply_t
+relay_crypto_job_threadfn(void *state_, void *work_)
+{
+  relay_crypto_job_t *job = work_;
+  char *payloads[RELAY_CRYPTO_JOB_BATCH];
+  int i, n_cells = smartlist_len(job->cells);
+  (void) state_;
+
+  /* Remove our layer from every cell at once: the keystream doesn't depend
+   * on what we find inside the cells. */
+  for (i = job->n_decrypted; i < n_cells; i += RELAY_CRYPTO_JOB_BATCH) {
+    const int n = MIN(RELAY_CRYPTO_JOB_BATCH, n_cells - i);
+    for (int j = 0; j < n; ++j) {
+      cell_t *cell = smartlist_get(job->cells, i + j);
+      payloads[j] = (char *) cell->payload;
+    }
+    crypto_cipher_crypt_inplace_multi(job->cipher, payloads,
+                                      CELL_PAYLOAD_SIZE, n);
+  }
+  job->n_decrypted = n_cells;
+
+  /* But the digest does, so stop checking at the first recognized cell. */
+  job->n_processed = 0;
+  job->recognized = 0;
+  SMARTLIST_FOREACH_BEGIN(job->cells, cell_t *, cell) {
+    ++job->n_processed;
+    if (relay_check_recognized_outbound(job->digest, cell)) {
+      job->recognized = 1;
+      break;
+    }
+  } SMARTLIST_FOREACH_END(cell);
+
+  return WQ_RPL_REPLY;
+}
+
+/** In the main thread, finish handling the cells in <b>job</b>, which a
+ * worker has decrypted, and free it.  Put the cells that it didn't get to
+ * back at the head of the circuit's pending list. */
+STATIC void
+relay_crypto_job_finish(relay_crypto_job_t *job)
+{
+  or_circuit_t *circ = job->circ;
+  int i, n_cells = smartlist_len(job->cells);
+
+  if (circ->base_.magic == DEAD_CIRCUIT_MAGIC) {
+    /* The circuit was freed while we were working on it; the crypto state
+     * was left for us to free. See relay_crypto_offload_circuit_free(). */
+    log_debug(LD_OR, "Circuit died while relay crypto was pending. "
+              "Freeing memory.");
+    crypto_cipher_free(job->cipher);
+    crypto_digest_free(job->digest);
+    relay_crypto_job_free(job);
+    circuit_release_dead_worker_ref(circ);
+    return;
+  }
+
+  tor_assert(circ->relay_crypto_job == job);
+  circ->relay_crypto_job = NULL;
+
+  for (i = 0; i < job->n_processed; ++i) {
+    cell_t *cell = smartlist_get(job->cells, i);
+    char recognized = (i == job->n_processed - 1) ? job->recognized : 0;
+    int reason;
+
+    if (TO_CIRCUIT(circ)->marked_for_close)
+      break;
+    reason = circuit_receive_decrypted_relay_cell(cell, TO_CIRCUIT(circ),
+                                                  CELL_DIRECTION_OUT,
+                                                  NULL, recognized);
+    if (reason < 0) {
+      log_fn(LOG_DEBUG, LD_PROTOCOL, "circuit_receive_decrypted_relay_cell "
+             "(forward) failed. Closing.");
+      circuit_mark_for_close(TO_CIRCUIT(circ), -reason);
+      break;
+    }
+  }
+
+  if (TO_CIRCUIT(circ)->marked_for_close) {
+    relay_crypto_job_free(job);
+    relay_crypto_cells_free(circ->relay_crypto_pending);
+    circ->relay_crypto_pending = NULL;
+    circ->relay_crypto_n_decrypted = 0;
+    return;
+  }
+
+  if (job->n_processed < n_cells) {
+    /* We stopped at a recognized cell: the cells after it still need to be
+     * checked, before anything that arrived in the meantime.  We have
+     * already removed our layer of encryption from them. */
+    smartlist_t *remaining = smartlist_new();
+    for (i = job->n_processed; i < n_cells; ++i) {
+      smartlist_add(remaining, smartlist_get(job->cells, i));
+    }
+    while (smartlist_len(job->cells) > job->n_processed)
+      smartlist_pop_last(job->cells);
+    if (circ->relay_crypto_pending) {
+      smartlist_add_all(remaining, circ->relay_crypto_pending);
+      smartlist_free(circ->relay_crypto_pending);
+    }
+    circ->relay_crypto_pending = remaining;
+    circ->relay_crypto_n_decrypted = job->n_decrypted - job->n_processed;
+  }
+  relay_crypto_job_free(job);
+}
+
+/** Reply function: in the main thread, finish handling the cells that a
+ * worker has decrypted, then launch a job for any cells that are left. */
+STATIC void
+relay_crypto_job_replyfn(void *work_)
+{
+  relay_crypto_job_t *job = work_;
+  or_circuit_t *circ = job->circ;
+  const bool circ_is_dead = (circ->base_.magic == DEAD_CIRCUIT_MAGIC);
+
+  relay_crypto_job_finish(job);
+  if (circ_is_dead)
+    return;
+  if (circ->relay_crypto_destroy_held) {
+    relay_crypto_process_inline(circ);
+    relay_crypto_close_destroyed(circ);
+  } else {
+    relay_crypto_job_launch(circ);
+  }
+}
+
+/** Called when a DESTROY cell arrives from behind on <b>circ</b>.  The
+ * relay cells that arrived before it (say, a RELAY_END, or the last data
+ * on a stream) must be handled first, or marking the circuit would drop
+ * them.  If no worker has started on those cells, handle them now, and
+ * return 0: the caller goes on to handle the DESTROY.  Otherwise, hold the
+ * DESTROY until the worker's reply has been handled, and return 1. */
+int
+relay_crypto_offload_hold_destroy(or_circuit_t *circ)
+{
+  if (relay_crypto_reclaim_job(circ) == 0)
+    return 0;
+  circ->relay_crypto_destroy_held = 1;
+  return 1;
+}
+
+/** Return the number of bytes allocated for copies of the cells that are
+ * waiting for, or being handled by, a worker thread. */
+size_t
+relay_crypto_offload_get_total_allocation(void)
+{
+  return relay_crypto_n_cells_allocated * sizeof(cell_t);
+}
+
+/** Called from the OOM handler, on a circuit that it has marked for close:
+ * free the cells on <b>circ</b> that are waiting for a worker thread, and
+ * return the number of bytes that we freed.  The cells of a job in flight
+ * belong to the worker; the reply function frees them. */
+size_t
+relay_crypto_offload_free_pending(or_circuit_t *circ)
+{
+  size_t n;
+
+  if (!circ->relay_crypto_pending)
+    return 0;
+  n = smartlist_len(circ->relay_crypto_pending);
+  relay_crypto_cells_free(circ->relay_crypto_pending);
+  circ->relay_crypto_pending = NULL;
+  circ->relay_crypto_n_decrypted = 0;
+  return n * sizeof(cell_t);
+}
+
+/** Called from circuit_free_(): release the offloaded cells on
+ * <b>circ</b>.  If a worker is still using the circuit's forward crypto
+ * state, take that state away from the circuit so that the reply function
+ * can free it later, and return 1: the caller must then leave the circuit
+ * for the reply function to free.  Otherwise return 0. */
+int
+relay_crypto_offload_circuit_free(or_circuit_t *circ)
+{
+  relay_crypto_job_t *job = circ->relay_crypto_job;
+
+  relay_crypto_cells_free(circ->relay_crypto_pending);
+  circ->relay_crypto_pending = NULL;
+  circ->relay_crypto_n_decrypted = 0;
+
+  if (!job)
+    return 0;
+
+  circ->relay_crypto_job = NULL;
+  if (workqueue_entry_cancel(job->workqueue_entry)) {
+    /* The worker never started; nobody else has the job. */
+    relay_crypto_job_free(job);
+    return 0;
+  }
+
+  circ->crypto.f_crypto = NULL;
+  circ->crypto.f_digest = NULL;
+  return 1;
+}
@@ -0,0 +1,66 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file relay_crypto_offload.h
+ * \brief Header file for relay_crypto_offload.c.
+ **/
+
+#ifndef TOR_RELAY_CRYPTO_OFFLOAD_H
+#define TOR_RELAY_CRYPTO_OFFLOAD_H
+
+int relay_crypto_offload_cell(circuit_t *circ, const cell_t *cell,
+                              cell_direction_t cell_direction);
+int relay_crypto_offload_hold_destroy(or_circuit_t *circ);
+int relay_crypto_offload_circuit_free(or_circuit_t *circ);
+size_t relay_crypto_offload_get_total_allocation(void);
+size_t relay_crypto_offload_free_pending(or_circuit_t *circ);
+
+#ifdef RELAY_CRYPTO_OFFLOAD_PRIVATE
+#include "lib/evloop/workqueue.h"
+
+/** Work item for decrypting a run of exit-ward cells on a worker thread. */
+typedef struct relay_crypto_job_t {
+  /** The circuit that the cells arrived on. */
+  or_circuit_t *circ;
+  /** Our entry on the threadpool's queue, for cancelling. */
+  workqueue_entry_t *workqueue_entry;
+  /** The circuit's forward cipher and digest state. While this job is
+   * running, nothing else touches them. */
+  crypto_cipher_t *cipher;
+  crypto_digest_t *digest;
+  /** The cells to decrypt, as cell_t *, in order of arrival. */
+  smartlist_t *cells;
+  /** How many of the cells at the start of <b>cells</b> have already had our
+   * layer of encryption removed?  Set by the worker to the number of cells
+   * that it has decrypted in total. */
+  int n_decrypted;
+  /** Set by the worker: how many of the cells did we decrypt? */
+  int n_processed;
+  /** Set by the worker: was the last decrypted cell recognized? */
+  char recognized;
+} relay_crypto_job_t;
+
+/** How many cells do we hand to crypto_cipher_crypt_inplace_multi() at a
+ * time? */
+#define RELAY_CRYPTO_JOB_BATCH 8
+
+/** Once this many cells are waiting for a worker thread on a circuit, we
+ * decrypt them in the main thread instead, if we can. */
+#define RELAY_CRYPTO_PENDING_MAX 256
+/** If this many cells are waiting while a worker is still busy with the
+ * circuit, the other side has ignored its circuit window: close the
+ * circuit. */
+#define RELAY_CRYPTO_PENDING_HARD_MAX ORCIRC_MAX_MIDDLE_CELLS
+
+STATIC workqueue_reply_t relay_crypto_job_threadfn(void *state_,
+                                                   void *work_);
+STATIC void relay_crypto_job_replyfn(void *work_);
+STATIC void relay_crypto_job_finish(relay_crypto_job_t *job);
+
+#ifdef TOR_UNIT_TESTS
+extern size_t relay_crypto_n_cells_allocated;
+#endif /* defined(TOR_UNIT_TESTS) */
+#endif /* defined(RELAY_CRYPTO_OFFLOAD_PRIVATE) */
+
+#endif /* !defined(TOR_RELAY_CRYPTO_OFFLOAD_H) */
@@ -130,6 +130,20 @@ void scheduler_channel_wants_writes(channel_t *chan);
 MOCK_DECL(void, scheduler_channel_doesnt_want_writes, (channel_t *chan));
 MOCK_DECL(void, scheduler_channel_has_waiting_cells, (channel_t *chan));
 
+/*
+ * Cell queue delay and run interval of the KIST scheduler, for the relay
+ * metrics. Defined in scheduler_kist.c.
+ */
+
+/* Number of buckets in the cell queue delay histogram. */
+#define KIST_QUEUE_DELAY_N_BUCKETS 10
+extern const int64_t kist_queue_delay_buckets[KIST_QUEUE_DELAY_N_BUCKETS];
+
+void scheduler_kist_note_queue_delay(const packed_cell_t *cell);
+int scheduler_kist_get_run_interval(void);
+void scheduler_kist_get_queue_delays(uint64_t *bucket_values,
+                                     uint64_t *count_out, int64_t *sum_out);
+
 /*****************************************************************************
  * Private scheduler functions
  *
@@ -187,6 +201,17 @@ typedef struct socket_table_ent_t {
   uint32_t unacked;
   uint32_t mss;
   uint32_t notsent;
+  /* Smoothed round trip time from the kernel, in usec */
+  uint32_t rtt;
+  /* The TCP_NOTSENT_LOWAT value we last set on the socket, or 0 if we never
+   * set one. */
+  uint32_t notsent_lowat;
+  /* When we last asked the kernel for the TCP info above. Only used with
+   * KISTNotsentLowat, when we don't ask again on every scheduling run. */
+  monotime_coarse_t info_updated;
+  /* True iff info_updated and limit hold values from the kernel that we can
+   * keep using until they are stale. */
+  unsigned int info_valid : 1;
 } socket_table_ent_t;
 
 typedef HT_HEAD(outbuf_table_s, outbuf_table_ent_t) outbuf_table_t;
@@ -195,6 +220,19 @@ MOCK_DECL(int, channel_should_write_to_kernel,
           (outbuf_table_t *table, channel_t *chan));
 MOCK_DECL(void, channel_write_to_kernel, (channel_t *chan));
 MOCK_DECL(void, update_socket_info_impl, (socket_table_ent_t *ent));
+#ifdef HAVE_KIST_SUPPORT
+int kist_socket_info_is_stale(const socket_table_ent_t *ent,
+                              const monotime_coarse_t *now);
+uint32_t kist_notsent_lowat_target(const socket_table_ent_t *ent);
+int kist_read_socket_notsent(tor_socket_t sock, socket_table_ent_t *ent);
+/** kist_read_socket_info() couldn't get TCP_INFO. */
+#define KIST_SOCK_INFO_ERR_TCP_INFO (-1)
+/** kist_read_socket_info() couldn't get SIOCOUTQNSD. */
+#define KIST_SOCK_INFO_ERR_NOTSENT (-2)
+int kist_read_socket_info(tor_socket_t sock, socket_table_ent_t *ent);
+#endif /* defined(HAVE_KIST_SUPPORT) */
+int kist_next_run_interval(int interval, int64_t delay_msec,
+                           int occupancy_pct);
 
 int scheduler_can_use_kist(void);
 void scheduler_kist_set_full_mode(void);
@@ -20,6 +20,7 @@
 #include "core/or/scheduler.h"
 #include "lib/math/fp.h"
 
+#include "core/or/cell_queue_st.h"
 #include "core/or/or_connection_st.h"
 
 #ifdef HAVE_SYS_IOCTL_H
@@ -100,6 +101,66 @@ static monotime_t scheduler_last_run;
 static double sock_buf_size_factor = 1.0;
 /* How often the scheduler runs. */
 STATIC int sched_run_interval = KIST_SCHED_RUN_INTERVAL_DEFAULT;
+/* True iff KISTNotsentLowat is set: bound each socket's unsent data with
+ * TCP_NOTSENT_LOWAT, and keep using its TCP info until it is stale. */
+static int kist_use_notsent_lowat = 0;
+
+/* Never keep using TCP info that is older than this, whatever the round trip
+ * time of the socket. */
+#define KIST_SOCK_INFO_MAX_AGE_MSEC 250
+/* Never set a TCP_NOTSENT_LOWAT smaller than this. It is the amount of data
+ * channel_should_write_to_kernel() waits for before writing. */
+#define KIST_NOTSENT_LOWAT_MIN (CELL_MAX_NETWORK_SIZE * 8)
+
+static void kist_clear_socket_info(socket_table_ent_t *ent);
+
+/* Upper bounds, in msec, of the buckets of the cell queue delay histogram. */
+const int64_t kist_queue_delay_buckets[KIST_QUEUE_DELAY_N_BUCKETS] = {
+  1, 2, 5, 10, 20, 50, 100, 200, 500, 1000
+};
+/* True iff we measure how long cells wait in their circuit queue: we do so
+ * for the adaptive run interval, and for the MetricsPort. */
+static int kist_track_queue_delay = 0;
+/* Number of cells whose queue delay fell in each bucket of
+ * kist_queue_delay_buckets, and above the last one. These are not
+ * cumulative, unlike what the MetricsPort reports. */
+static uint64_t queue_delay_hist[KIST_QUEUE_DELAY_N_BUCKETS + 1];
+/* Sum of all the queue delays in queue_delay_hist, in msec. */
+static uint64_t queue_delay_sum_msec = 0;
+
+/* Never adapt the run interval below this many msec. */
+#define KIST_ADAPTIVE_RUN_INTERVAL_MIN 2
+/* How often the adaptive run interval is reconsidered. */
+#define KIST_ADAPTIVE_PERIOD_MSEC 250
+/* The adaptive run interval goes down when the mean cell queue delay is
+ * above this, unless the kernel already has all it can send. */
+#define KIST_ADAPTIVE_DELAY_TARGET_MSEC KIST_SCHED_RUN_INTERVAL_DEFAULT
+/* When the kernel outqueues hold less than this percentage of a congestion
+ * window when we run, they drained before we came back: run more often. */
+#define KIST_ADAPTIVE_OCCUPANCY_LOW 25
+/* When they hold more than this, we can run less often. */
+#define KIST_ADAPTIVE_OCCUPANCY_HIGH 75
+
+/* State of the adaptive run interval (KISTAdaptiveRunInterval). */
+typedef struct kist_adaptive_state_t {
+  /* True iff KISTAdaptiveRunInterval is set. */
+  unsigned int enabled : 1;
+  /* True iff we have changed sched_run_interval since it was enabled, so
+   * that the configured interval isn't ours to use anymore. */
+  unsigned int started : 1;
+  /* When we last reconsidered the run interval. */
+  monotime_coarse_t last_adjusted;
+  /* The cell queue delays seen since then, in msec, and how many. */
+  uint64_t delay_sum_msec;
+  uint64_t n_delays;
+  /* The unsent bytes in the kernel outqueues of the pending channels, capped
+   * at one congestion window each, and the size of those windows, summed
+   * over each run since then. */
+  uint64_t occupied_bytes;
+  uint64_t window_bytes;
+} kist_adaptive_state_t;
+
+static kist_adaptive_state_t kist_adaptive;
 
 #ifdef HAVE_KIST_SUPPORT
 /* Indicate if KIST lite mode is on or off. We can disable it at runtime.
@@ -162,10 +223,21 @@ free_socket_info_by_ent(socket_table_ent_t *ent, void *data)
   return 1; /* So HT_FOREACH_FN will remove the element */
 }
 
+/* Helper for HT_FOREACH_FN: undo what KISTNotsentLowat did to the socket. */
+static int
+clear_socket_info_by_ent(socket_table_ent_t *ent, void *data)
+{
+  (void) data; /* Make compiler happy. */
+  kist_clear_socket_info(ent);
+  return 0; /* Keep the element in the table. */
+}
+
 /* Clean up socket_table. Probably because the KIST sched impl is going away */
 static void
 free_all_socket_info(void)
 {
+  HT_FOREACH_FN(socket_table_s, &socket_table, clear_socket_info_by_ent,
+                NULL);
   HT_FOREACH_FN(socket_table_s, &socket_table, free_socket_info_by_ent, NULL);
   HT_CLEAR(socket_table_s, &socket_table);
 }
@@ -193,6 +265,135 @@ free_socket_info_by_chan(socket_table_t *table, const channel_t *chan)
   free_socket_info_by_ent(ent, NULL);
 }
 
+#ifdef HAVE_KIST_SUPPORT
+
+/* Return true iff the TCP info that we last read from the kernel for ent, and
+ * the limit that we computed from it, are too old to keep using at
+ * <b>now</b>.
+ *
+ * Between two reads, the only thing that can change behind our back is that
+ * the kernel gets ACKs and frees up space, so the old limit minus what we
+ * have written since is a safe underestimate. KIST's extra space of one
+ * congestion window is what keeps the socket busy for a round trip while we
+ * aren't looking, so that is how long we wait before asking again. */
+int
+kist_socket_info_is_stale(const socket_table_ent_t *ent,
+                          const monotime_coarse_t *now)
+{
+  int64_t age_msec, max_age_msec;
+
+  if (!ent->info_valid)
+    return 1;
+
+  age_msec = monotime_coarse_diff_msec(&ent->info_updated, now);
+  max_age_msec = MIN(ent->rtt / 1000, KIST_SOCK_INFO_MAX_AGE_MSEC);
+  return age_msec < 0 || age_msec >= max_age_msec;
+}
+
+/* Return the TCP_NOTSENT_LOWAT value that makes the kernel enforce the
+ * "extra space" part of the limit that KIST computes for ent: once that much
+ * data is waiting to be sent, the socket stops accepting more and stops
+ * reporting itself writable. */
+uint32_t
+kist_notsent_lowat_target(const socket_table_ent_t *ent)
+{
+  int64_t target =
+    clamp_double_to_int64((ent->cwnd * (int64_t)ent->mss) *
+                          sock_buf_size_factor);
+  if (target < KIST_NOTSENT_LOWAT_MIN)
+    target = KIST_NOTSENT_LOWAT_MIN;
+  if (target > UINT32_MAX)
+    target = UINT32_MAX;
+  return (uint32_t) target;
+}
+
+/* Read how many bytes the kernel has queued for <b>sock</b> but not sent
+ * yet into <b>ent</b>. Return 0 on success, or -1 and leave errno set on
+ * failure. */
+int
+kist_read_socket_notsent(tor_socket_t sock, socket_table_ent_t *ent)
+{
+  return ioctl(sock, SIOCOUTQNSD, &(ent->notsent)) < 0 ? -1 : 0;
+}
+
+/* Read the TCP info that KIST needs for <b>sock</b> from the kernel into
+ * <b>ent</b>. Return 0 on success. On failure, leave errno set, and return
+ * KIST_SOCK_INFO_ERR_TCP_INFO if we couldn't get TCP_INFO, or
+ * KIST_SOCK_INFO_ERR_NOTSENT if we couldn't get SIOCOUTQNSD. */
+int
+kist_read_socket_info(tor_socket_t sock, socket_table_ent_t *ent)
+{
+  struct tcp_info tcp;
+  socklen_t tcp_info_len = sizeof(tcp);
+
+  if (getsockopt(sock, SOL_TCP, TCP_INFO, (void *)&(tcp), &tcp_info_len) < 0)
+    return KIST_SOCK_INFO_ERR_TCP_INFO;
+  if (kist_read_socket_notsent(sock, ent) < 0)
+    return KIST_SOCK_INFO_ERR_NOTSENT;
+  ent->cwnd = tcp.tcpi_snd_cwnd;
+  ent->unacked = tcp.tcpi_unacked;
+  ent->mss = tcp.tcpi_snd_mss;
+  ent->rtt = tcp.tcpi_rtt;
+  return 0;
+}
+
+/* Set TCP_NOTSENT_LOWAT on <b>sock</b> to <b>lowat</b>, and remember it in
+ * <b>ent</b>. A value of 0 brings back the system default. */
+static void
+kist_set_notsent_lowat(tor_socket_t sock, socket_table_ent_t *ent,
+                       uint32_t lowat)
+{
+#ifdef TCP_NOTSENT_LOWAT
+  unsigned int val = lowat;
+  if (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                 (void *) &val, sizeof(val)) < 0) {
+    log_info(LD_SCHED, "Unable to set TCP_NOTSENT_LOWAT on chan=%" PRIu64
+             ": %s", ent->chan->global_identifier,
+             tor_socket_strerror(tor_socket_errno(sock)));
+    return;
+  }
+  ent->notsent_lowat = lowat;
+#else
+  (void) sock;
+  (void) ent;
+  (void) lowat;
+#endif /* defined(TCP_NOTSENT_LOWAT) */
+}
+
+/* Bring the TCP_NOTSENT_LOWAT of <b>sock</b> in line with the limit we just
+ * computed for <b>ent</b>, unless it is already close enough. */
+static void
+kist_update_notsent_lowat(tor_socket_t sock, socket_table_ent_t *ent)
+{
+  const uint64_t target = kist_notsent_lowat_target(ent);
+  const uint64_t cur = ent->notsent_lowat;
+
+  /* Changing the value is a system call of its own: only do it when the
+   * congestion window has moved by more than a quarter. */
+  if (cur && target >= cur - cur / 4 && target <= cur + cur / 4)
+    return;
+  kist_set_notsent_lowat(sock, ent, (uint32_t) target);
+}
+
+#endif /* defined(HAVE_KIST_SUPPORT) */
+
+/* If we set a TCP_NOTSENT_LOWAT on the socket of ent's channel, remove it,
+ * and forget any TCP info we kept for it. */
+static void
+kist_clear_socket_info(socket_table_ent_t *ent)
+{
+  ent->info_valid = 0;
+#ifdef HAVE_KIST_SUPPORT
+  if (ent->notsent_lowat) {
+    const channel_tls_t *tlschan = CONST_BASE_CHAN_TO_TLS(ent->chan);
+    if (tlschan && tlschan->conn && SOCKET_OK(TO_CONN(tlschan->conn)->s)) {
+      kist_set_notsent_lowat(TO_CONN(tlschan->conn)->s, ent, 0);
+    }
+    ent->notsent_lowat = 0;
+  }
+#endif /* defined(HAVE_KIST_SUPPORT) */
+}
+
 /* Perform system calls for the given socket in order to calculate kist's
  * per-socket limit as documented in the function body. */
 MOCK_IMPL(void,
@@ -200,46 +401,59 @@ update_socket_info_impl, (socket_table_ent_t *ent))
 {
 #ifdef HAVE_KIST_SUPPORT
   int64_t tcp_space, extra_space;
+  monotime_coarse_t now;
   tor_assert(ent);
   tor_assert(ent->chan);
   const tor_socket_t sock =
     TO_CONN(CONST_BASE_CHAN_TO_TLS(ent->chan)->conn)->s;
-  struct tcp_info tcp;
-  socklen_t tcp_info_len = sizeof(tcp);
 
   if (kist_no_kernel_support || kist_lite_mode) {
     goto fallback;
   }
 
+  monotime_coarse_get(&now);
+  if (kist_use_notsent_lowat) {
+    if (!kist_socket_info_is_stale(ent, &now)) {
+      /* init_socket_info() already took what we wrote since the last run
+       * out of the limit. But the adaptive run interval wants to know how
+       * full the outqueue is now, not when we last read it: ask again for
+       * that one number. If we can't, read everything again below, and
+       * handle the error there. */
+      if (!kist_adaptive.enabled || kist_read_socket_notsent(sock, ent) == 0)
+        return;
+    }
+  }
+
   /* Gather information */
-  if (getsockopt(sock, SOL_TCP, TCP_INFO, (void *)&(tcp), &tcp_info_len) < 0) {
+  switch (kist_read_socket_info(sock, ent)) {
+  case 0:
+    break;
+  case KIST_SOCK_INFO_ERR_TCP_INFO:
     if (errno == EINVAL) {
       /* Oops, this option is not provided by the kernel, we'll have to
        * disable KIST entirely. This can happen if tor was built on a machine
        * with the support previously or if the kernel was updated and lost the
        * support. */
-      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
+      log_notice(LD_SCHED, "Looks like our kernel doesn't support TCP_INFO "
                            "for KIST anymore. We will fallback to the naive "
                            "approach. Remove KIST from the Schedulers list "
                            "to disable.");
       kist_no_kernel_support = 1;
     }
     goto fallback;
-  }
-  if (ioctl(sock, SIOCOUTQNSD, &(ent->notsent)) < 0) {
+  case KIST_SOCK_INFO_ERR_NOTSENT:
+  default:
     if (errno == EINVAL) {
-      log_notice(LD_SCHED, "Looks like our kernel doesn't have the support "
-                           "for KIST anymore. We will fallback to the naive "
-                           "approach. Remove KIST from the Schedulers list "
-                           "to disable.");
-      /* Same reason as the above. */
+      /* Same reason as the above, for the ioctl that tells us how much data
+       * the kernel hasn't sent yet. */
+      log_notice(LD_SCHED, "Looks like our kernel doesn't support "
+                           "SIOCOUTQNSD for KIST anymore. We will fallback "
+                           "to the naive approach. Remove KIST from the "
+                           "Schedulers list to disable.");
       kist_no_kernel_support = 1;
     }
     goto fallback;
   }
-  ent->cwnd = tcp.tcpi_snd_cwnd;
-  ent->unacked = tcp.tcpi_unacked;
-  ent->mss = tcp.tcpi_snd_mss;
 
   /* In order to reduce outbound kernel queuing delays and thus improve Tor's
    * ability to prioritize circuits, KIST wants to set a socket write limit
@@ -301,6 +515,12 @@ update_socket_info_impl, (socket_table_ent_t *ent))
      * And we know this will always be positive, since we checked above. */
     ent->limit = (uint64_t)tcp_space + (uint64_t)extra_space;
   }
+
+  if (kist_use_notsent_lowat) {
+    kist_update_notsent_lowat(sock, ent);
+    ent->info_updated = now;
+    ent->info_valid = 1;
+  }
   return;
 
 #else /* !defined(HAVE_KIST_SUPPORT) */
@@ -313,7 +533,8 @@ update_socket_info_impl, (socket_table_ent_t *ent))
    * also allow the socket to write as much as it can from the estimated
    * number of cells the lower layer can accept, effectively returning it to
    * Vanilla scheduler behavior. */
-  ent->cwnd = ent->unacked = ent->mss = ent->notsent = 0;
+  ent->cwnd = ent->unacked = ent->mss = ent->notsent = ent->rtt = 0;
+  ent->info_valid = 0;
   /* This function calls the specialized channel object (currently channeltls)
    * and ask how many cells it can write on the outbuf which we then multiply
    * by the size of the cells for this channel. The cast is because this
@@ -339,6 +560,9 @@ init_socket_info(socket_table_t *table, const channel_t *chan)
     ent->chan = chan;
     HT_INSERT(socket_table_s, table, ent);
   }
+  /* If update_socket_info() keeps the limit it computed on an earlier run,
+   * what we have written since then comes out of it. */
+  ent->limit = (ent->limit > ent->written) ? ent->limit - ent->written : 0;
   ent->written = 0;
 }
 
@@ -376,7 +600,15 @@ static void
 set_scheduler_run_interval(void)
 {
   int old_sched_run_interval = sched_run_interval;
-  sched_run_interval = kist_scheduler_run_interval();
+  int run_interval = kist_scheduler_run_interval();
+
+  /* With KISTAdaptiveRunInterval, the configured interval is only where we
+   * start from. Once we have moved away from it, keep our own, unless we are
+   * told not to use KIST at all. */
+  if (kist_adaptive.started && run_interval > 0) {
+    return;
+  }
+  sched_run_interval = run_interval;
   if (old_sched_run_interval != sched_run_interval) {
     log_info(LD_SCHED, "Scheduler KIST changing its running interval "
                        "from %" PRId32 " to %" PRId32,
@@ -419,6 +651,13 @@ update_socket_info(socket_table_t *table, const channel_t *chan)
                       ", notsent: %" PRIu32 ", mss: %" PRIu32,
             ent->chan->global_identifier, ent->limit, ent->cwnd, ent->unacked,
             ent->notsent, ent->mss);
+
+  /* Without kernel support (KISTLite), we know nothing of the outqueue. */
+  if (kist_adaptive.enabled && ent->cwnd > 0 && ent->mss > 0) {
+    const uint64_t window = (uint64_t) ent->cwnd * ent->mss;
+    kist_adaptive.window_bytes += window;
+    kist_adaptive.occupied_bytes += MIN((uint64_t) ent->notsent, window);
+  }
 }
 
 /* Increment the channel's socket written value by the number of bytes. */
@@ -497,11 +736,91 @@ have_work(void)
   return smartlist_len(cp) > 0;
 }
 
+/* Return the run interval that should follow <b>interval</b>, given the
+ * mean time cells waited in their circuit queue, <b>delay_msec</b>, and how
+ * full the kernel outqueues of the pending channels were when we ran, in
+ * percent of their congestion window, <b>occupancy_pct</b>. The latter is -1
+ * if we don't know (KISTLite, or no data).
+ *
+ * Run more often when the outqueues drained before we came back, or when
+ * cells wait too long and the kernel could take them. Run less often when
+ * the kernel still has plenty to send and cells don't wait long. */
+int
+kist_next_run_interval(int interval, int64_t delay_msec, int occupancy_pct)
+{
+  const int starving = occupancy_pct >= 0 &&
+                       occupancy_pct < KIST_ADAPTIVE_OCCUPANCY_LOW;
+  const int full = occupancy_pct > KIST_ADAPTIVE_OCCUPANCY_HIGH;
+  const int delayed = delay_msec > KIST_ADAPTIVE_DELAY_TARGET_MSEC;
+
+  if (starving || (delayed && !full)) {
+    interval -= MAX(1, interval / 4);
+  } else if (full && !delayed) {
+    interval += 1;
+  }
+  return CLAMP(KIST_ADAPTIVE_RUN_INTERVAL_MIN, interval,
+               KIST_SCHED_RUN_INTERVAL_MAX);
+}
+
+/* Forget everything the adaptive run interval has seen, and start a new
+ * period now. */
+static void
+kist_adaptive_reset(void)
+{
+  const unsigned int enabled = kist_adaptive.enabled;
+  memset(&kist_adaptive, 0, sizeof(kist_adaptive));
+  kist_adaptive.enabled = enabled;
+  monotime_coarse_get(&kist_adaptive.last_adjusted);
+}
+
+/* If KISTAdaptiveRunInterval is set and the current period is over, adapt
+ * sched_run_interval to what we have seen during that period. */
+static void
+kist_adaptive_update(void)
+{
+  monotime_coarse_t now;
+  int64_t delay_msec = 0;
+  int occupancy_pct = -1;
+  int new_interval;
+
+  if (!kist_adaptive.enabled) {
+    return;
+  }
+  monotime_coarse_get(&now);
+  if (monotime_coarse_diff_msec(&kist_adaptive.last_adjusted, &now) <
+      KIST_ADAPTIVE_PERIOD_MSEC) {
+    return;
+  }
+
+  if (kist_adaptive.n_delays > 0) {
+    delay_msec = (int64_t) (kist_adaptive.delay_sum_msec /
+                            kist_adaptive.n_delays);
+  }
+  if (kist_adaptive.window_bytes > 0) {
+    occupancy_pct = (int) ((kist_adaptive.occupied_bytes * 100) /
+                           kist_adaptive.window_bytes);
+  }
+  new_interval = kist_next_run_interval(sched_run_interval, delay_msec,
+                                        occupancy_pct);
+  if (new_interval != sched_run_interval) {
+    log_debug(LD_SCHED, "Adapting KIST run interval from %d to %d msec "
+              "(mean cell queue delay %" PRId64 " msec, outqueue "
+              "occupancy %d%%)", sched_run_interval, new_interval,
+              delay_msec, occupancy_pct);
+    sched_run_interval = new_interval;
+  }
+
+  kist_adaptive_reset();
+  kist_adaptive.started = 1;
+}
+
 /* Function of the scheduler interface: free_all() */
 static void
 kist_free_all(void)
 {
   free_all_socket_info();
+  memset(&kist_adaptive, 0, sizeof(kist_adaptive));
+  kist_track_queue_delay = 0;
 }
 
 /* Function of the scheduler interface: on_channel_free() */
@@ -524,6 +843,20 @@ kist_scheduler_on_new_options(void)
 {
   sock_buf_size_factor = get_options()->KISTSockBufSizeFactor;
 
+  if (kist_use_notsent_lowat && !get_options()->KISTNotsentLowat) {
+    HT_FOREACH_FN(socket_table_s, &socket_table, clear_socket_info_by_ent,
+                  NULL);
+  }
+  kist_use_notsent_lowat = get_options()->KISTNotsentLowat;
+
+  if (!kist_adaptive.enabled != !get_options()->KISTAdaptiveRunInterval) {
+    /* Start over from the configured interval, whichever way we go. */
+    kist_adaptive.enabled = get_options()->KISTAdaptiveRunInterval;
+    kist_adaptive_reset();
+  }
+  kist_track_queue_delay = kist_adaptive.enabled ||
+                           get_options()->MetricsPort_lines != NULL;
+
   /* Calls kist_scheduler_run_interval which calls get_options(). */
   set_scheduler_run_interval();
 }
@@ -762,6 +1095,7 @@ kist_scheduler_run(void)
   }
 
   monotime_get(&scheduler_last_run);
+  kist_adaptive_update();
 }
 
 /*****************************************************************************
@@ -818,6 +1152,69 @@ kist_scheduler_run_interval(void)
                                  KIST_SCHED_RUN_INTERVAL_MAX);
 }
 
+/* Note that <b>cell</b> is leaving its circuit queue now. */
+void
+scheduler_kist_note_queue_delay(const packed_cell_t *cell)
+{
+  uint64_t msec;
+  int i;
+
+  if (!kist_track_queue_delay) {
+    return;
+  }
+
+  msec = monotime_coarse_stamp_units_to_approx_msec(
+                     monotime_coarse_get_stamp() - cell->inserted_timestamp);
+  for (i = 0; i < KIST_QUEUE_DELAY_N_BUCKETS; i++) {
+    if ((int64_t) msec <= kist_queue_delay_buckets[i]) {
+      break;
+    }
+  }
+  queue_delay_hist[i]++;
+  queue_delay_sum_msec += msec;
+
+  if (kist_adaptive.enabled) {
+    kist_adaptive.delay_sum_msec += msec;
+    kist_adaptive.n_delays++;
+  }
+}
+
+/* Return the interval at which the KIST scheduler runs, in msec, or 0 if it
+ * isn't the one in use. */
+int
+scheduler_kist_get_run_interval(void)
+{
+  if (!kist_track_queue_delay) {
+    /* The scheduler isn't KIST, or hasn't been told about the MetricsPort
+     * yet. Either way, nobody is asking. */
+    return 0;
+  }
+  return sched_run_interval;
+}
+
+/* Copy the cell queue delay histogram into <b>bucket_values</b>, which must
+ * have room for KIST_QUEUE_DELAY_N_BUCKETS values: each one is the number of
+ * cells that waited at most the matching kist_queue_delay_buckets msec. Set
+ * *<b>count_out</b> to the number of cells, and *<b>sum_out</b> to the sum
+ * of their delays. */
+void
+scheduler_kist_get_queue_delays(uint64_t *bucket_values, uint64_t *count_out,
+                                int64_t *sum_out)
+{
+  uint64_t total = 0;
+
+  tor_assert(bucket_values);
+  tor_assert(count_out);
+  tor_assert(sum_out);
+
+  for (int i = 0; i < KIST_QUEUE_DELAY_N_BUCKETS; i++) {
+    total += queue_delay_hist[i];
+    bucket_values[i] = total;
+  }
+  *count_out = total + queue_delay_hist[KIST_QUEUE_DELAY_N_BUCKETS];
+  *sum_out = (int64_t) MIN(queue_delay_sum_msec, (uint64_t) INT64_MAX);
+}
+
 /* Set KISTLite mode that is KIST without kernel support. */
 void
 scheduler_kist_set_lite_mode(void)
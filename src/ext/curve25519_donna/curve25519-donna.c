@@ -54,6 +54,10 @@ typedef uint8_t u8;
 typedef int32_t s32;
 typedef int64_t limb;
 
+/* The largest number of scalar multiplications that curve25519_donna_batch()
+ * will do at once. */
+#define CURVE25519_DONNA_MAX_BATCH 16
+
 /* Field element representation:
  *
  * Field elements are written as an array of signed, 64-bit limbs, least
@@ -869,3 +873,64 @@ curve25519_donna(u8 *mypublic, const u8 *secret, const u8 *basepoint) {
   fcontract(mypublic, z);
   return 0;
 }
+
+/* Calculates curve25519_donna(mypublic[i], secret[i], basepoint[i]) for
+ * each i < n, sharing a single field inversion among all of them
+ * (Montgomery's trick).  n must be between 1 and CURVE25519_DONNA_MAX_BATCH.
+ * Returns 0 on success, -1 if n is out of range. */
+int curve25519_donna_batch(u8 **, const u8 *const *, const u8 *const *, int);
+
+int
+curve25519_donna_batch(u8 **mypublic, const u8 *const *secret,
+                       const u8 *const *basepoint, int n) {
+  limb bp[10], inv[10], zinv[10], t[19];
+  limb x[CURVE25519_DONNA_MAX_BATCH][10], z[CURVE25519_DONNA_MAX_BATCH][19];
+  limb acc[CURVE25519_DONNA_MAX_BATCH][10];
+  limb iszero[CURVE25519_DONNA_MAX_BATCH];
+  uint8_t e[32], zb[32];
+  int i, j;
+
+  if (n < 1 || n > CURVE25519_DONNA_MAX_BATCH) return -1;
+
+  for (i = 0; i < n; ++i) {
+    limb one[19] = {1};
+    u8 bits = 0;
+
+    for (j = 0; j < 32; ++j) e[j] = secret[i][j];
+    e[0] &= 248;
+    e[31] &= 127;
+    e[31] |= 64;
+
+    fexpand(bp, basepoint[i]);
+    cmult(x[i], z[i], e, bp);
+
+    /* A zero z gives a zero result.  Use 1 in its place, so that it
+     * doesn't spoil the inversion for the others. */
+    fcontract(zb, z[i]);
+    for (j = 0; j < 32; ++j) bits |= zb[j];
+    iszero[i] = 1 & ((((limb) bits) - 1) >> 8);
+    swap_conditional(z[i], one, iszero[i]);
+
+    if (i == 0)
+      memcpy(acc[0], z[0], sizeof(limb) * 10);
+    else
+      fmul(acc[i], acc[i-1], z[i]);
+  }
+
+  crecip(inv, acc[n-1]);
+
+  for (i = n - 1; i >= 0; --i) {
+    limb zero[19] = {0};
+    if (i > 0) {
+      fmul(zinv, inv, acc[i-1]);
+      fmul(t, inv, z[i]);
+      memcpy(inv, t, sizeof(limb) * 10);
+    } else {
+      memcpy(zinv, inv, sizeof(limb) * 10);
+    }
+    fmul(t, x[i], zinv);
+    swap_conditional(t, zero, iszero[i]);
+    fcontract(mypublic[i], t);
+  }
+  return 0;
+}
@@ -145,6 +145,7 @@ evdns_server_callback(struct evdns_server_request *req, void *data_)
   conn = ENTRY_TO_EDGE_CONN(entry_conn);
   CONNECTION_AP_EXPECT_NONPENDING(entry_conn);
   TO_CONN(conn)->state = AP_CONN_STATE_RESOLVE_WAIT;
+  connection_ap_schedule_expiry(entry_conn);
   conn->is_dns_request = 1;
 
   tor_addr_copy(&TO_CONN(conn)->addr, &tor_addr);
@@ -226,6 +227,7 @@ dnsserv_launch_request(const char *name, int reverse,
   conn = ENTRY_TO_EDGE_CONN(entry_conn);
   CONNECTION_AP_EXPECT_NONPENDING(entry_conn);
   conn->base_.state = AP_CONN_STATE_RESOLVE_WAIT;
+  connection_ap_schedule_expiry(entry_conn);
 
   tor_addr_copy(&TO_CONN(conn)->addr, &control_conn->base_.addr);
 #ifdef AF_UNIX
@@ -28,6 +28,7 @@
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_table.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerinfo.h"
 #include "feature/nodelist/routerlist.h"
@@ -627,6 +628,7 @@ dirserv_set_node_flags_from_authoritative_status(node_t *node,
   node->is_valid = (authstatus & RTR_INVALID) ? 0 : 1;
   node->is_bad_exit = (authstatus & RTR_BADEXIT) ? 1 : 0;
   node->is_middle_only = (authstatus & RTR_MIDDLEONLY) ? 1 : 0;
+  node_table_invalidate();
 }
 
 /** True iff <b>a</b> is more severe than <b>b</b>. */
@@ -967,6 +969,7 @@ directory_remove_invalid(void)
     }
   } SMARTLIST_FOREACH_END(node);
 
+  node_table_invalidate();
   routerlist_assert_ok(rl);
   smartlist_free(nodes);
 }
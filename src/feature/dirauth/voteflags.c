@@ -22,6 +22,7 @@
 #include "feature/hibernate/hibernate.h"
 #include "feature/nodelist/dirlist.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_table.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -295,6 +296,8 @@ dirserv_compute_performance_thresholds(digestmap_t *omit_as_sybil)
       ++n_active;
     }
   } SMARTLIST_FOREACH_END(node);
+  /* We may have changed some nodes' Exit flags. */
+  node_table_invalidate();
 
   /* Now, compute thresholds. */
   if (n_active) {
@@ -542,6 +545,7 @@ dirserv_set_router_is_running(routerinfo_t *router, time_t now)
   }
 
   node->is_running = answer;
+  node_table_invalidate();
 }
 
 /* Check <b>node</b> and <b>ri</b> on whether or not we should publish a
@@ -595,6 +599,7 @@ dirauth_set_routerstatus_from_routerinfo(routerstatus_t *rs,
   node->is_stable = !dirserv_thinks_router_is_unreliable(now, ri, 1, 0);
   node->is_fast = !dirserv_thinks_router_is_unreliable(now, ri, 0, 1);
   node->is_hs_dir = dirserv_thinks_router_is_hs_dir(ri, node, now);
+  node_table_invalidate();
 
   set_routerstatus_from_routerinfo(rs, node, ri);
 
@@ -278,6 +278,25 @@ microdesc_parse_fields(microdesc_t *md,
   return rv;
 }
 
+/** Parse the fields of <b>md</b> out of its body, which we have already
+ * found and digested.  (We use this for microdescriptors that we loaded from
+ * the cache index without parsing them.)  Return 0 on success and -1 on
+ * failure. */
+int
+microdesc_parse_body_fields(microdesc_t *md)
+{
+  memarea_t *area;
+  int r;
+
+  tor_assert(md->body);
+
+  area = memarea_new();
+  r = microdesc_parse_fields(md, area, md->body, md->body + md->bodylen,
+                             0, md->saved_location);
+  memarea_drop_all(area);
+  return r;
+}
+
 /** Parse as many microdescriptors as are found from the string starting at
  * <b>s</b> and ending at <b>eos</b>.  If allow_annotations is set, read any
  * annotations we recognize and ignore ones we don't.
@@ -13,6 +13,7 @@
 
 #include "core/or/or.h"
 #include "app/config/config.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/or/protover.h"
 #include "core/or/versions.h"
 #include "feature/client/entrynodes.h"
@@ -29,7 +30,9 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/nickname.h"
 #include "lib/crypt_ops/crypto_format.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/memarea/memarea.h"
+#include "lib/thread/threads.h"
 
 #include "feature/dirauth/vote_microdesc_hash_st.h"
 #include "feature/nodelist/authority_cert_st.h"
@@ -229,6 +232,28 @@ find_start_of_next_routerstatus(const char *s, const char *s_eos)
     return eos;
 }
 
+/** Helper: given a string <b>s</b>, at the start of the router-status objects
+ * in a networkstatus document, return the end of those objects: the start of
+ * the directory footer, or of the first directory signature, or the end of
+ * the string if there are neither. */
+static const char *
+find_end_of_routerstatuses(const char *s, const char *s_eos)
+{
+  const char *footer, *sig;
+
+  footer = tor_memstr(s, s_eos - s, "\ndirectory-footer");
+  sig = tor_memstr(s, s_eos - s, "\ndirectory-signature");
+
+  if (footer && sig)
+    return MIN(footer, sig) + 1;
+  else if (footer)
+    return footer+1;
+  else if (sig)
+    return sig+1;
+  else
+    return s_eos;
+}
+
 /** Parse the GuardFraction string from a consensus or vote.
  *
  *  If <b>vote</b> or <b>vote_rs</b> are set the document getting
@@ -286,6 +311,14 @@ routerstatus_parse_guardfraction(const char *guardfraction_str,
   return 0;
 }
 
+static routerstatus_t *routerstatus_parse_entry_from_tokens(
+                                     const char *s,
+                                     smartlist_t *tokens,
+                                     networkstatus_t *vote,
+                                     vote_routerstatus_t *vote_rs,
+                                     int consensus_method,
+                                     consensus_flavor_t flav);
+
 /** Given a string at *<b>s</b>, containing a routerstatus object, and an
  * empty smartlist at <b>tokens</b>, parse and return the first router status
  * object in the string, and advance *<b>s</b> to just after the end of the
@@ -309,7 +342,43 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                      int consensus_method,
                                      consensus_flavor_t flav)
 {
-  const char *eos, *s_dup = *s;
+  const char *eos;
+  routerstatus_t *rs = NULL;
+  tor_assert(tokens);
+
+  eos = find_start_of_next_routerstatus(*s, s_eos);
+
+  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
+    log_warn(LD_DIR, "Error tokenizing router status");
+    dump_desc(*s, "routerstatus entry");
+  } else {
+    rs = routerstatus_parse_entry_from_tokens(*s, tokens, vote, vote_rs,
+                                              consensus_method, flav);
+  }
+
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  smartlist_clear(tokens);
+  if (area) {
+    DUMP_AREA(area, "routerstatus entry");
+    memarea_clear(area);
+  }
+  *s = eos;
+
+  return rs;
+}
+
+/** As routerstatus_parse_entry_from_string(), but take the routerstatus
+ * object starting at <b>s</b> as a list of <b>tokens</b> that we have
+ * already tokenized with rtrstatus_token_table.  The caller keeps ownership
+ * of <b>tokens</b>. */
+static routerstatus_t *
+routerstatus_parse_entry_from_tokens(const char *s,
+                                     smartlist_t *tokens,
+                                     networkstatus_t *vote,
+                                     vote_routerstatus_t *vote_rs,
+                                     int consensus_method,
+                                     consensus_flavor_t flav)
+{
   routerstatus_t *rs = NULL;
   directory_token_t *tok;
   char timebuf[ISO_TIME_LEN+1];
@@ -322,12 +391,6 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     flav = FLAV_NS;
   tor_assert(flav == FLAV_NS || flav == FLAV_MICRODESC);
 
-  eos = find_start_of_next_routerstatus(*s, s_eos);
-
-  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
-    log_warn(LD_DIR, "Error tokenizing router status");
-    goto err;
-  }
   if (smartlist_len(tokens) < 1) {
     log_warn(LD_DIR, "Impossibly short router status");
     goto err;
@@ -584,20 +647,268 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   goto done;
  err:
-  dump_desc(s_dup, "routerstatus entry");
+  dump_desc(s, "routerstatus entry");
   if (rs && !vote_rs)
     routerstatus_free(rs);
   rs = NULL;
  done:
-  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
-  smartlist_clear(tokens);
-  if (area) {
-    DUMP_AREA(area, "routerstatus entry");
-    memarea_clear(area);
+  return rs;
+}
+
+/** The values of NS_PARALLEL_MIN_LEN and NS_PARALLEL_RANGE_LEN that we use;
+ * the tests lower them to exercise the parallel code on small documents. */
+STATIC size_t ns_parallel_min_len = NS_PARALLEL_MIN_LEN;
+STATIC size_t ns_parallel_range_len = NS_PARALLEL_RANGE_LEN;
+
+/** A router-status object that we tokenized ahead of time. */
+typedef struct rs_tokenized_t {
+  /** The start of the object. */
+  const char *start;
+  /** Its tokens, or NULL if it wouldn't tokenize. */
+  smartlist_t *tokens;
+} rs_tokenized_t;
+
+/** A range of the router-status objects in a networkstatus document, and the
+ * result of tokenizing them. */
+typedef struct rs_range_t {
+  /** The start of the first object in the range. */
+  const char *start;
+  /** The end of the last object in the range. */
+  const char *end;
+  /** The memory area that holds the tokens. */
+  memarea_t *area;
+  /** A list of rs_tokenized_t, one for each object in the range, in
+   * order. */
+  smartlist_t *entries;
+} rs_range_t;
+
+/** The state that the main thread shares with the cpuworker threads that
+ * help it tokenize the router-status objects in a networkstatus document. */
+typedef struct rs_tokenize_job_t {
+  /** Protects next_range and n_busy. */
+  tor_mutex_t lock;
+  /** Signalled when n_busy drops to zero. */
+  tor_cond_t cond;
+  /** The ranges to tokenize.  Each thread only touches the ranges that it
+   * takes from next_range. */
+  rs_range_t *ranges;
+  /** How many entries are there in <b>ranges</b>? */
+  int n_ranges;
+  /** The index of the first range that nobody has taken yet. */
+  int next_range;
+  /** How many threads are tokenizing a range right now? */
+  int n_busy;
+  /** How many references are there to this job?  The main thread holds one
+   * until it is done with the job, and each work item holds one until its
+   * reply runs.  Only used from the main thread. */
+  int refcnt;
+} rs_tokenize_job_t;
+
+/** Tokenize every router-status object in <b>range</b>. */
+static void
+rs_range_tokenize(rs_range_t *range)
+{
+  const char *s = range->start;
+
+  range->area = memarea_new();
+  range->entries = smartlist_new();
+
+  while (s < range->end) {
+    const char *eos = find_start_of_next_routerstatus(s, range->end);
+    rs_tokenized_t *ent = tor_malloc_zero(sizeof(rs_tokenized_t));
+    ent->start = s;
+    ent->tokens = smartlist_new();
+    if (tokenize_string(range->area, s, eos, ent->tokens,
+                        rtrstatus_token_table, 0)) {
+      SMARTLIST_FOREACH(ent->tokens, directory_token_t *, t, token_clear(t));
+      smartlist_free(ent->tokens);
+    }
+    smartlist_add(range->entries, ent);
+    s = eos;
   }
-  *s = eos;
+}
 
-  return rs;
+/** Release all storage held in <b>range</b>. */
+static void
+rs_range_clear(rs_range_t *range)
+{
+  if (range->entries) {
+    SMARTLIST_FOREACH_BEGIN(range->entries, rs_tokenized_t *, ent) {
+      if (ent->tokens) {
+        SMARTLIST_FOREACH(ent->tokens, directory_token_t *, t,
+                          token_clear(t));
+        smartlist_free(ent->tokens);
+      }
+      tor_free(ent);
+    } SMARTLIST_FOREACH_END(ent);
+    smartlist_free(range->entries);
+  }
+  if (range->area)
+    memarea_drop_all(range->area);
+  memset(range, 0, sizeof(*range));
+}
+
+/** Take ranges from <b>job</b> and tokenize them, until there are none left
+ * for us to take.  Called from the main thread and from the cpuworkers. */
+static void
+rs_tokenize_job_run(rs_tokenize_job_t *job)
+{
+  for (;;) {
+    int idx;
+
+    tor_mutex_acquire(&job->lock);
+    if (job->next_range >= job->n_ranges) {
+      tor_mutex_release(&job->lock);
+      return;
+    }
+    idx = job->next_range++;
+    ++job->n_busy;
+    tor_mutex_release(&job->lock);
+
+    rs_range_tokenize(&job->ranges[idx]);
+
+    tor_mutex_acquire(&job->lock);
+    if (--job->n_busy == 0)
+      tor_cond_signal_all(&job->cond);
+    tor_mutex_release(&job->lock);
+  }
+}
+
+/** Drop a reference to <b>job</b>, and free it if that was the last one. */
+static void
+rs_tokenize_job_decref(rs_tokenize_job_t *job)
+{
+  if (--job->refcnt > 0)
+    return;
+  tor_mutex_uninit(&job->lock);
+  tor_cond_uninit(&job->cond);
+  tor_free(job);
+}
+
+/** Cpuworker function: help tokenize the ranges in a rs_tokenize_job_t. */
+static workqueue_reply_t
+rs_tokenize_threadfn(void *state_, void *work_)
+{
+  (void) state_;
+  rs_tokenize_job_run(work_);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: drop the work item's reference to its job. */
+static void
+rs_tokenize_replyfn(void *work_)
+{
+  rs_tokenize_job_decref(work_);
+}
+
+/** Split the router-status objects between <b>start</b> (which must be the
+ * start of one) and <b>end</b> into ranges of about ns_parallel_range_len
+ * bytes, and tokenize them, with help from the cpuworkers if we have any.
+ * Return a newly allocated array of the ranges, in order, and set
+ * *<b>n_ranges_out</b> to its length. */
+static rs_range_t *
+rs_tokenize_in_parallel(const char *start, const char *end,
+                        int *n_ranges_out)
+{
+  smartlist_t *starts = smartlist_new();
+  smartlist_t *entries = smartlist_new();
+  rs_tokenize_job_t *job;
+  rs_range_t *ranges;
+  const char *s = start;
+  int i, n_ranges, n_helpers;
+
+  while (s < end) {
+    const char *next = NULL;
+    smartlist_add(starts, (char *) s);
+    if ((size_t)(end - s) > ns_parallel_range_len) {
+      const char *from = s + ns_parallel_range_len;
+      next = tor_memstr(from, end - from, "\nr ");
+    }
+    s = next ? next + 1 : end;
+  }
+
+  n_ranges = smartlist_len(starts);
+  ranges = tor_calloc(n_ranges, sizeof(rs_range_t));
+  for (i = 0; i < n_ranges; ++i) {
+    ranges[i].start = smartlist_get(starts, i);
+    ranges[i].end = (i + 1 < n_ranges) ? smartlist_get(starts, i + 1) : end;
+  }
+  smartlist_free(starts);
+
+  job = tor_malloc_zero(sizeof(rs_tokenize_job_t));
+  tor_mutex_init_nonrecursive(&job->lock);
+  tor_cond_init(&job->cond);
+  job->ranges = ranges;
+  job->n_ranges = n_ranges;
+  job->refcnt = 1;
+
+  /* The main thread takes ranges too, so it needs at most n_ranges - 1
+   * helpers. */
+  n_helpers = MIN((int) cpuworker_get_n_threads(), n_ranges - 1);
+  for (i = 0; i < n_helpers; ++i) {
+    workqueue_entry_t *ent = cpuworker_queue_work(WQ_PRI_HIGH,
+                                                  rs_tokenize_threadfn,
+                                                  rs_tokenize_replyfn,
+                                                  job);
+    if (!ent)
+      break;
+    ++job->refcnt;
+    smartlist_add(entries, ent);
+  }
+
+  rs_tokenize_job_run(job);
+
+  /* Every range has been taken; don't bother the helpers that haven't
+   * started yet, and wait for the ones that are still working. */
+  SMARTLIST_FOREACH(entries, workqueue_entry_t *, ent, {
+    if (workqueue_entry_cancel(ent))
+      rs_tokenize_job_decref(job);
+  });
+  smartlist_free(entries);
+
+  tor_mutex_acquire(&job->lock);
+  while (job->n_busy > 0)
+    tor_cond_wait(&job->cond, &job->lock, NULL);
+  tor_mutex_release(&job->lock);
+
+  job->ranges = NULL;
+  rs_tokenize_job_decref(job);
+
+  *n_ranges_out = n_ranges;
+  return ranges;
+}
+
+/** Parse the router-status object starting at <b>s</b>, which we tokenized
+ * ahead of time into <b>tokens</b> (or NULL if it wouldn't tokenize), and
+ * add it to the routerstatus_list of <b>ns</b>.  Return 0 on success and -1
+ * on failure. */
+static int
+ns_add_tokenized_routerstatus(networkstatus_t *ns, const char *s,
+                              smartlist_t *tokens, consensus_flavor_t flav)
+{
+  if (!tokens) {
+    log_warn(LD_DIR, "Error tokenizing router status");
+    dump_desc(s, "routerstatus entry");
+    return -1;
+  }
+
+  if (ns->type != NS_TYPE_CONSENSUS) {
+    vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+    if (routerstatus_parse_entry_from_tokens(s, tokens, ns, rs, 0, 0)) {
+      smartlist_add(ns->routerstatus_list, rs);
+      return 0;
+    }
+    vote_routerstatus_free(rs);
+    return -1;
+  } else {
+    routerstatus_t *rs;
+    rs = routerstatus_parse_entry_from_tokens(s, tokens, NULL, NULL,
+                                              ns->consensus_method, flav);
+    if (!rs)
+      return -1;
+    smartlist_add(ns->routerstatus_list, rs);
+    return 0;
+  }
 }
 
 int
@@ -1103,6 +1414,7 @@ networkstatus_parse_vote_from_string(const char *s,
   common_digests_t ns_digests;
   uint8_t sha3_as_signed[DIGEST256_LEN];
   const char *cert, *end_of_header, *end_of_footer, *s_dup = s;
+  const char *end_of_routerstatuses;
   directory_token_t *tok;
   struct in_addr in;
   int i, inorder, n_signatures = 0;
@@ -1474,6 +1786,29 @@ networkstatus_parse_vote_from_string(const char *s,
   s = end_of_header;
   ns->routerstatus_list = smartlist_new();
 
+  end_of_routerstatuses = find_end_of_routerstatuses(s, eos);
+  if ((size_t)(end_of_routerstatuses - s) >= ns_parallel_min_len &&
+      fast_memeq(s, "r ", 2)) {
+    /* There are a lot of them: tokenize them on several threads, then
+     * parse them here, in order. */
+    int n_ranges = 0, r = 0;
+    rs_range_t *ranges = rs_tokenize_in_parallel(s, end_of_routerstatuses,
+                                                 &n_ranges);
+    for (i = 0; i < n_ranges && r == 0; ++i) {
+      SMARTLIST_FOREACH_BEGIN(ranges[i].entries, rs_tokenized_t *, ent) {
+        r = ns_add_tokenized_routerstatus(ns, ent->start, ent->tokens, flav);
+        if (r < 0)
+          break;
+      } SMARTLIST_FOREACH_END(ent);
+    }
+    for (i = 0; i < n_ranges; ++i)
+      rs_range_clear(&ranges[i]);
+    tor_free(ranges);
+    if (r < 0)
+      goto err; // Malformed routerstatus, reject this vote.
+    s = end_of_routerstatuses;
+  }
+
   while (eos - s >= 2 && fast_memeq(s, "r ", 2)) {
     if (ns->type != NS_TYPE_CONSENSUS) {
       vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
@@ -29,10 +29,21 @@ networkstatus_t *networkstatus_parse_vote_from_string(const char *s,
                                            enum networkstatus_type_t ns_type);
 
 #ifdef NS_PARSE_PRIVATE
+/** How long must the router-status objects of a networkstatus document be,
+ * in bytes, before we split them into ranges and tokenize the ranges in
+ * parallel? */
+#define NS_PARALLEL_MIN_LEN (128*1024)
+/** Roughly how long, in bytes, should each of those ranges be? */
+#define NS_PARALLEL_RANGE_LEN (32*1024)
+
 STATIC int routerstatus_parse_guardfraction(const char *guardfraction_str,
                                             networkstatus_t *vote,
                                             vote_routerstatus_t *vote_rs,
                                             routerstatus_t *rs);
+#ifdef TOR_UNIT_TESTS
+extern size_t ns_parallel_min_len;
+extern size_t ns_parallel_range_len;
+#endif
 struct memarea_t;
 STATIC routerstatus_t *routerstatus_parse_entry_from_string(
                                      struct memarea_t *area,
@@ -168,17 +168,19 @@ get_token_arguments(memarea_t *area, directory_token_t *tok,
 #define MAX_ARGS 512
   char *mem = memarea_strndup(area, s, eol-s);
   char *cp = mem;
+  /* Use the bounded scanners, which can look at many bytes at once. */
+  const char *end = mem + strlen(mem);
   int j = 0;
   char *args[MAX_ARGS];
   while (*cp) {
     if (j == MAX_ARGS)
       return -1;
     args[j++] = cp;
-    cp = (char*)find_whitespace(cp);
+    cp = (char*)find_whitespace_eos(cp, end);
     if (!cp || !*cp)
       break; /* End of the line. */
     *cp++ = '\0';
-    cp = (char*)eat_whitespace(cp);
+    cp = (char*)eat_whitespace_eos(cp, end);
   }
   tok->n_args = j;
   tok->args = memarea_memdup(area, args, j*sizeof(char*));
@@ -303,7 +305,10 @@ get_next_token(memarea_t *area,
   /* Search the table for the appropriate entry.  (I tried a binary search
    * instead, but it wasn't any faster.) */
   for (i = 0; table[i].t ; ++i) {
-    if (mem_eq_token(*s, next-*s, table[i].t)) {
+    /* Most keywords differ in their first character, so check that before
+     * we bother with a strlen() and a memcmp(). */
+    if (next > *s && table[i].t[0] == **s &&
+        mem_eq_token(*s, next-*s, table[i].t)) {
       /* We've found the keyword. */
       kwd = table[i].t;
       tok->tp = table[i].v;
@@ -350,8 +355,12 @@ get_next_token(memarea_t *area,
   /* Check whether there's an object present */
   *s = eat_whitespace_eos(eol, eos);  /* Scan from end of first line */
   tor_assert(eos >= *s);
+  /* Most items have no object, so check for the begin line before we look
+   * for the end of the line. */
+  if (eos-*s < 11 || fast_memneq(*s, "-----BEGIN ", 11)) /* No object. */
+    goto check_object;
   eol = memchr(*s, '\n', eos-*s);
-  if (!eol || eol-*s<11 || strcmpstart(*s, "-----BEGIN ")) /* No object. */
+  if (!eol || eol-*s<11) /* No object. */
     goto check_object;
 
   if (eol - *s <= 16 || memchr(*s+11,'\0',eol-*s-16) || /* no short lines, */
@@ -1847,11 +1847,12 @@ set_intro_point_onion_key(curve25519_public_key_t *onion_key_out,
 }
 
 /** Given the start of a section and the end of it, decode a single
- * introduction point from that section. Return a newly allocated introduction
- * point object containing the decoded data. Return NULL if the section can't
- * be decoded. */
-STATIC hs_desc_intro_point_t *
-decode_introduction_point(const hs_descriptor_t *desc, const char *start)
+ * introduction point from that section, without checking the signatures on
+ * its certificates: see intro_points_check_certs(). Return a newly allocated
+ * introduction point object containing the decoded data. Return NULL if the
+ * section can't be decoded. */
+static hs_desc_intro_point_t *
+parse_introduction_point(const hs_descriptor_t *desc, const char *start)
 {
   hs_desc_intro_point_t *ip = NULL;
   memarea_t *area = NULL;
@@ -1902,13 +1903,6 @@ decode_introduction_point(const hs_descriptor_t *desc, const char *start)
                               "introduction point auth-key") < 0) {
     goto err;
   }
-  /* Validate authentication certificate with descriptor signing key. */
-  if (tor_cert_checksig(ip->auth_key_cert,
-                        &desc->plaintext_data.signing_pubkey, 0) < 0) {
-    log_warn(LD_REND, "Invalid authentication key signature: %s",
-             tor_cert_describe_signature_status(ip->auth_key_cert));
-    goto err;
-  }
 
   /* Exactly one "enc-key" SP "ntor" SP key NL */
   tok = find_by_keyword(tokens, R3_INTRO_ENC_KEY);
@@ -1941,14 +1935,6 @@ decode_introduction_point(const hs_descriptor_t *desc, const char *start)
                               "introduction point enc-key-cert") < 0) {
     goto err;
   }
-  if (tor_cert_checksig(ip->enc_key_cert,
-                        &desc->plaintext_data.signing_pubkey, 0) < 0) {
-    log_warn(LD_REND, "Invalid encryption key signature: %s",
-             tor_cert_describe_signature_status(ip->enc_key_cert));
-    goto err;
-  }
-  /* It is successfully cross certified. Flag the object. */
-  ip->cross_certified = 1;
 
   /* Do we have a "legacy-key" SP key NL ?*/
   tok = find_opt_by_keyword(tokens, R3_INTRO_LEGACY_KEY);
@@ -1975,6 +1961,83 @@ decode_introduction_point(const hs_descriptor_t *desc, const char *start)
   return ip;
 }
 
+/** Validate the authentication and encryption key certificates of every
+ * introduction point in <b>ips</b> with the descriptor signing key, checking
+ * all of their signatures in one batch. Remove and free each introduction
+ * point that fails, and flag the others as cross certified. */
+static void
+intro_points_check_certs(const hs_descriptor_t *desc, smartlist_t *ips)
+{
+  const int n_certs = smartlist_len(ips) * 2;
+  tor_cert_t **certs;
+  const ed25519_public_key_t **pubkeys;
+  int *okay;
+  int i = 0;
+
+  if (n_certs == 0) {
+    return;
+  }
+
+  certs = tor_calloc(n_certs, sizeof(tor_cert_t *));
+  pubkeys = tor_calloc(n_certs, sizeof(ed25519_public_key_t *));
+  okay = tor_calloc(n_certs, sizeof(int));
+
+  SMARTLIST_FOREACH_BEGIN(ips, hs_desc_intro_point_t *, ip) {
+    certs[ip_sl_idx*2] = ip->auth_key_cert;
+    certs[ip_sl_idx*2 + 1] = ip->enc_key_cert;
+    pubkeys[ip_sl_idx*2] = &desc->plaintext_data.signing_pubkey;
+    pubkeys[ip_sl_idx*2 + 1] = &desc->plaintext_data.signing_pubkey;
+  } SMARTLIST_FOREACH_END(ip);
+
+  tor_cert_checksig_batch(certs, pubkeys, n_certs, 0, okay);
+
+  SMARTLIST_FOREACH_BEGIN(ips, hs_desc_intro_point_t *, ip) {
+    const int auth_ok = okay[i++];
+    const int enc_ok = okay[i++];
+    if (auth_ok && enc_ok) {
+      /* It is successfully cross certified. Flag the object. */
+      ip->cross_certified = 1;
+      continue;
+    }
+    if (!auth_ok) {
+      log_warn(LD_REND, "Invalid authentication key signature: %s",
+               tor_cert_describe_signature_status(ip->auth_key_cert));
+    } else {
+      log_warn(LD_REND, "Invalid encryption key signature: %s",
+               tor_cert_describe_signature_status(ip->enc_key_cert));
+    }
+    hs_desc_intro_point_free(ip);
+    SMARTLIST_DEL_CURRENT_KEEPORDER(ips, ip);
+  } SMARTLIST_FOREACH_END(ip);
+
+  tor_free(certs);
+  tor_free(pubkeys);
+  tor_free(okay);
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Given the start of a section and the end of it, decode a single
+ * introduction point from that section, and check its certificates. Return a
+ * newly allocated introduction point object containing the decoded data.
+ * Return NULL if the section can't be decoded. */
+STATIC hs_desc_intro_point_t *
+decode_introduction_point(const hs_descriptor_t *desc, const char *start)
+{
+  hs_desc_intro_point_t *ip = parse_introduction_point(desc, start);
+  smartlist_t *ips;
+
+  if (!ip) {
+    return NULL;
+  }
+  ips = smartlist_new();
+  smartlist_add(ips, ip);
+  intro_points_check_certs(desc, ips);
+  ip = smartlist_len(ips) ? smartlist_get(ips, 0) : NULL;
+  smartlist_free(ips);
+  return ip;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** Given a descriptor string at <b>data</b>, decode all possible introduction
  * points that we can find. Add the introduction point object to desc_enc as we
  * find them. This function can't fail and it is possible that zero
@@ -1986,6 +2049,7 @@ decode_intro_points(const hs_descriptor_t *desc,
 {
   smartlist_t *chunked_desc = smartlist_new();
   smartlist_t *intro_points = smartlist_new();
+  smartlist_t *decoded = smartlist_new();
 
   tor_assert(desc);
   tor_assert(desc_enc);
@@ -2022,21 +2086,26 @@ decode_intro_points(const hs_descriptor_t *desc,
 
   /* Parse the intro points! */
   SMARTLIST_FOREACH_BEGIN(intro_points, const char *, intro_point) {
-    hs_desc_intro_point_t *ip = decode_introduction_point(desc, intro_point);
+    hs_desc_intro_point_t *ip = parse_introduction_point(desc, intro_point);
     if (!ip) {
       /* Malformed introduction point section. We'll ignore this introduction
        * point and continue parsing. New or unknown fields are possible for
        * forward compatibility. */
       continue;
     }
-    smartlist_add(desc_enc->intro_points, ip);
+    smartlist_add(decoded, ip);
   } SMARTLIST_FOREACH_END(intro_point);
 
+  /* Check all their certificates at once, and keep the ones that pass. */
+  intro_points_check_certs(desc, decoded);
+  smartlist_add_all(desc_enc->intro_points, decoded);
+
  done:
   SMARTLIST_FOREACH(chunked_desc, char *, a, tor_free(a));
   smartlist_free(chunked_desc);
   SMARTLIST_FOREACH(intro_points, char *, a, tor_free(a));
   smartlist_free(intro_points);
+  smartlist_free(decoded);
 }
 
 /** Return 1 iff the given base64 encoded signature in b64_sig from the encoded
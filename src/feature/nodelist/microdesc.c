@@ -8,8 +8,10 @@
  *  less-frequently-changing router information.
  */
 
+#define MICRODESC_PRIVATE
 #include "core/or/or.h"
 
+#include "lib/crypt_ops/crypto_digest.h"
 #include "lib/fdio/fdio.h"
 
 #include "app/config/config.h"
@@ -43,8 +45,13 @@
 
 /** A data structure to hold a bunch of cached microdescriptors.  There are
  * two active files in the cache: a "cache file" that we mmap, and a "journal
- * file" that we append to.  Periodically, we rebuild the cache file to hold
- * only the microdescriptors that we want to keep */
+ * file" that we append to.  Periodically, we move the journal to the end of
+ * the cache file, or rebuild the cache file to hold only the
+ * microdescriptors that we want to keep.
+ *
+ * Next to the cache file, we keep an "index file" that lists where each
+ * microdescriptor in the cache file is, so that we can load the cache without
+ * parsing every microdescriptor in it. */
 struct microdesc_cache_t {
   /** Map from sha256-digest to microdesc_t for every microdesc_t in the
    * cache. */
@@ -54,6 +61,8 @@ struct microdesc_cache_t {
   char *cache_fname;
   /** Name of the journal file. */
   char *journal_fname;
+  /** Name of the index file for the cache file. */
+  char *index_fname;
   /** Mmap'd contents of the cache file, or NULL if there is none. */
   tor_mmap_t *cache_content;
   /** Number of bytes used in the journal file. */
@@ -267,6 +276,7 @@ get_microdesc_cache_noload(void)
     HT_INIT(microdesc_map, &cache->map);
     cache->cache_fname = get_cachedir_fname("cached-microdescs");
     cache->journal_fname = get_cachedir_fname("cached-microdescs.new");
+    cache->index_fname = get_cachedir_fname("cached-microdescs.idx");
     the_microdesc_cache = cache;
   }
   return the_microdesc_cache;
@@ -509,6 +519,181 @@ warn_if_nul_found(const char *inp, size_t len, int64_t offset,
   }
 }
 
+/* The index file for the microdescriptor cache file holds a header and a
+ * sorted array of fixed-size entries, all in network byte order:
+ *
+ *   MD_INDEX_MAGIC, including its NUL padding  [16 bytes]
+ *   Length of the cache file                   [8 bytes]
+ *   SHA256 digest of the cache file            [32 bytes]
+ *   Number of entries                          [4 bytes]
+ *   Reserved; zero                             [4 bytes]
+ *
+ * and then, for each microdescriptor in the cache file, in order of digest:
+ *
+ *   SHA256 digest of the microdescriptor       [32 bytes]
+ *   Offset of its body in the cache file       [4 bytes]
+ *   Length of its body                         [4 bytes]
+ *   Its last-listed time                       [8 bytes]
+ *
+ * We only believe an index if the cache file still has the length and digest
+ * that the index lists, so an index that is stale for any reason (a crash, or
+ * an older Tor that doesn't know about indices) gets ignored. */
+
+/** The first bytes of a microdescriptor cache index. */
+#define MD_INDEX_MAGIC "tor-md-index-1\n"
+/** The length of the MD_INDEX_MAGIC field in the index. */
+#define MD_INDEX_MAGIC_LEN 16
+/** The length of the header of a microdescriptor cache index. */
+#define MD_INDEX_HEADER_LEN (MD_INDEX_MAGIC_LEN + 8 + DIGEST256_LEN + 8)
+/** The length of each entry in a microdescriptor cache index. */
+#define MD_INDEX_ENTRY_LEN (DIGEST256_LEN + 4 + 4 + 8)
+
+/** Helper: compare two microdescriptors by digest, for smartlist_sort. */
+static int
+compare_microdescs_by_digest_(const void **a_, const void **b_)
+{
+  const microdesc_t *a = *a_, *b = *b_;
+  return fast_memcmp(a->digest, b->digest, DIGEST256_LEN);
+}
+
+/** Write the index for the cache file of <b>cache</b>, listing every
+ * microdescriptor that we have stored there.  Return 0 on success and -1 on
+ * failure. */
+STATIC int
+microdesc_cache_write_index(microdesc_cache_t *cache)
+{
+  const tor_mmap_t *mm = cache->cache_content;
+  smartlist_t *mds;
+  microdesc_t **mdp;
+  uint8_t *buf, *cp;
+  size_t len;
+  int r;
+
+  if (!mm || mm->size > UINT32_MAX)
+    return -1;
+
+  mds = smartlist_new();
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    if ((*mdp)->saved_location == SAVED_IN_CACHE)
+      smartlist_add(mds, *mdp);
+  }
+  smartlist_sort(mds, compare_microdescs_by_digest_);
+
+  len = MD_INDEX_HEADER_LEN + smartlist_len(mds) * MD_INDEX_ENTRY_LEN;
+  buf = cp = tor_malloc_zero(len);
+  memcpy(cp, MD_INDEX_MAGIC, strlen(MD_INDEX_MAGIC));
+  set_uint64(cp + 16, tor_htonll(mm->size));
+  crypto_digest256((char *) cp + 24, mm->data, mm->size, DIGEST_SHA256);
+  set_uint32(cp + 56, htonl(smartlist_len(mds)));
+  cp += MD_INDEX_HEADER_LEN;
+
+  SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+    tor_assert(md->off >= 0 && (size_t)md->off + md->bodylen <= mm->size);
+    memcpy(cp, md->digest, DIGEST256_LEN);
+    set_uint32(cp + 32, htonl((uint32_t) md->off));
+    set_uint32(cp + 36, htonl((uint32_t) md->bodylen));
+    set_uint64(cp + 40, tor_htonll((uint64_t) md->last_listed));
+    cp += MD_INDEX_ENTRY_LEN;
+  } SMARTLIST_FOREACH_END(md);
+
+  r = write_bytes_to_file(cache->index_fname, (const char *) buf, len, 1);
+  if (r < 0) {
+    log_info(LD_DIR, "Couldn't write microdescriptor cache index to %s",
+             cache->index_fname);
+  }
+
+  tor_free(buf);
+  smartlist_free(mds);
+  return r;
+}
+
+/** Try to add every microdescriptor in the cache file of <b>cache</b>,
+ * which we have just mapped, from the cache index.  We don't parse them:
+ * microdesc_cache_lookup_by_digest256() does that the first time somebody
+ * asks for each one.  Return the number of microdescriptors we added, or -1
+ * if we have no usable index (in which case we add none). */
+STATIC int
+microdesc_cache_load_index(microdesc_cache_t *cache)
+{
+  const tor_mmap_t *mm = cache->cache_content;
+  tor_mmap_t *idx;
+  const uint8_t *entries, *e;
+  char digest[DIGEST256_LEN];
+  uint32_t i, n;
+  int r = -1;
+
+  tor_assert(mm);
+
+  idx = tor_mmap_file(cache->index_fname);
+  if (!idx)
+    return -1;
+
+  if (idx->size < MD_INDEX_HEADER_LEN ||
+      fast_memneq(idx->data, MD_INDEX_MAGIC, MD_INDEX_MAGIC_LEN))
+    goto done;
+  if (tor_ntohll(get_uint64(idx->data + 16)) != mm->size)
+    goto done;
+  n = ntohl(get_uint32(idx->data + 56));
+  if ((idx->size - MD_INDEX_HEADER_LEN) % MD_INDEX_ENTRY_LEN ||
+      (idx->size - MD_INDEX_HEADER_LEN) / MD_INDEX_ENTRY_LEN != n ||
+      n > INT_MAX)
+    goto done;
+  crypto_digest256(digest, mm->data, mm->size, DIGEST_SHA256);
+  if (tor_memneq(digest, idx->data + 24, DIGEST256_LEN))
+    goto done;
+
+  /* Check every entry before we add any of them. */
+  entries = (const uint8_t *) idx->data + MD_INDEX_HEADER_LEN;
+  for (i = 0, e = entries; i < n; ++i, e += MD_INDEX_ENTRY_LEN) {
+    const uint32_t off = ntohl(get_uint32(e + 32));
+    const uint32_t bodylen = ntohl(get_uint32(e + 36));
+    if (off > mm->size || bodylen > mm->size - off ||
+        bodylen < 9 || fast_memneq(mm->data + off, "onion-key", 9))
+      goto done;
+    if (i && fast_memcmp(e - MD_INDEX_ENTRY_LEN, e, DIGEST256_LEN) >= 0)
+      goto done; /* Not sorted, or a duplicate. */
+  }
+
+  for (i = 0, e = entries; i < n; ++i, e += MD_INDEX_ENTRY_LEN) {
+    microdesc_t *md = tor_malloc_zero(sizeof(microdesc_t));
+    memcpy(md->digest, e, DIGEST256_LEN);
+    md->off = ntohl(get_uint32(e + 32));
+    md->bodylen = ntohl(get_uint32(e + 36));
+    md->body = (char *) mm->data + md->off;
+    md->last_listed = (time_t) tor_ntohll(get_uint64(e + 40));
+    md->saved_location = SAVED_IN_CACHE;
+    md->fields_pending = 1;
+
+    HT_INSERT(microdesc_map, &cache->map, md);
+    md->held_in_map = 1;
+    ++cache->n_seen;
+    cache->total_len_seen += md->bodylen;
+  }
+  r = (int) n;
+
+ done:
+  tor_munmap_file(idx);
+  return r;
+}
+
+/** We have just loaded <b>cache</b> from its index.  Give every node in the
+ * current microdesc consensus its microdescriptor, as
+ * microdescs_add_list_to_cache() does for the ones that it adds. */
+static void
+microdesc_cache_note_indexed(microdesc_cache_t *cache)
+{
+  networkstatus_t *ns = networkstatus_get_latest_consensus();
+  if (!ns || ns->flavor != FLAV_MICRODESC)
+    return;
+
+  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+    microdesc_t *md =
+      microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest);
+    if (md)
+      nodelist_add_microdesc(md);
+  } SMARTLIST_FOREACH_END(rs);
+}
+
 /** Reload the contents of <b>cache</b> from disk.  If it is empty, load it
  * for the first time.  Return 0 on success, -1 on failure. */
 int
@@ -526,12 +711,23 @@ microdesc_cache_reload(microdesc_cache_t *cache)
 
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
   if (mm) {
+    int n_indexed;
     warn_if_nul_found(mm->data, mm->size, 0, "scanning microdesc cache");
-    added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
-                                    SAVED_IN_CACHE, 0, -1, NULL);
-    if (added) {
-      total += smartlist_len(added);
-      smartlist_free(added);
+    n_indexed = microdesc_cache_load_index(cache);
+    if (n_indexed >= 0) {
+      log_info(LD_DIR, "Loaded %d microdescriptors from the cache index.",
+               n_indexed);
+      total += n_indexed;
+      microdesc_cache_note_indexed(cache);
+      if (n_indexed)
+        router_dir_info_changed();
+    } else {
+      added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
+                                      SAVED_IN_CACHE, 0, -1, NULL);
+      if (added) {
+        total += smartlist_len(added);
+        smartlist_free(added);
+      }
     }
   }
 
@@ -659,17 +855,26 @@ microdesc_cache_clean(microdesc_cache_t *cache, time_t cutoff, int force)
   }
 }
 
+/** Return true iff rebuilding the cache file of <b>cache</b> would save
+ * 1/3 or more of the space that it and the journal use. */
+static int
+should_compact_md_cache(microdesc_cache_t *cache)
+{
+  const size_t old_len =
+    cache->cache_content ? cache->cache_content->size : 0;
+  return cache->bytes_dropped > (cache->journal_len + old_len) / 3;
+}
+
 static int
 should_rebuild_md_cache(microdesc_cache_t *cache)
 {
     const size_t old_len =
       cache->cache_content ? cache->cache_content->size : 0;
     const size_t journal_len = cache->journal_len;
-    const size_t dropped = cache->bytes_dropped;
 
     if (journal_len < 16384)
       return 0; /* Don't bother, not enough has happened yet. */
-    if (dropped > (journal_len + old_len) / 3)
+    if (should_compact_md_cache(cache))
       return 1; /* We could save 1/3 or more of the currently used space. */
     if (journal_len > old_len / 2)
       return 1; /* We should append to the regular file */
@@ -697,6 +902,119 @@ microdesc_wipe_body(microdesc_t *md)
   md->no_save = 1;
 }
 
+/** Wipe the body of every microdescriptor in <b>cache</b> that we had stored
+ * in the cache file.  We do this when we've lost our mapping of the cache
+ * file, to prevent from making things worse elsewhere. */
+static void
+microdesc_cache_wipe_cached_bodies(microdesc_cache_t *cache)
+{
+  microdesc_t **mdp;
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    if (md->saved_location == SAVED_IN_CACHE) {
+      microdesc_wipe_body(md);
+    }
+  }
+}
+
+/** Append every microdescriptor in <b>cache</b> that is not yet in the cache
+ * file to the end of that file, and clear the journal file.  Unlike
+ * microdesc_cache_rebuild(), this does not rewrite the microdescriptors that
+ * are already in the cache file, so it reclaims no space.  Return 0 on
+ * success and -1 on failure. */
+STATIC int
+microdesc_cache_append_journal(microdesc_cache_t *cache)
+{
+  open_file_t *open_file;
+  microdesc_t **mdp;
+  smartlist_t *wrote;
+  const char *data;
+  int fd, ok = 1;
+
+  tor_assert(cache->cache_content);
+
+  fd = start_writing_to_file(cache->cache_fname,
+                             OPEN_FLAGS_APPEND|O_BINARY,
+                             0600, &open_file);
+  if (fd < 0)
+    return -1;
+
+  /* If the file isn't what we have mapped, our offsets would be wrong. */
+  if (tor_fd_seekend(fd) < 0 ||
+      tor_fd_getpos(fd) != (off_t) cache->cache_content->size) {
+    abort_writing_to_file(open_file);
+    return -1;
+  }
+
+  log_info(LD_DIR, "Appending to the microdescriptor cache...");
+
+  wrote = smartlist_new();
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    size_t annotation_len;
+    if (md->no_save || !md->body || md->saved_location == SAVED_IN_CACHE)
+      continue;
+    if (dump_microdescriptor(fd, md, &annotation_len) < 0) {
+      ok = 0;
+      break;
+    }
+    smartlist_add(wrote, md);
+  }
+
+  /* As in microdesc_cache_rebuild(), unmap before we finish writing. */
+  if (tor_munmap_file(cache->cache_content) != 0) {
+    log_warn(LD_FS,
+             "Failed to unmap old microdescriptor cache while appending");
+  }
+  cache->cache_content = NULL;
+
+  if (finish_writing_to_file(open_file) < 0)
+    ok = 0;
+
+  cache->cache_content = tor_mmap_file(cache->cache_fname);
+  if (!cache->cache_content) {
+    log_warn(LD_DIR, "Couldn't map microdescriptor cache %s after appending",
+             cache->cache_fname);
+    microdesc_cache_wipe_cached_bodies(cache);
+    smartlist_free(wrote);
+    return -1;
+  }
+  data = cache->cache_content->data;
+
+  /* The mapping has moved, so everything in the cache file needs a new
+   * body pointer. */
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    if (md->saved_location == SAVED_IN_CACHE)
+      md->body = (char *) data + md->off;
+  }
+  if (!ok) {
+    /* Leave the new ones in the journal: we'll rebuild the cache file. */
+    smartlist_free(wrote);
+    return -1;
+  }
+
+  SMARTLIST_FOREACH_BEGIN(wrote, microdesc_t *, md) {
+    tor_assert((size_t) md->off + md->bodylen <=
+               cache->cache_content->size);
+    tor_free(md->body);
+    md->saved_location = SAVED_IN_CACHE;
+    md->body = (char *) data + md->off;
+    tor_assert(fast_memeq(md->body, "onion-key", 9));
+  } SMARTLIST_FOREACH_END(md);
+
+  log_info(LD_DIR, "Appended %d microdescriptors to the cache.",
+           smartlist_len(wrote));
+  smartlist_free(wrote);
+
+  write_str_to_file(cache->journal_fname, "", 1);
+  cache->journal_len = 0;
+
+  microdesc_cache_write_index(cache);
+
+  return 0;
+}
+
 /** Regenerate the main cache file for <b>cache</b>, clear the journal file,
  * and update every microdesc_t in the cache with pointers to its new
  * location.  If <b>force</b> is true, do this unconditionally.  If
@@ -724,6 +1042,15 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
   if (!force && !should_rebuild_md_cache(cache))
     return 0;
 
+  /* If rebuilding wouldn't save much space, just move the journal to the
+   * end of the cache file. */
+  if (!force && cache->cache_content && !should_compact_md_cache(cache)) {
+    if (microdesc_cache_append_journal(cache) == 0)
+      return 0;
+    log_info(LD_DIR, "Couldn't append to the microdescriptor cache; "
+             "rebuilding it instead.");
+  }
+
   log_info(LD_DIR, "Rebuilding the microdescriptor cache...");
 
   orig_size = (int)(cache->cache_content ? cache->cache_content->size : 0);
@@ -786,12 +1113,7 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
              strerror(errno));
     /* Okay. Let's prevent from making things worse elsewhere. */
     cache->cache_content = NULL;
-    HT_FOREACH(mdp, microdesc_map, &cache->map) {
-      microdesc_t *md = *mdp;
-      if (md->saved_location == SAVED_IN_CACHE) {
-        microdesc_wipe_body(md);
-      }
-    }
+    microdesc_cache_wipe_cached_bodies(cache);
     smartlist_free(wrote);
     return -1;
   }
@@ -830,6 +1152,8 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
   cache->journal_len = 0;
   cache->bytes_dropped = 0;
 
+  microdesc_cache_write_index(cache);
+
   new_size = cache->cache_content ? (int)cache->cache_content->size : 0;
   log_info(LD_DIR, "Done rebuilding microdesc cache. "
            "Saved %d bytes; %d still used.",
@@ -931,6 +1255,7 @@ microdesc_free_all(void)
     microdesc_cache_clear(the_microdesc_cache);
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
+    tor_free(the_microdesc_cache->index_fname);
     tor_free(the_microdesc_cache);
   }
 
@@ -950,6 +1275,19 @@ microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const char *d)
     cache = get_microdesc_cache();
   memcpy(search.digest, d, DIGEST256_LEN);
   md = HT_FIND(microdesc_map, &cache->map, &search);
+  if (md && md->fields_pending) {
+    /* We loaded this one from the index; parse it now that we need it. */
+    md->fields_pending = 0;
+    if (microdesc_parse_body_fields(md) < 0) {
+      log_warn(LD_DIR, "Unparseable microdescriptor found in cache; "
+               "dropping it.");
+      HT_REMOVE(microdesc_map, &cache->map, md);
+      md->held_in_map = 0;
+      cache->bytes_dropped += md->bodylen;
+      microdesc_free(md);
+      return NULL;
+    }
+  }
   return md;
 }
 
@@ -56,5 +56,11 @@ void microdesc_note_outdated_dirserver(const char *relay_digest);
 int microdesc_relay_is_outdated_dirserver(const char *relay_digest);
 void microdesc_reset_outdated_dirservers_list(void);
 
+#ifdef MICRODESC_PRIVATE
+STATIC int microdesc_cache_write_index(microdesc_cache_t *cache);
+STATIC int microdesc_cache_load_index(microdesc_cache_t *cache);
+STATIC int microdesc_cache_append_journal(microdesc_cache_t *cache);
+#endif
+
 #endif /* !defined(TOR_MICRODESC_H) */
 
@@ -42,6 +42,11 @@ struct microdesc_t {
   unsigned int held_in_map : 1;
   /** True iff the exit policy for this router rejects everything. */
   unsigned int policy_is_reject_star : 1;
+  /** If true, we loaded this microdescriptor from the cache index, and have
+   * not yet parsed the fields below out of its body.
+   * microdesc_cache_lookup_by_digest256() parses them before it returns the
+   * microdescriptor. */
+  unsigned int fields_pending : 1;
   /** Reference count: how many node_ts have a reference to this microdesc? */
   unsigned int held_by_nodes;
 
@@ -1693,6 +1693,8 @@ notify_after_networkstatus_changes(void)
   reschedule_dirvote(options);
 
   nodelist_set_consensus(c);
+  /* The new consensus has new bandwidth weights. */
+  node_select_invalidate();
 
   update_consensus_networkstatus_fetch_time(now);
 
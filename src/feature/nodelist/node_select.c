@@ -26,6 +26,7 @@
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/node_select.h"
+#include "feature/nodelist/node_table.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/routerset.h"
@@ -480,12 +481,111 @@ choose_array_element_by_weight(const uint64_t *entries, int n_entries)
                            entries, n_entries, total, rand_val);
 }
 
-/** Return bw*1000, unless bw*1000 would overflow, in which case return
- * INT32_MAX. */
-static inline int32_t
-kb_to_bytes(uint32_t bw)
+/** An alias table (as in Vose's alias method) for choosing an index at
+ * random with probability proportional to a fixed set of weights, in
+ * constant time per choice. */
+struct weighted_alias_t {
+  /** Number of entries. */
+  int n;
+  /** For each entry <b>i</b>: if a random number in [0,
+   * WEIGHTED_ALIAS_SCALE) is below threshold[i], choose <b>i</b>; otherwise
+   * choose alias[i]. */
+  uint64_t *threshold;
+  /** For each entry, the index to choose when we don't choose the entry. */
+  int *alias;
+};
+
+/** The range of the random number we compare against each threshold in a
+ * weighted_alias_t.  A double can represent every integer in this range. */
+#define WEIGHTED_ALIAS_SCALE (UINT64_C(1)<<53)
+
+/** Return a new alias table for choosing from the <b>n_entries</b> elements
+ * of <b>weights</b>, with probability proportional to each element.  Return
+ * NULL if there are no entries, or if the weights are not all finite and
+ * nonnegative with a positive total. */
+STATIC weighted_alias_t *
+weighted_alias_new(const double *weights, int n_entries)
 {
-  return (bw > (INT32_MAX/1000)) ? INT32_MAX : bw*1000;
+  weighted_alias_t *wa = NULL;
+  double *scaled = NULL;
+  int *small = NULL, *large = NULL;
+  int n_small = 0, n_large = 0;
+  double total = 0.0;
+  int i;
+
+  if (n_entries < 1)
+    return NULL;
+  for (i = 0; i < n_entries; ++i) {
+    if (!(weights[i] >= 0.0) || tor_isinf(weights[i]))
+      return NULL;
+    total += weights[i];
+  }
+  if (!(total > 0.0) || tor_isinf(total))
+    return NULL;
+
+  wa = tor_malloc_zero(sizeof(weighted_alias_t));
+  wa->n = n_entries;
+  wa->threshold = tor_calloc(n_entries, sizeof(uint64_t));
+  wa->alias = tor_calloc(n_entries, sizeof(int));
+  scaled = tor_calloc(n_entries, sizeof(double));
+  small = tor_calloc(n_entries, sizeof(int));
+  large = tor_calloc(n_entries, sizeof(int));
+
+  /* Scale the weights so that they average to 1, and sort them into the
+   * ones that are too small to fill their own slot and the ones that have
+   * some left over. */
+  for (i = 0; i < n_entries; ++i) {
+    scaled[i] = weights[i] * n_entries / total;
+    wa->alias[i] = i;
+    if (scaled[i] < 1.0)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+
+  /* Fill each small slot with the excess from a large one. */
+  while (n_small && n_large) {
+    const int s = small[--n_small];
+    const int l = large[n_large-1];
+    wa->threshold[s] = (uint64_t) (scaled[s] * WEIGHTED_ALIAS_SCALE);
+    wa->alias[s] = l;
+    scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+    if (scaled[l] < 1.0) {
+      --n_large;
+      small[n_small++] = l;
+    }
+  }
+  /* Whatever is left should be exactly full, up to rounding error. */
+  while (n_large)
+    wa->threshold[large[--n_large]] = WEIGHTED_ALIAS_SCALE;
+  while (n_small)
+    wa->threshold[small[--n_small]] = WEIGHTED_ALIAS_SCALE;
+
+  tor_free(scaled);
+  tor_free(small);
+  tor_free(large);
+  return wa;
+}
+
+/** Release all storage held by <b>wa</b>. */
+STATIC void
+weighted_alias_free_(weighted_alias_t *wa)
+{
+  if (!wa)
+    return;
+  tor_free(wa->threshold);
+  tor_free(wa->alias);
+  tor_free(wa);
+}
+
+/** Choose an index at random from <b>wa</b>, with probability proportional
+ * to the weight it was built with. */
+STATIC int
+weighted_alias_choose(const weighted_alias_t *wa)
+{
+  const int idx = crypto_rand_int(wa->n);
+  const uint64_t coin = crypto_rand_uint64(WEIGHTED_ALIAS_SCALE);
+  return (coin < wa->threshold[idx]) ? idx : wa->alias[idx];
 }
 
 /** Helper function:
@@ -525,29 +625,6 @@ smartlist_choose_node_by_bandwidth_weights(const smartlist_t *sl,
   }
 }
 
-/** When weighting bridges, enforce these values as lower and upper
- * bound for believable bandwidth, because there is no way for us
- * to verify a bridge's bandwidth currently. */
-#define BRIDGE_MIN_BELIEVABLE_BANDWIDTH 20000  /* 20 kB/sec */
-#define BRIDGE_MAX_BELIEVABLE_BANDWIDTH 100000 /* 100 kB/sec */
-
-/** Return the smaller of the router's configured BandwidthRate
- * and its advertised capacity, making sure to stay within the
- * interval between bridge-min-believe-bw and
- * bridge-max-believe-bw. */
-static uint32_t
-bridge_get_advertised_bandwidth_bounded(routerinfo_t *router)
-{
-  uint32_t result = router->bandwidthcapacity;
-  if (result > router->bandwidthrate)
-    result = router->bandwidthrate;
-  if (result > BRIDGE_MAX_BELIEVABLE_BANDWIDTH)
-    result = BRIDGE_MAX_BELIEVABLE_BANDWIDTH;
-  else if (result < BRIDGE_MIN_BELIEVABLE_BANDWIDTH)
-    result = BRIDGE_MIN_BELIEVABLE_BANDWIDTH;
-  return result;
-}
-
 /**
  * We have found an instance of bug 32868: log our best guess about where the
  * routerstatus was found.
@@ -706,36 +783,32 @@ compute_weighted_bandwidths(const smartlist_t *sl,
   bandwidths = tor_calloc(smartlist_len(sl), sizeof(double));
 
   // Cycle through smartlist and total the bandwidth.
-  static int warned_missing_bw = 0;
+  const node_table_t *table = node_table_get();
   SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
     int is_exit = 0, is_guard = 0, is_dir = 0, this_bw = 0;
     double weight = 1;
     double weight_without_guard_flag = 0; /* Used for guardfraction */
     double final_weight = 0;
-    is_exit = node->is_exit && ! node->is_bad_exit;
-    is_guard = node->is_possible_guard;
-    is_dir = node_is_dir(node);
-    if (node->rs) {
-      if (!node->rs->has_bandwidth) {
-        /* This should never happen, unless all the authorities downgrade
-         * to 0.2.0 or rogue routerstatuses get inserted into our consensus. */
-        if (! warned_missing_bw) {
-          log_warn(LD_BUG,
-                 "Consensus is missing some bandwidths. Using a naive "
-                 "router selection algorithm");
-          warned_missing_bw = 1;
-        }
-        this_bw = 30000; /* Chosen arbitrarily */
-      } else {
-        this_bw = kb_to_bytes(node->rs->bandwidth_kb);
-      }
-    } else if (node->ri) {
-      /* bridge or other descriptor not in our consensus */
-      this_bw = bridge_get_advertised_bandwidth_bounded(node->ri);
+    uint16_t node_flags;
+    uint8_t guardfraction_pct = 0;
+    const int idx = node_table_get_idx(table, node);
+    if (idx >= 0) {
+      node_flags = table->flags[idx];
+      this_bw = table->bandwidth[idx];
+      guardfraction_pct = table->guardfraction_pct[idx];
     } else {
+      node_flags = node_table_compute_flags(node);
+      this_bw = node_get_weighting_bandwidth(node);
+      if (node_flags & NODE_TABLE_GUARDFRACTION)
+        guardfraction_pct = node->rs->guardfraction_percentage;
+    }
+    if (this_bw < 0) {
       /* We can't use this one. */
       continue;
     }
+    is_exit = (node_flags & NODE_TABLE_EXIT) != 0;
+    is_guard = (node_flags & NODE_TABLE_GUARD) != 0;
+    is_dir = (node_flags & NODE_TABLE_DIR) != 0;
 
     if (is_guard && is_exit) {
       weight = (is_dir ? Wdb*Wd : Wd);
@@ -768,7 +841,7 @@ compute_weighted_bandwidths(const smartlist_t *sl,
      *    N for position p proportionally to Wpf*B or Wpn*B, clients should
      *    choose N proportionally to F*Wpf*B + (1-F)*Wpn*B.
      */
-    if (node->rs && node->rs->has_guardfraction && rule != WEIGHT_FOR_GUARD) {
+    if ((node_flags & NODE_TABLE_GUARDFRACTION) && rule != WEIGHT_FOR_GUARD) {
       /* We should only have guardfraction set if the node has the Guard
          flag. */
       if (! node->rs->is_possible_guard) {
@@ -777,7 +850,7 @@ compute_weighted_bandwidths(const smartlist_t *sl,
 
       guard_get_guardfraction_bandwidth(&guardfraction_bw,
                                         this_bw,
-                                        node->rs->guardfraction_percentage);
+                                        guardfraction_pct);
 
       /* Calculate final_weight = F*Wpf*B + (1-F)*Wpn*B */
       final_weight =
@@ -932,6 +1005,157 @@ nodelist_subtract(smartlist_t *sl, const smartlist_t *excluded)
   bitarray_free(excluded_idx);
 }
 
+/** A cached alias table for choosing among every node that passes one node
+ * table mask, weighted for one rule. */
+typedef struct node_alias_entry_t {
+  /** The weighting rule we used. */
+  bandwidth_weight_rule_t rule;
+  /** The NODE_TABLE_* flags that every candidate node has. */
+  uint16_t mask;
+  /** The candidate nodes, in the order that <b>alias</b> indexes them. */
+  const node_t **nodes;
+  /** An alias table over <b>nodes</b>, or NULL if we can't choose among
+   * them this way. */
+  weighted_alias_t *alias;
+} node_alias_entry_t;
+
+/** A list of node_alias_entry_t for the node table whose serial is
+ * node_alias_cache_serial.  The weights also depend on the consensus and on
+ * our options, so we clear this list whenever either of those changes: see
+ * node_select_invalidate(). */
+static smartlist_t *node_alias_cache = NULL;
+/** The serial number of the node table that node_alias_cache was built
+ * from. */
+static uint64_t node_alias_cache_serial = 0;
+
+/** How many times will we draw from an alias table, throwing away nodes
+ * that the caller excluded, before we fall back to building a weighted list
+ * of the nodes that remain? */
+#define NODE_ALIAS_MAX_TRIES 16
+
+/** Release all storage held by <b>ent</b>. */
+static void
+node_alias_entry_free_(node_alias_entry_t *ent)
+{
+  if (!ent)
+    return;
+  tor_free(ent->nodes);
+  weighted_alias_free(ent->alias);
+  tor_free(ent);
+}
+#define node_alias_entry_free(ent) \
+  FREE_AND_NULL(node_alias_entry_t, node_alias_entry_free_, (ent))
+
+/** Release all storage held in the alias table cache. */
+static void
+node_alias_cache_clear(void)
+{
+  if (!node_alias_cache)
+    return;
+  SMARTLIST_FOREACH(node_alias_cache, node_alias_entry_t *, ent,
+                    node_alias_entry_free(ent));
+  smartlist_free(node_alias_cache);
+}
+
+/** Return a cached alias table for choosing, weighted by <b>rule</b>, among
+ * the nodes in <b>table</b> that have every flag in <b>mask</b>.  Build it
+ * first if we don't have one. */
+static const node_alias_entry_t *
+node_alias_cache_get(const node_table_t *table,
+                     bandwidth_weight_rule_t rule, uint16_t mask)
+{
+  node_alias_entry_t *ent;
+  smartlist_t *sl;
+  double *bandwidths = NULL;
+  int i;
+
+  if (node_alias_cache_serial != table->serial) {
+    node_alias_cache_clear();
+    node_alias_cache_serial = table->serial;
+  }
+  if (!node_alias_cache)
+    node_alias_cache = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(node_alias_cache, node_alias_entry_t *, e) {
+    if (e->rule == rule && e->mask == mask)
+      return e;
+  } SMARTLIST_FOREACH_END(e);
+
+  sl = smartlist_new();
+  for (i = 0; i < table->n_nodes; ++i) {
+    if ((table->flags[i] & mask) == mask)
+      smartlist_add(sl, (void *)table->nodes[i]);
+  }
+
+  ent = tor_malloc_zero(sizeof(node_alias_entry_t));
+  ent->rule = rule;
+  ent->mask = mask;
+  if (compute_weighted_bandwidths(sl, rule, &bandwidths, NULL) == 0) {
+    ent->alias = weighted_alias_new(bandwidths, smartlist_len(sl));
+    ent->nodes = tor_memdup(sl->list, smartlist_len(sl) * sizeof(node_t *));
+  }
+  tor_free(bandwidths);
+  smartlist_free(sl);
+
+  smartlist_add(node_alias_cache, ent);
+  return ent;
+}
+
+/** Try to choose a node as router_choose_random_node_helper() would, using
+ * a cached alias table for <b>flags</b> and <b>rule</b>.  We draw from every
+ * node that passes the node table's checks, and throw away any that fail
+ * the rest of router_can_choose_node() or that the caller excluded, which
+ * gives each remaining node the same chance that weighting the filtered
+ * list would.
+ *
+ * Return NULL if we can't use an alias table, or if we draw too many nodes
+ * that we have to throw away. */
+static const node_t *
+node_choose_by_alias(const smartlist_t *excludednodes,
+                     const routerset_t *excludedset,
+                     router_crn_flags_t flags,
+                     bandwidth_weight_rule_t rule)
+{
+  const bool direct_bridge =
+    (flags & CRN_DIRECT_CONN) && get_options()->UseBridges;
+  const uint16_t mask = node_table_flags_for_crn(flags, direct_bridge);
+  const node_alias_entry_t *ent =
+    node_alias_cache_get(node_table_get(), rule, mask);
+  int i;
+
+  if (!ent->alias)
+    return NULL;
+
+  for (i = 0; i < NODE_ALIAS_MAX_TRIES; ++i) {
+    const node_t *node = ent->nodes[weighted_alias_choose(ent->alias)];
+    if (excludednodes && smartlist_contains(excludednodes, node))
+      continue;
+    if (excludedset && routerset_contains_node(excludedset, node))
+      continue;
+    if (!router_can_choose_node(node, flags))
+      continue;
+    return node;
+  }
+
+  return NULL;
+}
+
+/** Forget every cached alias table.  Call this when anything that
+ * compute_weighted_bandwidths() reads, other than the node table, may have
+ * changed: the consensus bandwidth weights, or our options. */
+void
+node_select_invalidate(void)
+{
+  node_alias_cache_clear();
+}
+
+/** Release all storage held by the node selection code. */
+void
+node_select_free_all(void)
+{
+  node_alias_cache_clear();
+}
+
 /* Node selection helper for router_choose_random_node().
  *
  * Populates a node list based on <b>flags</b>, ignoring nodes in
@@ -943,9 +1167,16 @@ router_choose_random_node_helper(smartlist_t *excludednodes,
                                  router_crn_flags_t flags,
                                  bandwidth_weight_rule_t rule)
 {
-  smartlist_t *sl=smartlist_new();
+  smartlist_t *sl;
   const node_t *choice = NULL;
 
+  /* Usually we can choose from a precomputed alias table without looking
+   * at the whole nodelist. */
+  choice = node_choose_by_alias(excludednodes, excludedset, flags, rule);
+  if (choice)
+    return choice;
+
+  sl = smartlist_new();
   router_add_running_nodes_to_smartlist(sl, flags);
   log_debug(LD_CIRC,
            "We found %d running nodes.",
@@ -93,9 +93,19 @@ const routerstatus_t *router_pick_trusteddirserver(dirinfo_type_t type,
 const routerstatus_t *router_pick_fallback_dirserver(dirinfo_type_t type,
                                                      int flags);
 
+void node_select_invalidate(void);
+void node_select_free_all(void);
+
 #ifdef NODE_SELECT_PRIVATE
 STATIC int choose_array_element_by_weight(const uint64_t *entries,
                                           int n_entries);
+typedef struct weighted_alias_t weighted_alias_t;
+STATIC weighted_alias_t *weighted_alias_new(const double *weights,
+                                            int n_entries);
+STATIC void weighted_alias_free_(weighted_alias_t *wa);
+#define weighted_alias_free(wa) \
+  FREE_AND_NULL(weighted_alias_t, weighted_alias_free_, (wa))
+STATIC int weighted_alias_choose(const weighted_alias_t *wa);
 STATIC void scale_array_elements_to_u64(uint64_t *entries_out,
                                         const double *entries_in,
                                         int n_entries,
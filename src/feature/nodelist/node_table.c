@@ -0,0 +1,245 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file node_table.c
+ * \brief Keep a compact snapshot of the nodelist for path selection.
+ *
+ * Choosing a node for a circuit means looking at every node in the
+ * nodelist: first to filter out the ones we can't use (see
+ * router_can_choose_node()), then to weight the rest by bandwidth (see
+ * compute_weighted_bandwidths()).  Each of those checks reads a flag or a
+ * number from the node_t, its routerstatus_t, its routerinfo_t, or its
+ * microdesc_t, so a single pass over a full consensus touches several cache
+ * lines per node, most of them scattered across the heap.
+ *
+ * Instead, we precompute those values into a node_table_t, a set of dense
+ * arrays indexed by nodelist_idx, and rebuild it lazily whenever anything
+ * in the nodelist changes.  A filter is then a mask comparison on one
+ * 16-bit word per node.
+ *
+ * Anything that changes a node_t, or the documents it points to, in a way
+ * that matters to node_table_compute_flags() or
+ * node_get_weighting_bandwidth() must call node_table_invalidate().
+ **/
+
+#include "core/or/or.h"
+
+#include "feature/nodelist/node_select.h"
+#include "feature/nodelist/node_table.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
+
+#include "feature/nodelist/node_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+#include "feature/nodelist/routerstatus_st.h"
+
+/** The current node table, or NULL if it needs to be rebuilt. */
+static node_table_t *the_node_table = NULL;
+
+/** Release all storage held by <b>table</b>. */
+static void
+node_table_free_(node_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->nodes);
+  tor_free(table->flags);
+  tor_free(table->guardfraction_pct);
+  tor_free(table->bandwidth);
+  tor_free(table);
+}
+#define node_table_free(t) FREE_AND_NULL(node_table_t, node_table_free_, (t))
+
+/** When weighting bridges, enforce these values as lower and upper
+ * bound for believable bandwidth, because there is no way for us
+ * to verify a bridge's bandwidth currently. */
+#define BRIDGE_MIN_BELIEVABLE_BANDWIDTH 20000  /* 20 kB/sec */
+#define BRIDGE_MAX_BELIEVABLE_BANDWIDTH 100000 /* 100 kB/sec */
+
+/** Return the smaller of the router's configured BandwidthRate
+ * and its advertised capacity, making sure to stay within the
+ * interval between bridge-min-believe-bw and
+ * bridge-max-believe-bw. */
+static uint32_t
+bridge_get_advertised_bandwidth_bounded(const routerinfo_t *router)
+{
+  uint32_t result = router->bandwidthcapacity;
+  if (result > router->bandwidthrate)
+    result = router->bandwidthrate;
+  if (result > BRIDGE_MAX_BELIEVABLE_BANDWIDTH)
+    result = BRIDGE_MAX_BELIEVABLE_BANDWIDTH;
+  else if (result < BRIDGE_MIN_BELIEVABLE_BANDWIDTH)
+    result = BRIDGE_MIN_BELIEVABLE_BANDWIDTH;
+  return result;
+}
+
+/** Return bw*1000, unless bw*1000 would overflow, in which case return
+ * INT32_MAX. */
+static inline int32_t
+kb_to_bytes(uint32_t bw)
+{
+  return (bw > (INT32_MAX/1000)) ? INT32_MAX : bw*1000;
+}
+
+/** Return the bandwidth, in bytes, that we should use for <b>node</b> when
+ * weighting it for path selection, or -1 if we have no way to weight it. */
+int32_t
+node_get_weighting_bandwidth(const node_t *node)
+{
+  static int warned_missing_bw = 0;
+
+  if (node->rs) {
+    if (!node->rs->has_bandwidth) {
+      /* This should never happen, unless all the authorities downgrade
+       * to 0.2.0 or rogue routerstatuses get inserted into our consensus. */
+      if (! warned_missing_bw) {
+        log_warn(LD_BUG,
+                 "Consensus is missing some bandwidths. Using a naive "
+                 "router selection algorithm");
+        warned_missing_bw = 1;
+      }
+      return 30000; /* Chosen arbitrarily */
+    }
+    return kb_to_bytes(node->rs->bandwidth_kb);
+  } else if (node->ri) {
+    /* bridge or other descriptor not in our consensus */
+    return (int32_t) bridge_get_advertised_bandwidth_bounded(node->ri);
+  }
+  /* We can't use this one. */
+  return -1;
+}
+
+/** Return the NODE_TABLE_* flags that describe <b>node</b>.
+ *
+ * The checks behind NODE_TABLE_USABLE, and the ones that the other flags
+ * stand in for, must stay in sync with router_can_choose_node(). */
+uint16_t
+node_table_compute_flags(const node_t *node)
+{
+  uint16_t flags = 0;
+
+  if (node->is_running && node->is_valid &&
+      !(node->rs && !routerstatus_version_supports_extend2_cells(node->rs,
+                                                                 1)) &&
+      !((node->ri || node->md) && !node_has_curve25519_onion_key(node)) &&
+      !node_allows_single_hop_exits(node))
+    flags |= NODE_TABLE_USABLE;
+
+  if (node->is_stable)
+    flags |= NODE_TABLE_STABLE;
+  if (node->is_fast)
+    flags |= NODE_TABLE_FAST;
+  if (node->is_possible_guard)
+    flags |= NODE_TABLE_GUARD;
+  if (!node->ri || node->ri->purpose == ROUTER_PURPOSE_GENERAL)
+    flags |= NODE_TABLE_PURPOSE_GENERAL;
+  if (!node->ri || node->ri->purpose == ROUTER_PURPOSE_BRIDGE)
+    flags |= NODE_TABLE_PURPOSE_BRIDGE;
+  if (node_supports_v3_rendezvous_point(node))
+    flags |= NODE_TABLE_RENDEZVOUS_V3;
+  if (node_supports_conflux(node))
+    flags |= NODE_TABLE_CONFLUX;
+  if (node_supports_initiating_ipv6_extends(node))
+    flags |= NODE_TABLE_IPV6_EXTEND;
+  if (node->is_exit && !node->is_bad_exit)
+    flags |= NODE_TABLE_EXIT;
+  if (node_is_dir(node))
+    flags |= NODE_TABLE_DIR;
+  if (node->rs && node->rs->has_guardfraction)
+    flags |= NODE_TABLE_GUARDFRACTION;
+
+  return flags;
+}
+
+/** Return the NODE_TABLE_* flags that a node must have for
+ * router_can_choose_node() to accept it given the CRN_* flags in
+ * <b>crn_flags</b>, leaving aside the checks that depend on our
+ * configuration.  If <b>direct_bridge</b> is true, we're picking a bridge to
+ * connect to directly. */
+uint16_t
+node_table_flags_for_crn(int crn_flags, bool direct_bridge)
+{
+  uint16_t mask = NODE_TABLE_USABLE | NODE_TABLE_PURPOSE_GENERAL;
+
+  if (direct_bridge)
+    mask |= NODE_TABLE_PURPOSE_BRIDGE;
+  if (crn_flags & CRN_NEED_UPTIME)
+    mask |= NODE_TABLE_STABLE;
+  if (crn_flags & CRN_NEED_CAPACITY)
+    mask |= NODE_TABLE_FAST;
+  if (crn_flags & CRN_NEED_GUARD)
+    mask |= NODE_TABLE_GUARD;
+  if (crn_flags & CRN_RENDEZVOUS_V3)
+    mask |= NODE_TABLE_RENDEZVOUS_V3;
+  if (crn_flags & CRN_CONFLUX)
+    mask |= NODE_TABLE_CONFLUX;
+  if (crn_flags & CRN_INITIATE_IPV6_EXTEND)
+    mask |= NODE_TABLE_IPV6_EXTEND;
+
+  return mask;
+}
+
+/** Build and return a new node table for the current nodelist. */
+static node_table_t *
+node_table_build(void)
+{
+  static uint64_t last_serial = 0;
+  const smartlist_t *nodes = nodelist_get_list();
+  node_table_t *table = tor_malloc_zero(sizeof(node_table_t));
+  const int n = smartlist_len(nodes);
+
+  table->serial = ++last_serial;
+  table->n_nodes = n;
+  table->nodes = tor_calloc(n ? n : 1, sizeof(const node_t *));
+  table->flags = tor_calloc(n ? n : 1, sizeof(uint16_t));
+  table->guardfraction_pct = tor_calloc(n ? n : 1, sizeof(uint8_t));
+  table->bandwidth = tor_calloc(n ? n : 1, sizeof(int32_t));
+
+  SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
+    table->nodes[node_sl_idx] = node;
+    table->flags[node_sl_idx] = node_table_compute_flags(node);
+    table->bandwidth[node_sl_idx] = node_get_weighting_bandwidth(node);
+    if (node->rs && node->rs->has_guardfraction)
+      table->guardfraction_pct[node_sl_idx] =
+        node->rs->guardfraction_percentage;
+  } SMARTLIST_FOREACH_END(node);
+
+  return table;
+}
+
+/** Return the node table for the current nodelist, building it first if
+ * anything has changed since it was last built. */
+const node_table_t *
+node_table_get(void)
+{
+  if (!the_node_table)
+    the_node_table = node_table_build();
+  return the_node_table;
+}
+
+/** Return the index of <b>node</b> in <b>table</b>, or -1 if <b>table</b> is
+ * NULL or doesn't describe <b>node</b>. */
+int
+node_table_get_idx(const node_table_t *table, const node_t *node)
+{
+  const int idx = node->nodelist_idx;
+  if (table && idx >= 0 && idx < table->n_nodes && table->nodes[idx] == node)
+    return idx;
+  return -1;
+}
+
+/** Note that some node in the nodelist has changed, so that the node table
+ * needs to be rebuilt before it is next used. */
+void
+node_table_invalidate(void)
+{
+  node_table_free(the_node_table);
+}
+
+/** Release all storage held by the node table. */
+void
+node_table_free_all(void)
+{
+  node_table_free(the_node_table);
+}
@@ -0,0 +1,86 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file node_table.h
+ * \brief Header file for node_table.c.
+ **/
+
+#ifndef TOR_NODE_TABLE_H
+#define TOR_NODE_TABLE_H
+
+#include <stdbool.h>
+
+/**
+ * @name Node table flags
+ *
+ * Bits in node_table_t.flags.  Each one records a property of a node that
+ * router_can_choose_node() or compute_weighted_bandwidths() would otherwise
+ * look up through the node's routerstatus, routerinfo or microdescriptor.
+ **/
+/**@{*/
+/** The node is running and valid, can handle EXTEND2 and ntor, and doesn't
+ * allow single-hop exits: it passes every check that router_can_choose_node()
+ * makes regardless of flags. */
+#define NODE_TABLE_USABLE           (1u<<0)
+/** The node has the Stable flag. */
+#define NODE_TABLE_STABLE           (1u<<1)
+/** The node has the Fast flag. */
+#define NODE_TABLE_FAST             (1u<<2)
+/** The node has the Guard flag. */
+#define NODE_TABLE_GUARD            (1u<<3)
+/** The node has no routerinfo, or one with the general purpose. */
+#define NODE_TABLE_PURPOSE_GENERAL  (1u<<4)
+/** The node has no routerinfo, or one with the bridge purpose. */
+#define NODE_TABLE_PURPOSE_BRIDGE   (1u<<5)
+/** The node can be a v3 onion service rendezvous point. */
+#define NODE_TABLE_RENDEZVOUS_V3    (1u<<6)
+/** The node supports conflux. */
+#define NODE_TABLE_CONFLUX          (1u<<7)
+/** The node can initiate IPv6 extends. */
+#define NODE_TABLE_IPV6_EXTEND      (1u<<8)
+/** The node has the Exit flag and not the BadExit flag. */
+#define NODE_TABLE_EXIT             (1u<<9)
+/** The node is a directory cache. */
+#define NODE_TABLE_DIR              (1u<<10)
+/** The node's routerstatus has a guardfraction. */
+#define NODE_TABLE_GUARDFRACTION    (1u<<11)
+/**@}*/
+
+/**
+ * A struct-of-arrays snapshot of the nodelist, holding the properties of
+ * each node that path selection filters and weights by.  Entry <b>i</b> of
+ * each array describes the node with nodelist_idx <b>i</b>.
+ *
+ * Path selection runs over every node in the consensus many times per
+ * circuit; keeping these values in small dense arrays saves it from
+ * following several pointers for each node.
+ **/
+typedef struct node_table_t {
+  /** A number that is different for every table we build, so that callers
+   * can tell when values they derived from an older table are stale. */
+  uint64_t serial;
+  /** Number of entries in each array. */
+  int n_nodes;
+  /** The node that each entry describes. */
+  const struct node_t **nodes;
+  /** NODE_TABLE_* flags for each node. */
+  uint16_t *flags;
+  /** Guardfraction percentage for each node, if it has one. */
+  uint8_t *guardfraction_pct;
+  /** The bandwidth, in bytes, to weight each node by, or -1 if we have
+   * none. */
+  int32_t *bandwidth;
+} node_table_t;
+
+const node_table_t *node_table_get(void);
+void node_table_invalidate(void);
+void node_table_free_all(void);
+
+uint16_t node_table_compute_flags(const struct node_t *node);
+int32_t node_get_weighting_bandwidth(const struct node_t *node);
+uint16_t node_table_flags_for_crn(int crn_flags, bool direct_bridge);
+int node_table_get_idx(const node_table_t *table,
+                       const struct node_t *node);
+
+#endif /* !defined(TOR_NODE_TABLE_H) */
@@ -59,6 +59,7 @@
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/node_select.h"
+#include "feature/nodelist/node_table.h"
 #include "feature/nodelist/nodefamily.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerlist.h"
@@ -256,6 +257,7 @@ node_get_or_create(const char *identity_digest)
 
   smartlist_add(the_nodelist->nodes, node);
   node->nodelist_idx = smartlist_len(the_nodelist->nodes) - 1;
+  node_table_invalidate();
 
   node->country = -1;
 
@@ -601,6 +603,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  node_table_invalidate();
 
   node_add_to_ed25519_map(node);
 
@@ -657,6 +660,7 @@ nodelist_add_microdesc(microdesc_t *md)
 
   node->md = md;
   md->held_by_nodes++;
+  node_table_invalidate();
   /* Setting the HSDir index requires the ed25519 identity key which can
    * only be found either in the ri or md. This is why this is called here.
    * Only nodes supporting HSDir=2 protocol version needs this index. */
@@ -780,6 +784,9 @@ nodelist_set_consensus(const networkstatus_t *ns)
     } SMARTLIST_FOREACH_END(node);
   }
 
+  /* Every node's flags and routerstatus may have changed. */
+  node_table_invalidate();
+
   /* If the consensus is live, note down the consensus valid-after that formed
    * the nodelist. */
   if (networkstatus_is_live(ns, approx_time())) {
@@ -812,6 +819,7 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
   if (node && node->md == md) {
     node->md = NULL;
     md->held_by_nodes--;
+    node_table_invalidate();
     if (! node_get_ed25519_id(node)) {
       node_remove_from_ed25519_map(node);
     }
@@ -825,6 +833,7 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    node_table_invalidate();
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
@@ -855,6 +864,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+  node_table_invalidate();
 }
 
 /** Return a newly allocated smartlist of the nodes that have <b>md</b> as
@@ -922,6 +932,9 @@ nodelist_purge(void)
 void
 nodelist_free_all(void)
 {
+  node_table_free_all();
+  node_select_free_all();
+
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
@@ -2479,6 +2492,7 @@ void
 router_dir_info_changed(void)
 {
   need_to_update_have_min_dir_info = 1;
+  node_table_invalidate();
   hs_service_dir_info_changed();
   hs_client_dir_info_changed();
 }
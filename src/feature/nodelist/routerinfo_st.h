@@ -61,6 +61,10 @@ struct routerinfo_t {
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
+  /** A compiled copy of exit_policy, or NULL if we haven't built one or
+   * couldn't.  Built on first use by
+   * compare_tor_addr_to_router_exit_policy(). */
+  struct addr_policy_trie_t *exit_policy_trie;
   long uptime; /**< How many seconds the router claims to have been up */
   smartlist_t *declared_family; /**< Nicknames of router which this router
                                  * claims are its family. */
@@ -89,6 +93,9 @@ struct routerinfo_t {
    * this routerinfo. Used only during voting. */
   unsigned int omit_from_vote:1;
 
+  /** True iff we have tried to build exit_policy_trie. */
+  unsigned int exit_policy_trie_built:1;
+
   /** Flags to summarize the protocol versions for this routerinfo_t. */
   protover_summary_flags_t pv;
 
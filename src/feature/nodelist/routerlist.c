@@ -69,6 +69,7 @@
 #include "core/or/circuituse.h"
 #include "core/or/extendinfo.h"
 #include "core/or/policies.h"
+#include "core/or/policy_trie.h"
 #include "feature/client/bridges.h"
 #include "feature/control/control_events.h"
 #include "feature/dirauth/authmode.h"
@@ -85,6 +86,7 @@
 #include "feature/nodelist/microdesc.h"
 #include "feature/nodelist/networkstatus.h"
 #include "feature/nodelist/node_select.h"
+#include "feature/nodelist/node_table.h"
 #include "feature/nodelist/nodelist.h"
 #include "feature/nodelist/routerinfo.h"
 #include "feature/nodelist/routerlist.h"
@@ -140,6 +142,7 @@ static int signed_desc_digest_is_recognized(signed_descriptor_t *desc);
 static const char *signed_descriptor_get_body_impl(
                                               const signed_descriptor_t *desc,
                                               int with_annotations);
+static bool router_can_choose_node_by_config(const node_t *node, int flags);
 
 /****************************************************************************/
 
@@ -549,62 +552,47 @@ routers_have_same_or_addrs(const routerinfo_t *r1, const routerinfo_t *r2)
 bool
 router_can_choose_node(const node_t *node, int flags)
 {
-  /* The full set of flags used for node selection. */
-  const bool need_uptime = (flags & CRN_NEED_UPTIME) != 0;
-  const bool need_capacity = (flags & CRN_NEED_CAPACITY) != 0;
-  const bool need_guard = (flags & CRN_NEED_GUARD) != 0;
+  const bool direct_conn = (flags & CRN_DIRECT_CONN) != 0;
+  const bool direct_bridge = direct_conn && get_options()->UseBridges;
+  const uint16_t mask = node_table_flags_for_crn(flags, direct_bridge);
+  const node_table_t *table = node_table_get();
+  const int idx = node_table_get_idx(table, node);
+  const uint16_t node_flags = (idx >= 0) ? table->flags[idx] :
+    node_table_compute_flags(node);
+
+  /* The node table covers: whether the node is running and valid; its
+   * purpose; the Stable, Fast, and Guard flags; whether it can handle
+   * EXTEND2 and ntor; whether it allows single hop exits; and whether it
+   * can be a v3 rendezvous point, do conflux, or initiate IPv6 extends. */
+  if ((node_flags & mask) != mask)
+    return false;
+
+  return router_can_choose_node_by_config(node, flags);
+}
+
+/** Helper for router_can_choose_node(): return true iff <b>node</b> passes
+ * the checks that depend on our configuration, given the CRN_* flags in
+ * <b>flags</b>. */
+static bool
+router_can_choose_node_by_config(const node_t *node, int flags)
+{
   const bool need_desc = (flags & CRN_NEED_DESC) != 0;
   const bool pref_addr = (flags & CRN_PREF_ADDR) != 0;
   const bool direct_conn = (flags & CRN_DIRECT_CONN) != 0;
-  const bool rendezvous_v3 = (flags & CRN_RENDEZVOUS_V3) != 0;
-  const bool initiate_ipv6_extend = (flags & CRN_INITIATE_IPV6_EXTEND) != 0;
-  const bool need_conflux = (flags & CRN_CONFLUX) != 0;
-
-  const or_options_t *options = get_options();
-  const bool check_reach =
-    !router_or_conn_should_skip_reachable_address_check(options, pref_addr);
-  const bool direct_bridge = direct_conn && options->UseBridges;
 
-  if (!node->is_running || !node->is_valid)
-    return false;
   if (need_desc && !node_has_preferred_descriptor(node, direct_conn))
     return false;
-  if (node->ri) {
-    if (direct_bridge && node->ri->purpose != ROUTER_PURPOSE_BRIDGE)
-      return false;
-    else if (node->ri->purpose != ROUTER_PURPOSE_GENERAL)
-      return false;
-  }
-  if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
-    return false;
-  /* Don't choose nodes if we are certain they can't do EXTEND2 cells */
-  if (node->rs && !routerstatus_version_supports_extend2_cells(node->rs, 1))
-    return false;
-  /* Don't choose nodes if we are certain they can't do ntor. */
-  if ((node->ri || node->md) && !node_has_curve25519_onion_key(node))
-    return false;
-  /* Exclude relays that allow single hop exit circuits. This is an
-   * obsolete option since 0.2.9.2-alpha and done by default in
-   * 0.3.1.0-alpha. */
-  if (node_allows_single_hop_exits(node))
-    return false;
-  /* Exclude relays that can not become a rendezvous for a hidden service
-   * version 3. */
-  if (rendezvous_v3 &&
-      !node_supports_v3_rendezvous_point(node))
-    return false;
-  /* Exclude relay that don't do conflux if requested. */
-  if (need_conflux && !node_supports_conflux(node)) {
-    return false;
-  }
-  /* Choose a node with an OR address that matches the firewall rules */
-  if (direct_conn && check_reach &&
-      !reachable_addr_allows_node(node,
+  if (direct_conn) {
+    const or_options_t *options = get_options();
+    const bool check_reach =
+      !router_or_conn_should_skip_reachable_address_check(options, pref_addr);
+    /* Choose a node with an OR address that matches the firewall rules */
+    if (check_reach &&
+        !reachable_addr_allows_node(node,
                                     FIREWALL_OR_CONNECTION,
                                     pref_addr))
-    return false;
-  if (initiate_ipv6_extend && !node_supports_initiating_ipv6_extends(node))
-    return false;
+      return false;
+  }
 
   return true;
 }
@@ -617,11 +605,21 @@ router_can_choose_node(const node_t *node, int flags)
 void
 router_add_running_nodes_to_smartlist(smartlist_t *sl, int flags)
 {
-  SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
-    if (!router_can_choose_node(node, flags))
+  const bool direct_conn = (flags & CRN_DIRECT_CONN) != 0;
+  const bool direct_bridge = direct_conn && get_options()->UseBridges;
+  const uint16_t mask = node_table_flags_for_crn(flags, direct_bridge);
+  const node_table_t *table = node_table_get();
+  const uint16_t *node_flags = table->flags;
+  const int n_nodes = table->n_nodes;
+  int i;
+
+  for (i = 0; i < n_nodes; ++i) {
+    if ((node_flags[i] & mask) != mask)
+      continue;
+    if (!router_can_choose_node_by_config(table->nodes[i], flags))
       continue;
-    smartlist_add(sl, (void *)node);
-  } SMARTLIST_FOREACH_END(node);
+    smartlist_add(sl, (void *)table->nodes[i]);
+  }
 }
 
 /** Look through the routerlist until we find a router that has my key.
@@ -941,6 +939,7 @@ routerinfo_free_(routerinfo_t *router)
     smartlist_free(router->declared_family);
   }
   addr_policy_list_free(router->exit_policy);
+  addr_policy_trie_free(router->exit_policy_trie);
   short_policy_free(router->ipv6_exit_policy);
 
   memset(router, 77, sizeof(routerinfo_t));
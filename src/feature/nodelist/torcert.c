@@ -244,31 +244,80 @@ int
 tor_cert_checksig(tor_cert_t *cert,
                   const ed25519_public_key_t *pubkey, time_t now)
 {
-  ed25519_checkable_t checkable;
-  int okay;
-  time_t expires = TIME_MAX;
+  return tor_cert_checksig_batch(&cert, &pubkey, 1, now, NULL) < 0 ? -1 : 0;
+}
 
-  if (tor_cert_get_checkable_sig(&checkable, cert, pubkey, &expires) < 0)
-    return -1;
+/** As tor_cert_checksig(), but check each of the <b>n_certs</b> certificates
+ * in <b>certs</b> against the corresponding key in <b>pubkeys</b>, verifying
+ * all of their signatures in a single batch.  (Any entry in <b>pubkeys</b>
+ * may be NULL, as with tor_cert_checksig().)
+ *
+ * If <b>okay_out</b> is provided, set its i'th element to 1 if the i'th
+ * certificate is valid, and to 0 otherwise.  Return 0 if every certificate
+ * was valid; otherwise return -N, where N is the number of invalid
+ * certificates.  Sets flags in each certificate as appropriate.
+ */
+int
+tor_cert_checksig_batch(tor_cert_t **certs,
+                        const ed25519_public_key_t **pubkeys,
+                        int n_certs, time_t now, int *okay_out)
+{
+  ed25519_checkable_t *checkable = NULL;
+  int *idx = NULL, *okay = NULL;
+  int i, n_checkable = 0, n_bad = 0;
 
-  if (now && now > expires) {
-    cert->cert_expired = 1;
-    return -1;
+  if (n_certs <= 0)
+    return 0;
+
+  checkable = tor_calloc(n_certs, sizeof(ed25519_checkable_t));
+  /* idx[j] is the certificate for the j'th entry in checkable. */
+  idx = tor_calloc(n_certs, sizeof(int));
+  okay = tor_calloc(n_certs, sizeof(int));
+
+  for (i = 0; i < n_certs; ++i) {
+    tor_cert_t *cert = certs[i];
+    time_t expires = TIME_MAX;
+    if (okay_out)
+      okay_out[i] = 0;
+    if (tor_cert_get_checkable_sig(&checkable[n_checkable], cert,
+                                   pubkeys[i], &expires) < 0) {
+      ++n_bad;
+      continue;
+    }
+    if (now && now > expires) {
+      cert->cert_expired = 1;
+      ++n_bad;
+      continue;
+    }
+    idx[n_checkable++] = i;
   }
 
-  if (ed25519_checksig_batch(&okay, &checkable, 1) < 0) {
-    cert->sig_bad = 1;
-    return -1;
-  } else {
+  if (n_checkable)
+    ed25519_checksig_batch(okay, checkable, n_checkable);
+
+  for (i = 0; i < n_checkable; ++i) {
+    tor_cert_t *cert = certs[idx[i]];
+    if (! okay[i]) {
+      cert->sig_bad = 1;
+      ++n_bad;
+      continue;
+    }
     cert->sig_ok = 1;
     /* Only copy the checkable public key when it is different from the signing
      * key of the certificate to avoid undefined behavior. */
-    if (cert->signing_key.pubkey != checkable.pubkey->pubkey) {
-      memcpy(cert->signing_key.pubkey, checkable.pubkey->pubkey, 32);
+    if (cert->signing_key.pubkey != checkable[i].pubkey->pubkey) {
+      memcpy(cert->signing_key.pubkey, checkable[i].pubkey->pubkey, 32);
     }
     cert->cert_valid = 1;
-    return 0;
+    if (okay_out)
+      okay_out[idx[i]] = 1;
   }
+
+  memwipe(checkable, 0, n_certs * sizeof(ed25519_checkable_t));
+  tor_free(checkable);
+  tor_free(idx);
+  tor_free(okay);
+  return -n_bad;
 }
 
 /** Return a string describing the status of the signature on <b>cert</b>
@@ -82,6 +82,9 @@ int tor_cert_get_checkable_sig(ed25519_checkable_t *checkable_out,
 
 int tor_cert_checksig(tor_cert_t *cert,
                       const ed25519_public_key_t *pubkey, time_t now);
+int tor_cert_checksig_batch(tor_cert_t **certs,
+                            const ed25519_public_key_t **pubkeys,
+                            int n_certs, time_t now, int *okay_out);
 const char *tor_cert_describe_signature_status(const tor_cert_t *cert);
 
 MOCK_DECL(tor_cert_t *,tor_cert_dup,(const tor_cert_t *cert));
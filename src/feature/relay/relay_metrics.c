@@ -19,6 +19,7 @@
 #include "core/or/circuitlist.h"
 #include "core/or/dos.h"
 #include "core/or/relay.h"
+#include "core/or/scheduler.h"
 
 #include "app/config/config.h"
 
@@ -63,6 +64,8 @@ static void fill_est_intro_cells(void);
 static void fill_est_rend_cells(void);
 static void fill_intro1_cells(void);
 static void fill_rend1_cells(void);
+static void fill_kist_run_interval(void);
+static void fill_cell_queue_delay(void);
 
 /** The base metrics that is a static array of metrics added to the metrics
  * store.
@@ -217,6 +220,20 @@ static const relay_metrics_entry_t base_metrics[] =
     .help = "Total number of REND1 cells we received",
     .fill_fn = fill_rend1_cells,
   },
+  {
+    .key = RELAY_METRICS_KIST_RUN_INTERVAL,
+    .type = METRICS_TYPE_GAUGE,
+    .name = METRICS_NAME(relay_kist_run_interval_msec),
+    .help = "Current interval between KIST scheduler runs in milliseconds",
+    .fill_fn = fill_kist_run_interval,
+  },
+  {
+    .key = RELAY_METRICS_CELL_QUEUE_DELAY,
+    .type = METRICS_TYPE_HISTOGRAM,
+    .name = METRICS_NAME(relay_cell_queue_delay_msec),
+    .help = "Time cells spent in circuit queues in milliseconds",
+    .fill_fn = fill_cell_queue_delay,
+  },
 };
 static const size_t num_base_metrics = ARRAY_LENGTH(base_metrics);
 
@@ -1200,6 +1217,39 @@ fill_rend1_cells(void)
   }
 }
 
+/** Fill function for the RELAY_METRICS_KIST_RUN_INTERVAL metric. */
+static void
+fill_kist_run_interval(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_KIST_RUN_INTERVAL];
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, 0, NULL);
+  metrics_store_entry_update(sentry, scheduler_kist_get_run_interval());
+}
+
+/** Fill function for the RELAY_METRICS_CELL_QUEUE_DELAY metric. */
+static void
+fill_cell_queue_delay(void)
+{
+  metrics_store_entry_t *sentry;
+  const relay_metrics_entry_t *rentry =
+    &base_metrics[RELAY_METRICS_CELL_QUEUE_DELAY];
+  uint64_t bucket_values[KIST_QUEUE_DELAY_N_BUCKETS];
+  uint64_t count;
+  int64_t sum;
+
+  scheduler_kist_get_queue_delays(bucket_values, &count, &sum);
+
+  sentry = metrics_store_add(the_store, rentry->type, rentry->name,
+                             rentry->help, KIST_QUEUE_DELAY_N_BUCKETS,
+                             kist_queue_delay_buckets);
+  metrics_store_hist_entry_set(sentry, bucket_values,
+                               KIST_QUEUE_DELAY_N_BUCKETS, count, sum);
+}
+
 /** Reset the global store and fill it with all the metrics from base_metrics
  * and their associated values.
  *
@@ -57,6 +57,10 @@ typedef enum {
   RELAY_METRICS_NUM_INTRO1_CELLS,
   /** Number of times we received a REND1 cell */
   RELAY_METRICS_NUM_REND1_CELLS,
+  /** Current KIST scheduler run interval. */
+  RELAY_METRICS_KIST_RUN_INTERVAL,
+  /** Time cells spent in circuit queues. */
+  RELAY_METRICS_CELL_QUEUE_DELAY,
 } relay_metrics_key_t;
 
 /** The metadata of a relay metric. */
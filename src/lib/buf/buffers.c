@@ -350,6 +350,27 @@ buf_drain(buf_t *buf, size_t n)
   check();
 }
 
+/** Remove the tail chunk of <b>buf</b>, which must be empty, and make
+ * <b>prev</b>, the chunk before it, the new tail.  If <b>prev</b> is NULL,
+ * the tail chunk must also be the head. */
+void
+buf_remove_empty_tail(buf_t *buf, chunk_t *prev)
+{
+  chunk_t *victim = buf->tail;
+  tor_assert(victim);
+  tor_assert(victim->datalen == 0);
+  if (prev) {
+    tor_assert(prev->next == victim);
+    prev->next = NULL;
+  } else {
+    tor_assert(buf->head == victim);
+    buf->head = NULL;
+  }
+  buf->tail = prev;
+  buf_chunk_free_unchecked(victim);
+  check();
+}
+
 /** Create and return a new buf with default chunk capacity <b>size</b>.
  */
 buf_t *
@@ -629,6 +650,19 @@ buf_peek(const buf_t *buf, char *string, size_t string_len)
   }
 }
 
+/** If the first <b>n</b> bytes of <b>buf</b> are all stored together in its
+ * first chunk, return a pointer to them, without copying.  The pointer is
+ * only valid until the next change to <b>buf</b>.  Otherwise, return NULL:
+ * the caller should use buf_peek() or buf_get_bytes() instead.
+ */
+const char *
+buf_peek_contiguous(const buf_t *buf, size_t n)
+{
+  if (!buf->head || buf->head->datalen < n)
+    return NULL;
+  return buf->head->data;
+}
+
 /** Remove <b>string_len</b> bytes from the front of <b>buf</b>, and store
  * them into <b>string</b>.  Return the new buffer size.  <b>string_len</b>
  * must be \<= the number of bytes on the buffer.
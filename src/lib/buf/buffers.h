@@ -48,6 +48,7 @@ void buf_add_vprintf(buf_t *buf, const char *format, va_list args)
 int buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
 size_t buf_move_all(buf_t *buf_out, buf_t *buf_in);
 void buf_peek(const buf_t *buf, char *string, size_t string_len);
+const char *buf_peek_contiguous(const buf_t *buf, size_t n);
 void buf_drain(buf_t *buf, size_t n);
 int buf_get_bytes(buf_t *buf, char *string, size_t string_len);
 int buf_get_line(buf_t *buf, char *data_out, size_t *data_len);
@@ -100,6 +101,7 @@ struct buf_t {
 };
 
 chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
+void buf_remove_empty_tail(buf_t *buf, chunk_t *prev);
 /** If a read onto the end of a chunk would be smaller than this number, then
  * just start a new chunk. */
 #define MIN_READ_LEN 8
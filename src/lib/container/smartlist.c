@@ -717,6 +717,31 @@ smartlist_heapify(smartlist_t *sl,
   }
 }
 
+/** Helper. <b>sl</b> may have at most one violation of the heap property:
+ * the item at <b>idx</b> may be less than its parent.  Restore the heap
+ * property, and return the item's new index. */
+static inline int
+smartlist_heap_sift_up(smartlist_t *sl,
+                       int (*compare)(const void *a, const void *b),
+                       ptrdiff_t idx_field_offset,
+                       int idx)
+{
+  while (idx) {
+    int parent = PARENT(idx);
+    if (compare(sl->list[idx], sl->list[parent]) < 0) {
+      void *tmp = sl->list[parent];
+      sl->list[parent] = sl->list[idx];
+      sl->list[idx] = tmp;
+      UPDATE_IDX(parent);
+      UPDATE_IDX(idx);
+      idx = parent;
+    } else {
+      break;
+    }
+  }
+  return idx;
+}
+
 /** Insert <b>item</b> into the heap stored in <b>sl</b>, where order is
  * determined by <b>compare</b> and the offset of the item in the heap is
  * stored in an int-typed field at position <b>idx_field_offset</b> within
@@ -728,23 +753,10 @@ smartlist_pqueue_add(smartlist_t *sl,
                      ptrdiff_t idx_field_offset,
                      void *item)
 {
-  int idx;
   smartlist_add(sl,item);
   UPDATE_IDX(sl->num_used-1);
 
-  for (idx = sl->num_used - 1; idx; ) {
-    int parent = PARENT(idx);
-    if (compare(sl->list[idx], sl->list[parent]) < 0) {
-      void *tmp = sl->list[parent];
-      sl->list[parent] = sl->list[idx];
-      sl->list[idx] = tmp;
-      UPDATE_IDX(parent);
-      UPDATE_IDX(idx);
-      idx = parent;
-    } else {
-      return;
-    }
-  }
+  smartlist_heap_sift_up(sl, compare, idx_field_offset, sl->num_used - 1);
 }
 
 /** Remove and return the top-priority item from the heap stored in <b>sl</b>,
@@ -797,6 +809,24 @@ smartlist_pqueue_remove(smartlist_t *sl,
   }
 }
 
+/** Move the item <b>item</b> to its new place in the heap stored in
+ * <b>sl</b> after its priority has changed, where order is determined by
+ * <b>compare</b> and the item's position is stored at position
+ * <b>idx_field_offset</b> within the item.  This is cheaper than removing
+ * the item and adding it again. */
+void
+smartlist_pqueue_update(smartlist_t *sl,
+                        int (*compare)(const void *a, const void *b),
+                        ptrdiff_t idx_field_offset,
+                        void *item)
+{
+  int idx = IDX_OF_ITEM(item);
+  tor_assert(idx >= 0);
+  tor_assert(sl->list[idx] == item);
+  idx = smartlist_heap_sift_up(sl, compare, idx_field_offset, idx);
+  smartlist_heapify(sl, compare, idx_field_offset, idx);
+}
+
 /** Assert that the heap property is correctly maintained by the heap stored
  * in <b>sl</b>, where order is determined by <b>compare</b>. */
 void
@@ -82,6 +82,10 @@ void smartlist_pqueue_remove(smartlist_t *sl,
                              int (*compare)(const void *a, const void *b),
                              ptrdiff_t idx_field_offset,
                              void *item);
+void smartlist_pqueue_update(smartlist_t *sl,
+                             int (*compare)(const void *a, const void *b),
+                             ptrdiff_t idx_field_offset,
+                             void *item);
 void smartlist_pqueue_assert_ok(smartlist_t *sl,
                                 int (*compare)(const void *a, const void *b),
                                 ptrdiff_t idx_field_offset);
@@ -19,6 +19,7 @@
 #include "lib/log/util_bug.h"
 #include "lib/cc/torint.h"
 #include "lib/crypt_ops/aes.h"
+#include "lib/intmath/cmp.h"
 
 #include <string.h>
 
@@ -128,6 +129,29 @@ crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *buf, size_t len)
   aes_crypt_inplace(env, buf, len);
 }
 
+/** Apply the cipher in <b>env</b> in place to each of the <b>n_bufs</b>
+ * buffers in <b>bufs</b>, each of which is <b>len</b> bytes long.  The
+ * result is the same as calling crypto_cipher_crypt_inplace() on each buffer
+ * in turn: the counter and any unused keystream carry over from one buffer
+ * to the next, so we never need to copy the buffers together.
+ */
+void
+crypto_cipher_crypt_inplace_multi(crypto_cipher_t *env, char **bufs,
+                                  size_t len, int n_bufs)
+{
+  int i;
+
+  tor_assert(env);
+  tor_assert(bufs || n_bufs == 0);
+  tor_assert(n_bufs >= 0);
+  tor_assert(len < SIZE_T_CEILING);
+
+  if (len == 0)
+    return;
+  for (i = 0; i < n_bufs; ++i)
+    aes_crypt_inplace(env, bufs[i], len);
+}
+
 /** Encrypt <b>fromlen</b> bytes (at least 1) from <b>from</b> with the key in
  * <b>key</b> to the buffer in <b>to</b> of length
  * <b>tolen</b>. <b>tolen</b> must be at least <b>fromlen</b> plus
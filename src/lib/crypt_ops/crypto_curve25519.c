@@ -40,7 +40,13 @@
 #ifdef USE_CURVE25519_DONNA
 int curve25519_donna(uint8_t *mypublic,
                      const uint8_t *secret, const uint8_t *basepoint);
-#endif
+int curve25519_donna_batch(uint8_t **mypublic,
+                           const uint8_t *const *secret,
+                           const uint8_t *const *basepoint, int n);
+/** The largest batch that curve25519_donna_batch() accepts.  This must
+ * match CURVE25519_DONNA_MAX_BATCH in the donna sources. */
+#define CURVE25519_IMPL_MAX_BATCH 16
+#endif /* defined(USE_CURVE25519_DONNA) */
 #ifdef USE_CURVE25519_NACL
 #ifdef HAVE_CRYPTO_SCALARMULT_CURVE25519_H
 #include <crypto_scalarmult_curve25519.h>
@@ -81,6 +87,49 @@ curve25519_impl(uint8_t *output, const uint8_t *secret,
   return r;
 }
 
+/**
+ * Helper function: for each i < n, compute the scalar "secrets[i]" times
+ * the point "points[i]", and store the result in "outputs[i]", as
+ * curve25519_impl() would.
+ *
+ * When our backend supports it, we do the multiplications in groups that
+ * share a single field inversion, which saves most of the cost of one
+ * inversion per extra multiplication.
+ **/
+STATIC void
+curve25519_impl_batch(uint8_t **outputs, const uint8_t *const *secrets,
+                      const uint8_t *const *points, int n)
+{
+#ifdef USE_CURVE25519_DONNA
+  uint8_t bp[CURVE25519_IMPL_MAX_BATCH][CURVE25519_PUBKEY_LEN];
+  const uint8_t *bpp[CURVE25519_IMPL_MAX_BATCH];
+  int i, j, n_this;
+
+  for (i = 0; i < n; i += n_this) {
+    n_this = n - i;
+    if (n_this > CURVE25519_IMPL_MAX_BATCH)
+      n_this = CURVE25519_IMPL_MAX_BATCH;
+    if (n_this == 1) {
+      curve25519_impl(outputs[i], secrets[i], points[i]);
+      continue;
+    }
+    for (j = 0; j < n_this; ++j) {
+      memcpy(bp[j], points[i+j], CURVE25519_PUBKEY_LEN);
+      /* Clear the high bit, in case our backend foolishly looks at it. */
+      bp[j][31] &= 0x7f;
+      bpp[j] = bp[j];
+    }
+    curve25519_donna_batch(outputs + i, secrets + i, bpp, n_this);
+  }
+  memwipe(bp, 0, sizeof(bp));
+#else /* !defined(USE_CURVE25519_DONNA) */
+  int i;
+  for (i = 0; i < n; ++i) {
+    curve25519_impl(outputs[i], secrets[i], points[i]);
+  }
+#endif /* defined(USE_CURVE25519_DONNA) */
+}
+
 /**
  * Helper function: Multiply the scalar "secret" by the Curve25519
  * basepoint (X=9), and store the result in "output".  Return 0 on
@@ -272,6 +321,32 @@ curve25519_handshake(uint8_t *output,
   curve25519_impl(output, skey->secret_key, pkey->public_key);
 }
 
+/** Perform <b>n</b> curve25519 ECDH handshakes at once: for each i < n,
+ * do the handshake with <b>skeys</b>[i] and <b>pkeys</b>[i], writing
+ * CURVE25519_OUTPUT_LEN bytes of output into <b>outputs</b>[i].
+ *
+ * The results are the same as calling curve25519_handshake() n times, but
+ * this is faster when you have more than one handshake to do. */
+void
+curve25519_handshake_batch(uint8_t **outputs,
+                           const curve25519_secret_key_t *const *skeys,
+                           const curve25519_public_key_t *const *pkeys,
+                           int n)
+{
+  const uint8_t *secrets[CURVE25519_HANDSHAKE_MAX_BATCH];
+  const uint8_t *points[CURVE25519_HANDSHAKE_MAX_BATCH];
+  int i;
+
+  tor_assert(n >= 0);
+  tor_assert(n <= CURVE25519_HANDSHAKE_MAX_BATCH);
+
+  for (i = 0; i < n; ++i) {
+    secrets[i] = skeys[i]->secret_key;
+    points[i] = pkeys[i]->public_key;
+  }
+  curve25519_impl_batch(outputs, secrets, points, n);
+}
+
 /** Check whether the ed25519-based curve25519 basepoint optimization seems to
  * be working. If so, return 0; otherwise return -1. */
 static int
@@ -58,6 +58,14 @@ void curve25519_handshake(uint8_t *output,
                           const curve25519_secret_key_t *,
                           const curve25519_public_key_t *);
 
+/** The largest number of handshakes that curve25519_handshake_batch() will
+ * do in one call. */
+#define CURVE25519_HANDSHAKE_MAX_BATCH 64
+void curve25519_handshake_batch(uint8_t **outputs,
+                                const curve25519_secret_key_t *const *skeys,
+                                const curve25519_public_key_t *const *pkeys,
+                                int n);
+
 int curve25519_keypair_write_to_file(const curve25519_keypair_t *keypair,
                                      const char *fname,
                                      const char *tag);
@@ -73,6 +81,9 @@ STATIC int curve25519_impl(uint8_t *output, const uint8_t *secret,
                            const uint8_t *basepoint);
 
 STATIC int curve25519_basepoint_impl(uint8_t *output, const uint8_t *secret);
+STATIC void curve25519_impl_batch(uint8_t **outputs,
+                                  const uint8_t *const *secrets,
+                                  const uint8_t *const *points, int n);
 #endif /* defined(CRYPTO_CURVE25519_PRIVATE) */
 
 int curve25519_public_from_base64(curve25519_public_key_t *pkey,
@@ -329,3 +329,98 @@ timer_disable(tor_timer_t *t)
   /* We don't reschedule the libevent timer here, since it's okay if it fires
    * early. */
 }
+
+/**
+ * Allocate and return a new timer wheel, whose current time is <b>now</b>.
+ *
+ * Unlike the timers above, those on a timer wheel are not tied to the event
+ * loop or to monotime_get(): the owner of the wheel picks the unit of time
+ * and tells it what time it is with timer_wheel_run(), which is when the
+ * timers that have expired fire.  This is useful for deadlines that we only
+ * need to check every so often, with work proportional to the number of
+ * deadlines that have passed rather than to the number of deadlines.
+ *
+ * A timer on a wheel must only ever be scheduled or disabled with the
+ * timer_wheel_*() functions, and must be disabled with timer_wheel_disable()
+ * before it is freed.
+ */
+tor_timer_wheel_t *
+timer_wheel_new(uint64_t now)
+{
+  timeout_error_t err = 0;
+  tor_timer_wheel_t *wheel = timeouts_open(0, &err);
+  if (!wheel) {
+    // LCOV_EXCL_START -- this can only fail on malloc failure.
+    log_err(LD_BUG, "Unable to open timer wheel: %s", strerror(err));
+    tor_assert(0);
+    // LCOV_EXCL_STOP
+  }
+  timeouts_update(wheel, now);
+  return wheel;
+}
+
+/**
+ * Release all storage held by <b>wheel</b>.  Does not fire timers; the ones
+ * that were scheduled on it are disabled, but not freed.
+ */
+void
+timer_wheel_free_(tor_timer_wheel_t *wheel)
+{
+  struct timeouts_it it = TIMEOUTS_IT_INITIALIZER(TIMEOUTS_ALL);
+  tor_timer_t *t;
+
+  if (!wheel)
+    return;
+
+  while ((t = timeouts_next(wheel, &it))) {
+    timeouts_del(wheel, t);
+  }
+  timeouts_close(wheel);
+}
+
+/**
+ * Schedule the timer <b>t</b> on <b>wheel</b> to fire at the first call to
+ * timer_wheel_run() with a time of at least <b>when</b>.
+ */
+void
+timer_wheel_schedule(tor_timer_wheel_t *wheel, tor_timer_t *t, uint64_t when)
+{
+  const timeout_t cur = timeouts_get_curtime(wheel);
+  timeouts_add(wheel, t, when > cur ? when - cur : 0);
+}
+
+/**
+ * Cancel the timer <b>t</b> on <b>wheel</b> if it is currently scheduled.
+ * (It's okay to call this on an unscheduled timer.)
+ */
+void
+timer_wheel_disable(tor_timer_wheel_t *wheel, tor_timer_t *t)
+{
+  timeouts_del(wheel, t);
+}
+
+/**
+ * Set the current time of <b>wheel</b> to <b>now</b>, and run the callbacks
+ * of every timer on it that has expired, in no particular order.  The
+ * callbacks may schedule timers on <b>wheel</b>, including their own; a
+ * timer that they schedule for no later than <b>now</b> fires again during
+ * this call.
+ *
+ * If <b>now</b> is before the current time of <b>wheel</b> (say, because
+ * the wall clock jumped backwards), every timer on it expires.
+ */
+void
+timer_wheel_run(tor_timer_wheel_t *wheel, uint64_t now)
+{
+  tor_timer_t *t;
+  monotime_t now_mono;
+
+  timeouts_update(wheel, now);
+  if (!timeouts_expired(wheel))
+    return;
+
+  monotime_get(&now_mono);
+  while ((t = timeouts_get(wheel))) {
+    t->callback.cb(t, t->callback.arg, &now_mono);
+  }
+}
@@ -29,6 +29,16 @@ void timer_free_(tor_timer_t *t);
 void timers_initialize(void);
 void timers_shutdown(void);
 
+typedef struct timeouts tor_timer_wheel_t;
+tor_timer_wheel_t *timer_wheel_new(uint64_t now);
+void timer_wheel_free_(tor_timer_wheel_t *wheel);
+#define timer_wheel_free(w) \
+  FREE_AND_NULL(tor_timer_wheel_t, timer_wheel_free_, (w))
+void timer_wheel_schedule(tor_timer_wheel_t *wheel, tor_timer_t *t,
+                          uint64_t when);
+void timer_wheel_disable(tor_timer_wheel_t *wheel, tor_timer_t *t);
+void timer_wheel_run(tor_timer_wheel_t *wheel, uint64_t now);
+
 #ifdef TOR_TIMERS_PRIVATE
 STATIC void timers_run_pending(void);
 #endif
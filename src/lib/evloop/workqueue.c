@@ -13,9 +13,24 @@
  * is a workqueue_entry_t, containing data to process and a function to
  * process it with.
  *
- * The main thread informs the worker threads of pending work by using a
- * condition variable.  The workers inform the main process of completed work
- * by using an alert_sockets_t object, as implemented in net/alertsock.c.
+ * Each worker thread has its own queues of pending work, one for each
+ * priority, with its own lock.  The main thread puts new work on a random
+ * thread's queues, and each thread takes work from its own queues first,
+ * and then steals from the other threads' queues, so that a busy thread
+ * never holds up work that an idle one could do.  Pool-wide counts of the
+ * work pending at each priority let every thread choose which priority to
+ * work on as if there were a single queue.  Threads with nothing to do
+ * sleep on a condition variable, which the main thread signals only when
+ * some thread is asleep.  The workers inform the main process of completed
+ * work by using an alert_sockets_t object, as implemented in
+ * net/alertsock.c.
+ *
+ * Where we have C11 atomics, the workers put their answers on the reply
+ * queue without taking a lock: each one pushes onto a singly linked stack
+ * with compare-and-swap, and the main thread takes the whole stack at once
+ * with an atomic exchange.  Only the worker that finds the stack empty needs
+ * to write to the alert socket; everyone else knows that the main thread is
+ * already going to look.
  *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
@@ -52,19 +67,31 @@ typedef struct work_tailq_t work_tailq_t;
 
 struct threadpool_t {
   /** An array of pointers to workerthread_t: one for each running worker
-   * thread. */
+   * thread.
+   *
+   * This array and <b>n_threads</b> are only written by
+   * threadpool_start_threads(), which runs once, from threadpool_new(),
+   * before anybody can queue work.  The main thread wrote them itself, and
+   * each worker takes <b>lock</b> before it looks at them, after they were
+   * written with <b>lock</b> held.  So once the pool is running, they
+   * never change, and anybody can read them without the lock. */
   struct workerthread_t **threads;
 
-  /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
+  /** Condition variable that idle threads wait on, and which gets signaled
+   * when we add work or an update. */
   tor_cond_t condition;
-  /** Queues of pending work that we have to do. The queue with priority
-   * <b>p</b> is work[p]. */
-  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
+  /** How many threads are waiting on <b>condition</b>? Only changed while
+   * holding <b>lock</b>. */
+  atomic_counter_t n_idle;
+  /** How many items of work of priority <b>p</b> are pending, across all
+   * the threads' queues?  Only changed while holding the lock for the
+   * thread whose queue changed. */
+  atomic_counter_t n_pending[WORKQUEUE_N_PRIORITIES];
 
   /** The current 'update generation' of the threadpool.  Any thread that is
-   * at an earlier generation needs to run the update function. */
-  unsigned generation;
+   * at an earlier generation needs to run the update function.  Only
+   * changed while holding <b>lock</b>. */
+  atomic_counter_t generation;
 
   /** Function that should be run for updates on each thread. */
   workqueue_reply_t (*update_fn)(void *, void *);
@@ -76,9 +103,10 @@ struct threadpool_t {
   struct event *reply_event;
   void (*reply_cb)(threadpool_t *);
 
-  /** Number of elements in threads. */
+  /** Number of elements in threads.  See <b>threads</b> for why we can
+   * read this without the lock. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Mutex to protect all the above fields, except where noted. */
   tor_mutex_t lock;
 
   /** A reply queue to use when constructing new threads. */
@@ -103,7 +131,11 @@ struct workqueue_entry_t {
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_t *on_pool;
-  /** True iff this entry is waiting for a worker to start processing it. */
+  /** The thread on whose queue we put this entry.  (Another thread may
+   * steal it from there.) */
+  struct workerthread_t *on_thread;
+  /** True iff this entry is waiting for a worker to start processing it.
+   * Protected by the lock of <b>on_thread</b>. */
   uint8_t pending;
   /** Priority of this entry. */
   workqueue_priority_bitfield_t priority : WORKQUEUE_PRIORITY_BITS;
@@ -113,13 +145,23 @@ struct workqueue_entry_t {
   void (*reply_fn)(void *arg);
   /** Argument for the above functions. */
   void *arg;
+#ifdef HAVE_WORKING_STDATOMIC
+  /** The next (older) answer on the same reply queue. */
+  struct workqueue_entry_t *next_reply;
+#endif
 };
 
 struct replyqueue_t {
+#ifdef HAVE_WORKING_STDATOMIC
+  /** Stack of answers that the reply queue needs to handle, most recent
+   * first.  Workers push onto it; only the main thread takes from it. */
+  _Atomic(workqueue_entry_t *) answers;
+#else
   /** Mutex to protect the answers field */
   tor_mutex_t lock;
   /** Doubly-linked list of answers that the reply queue needs to handle. */
   TOR_TAILQ_HEAD(, workqueue_entry_t) answers;
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
 
   /** Mechanism to wake up the main thread when it is receiving answers. */
   alert_sockets_t alert;
@@ -136,8 +178,13 @@ typedef struct workerthread_t {
   void *state;
   /** Reply queue to which we pass our results. */
   replyqueue_t *reply_queue;
+  /** Mutex to protect <b>work</b>. */
+  tor_mutex_t lock;
+  /** Queues of pending work that this thread (or another thread, stealing)
+   * should do.  The queue with priority <b>p</b> is work[p]. */
+  work_tailq_t work[WORKQUEUE_N_PRIORITIES];
   /** The current update generation of this thread */
-  unsigned generation;
+  size_t generation;
   /** One over the probability of taking work from a lower-priority queue. */
   int32_t lower_priority_chance;
 } workerthread_t;
@@ -195,14 +242,16 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
+  workerthread_t *thread = ent->on_thread;
+  tor_mutex_acquire(&thread->lock);
   workqueue_priority_t prio = ent->priority;
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work[prio], ent, next_work);
+    TOR_TAILQ_REMOVE(&thread->work[prio], ent, next_work);
+    atomic_counter_sub(&ent->on_pool->n_pending[prio], 1);
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&thread->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -210,54 +259,125 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
+/** Return true iff <b>thread</b> has not yet run its pool's latest update
+ * function. */
+static int
+worker_thread_needs_update(workerthread_t *thread)
+{
+  return thread->generation !=
+    atomic_counter_get(&thread->in_pool->generation);
+}
 
-   must hold lock */
+/** Return true iff <b>thread</b> has anything to do: either an update to
+ * run, or work pending on any thread's queue. */
 static int
 worker_thread_has_work(workerthread_t *thread)
 {
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    if (!TOR_TAILQ_EMPTY(&thread->in_pool->work[i]))
+    if (atomic_counter_get(&thread->in_pool->n_pending[i]))
         return 1;
   }
-  return thread->generation != thread->in_pool->generation;
+  return worker_thread_needs_update(thread);
 }
 
-/** Extract the next workqueue_entry_t from the the thread's pool, removing
- * it from the relevant queues and marking it as non-pending.
- *
- * The caller must hold the lock. */
-static workqueue_entry_t *
-worker_thread_extract_next_work(workerthread_t *thread)
+/** Return the priority of the work that <b>thread</b> should do next, or -1
+ * if no work is pending. */
+static int
+worker_thread_choose_priority(workerthread_t *thread)
 {
   threadpool_t *pool = thread->in_pool;
-  work_tailq_t *queue = NULL, *this_queue;
+  int chosen = -1;
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    this_queue = &pool->work[i];
-    if (!TOR_TAILQ_EMPTY(this_queue)) {
-      queue = this_queue;
+    if (atomic_counter_get(&pool->n_pending[i])) {
+      chosen = i;
       if (! crypto_fast_rng_one_in_n(get_thread_fast_rng(),
                                      thread->lower_priority_chance)) {
         /* Usually we'll just break now, so that we can get out of the loop
-         * and use the queue where we found work. But with a small
+         * and use the priority where we found work. But with a small
          * probability, we'll keep looking for lower priority work, so that
          * we don't ignore our low-priority queues entirely. */
         break;
       }
     }
   }
+  return chosen;
+}
+
+/** Remove the first workqueue_entry_t of priority <b>prio</b> from
+ * <b>victim</b>'s queue, mark it as non-pending, and return it.  Return NULL
+ * if there is no such entry. */
+static workqueue_entry_t *
+worker_thread_take_work(workerthread_t *victim, workqueue_priority_t prio)
+{
+  workqueue_entry_t *work;
+  tor_mutex_acquire(&victim->lock);
+  work = TOR_TAILQ_FIRST(&victim->work[prio]);
+  if (work) {
+    TOR_TAILQ_REMOVE(&victim->work[prio], work, next_work);
+    atomic_counter_sub(&victim->in_pool->n_pending[prio], 1);
+    work->pending = 0;
+  }
+  tor_mutex_release(&victim->lock);
+  return work;
+}
+
+/** Put <b>work</b>, which a thread has taken but not started, back at the
+ * front of the queue where it was. */
+static void
+worker_thread_return_work(workqueue_entry_t *work)
+{
+  workerthread_t *thread = work->on_thread;
+  tor_mutex_acquire(&thread->lock);
+  TOR_TAILQ_INSERT_HEAD(&thread->work[work->priority], work, next_work);
+  atomic_counter_add(&work->on_pool->n_pending[work->priority], 1);
+  work->pending = 1;
+  tor_mutex_release(&thread->lock);
+}
 
-  if (queue == NULL)
+/** Extract the next workqueue_entry_t for <b>thread</b> to do, removing it
+ * from the relevant queues and marking it as non-pending.  We look in the
+ * thread's own queues first, then steal from the other threads.  Return
+ * NULL if we found nothing (perhaps because another thread got there
+ * first). */
+static workqueue_entry_t *
+worker_thread_extract_next_work(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  workqueue_entry_t *work;
+  int prio = worker_thread_choose_priority(thread);
+  int i;
+
+  if (prio < 0)
     return NULL;
 
-  workqueue_entry_t *work = TOR_TAILQ_FIRST(queue);
-  TOR_TAILQ_REMOVE(queue, work, next_work);
-  work->pending = 0;
+  work = worker_thread_take_work(thread, prio);
+  for (i = 1; work == NULL && i < pool->n_threads; ++i) {
+    workerthread_t *victim =
+      pool->threads[(thread->index + i) % pool->n_threads];
+    work = worker_thread_take_work(victim, prio);
+  }
   return work;
 }
 
+/** Run the latest update function for <b>thread</b>'s pool, and return its
+ * result. */
+static workqueue_reply_t
+worker_thread_run_update(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+
+  tor_mutex_acquire(&pool->lock);
+  void *arg = pool->update_args[thread->index];
+  pool->update_args[thread->index] = NULL;
+  workqueue_reply_t (*update_fn)(void*,void*) = pool->update_fn;
+  thread->generation = atomic_counter_get(&pool->generation);
+  tor_mutex_release(&pool->lock);
+
+  return update_fn(thread->state, arg);
+}
+
 /**
  * Main function for the worker thread.
  */
@@ -269,35 +389,30 @@ worker_thread_main(void *thread_)
   workqueue_entry_t *work;
   workqueue_reply_t result;
 
+  /* Wait for threadpool_start_threads() to finish, so that all the threads
+   * that we might steal from are there, and so that we see pool->threads
+   * and pool->n_threads as it left them. */
   tor_mutex_acquire(&pool->lock);
+  tor_mutex_release(&pool->lock);
+
   while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
-
-        workqueue_reply_t r = update_fn(thread->state, arg);
-
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
-
-        tor_mutex_acquire(&pool->lock);
-        continue;
+    if (worker_thread_needs_update(thread)) {
+      if (worker_thread_run_update(thread) != WQ_RPL_REPLY) {
+        return;
       }
-      work = worker_thread_extract_next_work(thread);
-      if (BUG(work == NULL))
-        break;
-      tor_mutex_release(&pool->lock);
+      continue;
+    }
 
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
+    work = worker_thread_extract_next_work(thread);
+    if (work && worker_thread_needs_update(thread)) {
+      /* An update arrived while we were looking for work.  The work might
+       * have been queued after the update, so run the update first. */
+      worker_thread_return_work(work);
+      continue;
+    }
+
+    if (work) {
+      /* We run the work function without holding any lock. */
       result = work->fn(thread->state, work->arg);
 
       /* Queue the reply for the main thread. */
@@ -307,17 +422,23 @@ worker_thread_main(void *thread_)
       if (result != WQ_RPL_REPLY) {
         return;
       }
-      tor_mutex_acquire(&pool->lock);
+      continue;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
 
     /* TODO: support an idle-function */
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    /* Okay. Now, wait till somebody has work for us.  We count ourselves as
+     * idle before checking for work one last time: whoever queues work
+     * after that check will see the count, and signal us. */
+    tor_mutex_acquire(&pool->lock);
+    atomic_counter_add(&pool->n_idle, 1);
+    if (!worker_thread_has_work(thread)) {
+      if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
+        log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+      }
     }
+    atomic_counter_sub(&pool->n_idle, 1);
+    tor_mutex_release(&pool->lock);
   }
 }
 
@@ -327,10 +448,22 @@ static void
 queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
 {
   int was_empty;
+#ifdef HAVE_WORKING_STDATOMIC
+  workqueue_entry_t *head = atomic_load_explicit(&queue->answers,
+                                                 memory_order_relaxed);
+  do {
+    work->next_reply = head;
+  } while (!atomic_compare_exchange_weak_explicit(&queue->answers,
+                                                  &head, work,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+  was_empty = (head == NULL);
+#else /* !defined(HAVE_WORKING_STDATOMIC) */
   tor_mutex_acquire(&queue->lock);
   was_empty = TOR_TAILQ_EMPTY(&queue->answers);
   TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
   tor_mutex_release(&queue->lock);
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
 
   if (was_empty) {
     if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
@@ -350,11 +483,16 @@ workerthread_new(int32_t lower_priority_chance,
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
   thr->lower_priority_chance = lower_priority_chance;
+  tor_mutex_init_nonrecursive(&thr->lock);
+  for (int i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
+    TOR_TAILQ_INIT(&thr->work[i]);
+  }
 
   if (spawn_func(worker_thread_main, thr) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
     log_err(LD_GENERAL, "Can't launch worker thread.");
+    tor_mutex_uninit(&thr->lock);
     tor_free(thr);
     return NULL;
     //LCOV_EXCL_STOP
@@ -396,17 +534,25 @@ threadpool_queue_work_priority(threadpool_t *pool,
              ((int)prio) <= WORKQUEUE_PRIORITY_LAST);
 
   workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
+  workerthread_t *thread = pool->threads[
+    crypto_fast_rng_get_uint(get_thread_fast_rng(), pool->n_threads)];
   ent->on_pool = pool;
+  ent->on_thread = thread;
   ent->pending = 1;
   ent->priority = prio;
 
-  tor_mutex_acquire(&pool->lock);
-
-  TOR_TAILQ_INSERT_TAIL(&pool->work[prio], ent, next_work);
-
-  tor_cond_signal_one(&pool->condition);
-
-  tor_mutex_release(&pool->lock);
+  tor_mutex_acquire(&thread->lock);
+  TOR_TAILQ_INSERT_TAIL(&thread->work[prio], ent, next_work);
+  atomic_counter_add(&pool->n_pending[prio], 1);
+  tor_mutex_release(&thread->lock);
+
+  /* If any thread is idle, wake one up.  The others are busy, and will
+   * find this work (here, or on their own queues) when they're done. */
+  if (atomic_counter_get(&pool->n_idle)) {
+    tor_mutex_acquire(&pool->lock);
+    tor_cond_signal_one(&pool->condition);
+    tor_mutex_release(&pool->lock);
+  }
 
   return ent;
 }
@@ -464,7 +610,7 @@ threadpool_queue_update(threadpool_t *pool,
   pool->update_args = new_args;
   pool->free_update_arg_fn = free_fn;
   pool->update_fn = fn;
-  ++pool->generation;
+  atomic_counter_add(&pool->generation, 1);
 
   tor_cond_signal_all(&pool->condition);
 
@@ -492,12 +638,16 @@ threadpool_queue_update(threadpool_t *pool,
 #define CHANCE_PERMISSIVE 37
 #define CHANCE_STRICT INT32_MAX
 
-/** Launch threads until we have <b>n</b>. */
+/** Launch threads until we have <b>n</b>.  Only call this from
+ * threadpool_new(): other threads read pool->threads without the lock, so
+ * we can't grow it once they're running. */
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
   if (BUG(n < 0))
     return -1; // LCOV_EXCL_LINE
+  if (BUG(pool->n_threads > 0))
+    return -1; // LCOV_EXCL_LINE
   if (n > MAX_THREADS)
     n = MAX_THREADS;
 
@@ -551,9 +701,11 @@ threadpool_new(int n_threads,
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
   tor_cond_init(&pool->condition);
+  atomic_counter_init(&pool->n_idle);
+  atomic_counter_init(&pool->generation);
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
-    TOR_TAILQ_INIT(&pool->work[i]);
+    atomic_counter_init(&pool->n_pending[i]);
   }
 
   pool->new_thread_state_fn = new_thread_state_fn;
@@ -598,8 +750,12 @@ replyqueue_new(uint32_t alertsocks_flags)
     //LCOV_EXCL_STOP
   }
 
+#ifdef HAVE_WORKING_STDATOMIC
+  atomic_init(&rq->answers, NULL);
+#else
   tor_mutex_init(&rq->lock);
   TOR_TAILQ_INIT(&rq->answers);
+#endif
 
   return rq;
 }
@@ -659,6 +815,31 @@ replyqueue_process(replyqueue_t *queue)
     //LCOV_EXCL_STOP
   }
 
+#ifdef HAVE_WORKING_STDATOMIC
+  workqueue_entry_t *stack;
+  /* Take everything that the workers have pushed so far.  Anything pushed
+   * after this finds the stack empty, and alerts us again. */
+  while ((stack = atomic_exchange_explicit(&queue->answers, NULL,
+                                           memory_order_acquire))) {
+    /* The stack is newest-first: reverse it, so that we handle answers in
+     * the order they arrived. */
+    workqueue_entry_t *work, *answers = NULL;
+    while (stack) {
+      work = stack;
+      stack = work->next_reply;
+      work->next_reply = answers;
+      answers = work;
+    }
+    while (answers) {
+      work = answers;
+      answers = work->next_reply;
+      work->on_pool = NULL;
+
+      work->reply_fn(work->arg);
+      workqueue_entry_free(work);
+    }
+  }
+#else /* !defined(HAVE_WORKING_STDATOMIC) */
   tor_mutex_acquire(&queue->lock);
   while (!TOR_TAILQ_EMPTY(&queue->answers)) {
     /* lock must be held at this point.*/
@@ -674,6 +855,7 @@ replyqueue_process(replyqueue_t *queue)
   }
 
   tor_mutex_release(&queue->lock);
+#endif /* defined(HAVE_WORKING_STDATOMIC) */
 }
 
 /** Return the number of threads configured for the given pool. */
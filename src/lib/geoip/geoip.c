@@ -13,14 +13,19 @@
  * statistical functions, which collect statistics about different kinds of
  * per-country usage.
  *
- * The geoip lookup tables are implemented as sorted lists of disjoint address
- * ranges, each mapping to a singleton geoip_country_t.  These country objects
- * are also indexed by their names in a hashtable.
+ * The geoip files list disjoint address ranges, each mapping to a singleton
+ * geoip_country_t.  These country objects are also indexed by their names in
+ * a hashtable.  We look addresses up in a packed geoip_table_t: a sorted
+ * array of the start of each range, covering the whole address space, with a
+ * parallel array of countries, and a directory that tells us, for each value
+ * of the first 16 bits of an address, which few ranges it could fall in.
  *
  * The tables are populated from disk at startup by the geoip_load_file()
  * function.  For more information on the file format they read, see that
  * function.  See the scripts and the README file in src/config for more
- * information about how those files are generated.
+ * information about how those files are generated.  Since parsing those
+ * files takes a while, geoip_load_file_with_cache() can also save the
+ * packed table to a cache file, and map it from there on the next startup.
  *
  * Tor uses GeoIP information in order to implement user requests (such as
  * ExcludeNodes {cc}), and to keep track of how much usage relays are getting
@@ -29,6 +34,7 @@
 
 #define GEOIP_PRIVATE
 #include "lib/geoip/geoip.h"
+#include "lib/arch/bytes.h"
 #include "lib/container/map.h"
 #include "lib/container/order.h"
 #include "lib/container/smartlist.h"
@@ -36,6 +42,7 @@
 #include "lib/ctime/di_ops.h"
 #include "lib/encoding/binascii.h"
 #include "lib/fs/files.h"
+#include "lib/fs/mmap.h"
 #include "lib/log/escape.h"
 #include "lib/malloc/malloc.h"
 #include "lib/net/address.h" //????
@@ -48,8 +55,6 @@
 #include <stdio.h>
 #include <string.h>
 
-static void init_geoip_countries(void);
-
 /** An entry from the GeoIP IPv4 file: maps an IPv4 range to a country. */
 typedef struct geoip_ipv4_entry_t {
   uint32_t ip_low; /**< The lowest IP in the range, in host order */
@@ -64,18 +69,110 @@ typedef struct geoip_ipv6_entry_t {
   intptr_t country; /**< An index into geoip_countries */
 } geoip_ipv6_entry_t;
 
+/** Number of entries in the directory of a geoip_table_t: one for each value
+ * of the first 16 bits of an address, and one more at the end. */
+#define GEOIP_DIR_LEN ((1<<16) + 1)
+
+/** A packed table mapping every address of one family to a country.
+ *
+ * The table splits the address space into ranges, each one starting where the
+ * last one ended, and ending where the next one starts.  We keep the start of
+ * each range in one array and its country in another.  To find an address,
+ * we look up its first 16 bits in <b>dir</b>, which narrows it down to a few
+ * ranges, and binary-search those.
+ *
+ * All of these arrays live in one contiguous image, laid out as described in
+ * geoip_table_image_layout(), so that we can write it to a cache file and
+ * map it back in later. */
+typedef struct geoip_table_t {
+  /** Address family of this table. */
+  sa_family_t family;
+  /** Number of ranges in the table.  Always at least 1. */
+  uint32_t n_ranges;
+  /** For each value <b>p</b> of the first 16 bits of an address, the index of
+   * the range that holds the lowest address starting with <b>p</b>.  The
+   * final entry is n_ranges - 1. */
+  const uint32_t *dir;
+  /** For an IPv4 table, the first address of each range, in host order. */
+  const uint32_t *keys4;
+  /** For an IPv6 table, the first address of each range, as two 64-bit
+   * halves in host order, high half first. */
+  const uint64_t *keys6;
+  /** For each range, the index of its country in the table's own country
+   * list. */
+  const uint16_t *countries;
+  /** Number of countries in the table's own country list. */
+  uint32_t n_countries;
+  /** For each country in the table's own country list, its index in
+   * geoip_countries. */
+  int *country_map;
+  /** The image holding the table, if we built it in memory. */
+  char *image;
+  /** The mapped cache file holding the table, if we loaded it from one. */
+  tor_mmap_t *mapping;
+} geoip_table_t;
+
+/** The header of a table image, as stored at the start of a cache file.  We
+ * write it in host byte order; a cache file written on another kind of
+ * machine fails the byte_order check and gets rebuilt. */
+typedef struct geoip_image_header_t {
+  /** GEOIP_IMAGE_MAGIC, without its NUL. */
+  char magic[8];
+  /** GEOIP_IMAGE_BYTE_ORDER. */
+  uint32_t byte_order;
+  /** GEOIP_IMAGE_VERSION. */
+  uint32_t version;
+  /** 4 for an IPv4 table, 6 for an IPv6 table. */
+  uint32_t family;
+  /** Number of countries in the table's country list. */
+  uint32_t n_countries;
+  /** Number of ranges in the table. */
+  uint32_t n_ranges;
+  /** Unused; always zero. */
+  uint32_t reserved;
+  /** SHA1 digest of the geoip file that we built the table from. */
+  char source_digest[DIGEST_LEN];
+  /** Unused; always zero. */
+  char pad[4];
+} geoip_image_header_t;
+
+/** Value for the magic field of a geoip_image_header_t. */
+#define GEOIP_IMAGE_MAGIC "TorGeoIP"
+/** Value for the byte_order field of a geoip_image_header_t. */
+#define GEOIP_IMAGE_BYTE_ORDER 0x01020304u
+/** Value for the version field of a geoip_image_header_t. */
+#define GEOIP_IMAGE_VERSION 1
+
+/** Offsets of each part of a table image, and its total length. */
+typedef struct geoip_image_layout_t {
+  size_t country_codes_off;
+  size_t dir_off;
+  size_t keys_off;
+  size_t countries_off;
+  size_t len;
+} geoip_image_layout_t;
+
+static void init_geoip_countries(void);
+static void geoip_table_free_(geoip_table_t *table);
+#define geoip_table_free(t) \
+  FREE_AND_NULL(geoip_table_t, geoip_table_free_, (t))
+
 /** A list of geoip_country_t */
 static smartlist_t *geoip_countries = NULL;
 /** A map from lowercased country codes to their position in geoip_countries.
  * The index is encoded in the pointer, and 1 is added so that NULL can mean
  * not found. */
 static strmap_t *country_idxplus1_by_lc_code = NULL;
-/** List of all known geoip_ipv4_entry_t sorted
- * by their respective ip_low values. */
+/** List of geoip_ipv4_entry_t that we have parsed, but not yet put in
+ * geoip_ipv4_table. */
 static smartlist_t *geoip_ipv4_entries = NULL;
-/** List of all known geoip_ipv6_entry_t, sorted by their respective
- * ip_low values. */
+/** List of geoip_ipv6_entry_t that we have parsed, but not yet put in
+ * geoip_ipv6_table. */
 static smartlist_t *geoip_ipv6_entries = NULL;
+/** The table of IPv4 ranges, or NULL if we haven't built it. */
+static geoip_table_t *geoip_ipv4_table = NULL;
+/** The table of IPv6 ranges, or NULL if we haven't built it. */
+static geoip_table_t *geoip_ipv6_table = NULL;
 
 /** SHA1 digest of the IPv4 GeoIP file to include in extra-info
  * descriptors. */
@@ -111,20 +208,14 @@ geoip_get_country,(const char *country))
   return (country_t)idx;
 }
 
-/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
- * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
-static void
-geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
-                const char *country)
+/** Return the index in geoip_countries of the 2-letter country code
+ * <b>country</b>, adding it if it isn't there yet. */
+static intptr_t
+geoip_get_or_add_country(const char *country)
 {
   intptr_t idx;
   void *idxplus1_;
 
-  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
-    return;
-  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
-    return;
-
   idxplus1_ = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
   if (!idxplus1_) {
@@ -141,6 +232,23 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     geoip_country_t *c = smartlist_get(geoip_countries, (int)idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
+  return idx;
+}
+
+/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
+ * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
+static void
+geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
+                const char *country)
+{
+  intptr_t idx;
+
+  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
+    return;
+  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
+    return;
+
+  idx = geoip_get_or_add_country(country);
 
   if (tor_addr_family(low) == AF_INET) {
     geoip_ipv4_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv4_entry_t));
@@ -158,7 +266,10 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
 }
 
 /** Add an entry to the GeoIP table indicated by <b>family</b>,
- * parsing it from <b>line</b>. The format is as for geoip_load_file(). */
+ * parsing it from <b>line</b>. The format is as for geoip_load_file().
+ *
+ * The entry goes into the list of entries for the next table that we build
+ * for <b>family</b>; any table we had already built is discarded. */
 STATIC int
 geoip_parse_entry(const char *line, sa_family_t family)
 {
@@ -171,9 +282,11 @@ geoip_parse_entry(const char *line, sa_family_t family)
   if (family == AF_INET) {
     if (!geoip_ipv4_entries)
       geoip_ipv4_entries = smartlist_new();
+    geoip_table_free(geoip_ipv4_table);
   } else if (family == AF_INET6) {
     if (!geoip_ipv6_entries)
       geoip_ipv6_entries = smartlist_new();
+    geoip_table_free(geoip_ipv6_table);
   } else {
     log_warn(LD_GENERAL, "Unsupported family: %d", family);
     return -1;
@@ -240,22 +353,6 @@ geoip_ipv4_compare_entries_(const void **_a, const void **_b)
     return 0;
 }
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IP (a pointer
- * to a uint32_t in host order) to a geoip_ipv4_entry_t */
-static int
-geoip_ipv4_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  /* No alignment issue here, since _key really is a pointer to uint32_t */
-  const uint32_t addr = *(uint32_t *)_key;
-  const geoip_ipv4_entry_t *entry = *_member;
-  if (addr < entry->ip_low)
-    return -1;
-  else if (addr > entry->ip_high)
-    return 1;
-  else
-    return 0;
-}
-
 /** Sorting helper: return -1, 1, or 0 based on comparison of two
  * geoip_ipv6_entry_t */
 static int
@@ -266,24 +363,6 @@ geoip_ipv6_compare_entries_(const void **_a, const void **_b)
                      sizeof(struct in6_addr));
 }
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IPv6
- * (a pointer to a in6_addr) to a geoip_ipv6_entry_t */
-static int
-geoip_ipv6_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  const struct in6_addr *addr = (struct in6_addr *)_key;
-  const geoip_ipv6_entry_t *entry = *_member;
-
-  if (fast_memcmp(addr->s6_addr, entry->ip_low.s6_addr,
-             sizeof(struct in6_addr)) < 0)
-    return -1;
-  else if (fast_memcmp(addr->s6_addr, entry->ip_high.s6_addr,
-                  sizeof(struct in6_addr)) > 0)
-    return 1;
-  else
-    return 0;
-}
-
 /** Set up a new list of geoip countries with no countries (yet) set in it,
  * except for the unknown country.
  */
@@ -302,6 +381,410 @@ init_geoip_countries(void)
   strmap_set_lc(country_idxplus1_by_lc_code, "??", (void*)(1));
 }
 
+/** Return the offsets of the parts of a table image for <b>family</b> with
+ * <b>n_countries</b> countries and <b>n_ranges</b> ranges.  An image holds,
+ * in order, each aligned to 8 bytes: a geoip_image_header_t; the 2-letter
+ * code of each country; the directory; the first address of each range;
+ * and the country of each range. */
+static geoip_image_layout_t
+geoip_table_image_layout(sa_family_t family, uint32_t n_countries,
+                         uint32_t n_ranges)
+{
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+  geoip_image_layout_t layout;
+  const size_t key_len = (family == AF_INET) ? 4 : 16;
+  layout.country_codes_off = ALIGN8(sizeof(geoip_image_header_t));
+  layout.dir_off = ALIGN8(layout.country_codes_off + 2 * (size_t)n_countries);
+  layout.keys_off = ALIGN8(layout.dir_off + 4 * (size_t)GEOIP_DIR_LEN);
+  layout.countries_off = ALIGN8(layout.keys_off + key_len * n_ranges);
+  layout.len = ALIGN8(layout.countries_off + 2 * (size_t)n_ranges);
+#undef ALIGN8
+  return layout;
+}
+
+/** Release all storage held by <b>table</b>. */
+static void
+geoip_table_free_(geoip_table_t *table)
+{
+  if (!table)
+    return;
+  if (table->mapping)
+    tor_munmap_file(table->mapping);
+  tor_free(table->image);
+  tor_free(table->country_map);
+  tor_free(table);
+}
+
+/** Helper: return -1, 0, or 1 as the 128-bit number (<b>a_hi</b>,
+ * <b>a_lo</b>) is less than, equal to, or greater than (<b>b_hi</b>,
+ * <b>b_lo</b>). */
+static inline int
+geoip_key_cmp(uint64_t a_hi, uint64_t a_lo, uint64_t b_hi, uint64_t b_lo)
+{
+  if (a_hi != b_hi)
+    return a_hi < b_hi ? -1 : 1;
+  if (a_lo != b_lo)
+    return a_lo < b_lo ? -1 : 1;
+  return 0;
+}
+
+/** Return the first address of range <b>i</b> of <b>table</b> as a 128-bit
+ * number, in *<b>hi_out</b> and *<b>lo_out</b>. */
+static inline void
+geoip_table_get_key(const geoip_table_t *table, uint32_t i,
+                    uint64_t *hi_out, uint64_t *lo_out)
+{
+  if (table->family == AF_INET) {
+    *hi_out = 0;
+    *lo_out = table->keys4[i];
+  } else {
+    *hi_out = table->keys6[2*i];
+    *lo_out = table->keys6[2*i+1];
+  }
+}
+
+/** Return the country index, in geoip_countries, of the address (<b>hi</b>,
+ * <b>lo</b>) in <b>table</b>.  IPv4 addresses have <b>hi</b> set to 0. */
+static int
+geoip_table_lookup(const geoip_table_t *table, uint64_t hi, uint64_t lo)
+{
+  const unsigned prefix = (unsigned)
+    ((table->family == AF_INET) ? (lo >> 16) : (hi >> 48));
+  uint32_t low_idx = table->dir[prefix], high_idx = table->dir[prefix+1];
+
+  /* Find the last range that starts at or before our address. */
+  if (table->family == AF_INET) {
+    const uint32_t addr = (uint32_t) lo;
+    while (low_idx < high_idx) {
+      const uint32_t mid = low_idx + (high_idx - low_idx + 1) / 2;
+      if (table->keys4[mid] <= addr)
+        low_idx = mid;
+      else
+        high_idx = mid - 1;
+    }
+  } else {
+    while (low_idx < high_idx) {
+      const uint32_t mid = low_idx + (high_idx - low_idx + 1) / 2;
+      if (geoip_key_cmp(table->keys6[2*mid], table->keys6[2*mid+1],
+                        hi, lo) <= 0)
+        low_idx = mid;
+      else
+        high_idx = mid - 1;
+    }
+  }
+  return table->country_map[table->countries[low_idx]];
+}
+
+/** Check the table image of <b>len</b> bytes at <b>image</b>.  If it holds a
+ * well-formed table for <b>family</b>, built from a geoip file with the
+ * digest <b>source_digest</b>, return a new geoip_table_t that refers to it.
+ * Otherwise return NULL.
+ *
+ * The caller must keep the image alive for as long as the table, and set
+ * its image or mapping field so that it is freed along with the table. */
+static geoip_table_t *
+geoip_table_open(sa_family_t family, const char *image, size_t len,
+                 const char *source_digest)
+{
+  const geoip_image_header_t *hdr = (const geoip_image_header_t *)image;
+  geoip_image_layout_t layout;
+  geoip_table_t *table = NULL;
+  const char *country_codes;
+  uint32_t i;
+
+  if (len < sizeof(geoip_image_header_t))
+    return NULL;
+  if (fast_memneq(hdr->magic, GEOIP_IMAGE_MAGIC, sizeof(hdr->magic)) ||
+      hdr->byte_order != GEOIP_IMAGE_BYTE_ORDER ||
+      hdr->version != GEOIP_IMAGE_VERSION ||
+      hdr->family != (family == AF_INET ? 4 : 6) ||
+      hdr->n_ranges < 1 || hdr->n_ranges > UINT32_MAX / 16 ||
+      hdr->n_countries < 1 || hdr->n_countries > UINT16_MAX ||
+      fast_memneq(hdr->source_digest, source_digest, DIGEST_LEN))
+    return NULL;
+  layout = geoip_table_image_layout(family, hdr->n_countries, hdr->n_ranges);
+  if (len != layout.len)
+    return NULL;
+
+  table = tor_malloc_zero(sizeof(geoip_table_t));
+  table->family = family;
+  table->n_ranges = hdr->n_ranges;
+  table->n_countries = hdr->n_countries;
+  table->dir = (const uint32_t *)(image + layout.dir_off);
+  if (family == AF_INET)
+    table->keys4 = (const uint32_t *)(image + layout.keys_off);
+  else
+    table->keys6 = (const uint64_t *)(image + layout.keys_off);
+  table->countries = (const uint16_t *)(image + layout.countries_off);
+
+  /* Lookups trust the directory and the countries not to send them out of
+   * bounds, so check those.  Check that the ranges are in order too, so
+   * that a damaged file can't give us nonsense answers. */
+  if (table->dir[GEOIP_DIR_LEN-1] != table->n_ranges - 1)
+    goto err;
+  for (i = 0; i + 1 < GEOIP_DIR_LEN; ++i) {
+    if (table->dir[i] > table->dir[i+1])
+      goto err;
+  }
+  for (i = 0; i < table->n_ranges; ++i) {
+    uint64_t hi, lo, prev_hi, prev_lo;
+    if (table->countries[i] >= table->n_countries)
+      goto err;
+    geoip_table_get_key(table, i, &hi, &lo);
+    if (i == 0) {
+      if (hi || lo)
+        goto err;
+    } else {
+      geoip_table_get_key(table, i-1, &prev_hi, &prev_lo);
+      if (geoip_key_cmp(prev_hi, prev_lo, hi, lo) >= 0)
+        goto err;
+    }
+  }
+
+  country_codes = image + layout.country_codes_off;
+  table->country_map = tor_calloc(table->n_countries, sizeof(int));
+  for (i = 0; i < table->n_countries; ++i) {
+    char cc[3];
+    memcpy(cc, country_codes + 2*i, 2);
+    cc[2] = '\0';
+    table->country_map[i] = (int) geoip_get_or_add_country(cc);
+  }
+
+  return table;
+ err:
+  geoip_table_free(table);
+  return NULL;
+}
+
+/** Helper for geoip_table_build_image: add a range starting at (<b>hi</b>,
+ * <b>lo</b>) in <b>country</b> to the end of the arrays at *<b>keys</b>
+ * and *<b>countries</b>, unless it just continues the last range. */
+static void
+geoip_add_range(uint64_t **keys, uint16_t **countries, uint32_t *n,
+                uint32_t *cap, uint64_t hi, uint64_t lo, uint16_t country)
+{
+  if (*n && (*countries)[*n - 1] == country)
+    return;
+  if (*n == *cap) {
+    *cap *= 2;
+    *keys = tor_reallocarray(*keys, *cap, 2 * sizeof(uint64_t));
+    *countries = tor_reallocarray(*countries, *cap, sizeof(uint16_t));
+  }
+  (*keys)[2 * *n] = hi;
+  (*keys)[2 * *n + 1] = lo;
+  (*countries)[*n] = country;
+  ++*n;
+}
+
+/** Build an image for a table of <b>family</b> from its sorted list of
+ * parsed entries, <b>entries</b>, which came from a geoip file with the
+ * digest <b>source_digest</b>.  Return the image, and set *<b>len_out</b>
+ * to its length.
+ *
+ * Where entries overlap, the one that starts first wins; addresses that no
+ * entry covers belong to the unknown country. */
+static char *
+geoip_table_build_image(sa_family_t family, const smartlist_t *entries,
+                        const char *source_digest, size_t *len_out)
+{
+  const uint64_t max_hi = (family == AF_INET) ? 0 : UINT64_MAX;
+  const uint64_t max_lo = (family == AF_INET) ? UINT32_MAX : UINT64_MAX;
+  const uint32_t n_countries = smartlist_len(geoip_countries);
+  uint32_t n = 0, cap = 1024, i, prefix;
+  uint64_t *keys = tor_calloc(cap, 2 * sizeof(uint64_t));
+  uint16_t *countries = tor_calloc(cap, sizeof(uint16_t));
+  uint64_t next_hi = 0, next_lo = 0;
+  bool covered_all = false;
+  geoip_image_layout_t layout;
+  geoip_image_header_t *hdr;
+  char *image;
+
+  tor_assert(n_countries <= UINT16_MAX);
+
+  SMARTLIST_FOREACH_BEGIN(entries, const void *, ent) {
+    uint64_t low_hi, low_lo, high_hi, high_lo;
+    uint16_t country;
+    if (family == AF_INET) {
+      const geoip_ipv4_entry_t *e = ent;
+      low_hi = high_hi = 0;
+      low_lo = e->ip_low;
+      high_lo = e->ip_high;
+      country = (uint16_t) e->country;
+    } else {
+      const geoip_ipv6_entry_t *e = ent;
+      low_hi = tor_ntohll(get_uint64(e->ip_low.s6_addr));
+      low_lo = tor_ntohll(get_uint64(e->ip_low.s6_addr + 8));
+      high_hi = tor_ntohll(get_uint64(e->ip_high.s6_addr));
+      high_lo = tor_ntohll(get_uint64(e->ip_high.s6_addr + 8));
+      country = (uint16_t) e->country;
+    }
+    if (geoip_key_cmp(high_hi, high_lo, next_hi, next_lo) < 0)
+      continue;
+    if (geoip_key_cmp(low_hi, low_lo, next_hi, next_lo) > 0) {
+      /* There's a gap before this entry. */
+      geoip_add_range(&keys, &countries, &n, &cap, next_hi, next_lo, 0);
+    } else {
+      low_hi = next_hi;
+      low_lo = next_lo;
+    }
+    geoip_add_range(&keys, &countries, &n, &cap, low_hi, low_lo, country);
+    if (high_hi == max_hi && high_lo == max_lo) {
+      covered_all = true;
+      break;
+    }
+    next_lo = high_lo + 1;
+    next_hi = high_hi + (next_lo == 0);
+  } SMARTLIST_FOREACH_END(ent);
+  if (!covered_all)
+    geoip_add_range(&keys, &countries, &n, &cap, next_hi, next_lo, 0);
+
+  layout = geoip_table_image_layout(family, n_countries, n);
+  image = tor_malloc_zero(layout.len);
+  hdr = (geoip_image_header_t *) image;
+  memcpy(hdr->magic, GEOIP_IMAGE_MAGIC, sizeof(hdr->magic));
+  hdr->byte_order = GEOIP_IMAGE_BYTE_ORDER;
+  hdr->version = GEOIP_IMAGE_VERSION;
+  hdr->family = (family == AF_INET) ? 4 : 6;
+  hdr->n_countries = n_countries;
+  hdr->n_ranges = n;
+  memcpy(hdr->source_digest, source_digest, DIGEST_LEN);
+
+  SMARTLIST_FOREACH(geoip_countries, const geoip_country_t *, c,
+    memcpy(image + layout.country_codes_off + 2*c_sl_idx, c->countrycode, 2));
+
+  for (i = 0; i < n; ++i) {
+    if (family == AF_INET) {
+      uint32_t k = (uint32_t) keys[2*i+1];
+      memcpy(image + layout.keys_off + 4*i, &k, 4);
+    } else {
+      memcpy(image + layout.keys_off + 16*i, &keys[2*i], 16);
+    }
+  }
+  memcpy(image + layout.countries_off, countries, 2 * (size_t)n);
+
+  /* Point each prefix at the range holding its first address. */
+  for (prefix = 0, i = 0; prefix < GEOIP_DIR_LEN - 1; ++prefix) {
+    const uint64_t first_hi = (family == AF_INET) ? 0 :
+      ((uint64_t)prefix) << 48;
+    const uint64_t first_lo = (family == AF_INET) ? ((uint64_t)prefix) << 16
+      : 0;
+    uint32_t idx;
+    while (i + 1 < n &&
+           geoip_key_cmp(keys[2*(i+1)], keys[2*(i+1)+1],
+                         first_hi, first_lo) <= 0)
+      ++i;
+    idx = i;
+    memcpy(image + layout.dir_off + 4*prefix, &idx, 4);
+  }
+  i = n - 1;
+  memcpy(image + layout.dir_off + 4*(GEOIP_DIR_LEN-1), &i, 4);
+
+  tor_free(keys);
+  tor_free(countries);
+  *len_out = layout.len;
+  return image;
+}
+
+/** Build a table for <b>family</b> from its sorted list of parsed entries,
+ * <b>entries</b>, which came from a geoip file with the digest
+ * <b>source_digest</b>.  If <b>cache_fname</b> is set, also try to save the
+ * table there. */
+static geoip_table_t *
+geoip_table_build(sa_family_t family, const smartlist_t *entries,
+                  const char *source_digest, const char *cache_fname)
+{
+  geoip_table_t *table;
+  size_t len;
+  char *image = geoip_table_build_image(family, entries, source_digest, &len);
+
+  if (cache_fname &&
+      write_bytes_to_file(cache_fname, image, len, 1) < 0) {
+    log_info(LD_GENERAL, "Couldn't write GEOIP cache file %s.",
+             cache_fname);
+  }
+
+  table = geoip_table_open(family, image, len, source_digest);
+  /* We just built this image, so it had better be well-formed. */
+  tor_assert(table);
+  table->image = image;
+  return table;
+}
+
+/** Try to load a table for <b>family</b> from the cache file
+ * <b>cache_fname</b>.  Return the table if the file holds one that we built
+ * from a geoip file with the digest <b>source_digest</b>, or NULL
+ * otherwise. */
+static geoip_table_t *
+geoip_table_load_cache(sa_family_t family, const char *cache_fname,
+                       const char *source_digest)
+{
+  geoip_table_t *table;
+  tor_mmap_t *mapping = tor_mmap_file(cache_fname);
+
+  if (!mapping)
+    return NULL;
+  table = geoip_table_open(family, mapping->data, mapping->size,
+                           source_digest);
+  if (!table) {
+    log_info(LD_GENERAL, "GEOIP cache file %s is out of date or damaged; "
+             "rebuilding it.", cache_fname);
+    tor_munmap_file(mapping);
+    return NULL;
+  }
+  table->mapping = mapping;
+  return table;
+}
+
+/** Return the table for <b>family</b>, building it from the entries that
+ * we've parsed if we need to, or NULL if we have no geoip information for
+ * <b>family</b>. */
+static const geoip_table_t *
+geoip_get_table(sa_family_t family)
+{
+  geoip_table_t **tablep;
+  smartlist_t *entries;
+  char *digest;
+
+  if (family == AF_INET) {
+    tablep = &geoip_ipv4_table;
+    entries = geoip_ipv4_entries;
+    digest = geoip_digest;
+  } else {
+    tablep = &geoip_ipv6_table;
+    entries = geoip_ipv6_entries;
+    digest = geoip6_digest;
+  }
+
+  if (!*tablep && entries) {
+    smartlist_sort(entries, (family == AF_INET) ?
+                   geoip_ipv4_compare_entries_ :
+                   geoip_ipv6_compare_entries_);
+    *tablep = geoip_table_build(family, entries, digest, NULL);
+  }
+  return *tablep;
+}
+
+/** Discard all the geoip information that we have for <b>family</b>. */
+static void
+geoip_clear_family(sa_family_t family)
+{
+  if (family == AF_INET) {
+    if (geoip_ipv4_entries) {
+      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
+                        tor_free(e));
+      smartlist_free(geoip_ipv4_entries);
+    }
+    geoip_table_free(geoip_ipv4_table);
+  } else { /* AF_INET6 */
+    if (geoip_ipv6_entries) {
+      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
+                        tor_free(e));
+      smartlist_free(geoip_ipv6_entries);
+    }
+    geoip_table_free(geoip_ipv6_table);
+  }
+}
+
 /** Clear appropriate GeoIP database, based on <b>family</b>, and
  * reload it from the file <b>filename</b>. Return 0 on success, -1 on
  * failure.
@@ -322,9 +805,22 @@ init_geoip_countries(void)
  */
 int
 geoip_load_file(sa_family_t family, const char *filename, int severity)
+{
+  return geoip_load_file_with_cache(family, filename, NULL, severity);
+}
+
+/** As geoip_load_file(), but if <b>cache_fname</b> is set, use it as a cache
+ * of the packed table: load the table from there if it was built from the
+ * same file, and otherwise build it and save it there. */
+int
+geoip_load_file_with_cache(sa_family_t family, const char *filename,
+                           const char *cache_fname, int severity)
 {
   FILE *f;
   crypto_digest_t *geoip_digest_env = NULL;
+  char source_digest[DIGEST_LEN];
+  geoip_table_t *table = NULL;
+  smartlist_t *entries;
 
   tor_assert(family == AF_INET || family == AF_INET6);
 
@@ -336,47 +832,70 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
   if (!geoip_countries)
     init_geoip_countries();
 
-  if (family == AF_INET) {
-    if (geoip_ipv4_entries) {
-      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv4_entries);
+  geoip_clear_family(family);
+  geoip_digest_env = crypto_digest_new();
+
+  if (cache_fname) {
+    /* Digest the file first, to see whether our cache is up to date. */
+    while (!feof(f)) {
+      char buf[512];
+      if (fgets(buf, (int)sizeof(buf), f) == NULL)
+        break;
+      crypto_digest_add_bytes(geoip_digest_env, buf, strlen(buf));
     }
-    geoip_ipv4_entries = smartlist_new();
-  } else { /* AF_INET6 */
-    if (geoip_ipv6_entries) {
-      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv6_entries);
+    crypto_digest_get_digest(geoip_digest_env, source_digest, DIGEST_LEN);
+    table = geoip_table_load_cache(family, cache_fname, source_digest);
+    if (table) {
+      log_notice(LD_GENERAL, "Loaded GEOIP %s data for %s from %s.",
+                 (family == AF_INET) ? "IPv4" : "IPv6", filename,
+                 cache_fname);
+    } else {
+      rewind(f);
+      crypto_digest_free(geoip_digest_env);
+      geoip_digest_env = crypto_digest_new();
     }
-    geoip_ipv6_entries = smartlist_new();
   }
-  geoip_digest_env = crypto_digest_new();
 
-  log_notice(LD_GENERAL, "Parsing GEOIP %s file %s.",
-             (family == AF_INET) ? "IPv4" : "IPv6", filename);
-  while (!feof(f)) {
-    char buf[512];
-    if (fgets(buf, (int)sizeof(buf), f) == NULL)
-      break;
-    crypto_digest_add_bytes(geoip_digest_env, buf, strlen(buf));
-    /* FFFF track full country name. */
-    geoip_parse_entry(buf, family);
+  if (!table) {
+    entries = smartlist_new();
+    if (family == AF_INET)
+      geoip_ipv4_entries = entries;
+    else
+      geoip_ipv6_entries = entries;
+
+    log_notice(LD_GENERAL, "Parsing GEOIP %s file %s.",
+               (family == AF_INET) ? "IPv4" : "IPv6", filename);
+    while (!feof(f)) {
+      char buf[512];
+      if (fgets(buf, (int)sizeof(buf), f) == NULL)
+        break;
+      crypto_digest_add_bytes(geoip_digest_env, buf, strlen(buf));
+      /* FFFF track full country name. */
+      geoip_parse_entry(buf, family);
+    }
+    /*XXXX abort and return -1 if no entries/illformed?*/
+    crypto_digest_get_digest(geoip_digest_env, source_digest, DIGEST_LEN);
+
+    smartlist_sort(entries, (family == AF_INET) ?
+                   geoip_ipv4_compare_entries_ :
+                   geoip_ipv6_compare_entries_);
+    table = geoip_table_build(family, entries, source_digest, cache_fname);
+    /* We only needed the entries to build the table. */
+    geoip_clear_family(family);
   }
-  /*XXXX abort and return -1 if no entries/illformed?*/
   fclose(f);
+  crypto_digest_free(geoip_digest_env);
 
-  /* Sort list and remember file digests so that we can include it in
-   * our extra-info descriptors. */
+  /* Remember file digests so that we can include it in our extra-info
+   * descriptors. */
   if (family == AF_INET) {
-    smartlist_sort(geoip_ipv4_entries, geoip_ipv4_compare_entries_);
-    crypto_digest_get_digest(geoip_digest_env, geoip_digest, DIGEST_LEN);
+    geoip_ipv4_table = table;
+    memcpy(geoip_digest, source_digest, DIGEST_LEN);
   } else {
     /* AF_INET6 */
-    smartlist_sort(geoip_ipv6_entries, geoip_ipv6_compare_entries_);
-    crypto_digest_get_digest(geoip_digest_env, geoip6_digest, DIGEST_LEN);
+    geoip_ipv6_table = table;
+    memcpy(geoip6_digest, source_digest, DIGEST_LEN);
   }
-  crypto_digest_free(geoip_digest_env);
 
   return 0;
 }
@@ -390,12 +909,10 @@ geoip_load_file(sa_family_t family, const char *filename, int severity)
 STATIC int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
-  geoip_ipv4_entry_t *ent;
-  if (!geoip_ipv4_entries)
+  const geoip_table_t *table = geoip_get_table(AF_INET);
+  if (!table)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
-                          geoip_ipv4_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  return geoip_table_lookup(table, 0, ipaddr);
 }
 
 /** Given an IPv6 address, return a number representing the country to
@@ -406,13 +923,11 @@ geoip_get_country_by_ipv4(uint32_t ipaddr)
 STATIC int
 geoip_get_country_by_ipv6(const struct in6_addr *addr)
 {
-  geoip_ipv6_entry_t *ent;
-
-  if (!geoip_ipv6_entries)
+  const geoip_table_t *table = geoip_get_table(AF_INET6);
+  if (!table)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv6_entries, addr,
-                          geoip_ipv6_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  return geoip_table_lookup(table, tor_ntohll(get_uint64(addr->s6_addr)),
+                            tor_ntohll(get_uint64(addr->s6_addr + 8)));
 }
 
 /** Given an IP address, return a number representing the country to which
@@ -461,9 +976,9 @@ geoip_is_loaded,(sa_family_t family))
   if (geoip_countries == NULL)
     return 0;
   if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
+    return geoip_ipv4_table != NULL || geoip_ipv4_entries != NULL;
   else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+    return geoip_ipv6_table != NULL || geoip_ipv6_entries != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -489,20 +1004,10 @@ clear_geoip_db(void)
   }
 
   strmap_free(country_idxplus1_by_lc_code, NULL);
-  if (geoip_ipv4_entries) {
-    SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv4_entries);
-  }
-  if (geoip_ipv6_entries) {
-    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv6_entries);
-  }
+  geoip_clear_family(AF_INET);
+  geoip_clear_family(AF_INET6);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
-  geoip_ipv4_entries = NULL;
-  geoip_ipv6_entries = NULL;
 }
 
 /** Release all storage held in this file. */
@@ -0,0 +1,390 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file mempool.c
+ *
+ * \brief Implementation for mp_pool_t, an allocator for lots of objects of
+ * the same size that are allocated and freed one at a time.
+ *
+ * A pool hands out fixed-size items carved from large chunks.  Freed items
+ * go onto a freelist in the chunk they came from, and are reused before we
+ * carve anything new.  Every item is preceded by a pointer to its chunk, so
+ * releasing an item doesn't need to know which pool it came from.
+ *
+ * Each pool keeps its chunks on three lists: chunks with no items in use,
+ * chunks with some items in use, and chunks that are full.  We allocate from
+ * a partly used chunk whenever we can, so that busy pools stay dense and
+ * idle chunks can be given back to the system.  When a chunk becomes empty,
+ * we keep it around for reuse unless the pool already has enough empty
+ * chunks; mp_pool_clean() releases them on demand.
+ */
+
+#include "orconfig.h"
+#include "lib/memarea/mempool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/cc/torint.h"
+#include "lib/log/util_bug.h"
+#include "lib/malloc/malloc.h"
+
+/** All items that we hand out are aligned to a multiple of this value. */
+#define MP_ALIGN 8
+
+/** Round <b>n</b> up to the nearest multiple of MP_ALIGN. */
+#define MP_ALIGN_UP(n) (((n) + (MP_ALIGN - 1)) & ~(size_t)(MP_ALIGN - 1))
+
+/** Magic number for a live mp_chunk_t. */
+#define MP_CHUNK_MAGIC 0x09870123u
+
+struct mp_chunk_t;
+
+/** Header for an item in a pool.  The item's memory starts at u.mem. */
+typedef struct mp_allocated_t {
+  /** The chunk that this item lives in. */
+  struct mp_chunk_t *in_chunk;
+  union {
+    /** If this item is free, the next free item in the same chunk. */
+    struct mp_allocated_t *next_free;
+    /** If this item is in use, its memory. */
+    char mem[1];
+    /** Dummies, to make sure that mem is aligned. */
+    void *dummy_ptr_;
+    uint64_t dummy_u64_;
+    double dummy_double_;
+  } u;
+} mp_allocated_t;
+
+/** How many bytes of header come before the memory of each item? */
+#define MP_ITEM_HEADER_SIZE offsetof(mp_allocated_t, u)
+
+/** A region of memory that holds some of the items in a pool. */
+typedef struct mp_chunk_t {
+  /** Set to MP_CHUNK_MAGIC while the chunk is allocated. */
+  uint32_t magic;
+  /** Number of items in this chunk that are in use. */
+  int n_allocated;
+  /** Number of items that fit in this chunk. */
+  int capacity;
+  /** The pool that owns this chunk. */
+  mp_pool_t *pool;
+  /** Links to the adjacent chunks on the same list of <b>pool</b>. */
+  struct mp_chunk_t *next, *prev;
+  /** Most recently freed item in this chunk, or NULL. */
+  mp_allocated_t *first_free;
+  /** Start of the part of this chunk that has never been handed out. */
+  char *next_mem;
+  /** End of this chunk. */
+  char *end_mem;
+} mp_chunk_t;
+
+/** How many bytes of header come before the first item in a chunk? */
+#define MP_CHUNK_HEADER_SIZE MP_ALIGN_UP(sizeof(mp_chunk_t))
+
+/** A pool of fixed-size items. */
+struct mp_pool_t {
+  /** Chunks with no items in use. */
+  mp_chunk_t *empty_chunks;
+  /** Chunks with some, but not all, of their items in use. */
+  mp_chunk_t *used_chunks;
+  /** Chunks with all of their items in use. */
+  mp_chunk_t *full_chunks;
+  /** Number of chunks on empty_chunks. */
+  int n_empty_chunks;
+  /** Number of chunks on all three lists. */
+  int n_chunks;
+  /** Once we have this many empty chunks, free any more that empty out. */
+  int max_empty_chunks;
+  /** How many items fit in each chunk? */
+  int items_per_chunk;
+  /** How many bytes does each item take, including its header? */
+  size_t item_alloc_size;
+  /** How many bytes does each chunk take, including its header? */
+  size_t chunk_alloc_size;
+  /** How many items are in use? */
+  size_t n_used;
+};
+
+/** Remove <b>chunk</b> from the list whose head is *<b>list</b>. */
+static inline void
+mp_chunk_unlink(mp_chunk_t **list, mp_chunk_t *chunk)
+{
+  if (chunk->next)
+    chunk->next->prev = chunk->prev;
+  if (chunk->prev)
+    chunk->prev->next = chunk->next;
+  else
+    *list = chunk->next;
+  chunk->next = chunk->prev = NULL;
+}
+
+/** Add <b>chunk</b> to the head of the list whose head is *<b>list</b>. */
+static inline void
+mp_chunk_push(mp_chunk_t **list, mp_chunk_t *chunk)
+{
+  chunk->prev = NULL;
+  chunk->next = *list;
+  if (*list)
+    (*list)->prev = chunk;
+  *list = chunk;
+}
+
+/** Allocate and return a new, empty chunk for <b>pool</b>. */
+static mp_chunk_t *
+mp_chunk_new(mp_pool_t *pool)
+{
+  mp_chunk_t *chunk = tor_malloc(pool->chunk_alloc_size);
+  memset(chunk, 0, sizeof(mp_chunk_t));
+  chunk->magic = MP_CHUNK_MAGIC;
+  chunk->capacity = pool->items_per_chunk;
+  chunk->pool = pool;
+  chunk->next_mem = ((char*)chunk) + MP_CHUNK_HEADER_SIZE;
+  chunk->end_mem = ((char*)chunk) + pool->chunk_alloc_size;
+  ++pool->n_chunks;
+  return chunk;
+}
+
+/** Release <b>chunk</b>, which must not be on any of its pool's lists. */
+static void
+mp_chunk_free(mp_chunk_t *chunk)
+{
+  --chunk->pool->n_chunks;
+  chunk->magic = 0xdeadbeef;
+  tor_free(chunk);
+}
+
+/** Allocate and return a new pool of items that are each <b>item_size</b>
+ * bytes long.  We get memory from the system <b>items_per_chunk</b> items at
+ * a time, and keep up to <b>max_empty_chunks</b> chunks around for reuse
+ * after all of their items are freed. */
+mp_pool_t *
+mp_pool_new(size_t item_size, int items_per_chunk, int max_empty_chunks)
+{
+  mp_pool_t *pool;
+  size_t item_alloc_size;
+
+  tor_assert(item_size < SIZE_T_CEILING);
+  tor_assert(items_per_chunk > 0);
+  tor_assert(max_empty_chunks >= 0);
+
+  if (item_size < sizeof(((mp_allocated_t*)NULL)->u))
+    item_size = sizeof(((mp_allocated_t*)NULL)->u);
+  item_alloc_size = MP_ALIGN_UP(MP_ITEM_HEADER_SIZE + item_size);
+  tor_assert((SIZE_T_CEILING - MP_CHUNK_HEADER_SIZE) / item_alloc_size >
+             (size_t)items_per_chunk);
+
+  pool = tor_malloc_zero(sizeof(mp_pool_t));
+  pool->item_alloc_size = item_alloc_size;
+  pool->items_per_chunk = items_per_chunk;
+  pool->chunk_alloc_size =
+    MP_CHUNK_HEADER_SIZE + item_alloc_size * items_per_chunk;
+  pool->max_empty_chunks = max_empty_chunks;
+  return pool;
+}
+
+/** Free every chunk on the list whose head is <b>chunk</b>. */
+static void
+mp_chunk_list_free(mp_chunk_t *chunk)
+{
+  mp_chunk_t *next;
+  for (; chunk; chunk = next) {
+    next = chunk->next;
+    mp_chunk_free(chunk);
+  }
+}
+
+/** Free <b>pool</b> and all of its chunks, invalidating every item that was
+ * allocated from it. */
+void
+mp_pool_free_(mp_pool_t *pool)
+{
+  if (!pool)
+    return;
+  mp_chunk_list_free(pool->empty_chunks);
+  mp_chunk_list_free(pool->used_chunks);
+  mp_chunk_list_free(pool->full_chunks);
+  memset(pool, 0xe0, sizeof(mp_pool_t));
+  tor_free(pool);
+}
+
+/** Return a newly allocated item from <b>pool</b>.  Its contents are
+ * unspecified. */
+void *
+mp_pool_get(mp_pool_t *pool)
+{
+  mp_chunk_t *chunk;
+  mp_allocated_t *item;
+
+  if (PREDICT_LIKELY(pool->used_chunks != NULL)) {
+    chunk = pool->used_chunks;
+  } else if (pool->empty_chunks) {
+    chunk = pool->empty_chunks;
+    mp_chunk_unlink(&pool->empty_chunks, chunk);
+    --pool->n_empty_chunks;
+    mp_chunk_push(&pool->used_chunks, chunk);
+  } else {
+    chunk = mp_chunk_new(pool);
+    mp_chunk_push(&pool->used_chunks, chunk);
+  }
+
+  tor_assert(chunk->n_allocated < chunk->capacity);
+
+  if (chunk->first_free) {
+    item = chunk->first_free;
+    chunk->first_free = item->u.next_free;
+  } else {
+    tor_assert(chunk->next_mem + pool->item_alloc_size <= chunk->end_mem);
+    item = (mp_allocated_t *) chunk->next_mem;
+    item->in_chunk = chunk;
+    chunk->next_mem += pool->item_alloc_size;
+  }
+
+  if (++chunk->n_allocated == chunk->capacity) {
+    mp_chunk_unlink(&pool->used_chunks, chunk);
+    mp_chunk_push(&pool->full_chunks, chunk);
+  }
+  ++pool->n_used;
+
+  return item->u.mem;
+}
+
+/** Return <b>item</b>, which must have been allocated with mp_pool_get(),
+ * to the pool that it came from. */
+void
+mp_pool_release(void *item)
+{
+  mp_allocated_t *allocated;
+  mp_chunk_t *chunk;
+  mp_pool_t *pool;
+
+  allocated = (mp_allocated_t *) (((char*)item) - MP_ITEM_HEADER_SIZE);
+  chunk = allocated->in_chunk;
+  tor_assert(chunk);
+  tor_assert(chunk->magic == MP_CHUNK_MAGIC);
+  tor_assert(chunk->n_allocated > 0);
+  pool = chunk->pool;
+
+  allocated->u.next_free = chunk->first_free;
+  chunk->first_free = allocated;
+  --pool->n_used;
+
+  if (chunk->n_allocated-- == chunk->capacity) {
+    /* It was full; now it isn't. */
+    mp_chunk_unlink(&pool->full_chunks, chunk);
+    if (chunk->n_allocated)
+      mp_chunk_push(&pool->used_chunks, chunk);
+  } else if (chunk->n_allocated == 0) {
+    mp_chunk_unlink(&pool->used_chunks, chunk);
+  }
+
+  if (chunk->n_allocated == 0) {
+    if (pool->n_empty_chunks < pool->max_empty_chunks) {
+      mp_chunk_push(&pool->empty_chunks, chunk);
+      ++pool->n_empty_chunks;
+    } else {
+      mp_chunk_free(chunk);
+    }
+  }
+}
+
+/** Free all but <b>n_to_keep</b> of the empty chunks in <b>pool</b>.
+ * Return the number of bytes released. */
+size_t
+mp_pool_clean(mp_pool_t *pool, int n_to_keep)
+{
+  size_t freed = 0;
+  tor_assert(n_to_keep >= 0);
+  while (pool->n_empty_chunks > n_to_keep) {
+    mp_chunk_t *chunk = pool->empty_chunks;
+    mp_chunk_unlink(&pool->empty_chunks, chunk);
+    --pool->n_empty_chunks;
+    mp_chunk_free(chunk);
+    freed += pool->chunk_alloc_size;
+  }
+  return freed;
+}
+
+/** Return the number of items from <b>pool</b> that are currently in use. */
+size_t
+mp_pool_get_n_used(const mp_pool_t *pool)
+{
+  return pool->n_used;
+}
+
+/** Return the number of bytes that <b>pool</b> holds in chunks with no items
+ * in use: that is, how much mp_pool_clean(pool, 0) would release. */
+size_t
+mp_pool_get_empty_allocation(const mp_pool_t *pool)
+{
+  return pool->n_empty_chunks * pool->chunk_alloc_size;
+}
+
+/** Set <b>allocated_out</b> to the number of bytes allocated in
+ * <b>pool</b>, and <b>used_out</b> to the number of bytes in items that are
+ * currently in use. */
+void
+mp_pool_get_stats(const mp_pool_t *pool,
+                  size_t *allocated_out, size_t *used_out)
+{
+  *allocated_out = pool->n_chunks * pool->chunk_alloc_size;
+  *used_out = pool->n_used * pool->item_alloc_size;
+}
+
+/** Helper: check that every chunk on <b>list</b> belongs to <b>pool</b>
+ * and has a number of items in use between <b>min_used</b> and
+ * <b>max_used</b> inclusive (where -1 means "the chunk's capacity").  Return
+ * the number of chunks, and add their items in use to *<b>n_used</b>. */
+static int
+mp_chunk_list_assert_ok(const mp_pool_t *pool, const mp_chunk_t *chunk,
+                        int min_used, int max_used, size_t *n_used)
+{
+  int n_chunks = 0;
+  const mp_chunk_t *prev = NULL;
+  for (; chunk; prev = chunk, chunk = chunk->next) {
+    const int max = (max_used < 0) ? chunk->capacity : max_used;
+    const int min = (min_used < 0) ? chunk->capacity : min_used;
+    int n_free = 0;
+    const mp_allocated_t *item;
+
+    tor_assert(chunk->magic == MP_CHUNK_MAGIC);
+    tor_assert(chunk->pool == pool);
+    tor_assert(chunk->prev == prev);
+    tor_assert(chunk->capacity == pool->items_per_chunk);
+    tor_assert(chunk->n_allocated >= min);
+    tor_assert(chunk->n_allocated <= max);
+    tor_assert(chunk->next_mem <= chunk->end_mem);
+
+    for (item = chunk->first_free; item; item = item->u.next_free) {
+      tor_assert(item->in_chunk == chunk);
+      ++n_free;
+    }
+    tor_assert((size_t)(chunk->n_allocated + n_free) ==
+               (chunk->next_mem - ((const char*)chunk) - MP_CHUNK_HEADER_SIZE)
+               / pool->item_alloc_size);
+
+    *n_used += chunk->n_allocated;
+    ++n_chunks;
+  }
+  return n_chunks;
+}
+
+/** Assert that <b>pool</b> is internally consistent. */
+void
+mp_pool_assert_ok(const mp_pool_t *pool)
+{
+  size_t n_used = 0;
+  int n_chunks = 0, n_empty;
+
+  n_empty = mp_chunk_list_assert_ok(pool, pool->empty_chunks, 0, 0, &n_used);
+  tor_assert(n_empty == pool->n_empty_chunks);
+  tor_assert(n_empty <= pool->max_empty_chunks);
+  n_chunks += n_empty;
+  n_chunks += mp_chunk_list_assert_ok(pool, pool->used_chunks,
+                                      1, pool->items_per_chunk - 1, &n_used);
+  n_chunks += mp_chunk_list_assert_ok(pool, pool->full_chunks,
+                                      -1, -1, &n_used);
+  tor_assert(n_chunks == pool->n_chunks);
+  tor_assert(n_used == pool->n_used);
+}
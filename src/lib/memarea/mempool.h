@@ -0,0 +1,34 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file mempool.h
+ *
+ * \brief Header for mempool.c
+ **/
+
+#ifndef TOR_MEMPOOL_H
+#define TOR_MEMPOOL_H
+
+#include <stddef.h>
+
+typedef struct mp_pool_t mp_pool_t;
+
+mp_pool_t *mp_pool_new(size_t item_size, int items_per_chunk,
+                       int max_empty_chunks);
+void mp_pool_free_(mp_pool_t *pool);
+/** @copydoc mp_pool_free_
+ *
+ * Additionally, set <b>pool</b> to NULL. */
+#define mp_pool_free(pool) \
+  FREE_AND_NULL(mp_pool_t, mp_pool_free_, (pool))
+void *mp_pool_get(mp_pool_t *pool);
+void mp_pool_release(void *item);
+size_t mp_pool_clean(mp_pool_t *pool, int n_to_keep);
+size_t mp_pool_get_n_used(const mp_pool_t *pool);
+size_t mp_pool_get_empty_allocation(const mp_pool_t *pool);
+void mp_pool_get_stats(const mp_pool_t *pool,
+                       size_t *allocated_out, size_t *used_out);
+void mp_pool_assert_ok(const mp_pool_t *pool);
+
+#endif /* !defined(TOR_MEMPOOL_H) */
@@ -137,6 +137,36 @@ metrics_store_hist_entry_update(metrics_store_entry_t *entry,
   }
 }
 
+/** Set the observation counts of a histogram store entry to the ones in
+ * bucket_values, which must have one (cumulative) value per bucket, and its
+ * total number and sum of observations to count and sum.
+ *
+ * This is for callers that keep their own histogram in the fast path and
+ * only copy it to the store upon a metrics request.
+ *
+ * Note: entry **must** be a histogram. */
+void
+metrics_store_hist_entry_set(metrics_store_entry_t *entry,
+                             const uint64_t *bucket_values,
+                             const size_t bucket_count,
+                             const uint64_t count, const int64_t sum)
+{
+  tor_assert(entry);
+
+  if (BUG(entry->type != METRICS_TYPE_HISTOGRAM)) {
+    return;
+  }
+  if (BUG(bucket_count != entry->u.histogram.bucket_count)) {
+    return;
+  }
+
+  for (size_t i = 0; i < bucket_count; ++i) {
+    entry->u.histogram.buckets[i].value = bucket_values[i];
+  }
+  entry->u.histogram.count = count;
+  entry->u.histogram.sum = sum;
+}
+
 /** Reset a store entry that is set its metric data to 0. */
 void
 metrics_store_entry_reset(metrics_store_entry_t *entry)
@@ -78,5 +78,9 @@ void metrics_store_entry_update(metrics_store_entry_t *entry,
                                 const int64_t value);
 void metrics_store_hist_entry_update(metrics_store_entry_t *entry,
                                 const int64_t value, const int64_t obs);
+void metrics_store_hist_entry_set(metrics_store_entry_t *entry,
+                                  const uint64_t *bucket_values,
+                                  const size_t bucket_count,
+                                  const uint64_t count, const int64_t sum);
 
 #endif /* !defined(TOR_LIB_METRICS_METRICS_STORE_ENTRY_H) */
@@ -12,6 +12,7 @@
 #define BUFFERS_PRIVATE
 #include "lib/net/buffers_net.h"
 #include "lib/buf/buffers.h"
+#include "lib/intmath/cmp.h"
 #include "lib/log/log.h"
 #include "lib/log/util_bug.h"
 #include "lib/net/nettypes.h"
@@ -25,6 +26,39 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#include <limits.h>
+
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && defined(HAVE_WRITEV) \
+  && !defined(_WIN32)
+/** Defined if we can move data between a buffer and a socket or pipe with
+ * one readv() or writev() call, instead of one call per chunk. */
+#define USE_IOVECS
+#endif
+
+#ifdef USE_IOVECS
+/** The largest number of chunks that we write with a single writev(). */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define BUF_MAX_IOVECS IOV_MAX
+#else
+#define BUF_MAX_IOVECS 64
+#endif
+#endif /* defined(USE_IOVECS) */
+
+#ifdef TOR_UNIT_TESTS
+/** If false, never use readv() or writev(), even when they are available.
+ * Only tests should change this. */
+bool buf_net_use_iovecs = true;
+/** How many read and write system calls have we made on buffers? */
+uint64_t buf_net_n_syscalls = 0;
+#define should_use_iovecs() (buf_net_use_iovecs)
+#define note_syscall() STMT_BEGIN ++buf_net_n_syscalls; STMT_END
+#else
+#define should_use_iovecs() (true)
+#define note_syscall() STMT_NIL
+#endif /* defined(TOR_UNIT_TESTS) */
 
 #ifdef PARANOIA
 /** Helper: If PARANOIA is defined, assert that the buffer in local variable
@@ -52,6 +86,7 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
     read_result = tor_socket_recv(fd, CHUNK_WRITE_PTR(chunk), at_most, 0);
   else
     read_result = read(fd, CHUNK_WRITE_PTR(chunk), at_most);
+  note_syscall();
 
   if (read_result < 0) {
     int e = is_socket ? tor_socket_errno(fd) : errno;
@@ -81,6 +116,132 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
   }
 }
 
+/** Helper for buf_read_from_fd(): read up to *<b>readlen</b> bytes from
+ * <b>fd</b> onto the tail chunk of <b>buf</b>, or onto a new chunk if the
+ * tail is (nearly) full.  Set *<b>readlen</b> to the number of bytes we
+ * asked for.  Return values are as for read_to_chunk(). */
+static inline int
+read_to_tail(buf_t *buf, tor_socket_t fd, size_t *readlen,
+             int *reached_eof, int *error, bool is_socket)
+{
+  chunk_t *chunk;
+  if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
+    chunk = buf_add_chunk_with_capacity(buf, *readlen, 1);
+    if (*readlen > chunk->memlen)
+      *readlen = chunk->memlen;
+  } else {
+    size_t cap = CHUNK_REMAINING_CAPACITY(buf->tail);
+    chunk = buf->tail;
+    if (cap < *readlen)
+      *readlen = cap;
+  }
+
+  return read_to_chunk(buf, chunk, fd, *readlen,
+                       reached_eof, error, is_socket);
+}
+
+#ifdef USE_IOVECS
+/** Point at most two entries of <b>iov</b> at the space where we should
+ * read up to *<b>readlen</b> bytes onto the end of <b>buf</b>: the rest of
+ * the tail chunk, if it has room, and a new chunk after it for the
+ * remainder.  Store the chunks in the matching entries of <b>chunks</b>, set
+ * *<b>readlen</b> to the amount of space we found, and return the number of
+ * entries we used. */
+int
+buf_get_read_iovecs(buf_t *buf, size_t *readlen,
+                    struct iovec *iov, chunk_t **chunks)
+{
+  int n_iov = 0;
+  size_t requested = 0;
+
+  if (buf->tail && CHUNK_REMAINING_CAPACITY(buf->tail) >= MIN_READ_LEN) {
+    size_t len = MIN(CHUNK_REMAINING_CAPACITY(buf->tail), *readlen);
+    chunks[n_iov] = buf->tail;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(buf->tail);
+    iov[n_iov].iov_len = len;
+    requested += len;
+    ++n_iov;
+  }
+  if (requested < *readlen) {
+    chunk_t *chunk = buf_add_chunk_with_capacity(buf, *readlen - requested,
+                                                 1);
+    size_t len = MIN(chunk->memlen, *readlen - requested);
+    chunks[n_iov] = chunk;
+    iov[n_iov].iov_base = CHUNK_WRITE_PTR(chunk);
+    iov[n_iov].iov_len = len;
+    requested += len;
+    ++n_iov;
+  }
+  *readlen = requested;
+  return n_iov;
+}
+
+/** Add the <b>n</b> bytes that we have just read into the <b>n_iov</b>
+ * entries of <b>iov</b> and <b>chunks</b> from buf_get_read_iovecs() to the
+ * end of <b>buf</b>.  <b>old_tail</b> is the tail of <b>buf</b> from before
+ * we called buf_get_read_iovecs(): if the chunk that it added after
+ * <b>old_tail</b> is still empty, remove it again. */
+void
+buf_commit_read_iovecs(buf_t *buf, const struct iovec *iov,
+                       chunk_t **chunks, int n_iov, chunk_t *old_tail,
+                       size_t n)
+{
+  int i;
+  size_t left = n;
+  for (i = 0; i < n_iov && left; ++i) {
+    size_t got = MIN(left, iov[i].iov_len);
+    chunks[i]->datalen += got;
+    left -= got;
+  }
+  buf->datalen += n;
+
+  if (buf->tail != old_tail && buf->tail->datalen == 0)
+    buf_remove_empty_tail(buf, old_tail);
+}
+
+/** As read_to_tail(), but if the tail chunk of <b>buf</b> doesn't have room
+ * for *<b>readlen</b> bytes, add a new chunk after it, and fill both with a
+ * single readv() call.  (If the new chunk stays empty, we free it again.) */
+static inline int
+read_to_chunks_iov(buf_t *buf, tor_socket_t fd, size_t *readlen,
+                   int *reached_eof, int *error, bool is_socket)
+{
+  struct iovec iov[2];
+  chunk_t *chunks[2];
+  chunk_t *old_tail = buf->tail;
+  int n_iov;
+  ssize_t read_result;
+
+  n_iov = buf_get_read_iovecs(buf, readlen, iov, chunks);
+
+  read_result = readv(fd, iov, n_iov);
+  note_syscall();
+
+  if (read_result < 0) {
+    int e = is_socket ? tor_socket_errno(fd) : errno;
+    buf_commit_read_iovecs(buf, iov, chunks, n_iov, old_tail, 0);
+
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      if (error)
+        *error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    buf_commit_read_iovecs(buf, iov, chunks, n_iov, old_tail, 0);
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  } else { /* actually got bytes. */
+    buf_commit_read_iovecs(buf, iov, chunks, n_iov, old_tail, read_result);
+    log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
+              (int)buf->datalen);
+    tor_assert(read_result <= BUF_MAX_LEN);
+    return (int)read_result;
+  }
+}
+#endif /* defined(USE_IOVECS) */
+
 /** Read from file descriptor <b>fd</b>, writing onto end of <b>buf</b>.  Read
  * at most <b>at_most</b> bytes, growing the buffer as necessary.  If recv()
  * returns 0 (because of EOF), set *<b>reached_eof</b> to 1 and return 0.
@@ -110,20 +271,15 @@ buf_read_from_fd(buf_t *buf, int fd, size_t at_most,
 
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
-    chunk_t *chunk;
-    if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
-      chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
-      if (readlen > chunk->memlen)
-        readlen = chunk->memlen;
-    } else {
-      size_t cap = CHUNK_REMAINING_CAPACITY(buf->tail);
-      chunk = buf->tail;
-      if (cap < readlen)
-        readlen = cap;
-    }
 
-    r = read_to_chunk(buf, chunk, fd, readlen,
-                      reached_eof, socket_error, is_socket);
+#ifdef USE_IOVECS
+    if (should_use_iovecs())
+      r = read_to_chunks_iov(buf, fd, &readlen,
+                             reached_eof, socket_error, is_socket);
+    else
+#endif
+      r = read_to_tail(buf, fd, &readlen,
+                       reached_eof, socket_error, is_socket);
     check();
     if (r < 0)
       return r; /* Error */
@@ -153,6 +309,7 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
     write_result = tor_socket_send(fd, chunk->data, sz, 0);
   else
     write_result = write(fd, chunk->data, sz);
+  note_syscall();
 
   if (write_result < 0) {
     int e = is_socket ? tor_socket_errno(fd) : errno;
@@ -173,6 +330,65 @@ flush_chunk(tor_socket_t fd, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
+#ifdef USE_IOVECS
+/** Point up to <b>max_iov</b> entries of <b>iov</b> at the first <b>sz</b>
+ * bytes of <b>buf</b>.  Set *<b>total_out</b> to the number of bytes they
+ * cover, and return the number of entries we used. */
+int
+buf_get_flush_iovecs(const buf_t *buf, size_t sz,
+                     struct iovec *iov, int max_iov, size_t *total_out)
+{
+  const chunk_t *chunk;
+  int n_iov = 0;
+  size_t total = 0;
+
+  for (chunk = buf->head; chunk && n_iov < max_iov && total < sz;
+       chunk = chunk->next) {
+    size_t len = MIN(chunk->datalen, sz - total);
+    if (!len)
+      continue;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = len;
+    total += len;
+    ++n_iov;
+  }
+  *total_out = total;
+  return n_iov;
+}
+
+/** Helper for buf_flush_to_fd(): try to write <b>sz</b> bytes from the
+ * start of <b>buf</b> onto <b>fd</b> with a single writev() call, covering
+ * up to BUF_MAX_IOVECS chunks.  Set *<b>attempted_out</b> to the number of
+ * bytes we tried to write.  Return values are as for flush_chunk(). */
+static inline int
+flush_chunks_iov(tor_socket_t fd, buf_t *buf, size_t sz,
+                 size_t *attempted_out, bool is_socket)
+{
+  struct iovec iov[BUF_MAX_IOVECS];
+  int n_iov;
+  ssize_t write_result;
+
+  n_iov = buf_get_flush_iovecs(buf, sz, iov, BUF_MAX_IOVECS, attempted_out);
+
+  write_result = writev(fd, iov, n_iov);
+  note_syscall();
+
+  if (write_result < 0) {
+    int e = is_socket ? tor_socket_errno(fd) : errno;
+
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"writev() would block, returning.");
+    return 0;
+  } else {
+    buf_drain(buf, write_result);
+    tor_assert(write_result <= BUF_MAX_LEN);
+    return (int)write_result;
+  }
+}
+#endif /* defined(USE_IOVECS) */
+
 /** Write data from <b>buf</b> to the file descriptor <b>fd</b>.  Write at most
  * <b>sz</b> bytes, and remove the written bytes
  * from the buffer.  Return the number of bytes written on success,
@@ -196,12 +412,19 @@ buf_flush_to_fd(buf_t *buf, int fd, size_t sz,
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
-    if (buf->head->datalen >= sz)
-      flushlen0 = sz;
-    else
-      flushlen0 = buf->head->datalen;
+#ifdef USE_IOVECS
+    if (should_use_iovecs()) {
+      r = flush_chunks_iov(fd, buf, sz, &flushlen0, is_socket);
+    } else
+#endif
+    {
+      if (buf->head->datalen >= sz)
+        flushlen0 = sz;
+      else
+        flushlen0 = buf->head->datalen;
 
-    r = flush_chunk(fd, buf, buf->head, flushlen0, is_socket);
+      r = flush_chunk(fd, buf, buf->head, flushlen0, is_socket);
+    }
     check();
     if (r < 0)
       return r;
@@ -14,6 +14,7 @@
 #define TOR_BUFFERS_NET_H
 
 #include <stddef.h>
+#include "lib/cc/torint.h"
 #include "lib/net/socket.h"
 
 struct buf_t;
@@ -29,4 +30,23 @@ int buf_read_from_pipe(struct buf_t *buf, int fd, size_t at_most,
 
 int buf_flush_to_pipe(struct buf_t *buf, int fd, size_t sz);
 
+#ifdef BUFFERS_PRIVATE
+#ifdef TOR_UNIT_TESTS
+extern bool buf_net_use_iovecs;
+extern uint64_t buf_net_n_syscalls;
+#endif /* defined(TOR_UNIT_TESTS) */
+
+#ifndef _WIN32
+struct chunk_t;
+struct iovec;
+int buf_get_read_iovecs(struct buf_t *buf, size_t *readlen,
+                        struct iovec *iov, struct chunk_t **chunks);
+void buf_commit_read_iovecs(struct buf_t *buf, const struct iovec *iov,
+                            struct chunk_t **chunks, int n_iov,
+                            struct chunk_t *old_tail, size_t n);
+int buf_get_flush_iovecs(const struct buf_t *buf, size_t sz,
+                         struct iovec *iov, int max_iov, size_t *total_out);
+#endif /* !defined(_WIN32) */
+#endif /* defined(BUFFERS_PRIVATE) */
+
 #endif /* !defined(TOR_BUFFERS_NET_H) */
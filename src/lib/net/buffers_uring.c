@@ -0,0 +1,652 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file buffers_uring.c
+ * \brief Move data between many buffers and sockets with one system call.
+ *
+ * buf_read_from_socket() and buf_flush_to_socket() make at least one system
+ * call for every socket that they touch.  On Linux, a buf_uring_t lets us
+ * queue up reads and writes for any number of buffers and sockets, then hand
+ * them all to the kernel at once with io_uring_enter(), and wait there for
+ * their results.
+ *
+ * We queue every operation with MSG_DONTWAIT: the kernel then tries each
+ * one once, and reports EAGAIN rather than waiting for the socket.  That way a
+ * buf_uring_run() call never blocks for longer than the equivalent series
+ * of read and write calls would.
+ *
+ * We make the system calls ourselves from the kernel's headers, rather than
+ * depending on liburing.
+ **/
+
+#define BUFFERS_PRIVATE
+#define BUFFERS_URING_PRIVATE
+#include "orconfig.h"
+#include "lib/buf/buffers.h"
+#include "lib/intmath/cmp.h"
+#include "lib/log/log.h"
+#include "lib/log/util_bug.h"
+#include "lib/net/buffers_net.h"
+#include "lib/net/buffers_uring.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_MMAN_H) && \
+  defined(HAVE_SYS_UIO_H) && defined(__NR_io_uring_setup) &&     \
+  defined(__NR_io_uring_enter)
+/** Defined if we can use io_uring on this platform. */
+#define USE_IO_URING
+#endif
+
+#ifdef USE_IO_URING
+
+/** The largest number of chunks that a single queued write covers. */
+#define BUF_URING_MAX_IOVECS 16
+
+/** A read or write that we have queued on a buf_uring_t. */
+typedef struct buf_uring_op_t {
+  /** The buffer that we're reading into or writing from. */
+  buf_t *buf;
+  /** The socket that we're reading from or writing to. */
+  tor_socket_t sock;
+  /** True for a write; false for a read. */
+  bool is_write;
+  /** True once the kernel has told us the result of this operation. */
+  bool done;
+  /** The memory that the operation reads or writes. */
+  struct iovec iov[BUF_URING_MAX_IOVECS];
+  int n_iov;
+  /** The message header that we hand to the kernel, pointing at iov. */
+  struct msghdr msg;
+  /** For reads: the chunks that each entry of iov points into. */
+  chunk_t *chunks[2];
+  /** For reads: the tail chunk of buf before we queued the read. */
+  chunk_t *old_tail;
+  /** The result from the kernel: a byte count or a negative errno. */
+  int result;
+} buf_uring_op_t;
+
+/** An io_uring instance, and the operations that we have queued on it. */
+struct buf_uring_t {
+  /** The file descriptor for the ring. */
+  int fd;
+  /** The memory that we share with the kernel. */
+  void *sq_ring;
+  size_t sq_ring_len;
+  void *cq_ring;
+  size_t cq_ring_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  /** Pointers into sq_ring. */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  /** Pointers into cq_ring. */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  /** The operations that we're about to run or have just run. */
+  buf_uring_op_t *ops;
+  /** How many operations can we queue at once? */
+  int capacity;
+  /** How many operations have we queued? */
+  int n_ops;
+  /** True if something went wrong and we can't trust the ring any more. */
+  bool broken;
+  /** How many times have we called io_uring_enter() on this ring? */
+  uint64_t n_syscalls;
+};
+
+/** Wrapper for the io_uring_setup() system call. */
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+/** Wrapper for the io_uring_enter() system call. */
+MOCK_IMPL(STATIC int,
+sys_io_uring_enter,(int fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags))
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, NULL, (size_t)0);
+}
+
+/** Return a new buf_uring_t that can hold up to about <b>n_entries</b>
+ * operations at once, or NULL if the kernel won't give us one. */
+buf_uring_t *
+buf_uring_new(unsigned n_entries)
+{
+  struct io_uring_params params;
+  buf_uring_t *ring;
+  char *sq, *cq;
+  int fd;
+
+  memset(&params, 0, sizeof(params));
+  fd = sys_io_uring_setup(n_entries, &params);
+  if (fd < 0) {
+    log_info(LD_NET, "Unable to create an io_uring: %s", strerror(errno));
+    return NULL;
+  }
+
+  ring = tor_malloc_zero(sizeof(buf_uring_t));
+  ring->fd = fd;
+  ring->sq_ring_len = params.sq_off.array +
+    params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_len = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sq_ring_len = ring->cq_ring_len =
+      MAX(ring->sq_ring_len, ring->cq_ring_len);
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    goto err;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      goto err;
+    }
+  }
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto err;
+  }
+
+  sq = ring->sq_ring;
+  cq = ring->cq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  /* We wait for every operation in a batch before we queue the next one, so
+   * there's never more than sq_entries of them in the completion queue. */
+  ring->capacity = (int) MIN(params.sq_entries, params.cq_entries);
+  ring->ops = tor_calloc(ring->capacity, sizeof(buf_uring_op_t));
+  return ring;
+
+ err:
+  log_info(LD_NET, "Unable to map io_uring memory: %s", strerror(errno));
+  buf_uring_free(ring);
+  return NULL;
+}
+
+/** Close <b>ring</b>'s file descriptor and release the memory that we share
+ * with the kernel, so that the kernel cancels whatever it is still doing for
+ * us.  Called when we can't wait for its operations to finish. */
+static void
+buf_uring_teardown(buf_uring_t *ring)
+{
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_len);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_len);
+  ring->sqes = NULL;
+  ring->sq_ring = ring->cq_ring = NULL;
+  if (ring->fd >= 0)
+    close(ring->fd);
+  ring->fd = -1;
+}
+
+/** Release all storage held by <b>ring</b>. */
+void
+buf_uring_free_(buf_uring_t *ring)
+{
+  if (!ring)
+    return;
+  buf_uring_teardown(ring);
+  tor_free(ring->ops);
+  tor_free(ring);
+}
+
+/** Return a new operation on <b>ring</b> for <b>buf</b> and <b>s</b>, or
+ * NULL if <b>ring</b> is full. */
+static buf_uring_op_t *
+buf_uring_new_op(buf_uring_t *ring, buf_t *buf, tor_socket_t s,
+                 bool is_write)
+{
+  buf_uring_op_t *op;
+  if (ring->broken || ring->n_ops == ring->capacity)
+    return NULL;
+  op = &ring->ops[ring->n_ops];
+  memset(op, 0, sizeof(*op));
+  op->buf = buf;
+  op->sock = s;
+  op->is_write = is_write;
+  return op;
+}
+
+/** Queue a read of up to <b>at_most</b> bytes from <b>s</b> onto the end of
+ * <b>buf</b>.  Return an index to pass to buf_uring_get_read_result() after
+ * buf_uring_run(), or -1 if <b>ring</b> is full.  Until then, the caller
+ * must not touch <b>buf</b>. */
+int
+buf_uring_add_read(buf_uring_t *ring, buf_t *buf, tor_socket_t s,
+                   size_t at_most)
+{
+  buf_uring_op_t *op;
+
+  tor_assert(SOCKET_OK(s));
+  if (BUG(at_most == 0) ||
+      BUG(buf->datalen > BUF_MAX_LEN - at_most))
+    return -1;
+  if (!(op = buf_uring_new_op(ring, buf, s, false)))
+    return -1;
+
+  op->old_tail = buf->tail;
+  op->n_iov = buf_get_read_iovecs(buf, &at_most, op->iov, op->chunks);
+  return ring->n_ops++;
+}
+
+/** Queue a write of up to <b>sz</b> bytes from the start of <b>buf</b> to
+ * <b>s</b>.  Return an index to pass to buf_uring_get_flush_result() after
+ * buf_uring_run(), or -1 if <b>ring</b> is full.  Until then, the caller
+ * must not touch <b>buf</b>. */
+int
+buf_uring_add_flush(buf_uring_t *ring, buf_t *buf, tor_socket_t s,
+                    size_t sz)
+{
+  buf_uring_op_t *op;
+  size_t total;
+
+  tor_assert(SOCKET_OK(s));
+  if (BUG(sz == 0) || BUG(sz > buf->datalen))
+    return -1;
+  if (!(op = buf_uring_new_op(ring, buf, s, true)))
+    return -1;
+
+  op->n_iov = buf_get_flush_iovecs(buf, sz, op->iov, BUF_URING_MAX_IOVECS,
+                                   &total);
+  return ring->n_ops++;
+}
+
+/** Return true iff <b>err</b>, from io_uring_enter(), means that we should
+ * just try again. */
+static bool
+buf_uring_errno_is_transient(int err)
+{
+  return err == EINTR || err == EAGAIN || err == EBUSY;
+}
+
+/** Bit that we set in the user_data of the cancellations that we queue in
+ * buf_uring_cancel_submitted(), to tell their completions from those of
+ * our reads and writes. */
+#define BUF_URING_CANCEL_FLAG (UINT64_C(1) << 63)
+
+/** Take every completion that the kernel has posted on <b>ring</b>, record
+ * its result in the matching operation, and add the number of completions
+ * to *<b>n_done</b>.  Return 0 on success, or -1 if a completion made no
+ * sense. */
+static int
+buf_uring_reap(buf_uring_t *ring, int *n_done)
+{
+  unsigned head = *ring->cq_head;
+  int r = 0;
+
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    if (cqe->user_data & BUF_URING_CANCEL_FLAG) {
+      /* Nothing to do: the operation it cancelled will complete too. */
+    } else if (BUG(cqe->user_data >= (uint64_t) ring->n_ops) ||
+               BUG(ring->ops[cqe->user_data].done)) {
+      r = -1;
+    } else {
+      ring->ops[cqe->user_data].result = cqe->res;
+      ring->ops[cqe->user_data].done = true;
+      ++*n_done;
+    }
+    ++head;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return r;
+}
+
+/** Called when io_uring_enter() has failed on <b>ring</b>, after we put
+ * the operations up to <b>tail</b> on the submission queue.  The kernel may
+ * still be reading into or writing from the buffers of the operations that
+ * it took from the queue, so we can't return until it is done with them:
+ * take back the operations it never saw, ask it to cancel the rest, and
+ * wait for every one of them to complete.  If even that fails, tear down
+ * the ring.
+ *
+ * Operations that the kernel cancelled never touched their buffers, so we
+ * mark them as not done. */
+static void
+buf_uring_cancel_submitted(buf_uring_t *ring, unsigned tail, int *n_done)
+{
+  const unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  const int n_submitted = ring->n_ops - (int) (tail - head);
+  unsigned to_submit = 0;
+  int i;
+
+  /* Without SQPOLL, the kernel only looks at the submission queue inside
+   * io_uring_enter(), so we can take back the entries it hasn't consumed. */
+  tail = head;
+  for (i = 0; i < n_submitted; ++i) {
+    unsigned idx;
+    struct io_uring_sqe *sqe;
+    if (ring->ops[i].done)
+      continue;
+    idx = tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) i;
+    sqe->user_data = BUF_URING_CANCEL_FLAG | (uint64_t) i;
+    ring->sq_array[idx] = idx;
+    ++tail;
+    ++to_submit;
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  while (*n_done < n_submitted) {
+    int r = sys_io_uring_enter(ring->fd, to_submit, 1,
+                               IORING_ENTER_GETEVENTS);
+    ++ring->n_syscalls;
+    if (r < 0 && !buf_uring_errno_is_transient(errno)) {
+      log_warn(LD_NET, "io_uring_enter() failed while cancelling %d "
+               "operations: %s. Closing the ring.",
+               n_submitted - *n_done, strerror(errno));
+      buf_uring_teardown(ring);
+      return;
+    }
+    if (r > 0)
+      to_submit -= MIN((unsigned) r, to_submit);
+    if (buf_uring_reap(ring, n_done) < 0) {
+      buf_uring_teardown(ring);
+      return;
+    }
+  }
+
+  for (i = 0; i < n_submitted; ++i) {
+    if (ring->ops[i].done && ring->ops[i].result == -ECANCELED) {
+      ring->ops[i].done = false;
+      --*n_done;
+    }
+  }
+}
+
+/** Hand every operation that we have queued on <b>ring</b> to the kernel,
+ * wait for all of them to finish, and update their buffers.  Return 0 on
+ * success.  On failure, return -1, and <b>ring</b> can't be used any more;
+ * the buffers are still up to date with every operation that finished, and
+ * buf_uring_op_is_done() tells which ones those were.  We cancel the
+ * others before we return, so that the kernel won't touch their buffers. */
+int
+buf_uring_run(buf_uring_t *ring)
+{
+  unsigned tail;
+  int i, n_done = 0;
+
+  if (ring->broken)
+    return -1;
+  if (ring->n_ops == 0)
+    return 0;
+
+  tail = *ring->sq_tail;
+  for (i = 0; i < ring->n_ops; ++i) {
+    buf_uring_op_t *op = &ring->ops[i];
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    memset(&op->msg, 0, sizeof(op->msg));
+    op->msg.msg_iov = op->iov;
+    op->msg.msg_iovlen = op->n_iov;
+    /* With READV and WRITEV, the kernel would wait for an idle socket to
+     * become ready, even though it is nonblocking.  MSG_DONTWAIT makes it
+     * tell us EAGAIN instead, as read() and write() would. */
+    sqe->opcode = op->is_write ? IORING_OP_SENDMSG : IORING_OP_RECVMSG;
+    sqe->fd = op->sock;
+    sqe->addr = (uint64_t)(uintptr_t) &op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_DONTWAIT;
+#ifdef MSG_NOSIGNAL
+    if (op->is_write)
+      sqe->msg_flags |= MSG_NOSIGNAL;
+#endif
+    sqe->user_data = (uint64_t) i;
+    ring->sq_array[idx] = idx;
+    ++tail;
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+  while (n_done < ring->n_ops) {
+    unsigned to_submit = tail - __atomic_load_n(ring->sq_head,
+                                                __ATOMIC_ACQUIRE);
+    int r = sys_io_uring_enter(ring->fd, to_submit, ring->n_ops - n_done,
+                               IORING_ENTER_GETEVENTS);
+    ++ring->n_syscalls;
+    if (r < 0 && !buf_uring_errno_is_transient(errno)) {
+      log_warn(LD_NET, "io_uring_enter() failed: %s", strerror(errno));
+      ring->broken = true;
+      if (buf_uring_reap(ring, &n_done) == 0)
+        buf_uring_cancel_submitted(ring, tail, &n_done);
+      else
+        buf_uring_teardown(ring);
+      break;
+    }
+    if (buf_uring_reap(ring, &n_done) < 0) {
+      /* We can't tell which operations the kernel still has. */
+      ring->broken = true;
+      buf_uring_teardown(ring);
+      break;
+    }
+  }
+
+  for (i = 0; i < ring->n_ops; ++i) {
+    buf_uring_op_t *op = &ring->ops[i];
+    const size_t n = (op->done && op->result > 0) ? op->result : 0;
+    tor_assert(op->result <= BUF_MAX_LEN);
+    if (op->is_write) {
+      if (n)
+        buf_drain(op->buf, n);
+    } else {
+      buf_commit_read_iovecs(op->buf, op->iov, op->chunks, op->n_iov,
+                             op->old_tail, n);
+    }
+  }
+  return ring->broken ? -1 : 0;
+}
+
+/** After buf_uring_run(), return true iff the operation at <b>idx</b> on
+ * <b>ring</b> finished.  (If buf_uring_run() succeeded, they all did.) */
+bool
+buf_uring_op_is_done(const buf_uring_t *ring, int idx)
+{
+  tor_assert(idx >= 0 && idx < ring->n_ops);
+  return ring->ops[idx].done;
+}
+
+/** After buf_uring_run(), return the result of the read at <b>idx</b> on
+ * <b>ring</b>.  Return values are as for buf_read_from_socket(). */
+int
+buf_uring_get_read_result(const buf_uring_t *ring, int idx,
+                          int *reached_eof, int *socket_error)
+{
+  tor_assert(idx >= 0 && idx < ring->n_ops);
+  const buf_uring_op_t *op = &ring->ops[idx];
+  tor_assert(! op->is_write);
+  if (BUG(! op->done))
+    return -1;
+
+  if (op->result < 0) {
+    if (ERRNO_IS_EAGAIN(-op->result))
+      return 0; /* would block. */
+    if (socket_error)
+      *socket_error = -op->result;
+    return -1;
+  } else if (op->result == 0) {
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)op->sock);
+    *reached_eof = 1;
+  }
+  return op->result;
+}
+
+/** After buf_uring_run(), return the result of the write at <b>idx</b> on
+ * <b>ring</b>.  Return values are as for buf_flush_to_socket(); on error,
+ * also set *<b>socket_error</b> to the error. */
+int
+buf_uring_get_flush_result(const buf_uring_t *ring, int idx,
+                           int *socket_error)
+{
+  tor_assert(idx >= 0 && idx < ring->n_ops);
+  const buf_uring_op_t *op = &ring->ops[idx];
+  tor_assert(op->is_write);
+  if (BUG(! op->done))
+    return -1;
+
+  if (op->result < 0) {
+    if (ERRNO_IS_EAGAIN(-op->result))
+      return 0; /* would block. */
+    *socket_error = -op->result;
+    return -1;
+  }
+  return op->result;
+}
+
+/** Return the number of times that we have called io_uring_enter() on
+ * <b>ring</b>. */
+uint64_t
+buf_uring_get_n_syscalls(const buf_uring_t *ring)
+{
+  return ring->n_syscalls;
+}
+
+/** Forget every operation that we have queued on <b>ring</b>, so that we can
+ * use it again. */
+void
+buf_uring_clear(buf_uring_t *ring)
+{
+  ring->n_ops = 0;
+}
+
+#else /* !defined(USE_IO_URING) */
+
+MOCK_IMPL(STATIC int,
+sys_io_uring_enter,(int fd, unsigned to_submit, unsigned min_complete,
+                    unsigned flags))
+{
+  (void) fd; (void) to_submit; (void) min_complete; (void) flags;
+  tor_assert_nonfatal_unreached();
+  errno = ENOSYS;
+  return -1;
+}
+
+buf_uring_t *
+buf_uring_new(unsigned n_entries)
+{
+  (void) n_entries;
+  return NULL;
+}
+
+void
+buf_uring_free_(buf_uring_t *ring)
+{
+  tor_assert(!ring);
+}
+
+int
+buf_uring_add_read(buf_uring_t *ring, buf_t *buf, tor_socket_t s,
+                   size_t at_most)
+{
+  (void) ring; (void) buf; (void) s; (void) at_most;
+  tor_assert_nonfatal_unreached();
+  return -1;
+}
+
+int
+buf_uring_add_flush(buf_uring_t *ring, buf_t *buf, tor_socket_t s,
+                    size_t sz)
+{
+  (void) ring; (void) buf; (void) s; (void) sz;
+  tor_assert_nonfatal_unreached();
+  return -1;
+}
+
+int
+buf_uring_run(buf_uring_t *ring)
+{
+  (void) ring;
+  tor_assert_nonfatal_unreached();
+  return -1;
+}
+
+bool
+buf_uring_op_is_done(const buf_uring_t *ring, int idx)
+{
+  (void) ring; (void) idx;
+  tor_assert_nonfatal_unreached();
+  return false;
+}
+
+int
+buf_uring_get_read_result(const buf_uring_t *ring, int idx,
+                          int *reached_eof, int *socket_error)
+{
+  (void) ring; (void) idx; (void) reached_eof; (void) socket_error;
+  tor_assert_nonfatal_unreached();
+  return -1;
+}
+
+int
+buf_uring_get_flush_result(const buf_uring_t *ring, int idx,
+                           int *socket_error)
+{
+  (void) ring; (void) idx; (void) socket_error;
+  tor_assert_nonfatal_unreached();
+  return -1;
+}
+
+uint64_t
+buf_uring_get_n_syscalls(const buf_uring_t *ring)
+{
+  (void) ring;
+  tor_assert_nonfatal_unreached();
+  return 0;
+}
+
+void
+buf_uring_clear(buf_uring_t *ring)
+{
+  (void) ring;
+  tor_assert_nonfatal_unreached();
+}
+
+#endif /* defined(USE_IO_URING) */
@@ -0,0 +1,49 @@
+/* Copyright (c) 2007-2021, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file buffers_uring.h
+ *
+ * \brief Header file for buffers_uring.c.
+ **/
+
+#ifndef TOR_BUFFERS_URING_H
+#define TOR_BUFFERS_URING_H
+
+#include <stddef.h>
+#include "lib/cc/torint.h"
+#include "lib/malloc/malloc.h"
+#include "lib/net/socket.h"
+#include "lib/testsupport/testsupport.h"
+
+struct buf_t;
+typedef struct buf_uring_t buf_uring_t;
+
+buf_uring_t *buf_uring_new(unsigned n_entries);
+void buf_uring_free_(buf_uring_t *ring);
+/** @copydoc buf_uring_free_
+ *
+ * Additionally, set <b>ring</b> to NULL. */
+#define buf_uring_free(ring) \
+  FREE_AND_NULL(buf_uring_t, buf_uring_free_, (ring))
+
+int buf_uring_add_read(buf_uring_t *ring, struct buf_t *buf,
+                       tor_socket_t s, size_t at_most);
+int buf_uring_add_flush(buf_uring_t *ring, struct buf_t *buf,
+                        tor_socket_t s, size_t sz);
+int buf_uring_run(buf_uring_t *ring);
+bool buf_uring_op_is_done(const buf_uring_t *ring, int idx);
+int buf_uring_get_read_result(const buf_uring_t *ring, int idx,
+                              int *reached_eof, int *socket_error);
+int buf_uring_get_flush_result(const buf_uring_t *ring, int idx,
+                               int *socket_error);
+uint64_t buf_uring_get_n_syscalls(const buf_uring_t *ring);
+void buf_uring_clear(buf_uring_t *ring);
+
+#ifdef BUFFERS_URING_PRIVATE
+MOCK_DECL(STATIC int, sys_io_uring_enter,
+          (int fd, unsigned to_submit, unsigned min_complete,
+           unsigned flags));
+#endif
+
+#endif /* !defined(TOR_BUFFERS_URING_H) */
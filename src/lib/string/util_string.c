@@ -17,6 +17,13 @@
 #include <string.h>
 #include <stdlib.h>
 
+#if defined(__SSE2__) && defined(__GNUC__)
+/* SSE2 is part of the x86-64 baseline, so we can use it without any runtime
+ * check. */
+#define USE_SSE2_SCAN
+#include <emmintrin.h>
+#endif
+
 /** Given <b>hlen</b> bytes at <b>haystack</b> and <b>nlen</b> bytes at
  * <b>needle</b>, return a pointer to the first occurrence of the needle
  * within the haystack, or NULL if there is no such occurrence.
@@ -369,12 +376,40 @@ find_whitespace(const char *s)
   }
 }
 
+#ifdef USE_SSE2_SCAN
+/** Return a bitmask with bit <b>i</b> set iff the <b>i</b>th of the 16 bytes
+ * at <b>s</b> is one that find_whitespace() stops at. */
+static inline unsigned
+whitespace_mask_16(const char *s)
+{
+  const __m128i v = _mm_loadu_si128((const __m128i *)s);
+  __m128i m;
+  m = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+  return (unsigned) _mm_movemask_epi8(m);
+}
+#endif /* defined(USE_SSE2_SCAN) */
+
 /** As find_whitespace, but stop at <b>eos</b> whether we have found a
  * whitespace or not. */
 const char *
 find_whitespace_eos(const char *s, const char *eos)
 {
   /* tor_assert(s); */
+#ifdef USE_SSE2_SCAN
+  /* Look at 16 bytes at a time while we can do so without reading past
+   * eos; directory documents have plenty of long base64 words. */
+  while (eos - s >= 16) {
+    unsigned mask = whitespace_mask_16(s);
+    if (mask)
+      return s + __builtin_ctz(mask);
+    s += 16;
+  }
+#endif /* defined(USE_SSE2_SCAN) */
   while (s < eos) {
     switch (*s)
     {
@@ -111,6 +111,8 @@ void tor_tls_block_renegotiation(tor_tls_t *tls);
 int tor_tls_get_pending_bytes(tor_tls_t *tls);
 size_t tor_tls_get_forced_write_size(tor_tls_t *tls);
 
+void tor_tls_enable_ktls(tor_tls_t *tls);
+
 void tor_tls_get_n_raw_bytes(tor_tls_t *tls,
                              size_t *n_read, size_t *n_written);
 
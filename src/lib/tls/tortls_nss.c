@@ -670,6 +670,13 @@ tor_tls_get_forced_write_size(tor_tls_t *tls)
   return 0;
 }
 
+void
+tor_tls_enable_ktls(tor_tls_t *tls)
+{
+  tor_assert(tls);
+  /* NSS can't hand its records to the kernel. */
+}
+
 void
 tor_tls_get_n_raw_bytes(tor_tls_t *tls,
                         size_t *n_read, size_t *n_written)
@@ -1059,6 +1059,22 @@ tor_tls_setup_session_secret_cb(tor_tls_t *tls)
   SSL_set_session_secret_cb(tls->ssl, tor_tls_session_secret_cb, NULL);
 }
 
+/** Once the handshake on <b>tls</b> is done, log whether the kernel has
+ * taken over encrypting the records that we send. */
+static void
+tor_tls_check_ktls(tor_tls_t *tls)
+{
+  int ktls_send = 0;
+  if (!tls->ktls_requested)
+    return;
+#ifndef OPENSSL_NO_KTLS
+  ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+#endif
+  log_info(LD_NET, "Kernel TLS %s for our records on TLS connection with %s",
+           ktls_send ? "enabled" : "unavailable",
+           ADDR(tls));
+}
+
 /** Create a new TLS object from a file descriptor, and a flag to
  * determine whether it is functioning as a server.
  */
@@ -1398,6 +1414,8 @@ tor_tls_finish_handshake(tor_tls_t *tls)
     }
   }
   tls_log_errors(NULL, LOG_WARN, LD_NET, "finishing the handshake");
+  if (r == TOR_TLS_DONE)
+    tor_tls_check_ktls(tls);
   return r;
 }
 
@@ -1501,6 +1519,22 @@ tor_tls_get_forced_write_size(tor_tls_t *tls)
   return tls->wantwrite_n;
 }
 
+/** Ask OpenSSL to hand the record encryption on <b>tls</b> over to the
+ * kernel once the handshake is done, if the kernel supports it.  This must be
+ * called before the handshake starts.  We still write through SSL_write(),
+ * which then skips its own encryption: that way OpenSSL can still send
+ * alerts and KeyUpdate responses.  If the kernel can't do it, nothing
+ * changes: OpenSSL keeps encrypting our records itself. */
+void
+tor_tls_enable_ktls(tor_tls_t *tls)
+{
+  tor_assert(tls);
+  tls->ktls_requested = 1;
+#ifdef SSL_OP_ENABLE_KTLS
+  SSL_set_options(tls->ssl, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
 /** Sets n_read and n_written to the number of bytes read and written,
  * respectively, on the raw socket used by <b>tls</b> since the last time this
  * function was called on <b>tls</b>. */
@@ -67,6 +67,8 @@ struct tor_tls_t {
    */
   unsigned long last_write_count;
   unsigned long last_read_count;
+  /** True iff tor_tls_enable_ktls() has been called on this connection. */
+  unsigned int ktls_requested:1;
   /** Most recent error value from ERR_get_error(). */
   unsigned long last_error;
   /** If set, a callback to invoke whenever the client tries to renegotiate
@@ -8,13 +8,22 @@
  * \brief Benchmarks for lower level Tor modules.
  **/
 
+#define BUFFERS_PRIVATE
 #include "orconfig.h"
 
 #include "core/or/or.h"
 #include "core/crypto/onion_tap.h"
 #include "core/crypto/relay_crypto.h"
 
+#include "lib/buf/buffers.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/workqueue.h"
 #include "lib/intmath/weakrng.h"
+#include "lib/memarea/memarea.h"
+#include "lib/memarea/mempool.h"
+#include "lib/net/buffers_net.h"
+#include "lib/net/buffers_uring.h"
+#include "lib/time/compat_time.h"
 
 #ifdef ENABLE_OPENSSL
 #include <openssl/opensslv.h>
@@ -29,20 +38,61 @@
 #include "app/main/subsysmgr.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "lib/crypt_ops/crypto_dh.h"
+#include "core/crypto/onion_crypto.h"
 #include "core/crypto/onion_ntor.h"
 #include "lib/crypt_ops/crypto_ed25519.h"
 #include "lib/crypt_ops/crypto_rand.h"
 #include "feature/dircommon/consdiff.h"
+#include "feature/hibernate/hibernate.h"
 #include "lib/compress/compress.h"
 
+#include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
+#include "core/or/channel.h"
+#include "core/or/channeltls.h"
+#include "core/or/connection_edge.h"
+#include "core/or/connection_or.h"
+#include "core/or/or_connection_st.h"
+#include "core/or/connection_st.h"
+#include "core/or/entry_connection_st.h"
 #include "core/or/cell_st.h"
+#include "core/or/cell_queue_st.h"
+#include "core/or/circuitmux.h"
+#include "core/or/circuitmux_ewma.h"
+#include "core/or/circuitmux_logewma.h"
 #include "core/or/or_circuit_st.h"
+#include "core/or/addr_policy_st.h"
+#include "core/or/policies.h"
+#include "core/or/policy_trie.h"
+#define SCHEDULER_PRIVATE
+#define SCHEDULER_KIST_PRIVATE
+#include "core/or/scheduler.h"
 
 #include "lib/crypt_ops/digestset.h"
 #include "lib/crypt_ops/crypto_init.h"
 
 #include "feature/dirparse/microdesc_parse.h"
 #include "feature/nodelist/microdesc.h"
+#include "core/mainloop/cpuworker.h"
+#include "feature/dirparse/ns_parse.h"
+#include "feature/dirparse/parsecommon.h"
+#include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/networkstatus_st.h"
+#include "feature/nodelist/node_select.h"
+#include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/node_st.h"
+#include "feature/nodelist/routerinfo_st.h"
+#include "lib/fs/files.h"
+#include "lib/geoip/geoip.h"
+#include "lib/crypt_ops/crypto_format.h"
+#include "lib/encoding/binascii.h"
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -235,8 +285,9 @@ bench_onion_ntor_impl(void)
                                 key_out, sizeof(key_out));
   }
   end = perftime();
-  printf("Server-side: %f usec\n",
-         NANOCOUNT(start, end, iters)/1e3);
+  printf("Server-side: %f usec (%.0f handshakes/sec/core)\n",
+         NANOCOUNT(start, end, iters)/1e3,
+         1e9 / NANOCOUNT(start, end, iters));
 
   start = perftime();
   for (i = 0; i < iters; ++i) {
@@ -254,6 +305,129 @@ bench_onion_ntor_impl(void)
   dimap_free(keymap, NULL);
 }
 
+/** Compare doing the curve25519 scalar multiplications for a set of
+ * onionskins one at a time, and with curve25519_handshake_batch(). */
+static void
+bench_onion_ntor_batch(void)
+{
+  const int iters = 1<<10;
+  const int batch_sizes[] = { 1, 2, 4, 8, 16, 32, 64 };
+  curve25519_keypair_t keypair_b;
+  curve25519_public_key_t pubkeys[CURVE25519_HANDSHAKE_MAX_BATCH];
+  const curve25519_secret_key_t *skeys[CURVE25519_HANDSHAKE_MAX_BATCH];
+  const curve25519_public_key_t *pkeys[CURVE25519_HANDSHAKE_MAX_BATCH];
+  uint8_t out[CURVE25519_HANDSHAKE_MAX_BATCH][CURVE25519_OUTPUT_LEN];
+  uint8_t *outs[CURVE25519_HANDSHAKE_MAX_BATCH];
+  uint64_t start, end;
+  int i;
+  unsigned k;
+
+  curve25519_keypair_generate(&keypair_b, 0);
+  for (i = 0; i < CURVE25519_HANDSHAKE_MAX_BATCH; ++i) {
+    curve25519_keypair_t kp;
+    curve25519_keypair_generate(&kp, 0);
+    memcpy(&pubkeys[i], &kp.pubkey, sizeof(kp.pubkey));
+    skeys[i] = &keypair_b.seckey;
+    pkeys[i] = &pubkeys[i];
+    outs[i] = out[i];
+  }
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    curve25519_handshake(out[i % CURVE25519_HANDSHAKE_MAX_BATCH],
+                         skeys[0], pkeys[i % CURVE25519_HANDSHAKE_MAX_BATCH]);
+  }
+  end = perftime();
+  printf("Server-side DH, one at a time: %.2f usec "
+         "(%.0f handshakes/sec/core)\n",
+         NANOCOUNT(start, end, iters)/1e3,
+         1e9 / NANOCOUNT(start, end, iters));
+
+  for (k = 0; k < ARRAY_LENGTH(batch_sizes); ++k) {
+    const int n = batch_sizes[k];
+    start = perftime();
+    for (i = 0; i < iters; i += n) {
+      curve25519_handshake_batch(outs, skeys, pkeys, n);
+    }
+    end = perftime();
+    /* iters is a multiple of every batch size. */
+    printf("Server-side DH, batches of %2d: %.2f usec "
+           "(%.0f handshakes/sec/core)\n", n,
+           NANOCOUNT(start, end, iters)/1e3,
+           1e9 / NANOCOUNT(start, end, iters));
+  }
+}
+
+/** Compare doing whole server-side ntor handshakes one at a time, and in
+ * batches as large as a cpuworker job, where they share their scalar
+ * multiplications. */
+static void
+bench_onion_ntor_server_batch(void)
+{
+  const int iters = 1<<10;
+  server_onion_keys_t keys;
+  curve25519_keypair_t keypair;
+  ntor_handshake_state_t *state = NULL;
+  uint8_t os[CPUWORKER_MAX_BATCH][NTOR_ONIONSKIN_LEN];
+  uint8_t reply[CPUWORKER_MAX_BATCH][NTOR_REPLY_LEN];
+  uint8_t key_out[CPUWORKER_MAX_BATCH][CPATH_KEY_MATERIAL_LEN];
+  uint8_t nonce[CPUWORKER_MAX_BATCH][DIGEST_LEN];
+  circuit_params_t ns_params, params[CPUWORKER_MAX_BATCH];
+  onion_server_handshake_t hs[CPUWORKER_MAX_BATCH];
+  uint64_t start, end;
+  int i, j;
+
+  memset(&keys, 0, sizeof(keys));
+  memset(&ns_params, 0, sizeof(ns_params));
+  memset(hs, 0, sizeof(hs));
+  curve25519_keypair_generate(&keypair, 0);
+  dimap_add_entry(&keys.curve25519_key_map, keypair.pubkey.public_key,
+                  &keypair);
+  crypto_rand((char *)keys.my_identity, sizeof(keys.my_identity));
+  for (i = 0; i < CPUWORKER_MAX_BATCH; ++i) {
+    onion_skin_ntor_create(keys.my_identity, &keypair.pubkey, &state, os[i]);
+    ntor_handshake_state_free(state);
+    hs[i].type = ONION_HANDSHAKE_TYPE_NTOR;
+    hs[i].onion_skin = os[i];
+    hs[i].onionskin_len = NTOR_ONIONSKIN_LEN;
+    hs[i].ns_params = &ns_params;
+    hs[i].reply_out = reply[i];
+    hs[i].reply_out_maxlen = sizeof(reply[i]);
+    hs[i].keys_out = key_out[i];
+    hs[i].key_out_len = sizeof(key_out[i]);
+    hs[i].rend_nonce_out = nonce[i];
+    hs[i].negotiated_params_out = &params[i];
+  }
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    j = i % CPUWORKER_MAX_BATCH;
+    onion_skin_server_handshake(ONION_HANDSHAKE_TYPE_NTOR, os[j],
+                                NTOR_ONIONSKIN_LEN, &keys, &ns_params,
+                                reply[j], sizeof(reply[j]),
+                                key_out[j], sizeof(key_out[j]),
+                                nonce[j], &params[j]);
+  }
+  end = perftime();
+  printf("Server-side handshake, one at a time: %.2f usec "
+         "(%.0f handshakes/sec/core)\n",
+         NANOCOUNT(start, end, iters)/1e3,
+         1e9 / NANOCOUNT(start, end, iters));
+
+  start = perftime();
+  for (i = 0; i < iters; i += CPUWORKER_MAX_BATCH) {
+    onion_skin_server_handshake_batch(hs, CPUWORKER_MAX_BATCH, &keys);
+  }
+  end = perftime();
+  /* iters is a multiple of CPUWORKER_MAX_BATCH. */
+  printf("Server-side handshake, batches of %d: %.2f usec "
+         "(%.0f handshakes/sec/core)\n", CPUWORKER_MAX_BATCH,
+         NANOCOUNT(start, end, iters)/1e3,
+         1e9 / NANOCOUNT(start, end, iters));
+
+  dimap_free(keys.curve25519_key_map, NULL);
+}
+
 static void
 bench_onion_ntor(void)
 {
@@ -265,6 +439,61 @@ bench_onion_ntor(void)
     curve25519_set_impl_params(ed);
     bench_onion_ntor_impl();
   }
+  bench_onion_ntor_batch();
+  bench_onion_ntor_server_batch();
+}
+
+/** Compare checking ed25519 signatures one at a time, and in batches of
+ * various sizes with ed25519_checksig_batch(). */
+static void
+bench_ed25519_batch(void)
+{
+  const int iters = 1<<10;
+  const int batch_sizes[] = { 1, 2, 4, 8, 16, 32, 64 };
+  const int max_batch = 64;
+  ed25519_checkable_t *checkable = tor_calloc(max_batch,
+                                              sizeof(ed25519_checkable_t));
+  ed25519_keypair_t *kp = tor_calloc(max_batch, sizeof(ed25519_keypair_t));
+  uint8_t *msgs = tor_calloc(max_batch, 32);
+  uint64_t start, end;
+  int i;
+  unsigned k;
+
+  for (i = 0; i < max_batch; ++i) {
+    ed25519_keypair_generate(&kp[i], 0);
+    crypto_rand((char *)msgs + 32*i, 32);
+    ed25519_sign(&checkable[i].signature, msgs + 32*i, 32, &kp[i]);
+    checkable[i].pubkey = &kp[i].pubkey;
+    checkable[i].msg = msgs + 32*i;
+    checkable[i].len = 32;
+  }
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    const ed25519_checkable_t *ch = &checkable[i % max_batch];
+    ed25519_checksig(&ch->signature, ch->msg, ch->len, ch->pubkey);
+  }
+  end = perftime();
+  printf("Verify signatures one at a time: %.2f usec "
+         "(%.0f verifications/sec)\n",
+         MICROCOUNT(start, end, iters), 1e9 / NANOCOUNT(start, end, iters));
+
+  for (k = 0; k < ARRAY_LENGTH(batch_sizes); ++k) {
+    const int n = batch_sizes[k];
+    start = perftime();
+    /* iters is a multiple of every batch size. */
+    for (i = 0; i < iters; i += n) {
+      ed25519_checksig_batch(NULL, checkable, n);
+    }
+    end = perftime();
+    printf("Verify signatures in batches of %2d: %.2f usec "
+           "(%.0f verifications/sec)\n", n,
+           MICROCOUNT(start, end, iters), 1e9 / NANOCOUNT(start, end, iters));
+  }
+
+  tor_free(checkable);
+  tor_free(kp);
+  tor_free(msgs);
 }
 
 static void
@@ -322,6 +551,8 @@ bench_ed25519_impl(void)
   end = perftime();
   printf("Blind a public key: %.2f usec\n",
          MICROCOUNT(start, end, iters));
+
+  bench_ed25519_batch();
 }
 
 static void
@@ -422,6 +653,34 @@ bench_cell_aes(void)
            NANOCOUNT(start, end, iters*len));
   }
 
+  /* Now compare one call per cell with crypto_cipher_crypt_inplace_multi(),
+   * as used for batches of cells on the same circuit.  They should cost the
+   * same: the batched call works on each cell in place. */
+  const int max_batch = 64;
+  char *cells = tor_malloc(len * max_batch);
+  char *bufs[64];
+  for (i = 0; i < max_batch; ++i)
+    bufs[i] = cells + len * i;
+  for (int batch = 1; batch <= max_batch; batch *= 4) {
+    const int n_batches = iters / batch;
+    start = perftime();
+    for (i = 0; i < n_batches; ++i) {
+      for (int j = 0; j < batch; ++j)
+        crypto_cipher_crypt_inplace(c, bufs[j], len);
+    }
+    end = perftime();
+    printf("%d cells, one call per cell: %.2f nsec per cell\n", batch,
+           NANOCOUNT(start, end, n_batches*batch));
+    start = perftime();
+    for (i = 0; i < n_batches; ++i) {
+      crypto_cipher_crypt_inplace_multi(c, bufs, len, batch);
+    }
+    end = perftime();
+    printf("%d cells, batched: %.2f nsec per cell\n", batch,
+           NANOCOUNT(start, end, n_batches*batch));
+  }
+
+  tor_free(cells);
   crypto_cipher_free(c);
   tor_free(b);
 }
@@ -617,6 +876,505 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** Run allocation benchmarks for packed cells: tor_malloc() against an
+ * mp_pool_t. */
+static void
+bench_cell_alloc(void)
+{
+  const int iters = 1<<20;
+  const int queue_lens[] = { 1, 64, 1024, 16384 };
+  packed_cell_t **cells;
+  uint64_t start, end;
+  int i, j, k;
+
+  cells = tor_calloc(queue_lens[ARRAY_LENGTH(queue_lens)-1], sizeof(*cells));
+
+  reset_perftime();
+
+  for (i = 0; i < (int)ARRAY_LENGTH(queue_lens); ++i) {
+    /* Fill a queue of n cells and drain it, as a circuit would, until we
+     * have allocated <b>iters</b> cells. */
+    const int n = queue_lens[i];
+    const int rounds = iters / n;
+    mp_pool_t *pool = mp_pool_new(sizeof(packed_cell_t), 128, 8);
+
+    start = perftime();
+    for (j = 0; j < rounds; ++j) {
+      for (k = 0; k < n; ++k)
+        cells[k] = tor_malloc_zero(sizeof(packed_cell_t));
+      for (k = 0; k < n; ++k)
+        tor_free(cells[k]);
+    }
+    end = perftime();
+    printf("Queues of %5d: tor_malloc %.2f ns per cell; ",
+           n, NANOCOUNT(start, end, rounds*n));
+
+    start = perftime();
+    for (j = 0; j < rounds; ++j) {
+      for (k = 0; k < n; ++k) {
+        cells[k] = mp_pool_get(pool);
+        memset(cells[k], 0, sizeof(packed_cell_t));
+      }
+      for (k = 0; k < n; ++k)
+        mp_pool_release(cells[k]);
+    }
+    end = perftime();
+    printf("mp_pool %.2f ns per cell\n", NANOCOUNT(start, end, rounds*n));
+
+    mp_pool_free(pool);
+  }
+
+  tor_free(cells);
+}
+
+/** Return the number of read and write system calls that this process has
+ * made, according to the kernel, or -1 if we can't tell. */
+static int64_t
+bench_get_n_io_syscalls(void)
+{
+  /* The file claims to be empty, so we can't use read_file_to_str(). */
+  int fd = tor_open_cloexec("/proc/self/io", O_RDONLY, 0);
+  char *s;
+  const char *cp;
+  int64_t total = 0;
+  size_t sz;
+  long n;
+
+  if (fd < 0)
+    return -1;
+  s = read_file_to_str_until_eof(fd, 4096, &sz);
+  close(fd);
+  if (!s)
+    return -1;
+  if (!(cp = strstr(s, "syscr: ")) || tor_sscanf(cp, "syscr: %ld", &n) != 1)
+    goto err;
+  total += n;
+  if (!(cp = strstr(s, "syscw: ")) || tor_sscanf(cp, "syscw: %ld", &n) != 1)
+    goto err;
+  total += n;
+  tor_free(s);
+  return total;
+ err:
+  tor_free(s);
+  return -1;
+}
+
+/** Run benchmarks for moving data between buffers and sockets: how many
+ * system calls does it take to move each megabyte, with and without
+ * readv() and writev()?  For the "per chunk" case, we never ask the buffer
+ * code for more than one chunk at a time, as it did before it could use
+ * iovecs. */
+static void
+bench_buf_socket_io(void)
+{
+  const int n_mb = 64;
+  const size_t total = ((size_t)n_mb) << 20;
+  const size_t max_queued = 256*1024;
+  char piece[RELAY_PAYLOAD_SIZE];
+  tor_socket_t fds[2];
+  int per_chunk;
+
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    puts("Couldn't make a socketpair.");
+    return;
+  }
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+  crypto_rand(piece, sizeof(piece));
+
+  reset_perftime();
+
+  for (per_chunk = 1; per_chunk >= 0; --per_chunk) {
+    buf_t *out = buf_new(), *in = buf_new();
+    size_t queued = 0, received = 0;
+    uint64_t start, end;
+    int64_t start_calls, end_calls;
+    int eof = 0, err = 0, r;
+
+    start_calls = bench_get_n_io_syscalls();
+    start = perftime();
+    while (received < total) {
+      /* Queue data in relay-payload-sized pieces, as an exit does when it
+       * packages cells for a stream. */
+      while (queued < total && buf_datalen(out) < max_queued) {
+        size_t n = MIN(sizeof(piece), total - queued);
+        buf_add(out, piece, n);
+        queued += n;
+      }
+      if (!per_chunk) {
+        if (buf_datalen(out) &&
+            buf_flush_to_socket(out, fds[0], buf_datalen(out)) < 0)
+          break;
+        if (buf_read_from_socket(in, fds[1], max_queued, &eof, &err) < 0)
+          break;
+      } else {
+        r = 0;
+        while (buf_datalen(out)) {
+          const size_t n = out->head->datalen;
+          if ((r = buf_flush_to_socket(out, fds[0], n)) < 0 ||
+              (size_t)r < n)
+            break;
+        }
+        if (r < 0)
+          break;
+        for (;;) {
+          size_t n = in->default_chunk_size;
+          if (in->tail && CHUNK_REMAINING_CAPACITY(in->tail) >= MIN_READ_LEN)
+            n = CHUNK_REMAINING_CAPACITY(in->tail);
+          n = MIN(n, max_queued - buf_datalen(in));
+          if (n == 0)
+            break;
+          if ((r = buf_read_from_socket(in, fds[1], n, &eof, &err)) < 0)
+            break;
+          if ((size_t)r < n)
+            break;
+        }
+        if (r < 0)
+          break;
+      }
+      received += buf_datalen(in);
+      buf_clear(in);
+    }
+    end = perftime();
+    end_calls = bench_get_n_io_syscalls();
+
+    printf("%-12s ", per_chunk ? "per chunk:" : "readv/writev:");
+    if (start_calls >= 0 && end_calls >= 0)
+      printf("%.1f system calls per MB; ",
+             (end_calls - start_calls) / (double)n_mb);
+    printf("%.2f usec per MB\n", NANOCOUNT(start, end, n_mb) / 1000.0);
+
+    buf_free(out);
+    buf_free(in);
+  }
+
+  tor_close_socket(fds[0]);
+  tor_close_socket(fds[1]);
+}
+
+#define BENCH_URING_N_CONNS 256
+
+/** Run benchmarks for reading and writing many sockets at once: how many
+ * system calls does it take to move data across all of them, with one
+ * read and write per socket, and with io_uring batches?  How does the time
+ * that batching saves compare with the cost of the encryption that an OR
+ * connection would do on the same data? */
+static void
+bench_buf_uring(void)
+{
+  const int rounds = 200;
+  const size_t chunk_len = 4096;
+  tor_socket_t fds[BENCH_URING_N_CONNS][2];
+  buf_t *out[BENCH_URING_N_CONNS], *in[BENCH_URING_N_CONNS];
+  char *piece = tor_malloc(chunk_len);
+  buf_uring_t *ring = buf_uring_new(2*BENCH_URING_N_CONNS);
+  double usec[2] = { 0, 0 };
+  int i, j, use_uring;
+
+  if (!ring) {
+    puts("Couldn't make an io_uring.");
+    tor_free(piece);
+    return;
+  }
+  memset(fds, 0xff, sizeof(fds));
+  memset(out, 0, sizeof(out));
+  memset(in, 0, sizeof(in));
+  for (i = 0; i < BENCH_URING_N_CONNS; ++i) {
+    if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]) < 0) {
+      puts("Couldn't make a socketpair.");
+      goto done;
+    }
+    set_socket_nonblocking(fds[i][0]);
+    set_socket_nonblocking(fds[i][1]);
+    out[i] = buf_new();
+    in[i] = buf_new();
+  }
+  crypto_rand(piece, chunk_len);
+
+  reset_perftime();
+
+  for (use_uring = 0; use_uring <= 1; ++use_uring) {
+    uint64_t start, end;
+    int64_t start_calls, end_calls;
+    int eof = 0, err = 0;
+
+    start_calls = use_uring ? (int64_t) buf_uring_get_n_syscalls(ring) :
+      bench_get_n_io_syscalls();
+    start = perftime();
+    for (j = 0; j < rounds; ++j) {
+      for (i = 0; i < BENCH_URING_N_CONNS; ++i)
+        buf_add(out[i], piece, chunk_len);
+      /* Write on every socket, then read on every socket, as the main loop
+       * would when all of them became ready at once. */
+      if (use_uring) {
+        for (i = 0; i < BENCH_URING_N_CONNS; ++i)
+          buf_uring_add_flush(ring, out[i], fds[i][0], chunk_len);
+        buf_uring_run(ring);
+        buf_uring_clear(ring);
+        for (i = 0; i < BENCH_URING_N_CONNS; ++i)
+          buf_uring_add_read(ring, in[i], fds[i][1], chunk_len);
+        buf_uring_run(ring);
+        buf_uring_clear(ring);
+      } else {
+        for (i = 0; i < BENCH_URING_N_CONNS; ++i)
+          buf_flush_to_socket(out[i], fds[i][0], chunk_len);
+        for (i = 0; i < BENCH_URING_N_CONNS; ++i)
+          buf_read_from_socket(in[i], fds[i][1], chunk_len, &eof, &err);
+      }
+      for (i = 0; i < BENCH_URING_N_CONNS; ++i)
+        buf_clear(in[i]);
+    }
+    end = perftime();
+    end_calls = use_uring ? (int64_t) buf_uring_get_n_syscalls(ring) :
+      bench_get_n_io_syscalls();
+
+    printf("%-22s ", use_uring ? "io_uring batches:" :
+           "read/write per socket:");
+    if (start_calls >= 0 && end_calls >= 0)
+      printf("%.3f system calls per socket; ",
+             (end_calls - start_calls) /
+             (double)(rounds * BENCH_URING_N_CONNS));
+    usec[use_uring] = NANOCOUNT(start, end, rounds) / 1000.0;
+    printf("%.2f usec per round of %d sockets\n", usec[use_uring],
+           BENCH_URING_N_CONNS);
+  }
+
+  /* For comparison: an OR connection would also have to encrypt what it
+   * writes and decrypt what it reads.  TLS does at least as much work as
+   * AES-CTR over the same bytes, so this is a lower bound on what it would
+   * add to each round. */
+  {
+    char key[CIPHER_KEY_LEN];
+    crypto_cipher_t *c;
+    uint64_t start, end;
+    crypto_rand(key, sizeof(key));
+    c = crypto_cipher_new(key);
+    start = perftime();
+    for (j = 0; j < rounds; ++j) {
+      for (i = 0; i < 2*BENCH_URING_N_CONNS; ++i)
+        crypto_cipher_crypt_inplace(c, piece, chunk_len);
+    }
+    end = perftime();
+    printf("%-22s %.2f usec per round of %d sockets\n", "AES for TLS:",
+           NANOCOUNT(start, end, rounds) / 1000.0, BENCH_URING_N_CONNS);
+    printf("Per socket: io_uring saves %.2f usec; TLS would add at least "
+           "%.2f usec\n",
+           (usec[0] - usec[1]) / BENCH_URING_N_CONNS,
+           NANOCOUNT(start, end, rounds) / 1000.0 / BENCH_URING_N_CONNS);
+    crypto_cipher_free(c);
+  }
+
+ done:
+  for (i = 0; i < BENCH_URING_N_CONNS; ++i) {
+    buf_free(out[i]);
+    buf_free(in[i]);
+    if (SOCKET_OK(fds[i][0]))
+      tor_close_socket(fds[i][0]);
+    if (SOCKET_OK(fds[i][1]))
+      tor_close_socket(fds[i][1]);
+  }
+  buf_uring_free(ring);
+  tor_free(piece);
+}
+
+/** Work item for bench_cell_crypto_threads(): one circuit's worth of cells
+ * to decrypt. */
+typedef struct bench_crypto_job_t {
+  crypto_cipher_t *cipher;
+  crypto_digest_t *digest;
+  cell_t *cells;
+  int n_cells;
+} bench_crypto_job_t;
+
+/** How many bench_crypto_job_t are still waiting for a reply? */
+static int bench_crypto_n_pending = 0;
+
+static workqueue_reply_t
+bench_crypto_threadfn(void *state, void *arg)
+{
+  bench_crypto_job_t *job = arg;
+  (void) state;
+  for (int i = 0; i < job->n_cells; ++i) {
+    relay_decrypt_one_outbound(job->cipher, job->digest, &job->cells[i]);
+  }
+  return WQ_RPL_REPLY;
+}
+
+static void
+bench_crypto_replyfn(void *arg)
+{
+  (void) arg;
+  --bench_crypto_n_pending;
+}
+
+static void *
+bench_crypto_state_new(void *arg)
+{
+  (void) arg;
+  return NULL;
+}
+
+static void
+bench_crypto_state_free(void *arg)
+{
+  (void) arg;
+}
+
+static workqueue_reply_t
+bench_crypto_shutdown_threadfn(void *state, void *arg)
+{
+  (void) state;
+  (void) arg;
+  return WQ_RPL_SHUTDOWN;
+}
+
+/** Measure how many relay cells per second we can decrypt, as in
+ * RelayCryptoOffload, with different numbers of worker threads. */
+static void
+bench_cell_crypto_threads(void)
+{
+  const int n_circs = 256;
+  const int cells_per_job = 64;
+  const int jobs_per_circ = 16;
+  const int max_threads = MAX(get_num_cpus(get_options()), 4);
+  bench_crypto_job_t *jobs = tor_calloc(n_circs, sizeof(bench_crypto_job_t));
+  int i, n_threads;
+
+  for (i = 0; i < n_circs; ++i) {
+    char key[CIPHER_KEY_LEN];
+    crypto_rand(key, sizeof(key));
+    jobs[i].cipher = crypto_cipher_new(key);
+    jobs[i].digest = crypto_digest_new();
+    jobs[i].n_cells = cells_per_job;
+    jobs[i].cells = tor_calloc(cells_per_job, sizeof(cell_t));
+    crypto_rand((char*)jobs[i].cells, cells_per_job * sizeof(cell_t));
+  }
+
+  for (n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+    replyqueue_t *rq = replyqueue_new(0);
+    threadpool_t *tp = threadpool_new(n_threads, rq,
+                                      bench_crypto_state_new,
+                                      bench_crypto_state_free, NULL);
+    monotime_t start, end;
+    int round;
+
+    tor_assert(tp);
+    monotime_get(&start);
+    /* Like RelayCryptoOffload, we have only one job per circuit in flight
+     * at a time, so that the cells on each circuit stay in order. */
+    for (round = 0; round < jobs_per_circ; ++round) {
+      for (i = 0; i < n_circs; ++i) {
+        ++bench_crypto_n_pending;
+        threadpool_queue_work(tp, bench_crypto_threadfn,
+                              bench_crypto_replyfn, &jobs[i]);
+      }
+      while (bench_crypto_n_pending) {
+        replyqueue_process(rq);
+      }
+    }
+    monotime_get(&end);
+
+    const int64_t usec = monotime_diff_usec(&start, &end);
+    const double n_cells = (double)n_circs * cells_per_job * jobs_per_circ;
+    printf("%d threads: %.0f cells per second.\n", n_threads,
+           n_cells * 1e6 / (usec ? usec : 1));
+
+    threadpool_queue_update(tp, NULL, bench_crypto_shutdown_threadfn,
+                            NULL, NULL);
+  }
+
+  for (i = 0; i < n_circs; ++i) {
+    crypto_cipher_free(jobs[i].cipher);
+    crypto_digest_free(jobs[i].digest);
+    tor_free(jobs[i].cells);
+  }
+  tor_free(jobs);
+}
+
+/** Work function for bench_workqueue(): mix a few bytes, about as much
+ * work as the smallest job that we give a cpuworker. */
+static workqueue_reply_t
+bench_workqueue_threadfn(void *state, void *arg)
+{
+  uint8_t *buf = arg;
+  (void) state;
+  crypto_digest256((char *)buf, (const char *)buf, DIGEST256_LEN,
+                   DIGEST_SHA256);
+  return WQ_RPL_REPLY;
+}
+
+/** How many bench_workqueue_threadfn() replies are we waiting for? */
+static int bench_workqueue_n_pending = 0;
+
+static void
+bench_workqueue_replyfn(void *arg)
+{
+  (void) arg;
+  --bench_workqueue_n_pending;
+}
+
+static void *
+bench_workqueue_state_new(void *arg)
+{
+  (void) arg;
+  return tor_malloc_zero(1);
+}
+
+static workqueue_reply_t
+bench_workqueue_shutdown_threadfn(void *state, void *arg)
+{
+  (void) arg;
+  tor_free(state);
+  return WQ_RPL_SHUTDOWN;
+}
+
+/** Run benchmarks for the threadpool itself: how many small jobs per
+ * second can we get through, with different numbers of threads, when we
+ * queue them in large batches? */
+static void
+bench_workqueue(void)
+{
+  const int batch = 4096;
+  const int n_batches = 64;
+  const int max_threads = MAX(get_num_cpus(get_options()), 4);
+  uint8_t *bufs = tor_calloc(batch, DIGEST256_LEN);
+  int n_threads;
+
+  for (n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+    replyqueue_t *rq = replyqueue_new(0);
+    threadpool_t *tp = threadpool_new(n_threads, rq,
+                                      bench_workqueue_state_new,
+                                      tor_free_, NULL);
+    monotime_t start, end;
+    int i, j;
+
+    tor_assert(tp);
+    monotime_get(&start);
+    for (j = 0; j < n_batches; ++j) {
+      for (i = 0; i < batch; ++i) {
+        ++bench_workqueue_n_pending;
+        threadpool_queue_work_priority(tp, i & 1 ? WQ_PRI_HIGH : WQ_PRI_LOW,
+                                       bench_workqueue_threadfn,
+                                       bench_workqueue_replyfn,
+                                       bufs + i * DIGEST256_LEN);
+      }
+      while (bench_workqueue_n_pending) {
+        replyqueue_process(rq);
+      }
+    }
+    monotime_get(&end);
+
+    const int64_t usec = monotime_diff_usec(&start, &end);
+    printf("%2d threads: %.0f jobs per second.\n", n_threads,
+           (double)batch * n_batches * 1e6 / (usec ? usec : 1));
+
+    threadpool_queue_update(tp, NULL, bench_workqueue_shutdown_threadfn,
+                            NULL, NULL);
+  }
+
+  tor_free(bufs);
+}
+
 static void
 bench_dh(void)
 {
@@ -739,6 +1497,809 @@ bench_md_parse(void)
   printf("Microdesc parse: %f nsec\n", NANOCOUNT(start, end, N));
 }
 
+/** Return a newly allocated microdesc consensus with <b>n_relays</b>
+ * router-status entries, about the size of the ones we see on the live
+ * network.  Nothing in it is signed; we only want to time the parser. */
+static char *
+bench_make_consensus(int n_relays)
+{
+  smartlist_t *chunks = smartlist_new();
+  char id_hex[HEX_DIGEST_LEN+1], sk_hex[HEX_DIGEST_LEN+1];
+  char id[DIGEST_LEN], sk[DIGEST_LEN];
+  char sig[256], sig_b64[512];
+  char *result;
+  int i;
+
+  crypto_rand(id, sizeof(id));
+  crypto_rand(sk, sizeof(sk));
+  crypto_rand(sig, sizeof(sig));
+  base16_encode(id_hex, sizeof(id_hex), id, sizeof(id));
+  base16_encode(sk_hex, sizeof(sk_hex), sk, sizeof(sk));
+  base64_encode(sig_b64, sizeof(sig_b64), sig, sizeof(sig),
+                BASE64_ENCODE_MULTILINE);
+
+  smartlist_add_asprintf(chunks,
+                         "network-status-version 3 microdesc\n"
+                         "vote-status consensus\n"
+                         "consensus-method 32\n"
+                         "valid-after 2023-01-01 00:00:00\n"
+                         "fresh-until 2023-01-01 01:00:00\n"
+                         "valid-until 2023-01-01 03:00:00\n"
+                         "voting-delay 300 300\n"
+                         "known-flags Exit Fast Guard HSDir Running Stable "
+                         "V2Dir Valid\n"
+                         "dir-source bench %s 192.0.2.1 192.0.2.1 80 443\n"
+                         "contact nobody\n"
+                         "vote-digest %s\n",
+                         id_hex, sk_hex);
+
+  for (i = 0; i < n_relays; ++i) {
+    char rid[DIGEST_LEN], md[DIGEST256_LEN];
+    char rid_b64[BASE64_DIGEST_LEN+1], md_b64[BASE64_DIGEST256_LEN+1];
+    crypto_rand(rid, sizeof(rid));
+    crypto_rand(md, sizeof(md));
+    /* The entries must be sorted by identity. */
+    set_uint32(rid, htonl(i));
+    digest_to_base64(rid_b64, rid);
+    digest256_to_base64(md_b64, md);
+    smartlist_add_asprintf(chunks,
+                           "r relay%d %s 2022-12-31 23:00:00 "
+                           "198.51.%d.%d 9001 0\n"
+                           "a [2001:db8::%x]:9001\n"
+                           "m %s\n"
+                           "s Fast Guard HSDir Running Stable V2Dir Valid\n"
+                           "v Tor 0.4.8.1\n"
+                           "pr Conflux=1 Cons=1-2 Desc=1-2 DirCache=2 "
+                           "FlowCtrl=1-2 HSDir=2 HSIntro=4-5 HSRend=1-2 "
+                           "Link=1-5 LinkAuth=1,3 Microdesc=1-2 Padding=2 "
+                           "Relay=1-4\n"
+                           "w Bandwidth=%d\n",
+                           i, rid_b64, (i >> 8) & 0xff, i & 0xff, i,
+                           md_b64, 100 + i);
+  }
+
+  smartlist_add_asprintf(chunks,
+                         "directory-footer\n"
+                         "directory-signature sha256 %s %s\n"
+                         "-----BEGIN SIGNATURE-----\n"
+                         "%s"
+                         "-----END SIGNATURE-----\n",
+                         id_hex, sk_hex, sig_b64);
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Time how long we take to parse a consensus the size of the live
+ * network's, with no worker threads and then with the cpuworker pool, which
+ * tokenizes its router-status entries in parallel. */
+static void
+bench_ns_parse(void)
+{
+  const int n_relays = 7000;
+  const int iters = 20;
+  char *text = bench_make_consensus(n_relays);
+  size_t len = strlen(text);
+  int pass, i;
+
+  printf("Consensus: %d relays, %d bytes\n", n_relays, (int)len);
+
+  for (pass = 0; pass < 2; ++pass) {
+    monotime_t start, end;
+    if (pass == 1) {
+      cpuworker_init();
+    }
+
+    monotime_get(&start);
+    for (i = 0; i < iters; ++i) {
+      networkstatus_t *ns;
+      ns = networkstatus_parse_vote_from_string(text, len, NULL,
+                                                NS_TYPE_CONSENSUS);
+      tor_assert(ns);
+      tor_assert(smartlist_len(ns->routerstatus_list) == n_relays);
+      networkstatus_vote_free(ns);
+    }
+    monotime_get(&end);
+
+    printf("%u worker threads: %.2f msec per consensus\n",
+           cpuworker_get_n_threads(),
+           monotime_diff_usec(&start, &end) / 1000.0 / iters);
+  }
+
+  tor_free(text);
+}
+
+/** Time the directory tokenizer on its own, over every line of a consensus
+ * the size of the live network's. */
+static void
+bench_tokenize(void)
+{
+  static token_rule_t table[] = {
+    T0N("r",                   K_R,                   GE(7),   NO_OBJ ),
+    T0N("a",                   K_A,                   GE(1),   NO_OBJ ),
+    T0N("m",                   K_M,               CONCAT_ARGS, NO_OBJ ),
+    T0N("s",                   K_S,                   ARGS,    NO_OBJ ),
+    T0N("v",                   K_V,               CONCAT_ARGS, NO_OBJ ),
+    T0N("pr",                  K_PROTO,           CONCAT_ARGS, NO_OBJ ),
+    T0N("w",                   K_W,                   ARGS,    NO_OBJ ),
+    T0N("directory-signature", K_DIRECTORY_SIGNATURE, GE(2), NEED_OBJ ),
+    END_OF_TABLE
+  };
+  const int iters = 10;
+  char *text = bench_make_consensus(7000);
+  const char *end = text + strlen(text);
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  int64_t best_usec = INT64_MAX;
+  int i, n_tokens = 0;
+
+  for (i = 0; i < iters; ++i) {
+    monotime_t start, stop;
+    monotime_get(&start);
+    if (tokenize_string(area, text, end, tokens, table, TS_NOCHECK) < 0)
+      tor_assert_unreached();
+    monotime_get(&stop);
+    best_usec = MIN(best_usec, monotime_diff_usec(&start, &stop));
+    n_tokens = smartlist_len(tokens);
+    SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+    smartlist_clear(tokens);
+    memarea_clear(area);
+  }
+
+  printf("Tokenize: %d tokens, %d bytes: %.2f msec (%.1f nsec per token)\n",
+         n_tokens, (int)(end - text), best_usec / 1000.0,
+         best_usec * 1000.0 / n_tokens);
+
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  tor_free(text);
+}
+
+/** Time how many three-hop paths we can choose per second from a nodelist
+ * the size of the live network's.
+ *
+ * We can't install a consensus here without signing it, so we build the
+ * nodelist from router descriptors and set each node's flags by hand. */
+static void
+bench_path_select(void)
+{
+  const int n_relays = 7000;
+  const int iters = 2000;
+  smartlist_t *routers = smartlist_new();
+  smartlist_t *excluded = smartlist_new();
+  monotime_t start, end;
+  int64_t usec;
+  int i;
+
+  for (i = 0; i < n_relays; ++i) {
+    routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+    node_t *node;
+    crypto_rand(ri->cache_info.identity_digest, DIGEST_LEN);
+    ri->purpose = ROUTER_PURPOSE_GENERAL;
+    ri->bandwidthrate = ri->bandwidthcapacity = 20000 + 10 * i;
+    ri->onion_curve25519_pkey =
+      tor_malloc_zero(sizeof(curve25519_public_key_t));
+    crypto_rand((char *)ri->onion_curve25519_pkey->public_key,
+                CURVE25519_PUBKEY_LEN);
+    smartlist_add(routers, ri);
+    node = nodelist_set_routerinfo(ri, NULL);
+    node->is_running = node->is_valid = 1;
+    node->is_fast = (i % 8) != 0;
+    node->is_stable = (i % 3) != 0;
+    node->is_possible_guard = (i % 4) == 0;
+    node->is_exit = (i % 5) == 0;
+  }
+  router_dir_info_changed();
+
+  monotime_get(&start);
+  for (i = 0; i < iters; ++i) {
+    const node_t *node;
+    smartlist_clear(excluded);
+    node = router_choose_random_node(excluded, NULL,
+                                     CRN_NEED_GUARD|CRN_NEED_UPTIME|
+                                     CRN_NEED_CAPACITY);
+    tor_assert(node);
+    smartlist_add(excluded, (void *)node);
+    node = router_choose_random_node(excluded, NULL, CRN_NEED_CAPACITY);
+    tor_assert(node);
+    smartlist_add(excluded, (void *)node);
+    node = router_choose_random_node(excluded, NULL,
+                                     CRN_NEED_UPTIME|CRN_NEED_CAPACITY);
+    tor_assert(node);
+  }
+  monotime_get(&end);
+  usec = monotime_diff_usec(&start, &end);
+
+  printf("%d relays: %.2f usec per path (%.0f paths per second)\n",
+         n_relays, ((double)usec) / iters, iters * 1e6 / usec);
+
+  nodelist_free_all();
+  SMARTLIST_FOREACH_BEGIN(routers, routerinfo_t *, ri) {
+    tor_free(ri->onion_curve25519_pkey);
+    tor_free(ri);
+  } SMARTLIST_FOREACH_END(ri);
+  smartlist_free(routers);
+  smartlist_free(excluded);
+}
+
+/** Helper: add a rule to <b>policy</b>. */
+static void
+bench_policy_add(smartlist_t *policy, addr_policy_action_t type,
+                 uint32_t addr, maskbits_t bits,
+                 uint16_t prt_min, uint16_t prt_max)
+{
+  addr_policy_t *p = tor_malloc_zero(sizeof(addr_policy_t));
+  p->policy_type = type;
+  tor_addr_from_ipv4h(&p->addr, addr);
+  p->maskbits = bits;
+  p->prt_min = prt_min;
+  p->prt_max = prt_max;
+  smartlist_add(policy, p);
+}
+
+/** Time exit policy lookups, walking the policy and in a compiled copy of
+ * it, for policies made of reject lists of growing length in front of a
+ * reduced exit policy. */
+static void
+bench_exit_policy(void)
+{
+  /* The ports that ReducedExitPolicy accepts, as ranges. */
+  static const uint16_t reduced_ports[][2] = {
+    {20,23}, {43,43}, {53,53}, {79,81}, {88,88}, {110,110}, {143,143},
+    {194,194}, {220,220}, {389,389}, {443,443}, {464,465}, {531,531},
+    {543,544}, {554,554}, {563,563}, {587,587}, {636,636}, {706,706},
+    {749,749}, {873,873}, {902,904}, {981,981}, {989,995}, {1194,1194},
+    {1220,1220}, {1293,1293}, {1500,1500}, {1533,1533}, {1677,1677},
+    {1723,1723}, {1755,1755}, {1863,1863}, {2082,2083}, {2086,2087},
+    {2095,2096}, {2102,2104}, {3128,3128}, {3389,3389}, {3690,3690},
+    {4321,4321}, {4643,4643}, {5050,5050}, {5190,5190}, {5222,5223},
+    {5228,5228}, {5900,5900}, {6660,6669}, {6679,6679}, {6697,6697},
+    {8000,8000}, {8008,8008}, {8074,8074}, {8080,8080}, {8082,8082},
+    {8087,8088}, {8232,8233}, {8332,8333}, {8443,8443}, {8888,8888},
+    {9418,9418}, {9999,9999}, {10000,10000}, {11371,11371},
+    {19294,19294}, {19638,19638}, {50002,50002}, {64738,64738},
+  };
+  const int n_lookups = 200000;
+  const int reject_lens[] = { 0, 64, 256, 1024, 4096, 16384 };
+  tor_addr_t *addrs = tor_calloc(n_lookups, sizeof(tor_addr_t));
+  uint16_t *ports = tor_calloc(n_lookups, sizeof(uint16_t));
+  unsigned i;
+  int j;
+
+  for (j = 0; j < n_lookups; ++j) {
+    tor_addr_from_ipv4h(&addrs[j], crypto_rand_u32());
+    ports[j] = (j % 2) ? 443 : 1 + crypto_rand_int(65535);
+  }
+
+  for (i = 0; i < ARRAY_LENGTH(reject_lens); ++i) {
+    smartlist_t *policy = smartlist_new();
+    addr_policy_trie_t *trie;
+    monotime_t start, end;
+    int64_t walk_usec, compile_usec, trie_usec;
+    int n_rejected = 0;
+    unsigned k;
+
+    /* Block lists are mostly single hosts and small networks. */
+    for (j = 0; j < reject_lens[i]; ++j) {
+      const maskbits_t bits = (j % 4) ? 32 : 16 + crypto_rand_int(9);
+      bench_policy_add(policy, ADDR_POLICY_REJECT, crypto_rand_u32(), bits,
+                       1, 65535);
+    }
+    for (k = 0; k < ARRAY_LENGTH(reduced_ports); ++k) {
+      bench_policy_add(policy, ADDR_POLICY_ACCEPT, 0, 0,
+                       reduced_ports[k][0], reduced_ports[k][1]);
+    }
+    bench_policy_add(policy, ADDR_POLICY_REJECT, 0, 0, 1, 65535);
+
+    monotime_get(&start);
+    for (j = 0; j < n_lookups; ++j) {
+      n_rejected += compare_tor_addr_to_addr_policy(&addrs[j], ports[j],
+                                                   policy)
+        == ADDR_POLICY_REJECTED;
+    }
+    monotime_get(&end);
+    walk_usec = monotime_diff_usec(&start, &end);
+
+    monotime_get(&start);
+    trie = addr_policy_trie_new(policy);
+    monotime_get(&end);
+    compile_usec = monotime_diff_usec(&start, &end);
+
+    monotime_get(&start);
+    for (j = 0; j < n_lookups; ++j) {
+      n_rejected -= addr_policy_trie_lookup(trie, &addrs[j], ports[j])
+        == ADDR_POLICY_REJECTED;
+    }
+    monotime_get(&end);
+    trie_usec = monotime_diff_usec(&start, &end);
+    tor_assert(n_rejected == 0);
+
+    printf("%5d rules: walk %8.1f nsec/lookup, compiled %6.1f nsec/lookup "
+           "(compiled in %.2f msec)\n",
+           smartlist_len(policy), walk_usec * 1000.0 / n_lookups,
+           trie_usec * 1000.0 / n_lookups, compile_usec / 1000.0);
+
+    addr_policy_trie_free(trie);
+    addr_policy_list_free(policy);
+  }
+
+  tor_free(addrs);
+  tor_free(ports);
+}
+
+/** Helper: write a synthetic geoip file for <b>family</b>, shaped like the
+ * real ones, to <b>fname</b>.  Return the number of ranges in it. */
+static int
+bench_write_geoip_file(sa_family_t family, const char *fname)
+{
+  smartlist_t *lines = smartlist_new();
+  char *text;
+  int n;
+
+  if (family == AF_INET) {
+    uint64_t addr = 1<<24;
+    while (addr < ((uint64_t)224)<<24) {
+      const uint64_t len = UINT64_C(1) << (8 + crypto_rand_int(9));
+      if (crypto_rand_int(10)) {
+        smartlist_add_asprintf(lines, "%u,%u,%c%c\n", (unsigned) addr,
+                               (unsigned) (addr + len - 1),
+                               'a' + crypto_rand_int(16),
+                               'a' + crypto_rand_int(16));
+      }
+      addr += len;
+    }
+  } else {
+    uint64_t hi = UINT64_C(0x2001) << 48;
+    while (hi < UINT64_C(0x2c10) << 48) {
+      const uint64_t len = UINT64_C(1) << (40 + crypto_rand_int(8));
+      if (crypto_rand_int(10)) {
+        const uint64_t last = hi + len - 1;
+        smartlist_add_asprintf(lines,
+          "%x:%x:%x:%x::,%x:%x:%x:%x:ffff:ffff:ffff:ffff,%c%c\n",
+          (unsigned)(hi>>48), (unsigned)(hi>>32) & 0xffff,
+          (unsigned)(hi>>16) & 0xffff, (unsigned)hi & 0xffff,
+          (unsigned)(last>>48), (unsigned)(last>>32) & 0xffff,
+          (unsigned)(last>>16) & 0xffff, (unsigned)last & 0xffff,
+          'a' + crypto_rand_int(16), 'a' + crypto_rand_int(16));
+      }
+      hi += len;
+    }
+  }
+  n = smartlist_len(lines);
+  text = smartlist_join_strings(lines, "", 0, NULL);
+  tor_assert(write_str_to_file(fname, text, 0) == 0);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(text);
+  return n;
+}
+
+/** Time loading synthetic geoip files, with and without a cache, and
+ * looking addresses up in them. */
+static void
+bench_geoip(void)
+{
+  const int n_lookups = 2000000;
+  const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  char *prefix = NULL;
+  int fam_idx;
+
+  tor_asprintf(&prefix, "%s/tor-bench-geoip-%u", tmpdir, crypto_rand_u32());
+
+  for (fam_idx = 0; fam_idx < 2; ++fam_idx) {
+    const sa_family_t family = fam_idx ? AF_INET6 : AF_INET;
+    char *fname = NULL, *cache_fname = NULL;
+    tor_addr_t *addrs = tor_calloc(1024, sizeof(tor_addr_t));
+    monotime_t start, end;
+    int64_t parse_usec, cache_usec, lookup_usec;
+    int i, n_ranges, sum = 0;
+
+    tor_asprintf(&fname, "%s-%d", prefix, fam_idx);
+    tor_asprintf(&cache_fname, "%s-%d.cache", prefix, fam_idx);
+    n_ranges = bench_write_geoip_file(family, fname);
+
+    monotime_get(&start);
+    tor_assert(geoip_load_file_with_cache(family, fname, cache_fname,
+                                          LOG_WARN) == 0);
+    monotime_get(&end);
+    parse_usec = monotime_diff_usec(&start, &end);
+
+    geoip_free_all();
+    monotime_get(&start);
+    tor_assert(geoip_load_file_with_cache(family, fname, cache_fname,
+                                          LOG_WARN) == 0);
+    monotime_get(&end);
+    cache_usec = monotime_diff_usec(&start, &end);
+
+    for (i = 0; i < 1024; ++i) {
+      if (family == AF_INET) {
+        tor_addr_from_ipv4h(&addrs[i], crypto_rand_u32());
+      } else {
+        uint8_t a[16];
+        crypto_rand((char *)a, sizeof(a));
+        a[0] = 0x20;
+        tor_addr_from_ipv6_bytes(&addrs[i], a);
+      }
+    }
+    monotime_get(&start);
+    for (i = 0; i < n_lookups; ++i)
+      sum += geoip_get_country_by_addr(&addrs[i & 1023]);
+    monotime_get(&end);
+    lookup_usec = monotime_diff_usec(&start, &end);
+
+    printf("%s, %d ranges: parse %.1f msec, load from cache %.1f msec, "
+           "%.1f nsec/lookup (%d)\n",
+           family == AF_INET ? "IPv4" : "IPv6", n_ranges,
+           parse_usec / 1000.0, cache_usec / 1000.0,
+           lookup_usec * 1000.0 / n_lookups, sum % 10);
+
+    geoip_free_all();
+    unlink(fname);
+    unlink(cache_fname);
+    tor_free(fname);
+    tor_free(cache_fname);
+    tor_free(addrs);
+  }
+  tor_free(prefix);
+}
+
+/** Time sending cells through the EWMA and log-domain EWMA circuitmux
+ * policies, one at a time from the best circuit, with a one-second tick so
+ * that the EWMA policy has to rescale its queue during the run. */
+static void
+bench_cmux_ewma(void)
+{
+  circuitmux_policy_t *policies[] = { &ewma_policy, &logewma_policy };
+  const char *names[] = { "EWMA", "LogEWMA" };
+  const int n_circs_list[] = { 16, 256, 4096, 65536 };
+  const int64_t run_usec = 1500000;
+  networkstatus_t ns;
+  circuitmux_t *cmux = circuitmux_alloc();
+  unsigned i, p;
+
+  memset(&ns, 0, sizeof(ns));
+  ns.net_params = smartlist_new();
+  smartlist_add_strdup(ns.net_params, "CircuitPriorityTickSecs=1");
+  cmux_ewma_set_options(NULL, &ns);
+
+  for (i = 0; i < ARRAY_LENGTH(n_circs_list); ++i) {
+    const int n_circs = n_circs_list[i];
+    circuit_t *circs = tor_calloc(n_circs, sizeof(circuit_t));
+    circuitmux_policy_circ_data_t **circ_data =
+      tor_calloc(n_circs, sizeof(circuitmux_policy_circ_data_t *));
+
+    for (p = 0; p < ARRAY_LENGTH(policies); ++p) {
+      circuitmux_policy_t *pol = policies[p];
+      circuitmux_policy_data_t *pol_data = pol->alloc_cmux_data(cmux);
+      monotime_t start, now;
+      int64_t usec;
+      uint64_t n_sent = 0;
+      int j;
+
+      for (j = 0; j < n_circs; ++j) {
+        circuit_t *circ = &circs[j];
+        circ_data[j] = pol->alloc_circ_data(cmux, pol_data, circ,
+                                            CELL_DIRECTION_OUT, 1);
+        pol->notify_circ_active(cmux, pol_data, circ, circ_data[j]);
+      }
+
+      monotime_get(&start);
+      do {
+        for (j = 0; j < 1000; ++j) {
+          circuit_t *circ = pol->pick_active_circuit(cmux, pol_data);
+          int idx = (int)(circ - circs);
+          pol->notify_xmit_cells(cmux, pol_data, circ, circ_data[idx], 1);
+        }
+        n_sent += 1000;
+        monotime_get(&now);
+        usec = monotime_diff_usec(&start, &now);
+      } while (usec < run_usec);
+
+      printf("%s, %d active circuits: %.1f nsec/cell\n",
+             names[p], n_circs, usec * 1000.0 / n_sent);
+
+      for (j = 0; j < n_circs; ++j) {
+        circuit_t *circ = &circs[j];
+        pol->notify_circ_inactive(cmux, pol_data, circ, circ_data[j]);
+        pol->free_circ_data(cmux, pol_data, circ, circ_data[j]);
+      }
+      pol->free_cmux_data(cmux, pol_data);
+    }
+    tor_free(circs);
+    tor_free(circ_data);
+  }
+
+  circuitmux_free(cmux);
+  cmux_ewma_set_options(NULL, NULL);
+  SMARTLIST_FOREACH(ns.net_params, char *, cp, tor_free(cp));
+  smartlist_free(ns.net_params);
+}
+
+#ifdef HAVE_KIST_SUPPORT
+/** Open <b>n</b> loopback TCP connections, and store the sending end of
+ * each in <b>out</b> and the receiving end in <b>in</b>. Return the number of
+ * connections we managed to open. */
+static int
+bench_open_tcp_pairs(int n, tor_socket_t *out, tor_socket_t *in)
+{
+  struct sockaddr_in sin;
+  socklen_t len = sizeof(sin);
+  tor_socket_t listener = socket(AF_INET, SOCK_STREAM, 0);
+  int i;
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  if (!SOCKET_OK(listener) ||
+      bind(listener, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+      listen(listener, 16) < 0 ||
+      getsockname(listener, (struct sockaddr *) &sin, &len) < 0) {
+    if (SOCKET_OK(listener))
+      tor_close_socket_simple(listener);
+    return 0;
+  }
+  for (i = 0; i < n; ++i) {
+    out[i] = socket(AF_INET, SOCK_STREAM, 0);
+    if (!SOCKET_OK(out[i]))
+      break;
+    if (connect(out[i], (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+        !SOCKET_OK(in[i] = accept(listener, NULL, NULL))) {
+      tor_close_socket_simple(out[i]);
+      break;
+    }
+  }
+  tor_close_socket_simple(listener);
+  return i;
+}
+
+/** Compare the system calls that KIST makes to learn about its sockets on
+ * each scheduling run, with and without KISTNotsentLowat, over a few thousand
+ * loopback connections. Loopback round trips are too short to matter, so we
+ * pretend that each connection has a round trip time between 20 and 200
+ * msec, as relay-to-relay connections do. */
+static void
+bench_kist_sock_info(void)
+{
+  const int n_socks = 2000;
+  const int run_interval_msec = 10;
+  const int n_runs = 100;
+  tor_socket_t *out = tor_calloc(n_socks, sizeof(tor_socket_t));
+  tor_socket_t *in = tor_calloc(n_socks, sizeof(tor_socket_t));
+  socket_table_ent_t *ents = tor_calloc(n_socks, sizeof(socket_table_ent_t));
+  uint32_t *rtts = tor_calloc(n_socks, sizeof(uint32_t));
+  char buf[16384];
+  monotime_coarse_t base, now;
+  monotime_t start, end;
+  int64_t kist_usec, lowat_usec;
+  uint64_t n_reads = 0;
+  int n, i, run, ok = 1;
+
+  n = bench_open_tcp_pairs(n_socks, out, in);
+  memset(buf, 'x', sizeof(buf));
+  for (i = 0; i < n; ++i) {
+    if (send(out[i], buf, sizeof(buf), 0) < 0)
+      ok = 0;
+    rtts[i] = (20 + crypto_rand_int(181)) * 1000;
+  }
+
+  /* KIST asks the kernel about every socket on every run. */
+  monotime_get(&start);
+  for (run = 0; run < n_runs; ++run) {
+    for (i = 0; i < n; ++i)
+      ok &= kist_read_socket_info(out[i], &ents[i]) == 0;
+  }
+  monotime_get(&end);
+  kist_usec = monotime_diff_usec(&start, &end);
+
+  /* With KISTNotsentLowat, it asks again once the info is stale. */
+  memset(ents, 0, n_socks * sizeof(socket_table_ent_t));
+  monotime_coarse_get(&base);
+  monotime_get(&start);
+  for (run = 0; run < n_runs; ++run) {
+    monotime_coarse_add_msec(&now, &base, run * run_interval_msec);
+    for (i = 0; i < n; ++i) {
+      if (!kist_socket_info_is_stale(&ents[i], &now))
+        continue;
+      ok &= kist_read_socket_info(out[i], &ents[i]) == 0;
+      ents[i].rtt = rtts[i];
+      ents[i].info_updated = now;
+      ents[i].info_valid = 1;
+      ++n_reads;
+    }
+  }
+  monotime_get(&end);
+  lowat_usec = monotime_diff_usec(&start, &end);
+
+  printf("%d sockets, %d runs, every %d msec%s:\n", n, n_runs,
+         run_interval_msec, ok ? "" : " (some calls failed)");
+  printf("  KIST: %.1f usec/run, %d syscalls/run\n",
+         (double) kist_usec / n_runs, 2 * n);
+  printf("  KIST with KISTNotsentLowat: %.1f usec/run, %.1f syscalls/run\n",
+         (double) lowat_usec / n_runs, 2.0 * n_reads / n_runs);
+
+  for (i = 0; i < n; ++i) {
+    tor_close_socket_simple(out[i]);
+    tor_close_socket_simple(in[i]);
+  }
+  tor_free(out);
+  tor_free(in);
+  tor_free(ents);
+  tor_free(rtts);
+}
+#endif /* defined(HAVE_KIST_SUPPORT) */
+
+/** Return the number of AP streams in the connection array that the old,
+ * scan-everything connection_ap_expire_beginning() would have given up on
+ * at <b>now</b>.  This does the checks it did for every connection, up to
+ * the point where it decided that a stream wasn't due yet. */
+static int
+bench_expire_scan(time_t now)
+{
+  const or_options_t *options = get_options();
+  int n_due = 0;
+
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    if (conn->type != CONN_TYPE_AP || conn->marked_for_close)
+      continue;
+    if (conn->state == AP_CONN_STATE_OPEN)
+      continue;
+    if (AP_CONN_STATE_IS_UNATTACHED(conn->state)) {
+      if (now - conn->timestamp_created >= options->SocksTimeout &&
+          !TO_ENTRY_CONN(conn)->hs_with_pow_conn)
+        ++n_due;
+      continue;
+    }
+    if (now - conn->timestamp_last_read_allowed >= 10)
+      ++n_due;
+  } SMARTLIST_FOREACH_END(conn);
+
+  return n_due;
+}
+
+/** Return the number of OR connections in the connection array that the
+ * old run_connection_housekeeping() would have closed at <b>now</b>.  This
+ * does the checks it did for every connection, up to the point where it
+ * decided that a connection could stay open. */
+static int
+bench_or_expire_scan(time_t now)
+{
+  const or_options_t *options = get_options();
+  int n_due = 0;
+
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    or_connection_t *or_conn;
+    channel_t *chan;
+    int have_any_circuits;
+    if (conn->type != CONN_TYPE_OR || conn->marked_for_close)
+      continue;
+    or_conn = TO_OR_CONN(conn);
+    chan = TLS_CHAN_TO_BASE(or_conn->chan);
+    have_any_circuits = channel_num_circuits(chan) != 0;
+    if (have_any_circuits)
+      chan->timestamp_last_had_circuits = now;
+    if (channel_is_bad_for_new_circs(chan) && !have_any_circuits)
+      ++n_due;
+    else if (!connection_state_is_open(conn))
+      n_due += now >=
+        conn->timestamp_last_write_allowed + options->KeepalivePeriod;
+    else if (we_are_hibernating() && !have_any_circuits &&
+             !connection_get_outbuf_len(conn))
+      ++n_due;
+    else if (!have_any_circuits &&
+             now - or_conn->idle_timeout >= chan->timestamp_last_had_circuits)
+      ++n_due;
+    else if (
+      now >= or_conn->timestamp_lastempty + options->KeepalivePeriod*10 &&
+      now >= conn->timestamp_last_write_allowed + options->KeepalivePeriod*10)
+      ++n_due;
+  } SMARTLIST_FOREACH_END(conn);
+
+  return n_due;
+}
+
+/** Time the once-a-second checks for connections that have waited too
+ * long, on a relay-sized connection array: tens of thousands of OR
+ * connections and a few SOCKS streams, none of which are due.  Scanning the
+ * array costs time proportional to the number of connections; the expiry
+ * timer wheels cost time proportional to the number of connections that are
+ * due.  What's left of run_connection_housekeeping(), keepalives and padding,
+ * still looks at every connection. */
+static void
+bench_conn_expiry(void)
+{
+  const int n_or = 50000;
+  const int n_ap = 1000;
+  const int iters = 1000;
+  const time_t now = time(NULL);
+  smartlist_t *conns;
+  or_connection_t **or_conns = tor_calloc(n_or, sizeof(or_connection_t *));
+  entry_connection_t **ap_conns = tor_calloc(n_ap,
+                                             sizeof(entry_connection_t *));
+  uint64_t start, end;
+  int i, n_due = 0;
+
+  /* OR connections are open and busy.  Streams are spread out among them;
+   * they are waiting for a controller to attach them, and have SocksTimeout
+   * seconds to go. */
+  tor_init_connection_lists();
+  conns = get_connection_array();
+  update_approx_time(now);
+  consider_hibernation(now);
+  for (i = 0; i < n_or; ++i) {
+    or_connection_t *or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+    or_conns[i] = or_conn;
+    tor_addr_from_ipv4h(&TO_CONN(or_conn)->addr, 0x12000000 + i);
+    channel_tls_handle_incoming(or_conn);
+    TO_CONN(or_conn)->state = OR_CONN_STATE_OPEN;
+    TO_CONN(or_conn)->timestamp_last_write_allowed = now;
+    or_conn->timestamp_lastempty = now;
+    TO_CONN(or_conn)->conn_array_index = smartlist_len(conns);
+    smartlist_add(conns, TO_CONN(or_conn));
+    connection_or_schedule_expiry(or_conn);
+    if (i % (n_or / n_ap) == 0) {
+      entry_connection_t *ec = entry_connection_new(CONN_TYPE_AP, AF_INET);
+      ap_conns[i / (n_or / n_ap)] = ec;
+      connection_entry_set_controller_wait(ec);
+      ENTRY_TO_CONN(ec)->conn_array_index = smartlist_len(conns);
+      smartlist_add(conns, ENTRY_TO_CONN(ec));
+    }
+  }
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    n_due += bench_expire_scan(time(NULL));
+  end = perftime();
+  printf("%d OR conns, %d streams: scanning every connection: "
+         "%.2f usec/run\n", n_or, n_ap, NANOCOUNT(start, end, iters) / 1e3);
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    connection_ap_expire_beginning();
+  end = perftime();
+  printf("%d OR conns, %d streams: expiry timer wheel: "
+         "%.2f usec/run%s\n", n_or, n_ap, NANOCOUNT(start, end, iters) / 1e3,
+         n_due ? " (some streams were due)" : "");
+
+  n_due = 0;
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    n_due += bench_or_expire_scan(now);
+  end = perftime();
+  printf("%d OR conns: closing idle OR conns, scanning every connection: "
+         "%.2f usec/run%s\n", n_or, NANOCOUNT(start, end, iters) / 1e3,
+         n_due ? " (some OR conns were due)" : "");
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    connection_or_expire_idle(now);
+  end = perftime();
+  printf("%d OR conns: closing idle OR conns, expiry timer wheel: "
+         "%.2f usec/run\n", n_or, NANOCOUNT(start, end, iters) / 1e3);
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    run_all_connection_housekeeping(now);
+  end = perftime();
+  printf("%d OR conns: all connection housekeeping: %.2f usec/run\n",
+         n_or, NANOCOUNT(start, end, iters) / 1e3);
+
+  SMARTLIST_FOREACH(conns, connection_t *, conn,
+                    conn->conn_array_index = -1);
+  smartlist_clear(conns);
+  for (i = 0; i < n_ap; ++i)
+    connection_free_(ENTRY_TO_CONN(ap_conns[i]));
+  for (i = 0; i < n_or; ++i)
+    connection_free_(TO_CONN(or_conns[i]));
+  channel_free_all();
+  tor_free(or_conns);
+  tor_free(ap_conns);
+  connection_edge_free_all();
+  connection_or_free_all();
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -761,6 +2322,11 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cell_crypto_threads),
+  ENT(workqueue),
+  ENT(cell_alloc),
+  ENT(buf_socket_io),
+  ENT(buf_uring),
   ENT(dh),
 
 #ifdef ENABLE_OPENSSL
@@ -769,6 +2335,16 @@ static struct benchmark_t benchmarks[] = {
 #endif
 
   ENT(md_parse),
+  ENT(ns_parse),
+  ENT(tokenize),
+  ENT(path_select),
+  ENT(exit_policy),
+  ENT(geoip),
+  ENT(cmux_ewma),
+  ENT(conn_expiry),
+#ifdef HAVE_KIST_SUPPORT
+  ENT(kist_sock_info),
+#endif
   {NULL,NULL,0}
 };
 
@@ -855,6 +2431,10 @@ main(int argc, const char **argv)
     return 1;
   }
 
+  struct tor_libevent_cfg_t cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+
   for (benchmark_t *b = benchmarks; b->name; ++b) {
     if (b->enabled || n_enabled == 0) {
       printf("===== %s =====\n", b->name);
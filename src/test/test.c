@@ -32,7 +32,9 @@
 #define ROUTER_PRIVATE
 #define CIRCUITSTATS_PRIVATE
 #define CIRCUITLIST_PRIVATE
+#define CPUWORKER_PRIVATE
 #define MAINLOOP_PRIVATE
+#define RELAY_CRYPTO_OFFLOAD_PRIVATE
 #define STATEFILE_PRIVATE
 
 #include "core/or/or.h"
@@ -40,26 +42,38 @@
 #include "lib/buf/buffers.h"
 #include "core/or/circuitlist.h"
 #include "core/or/circuitstats.h"
+#include "core/or/command.h"
 #include "lib/compress/compress.h"
 #include "app/config/config.h"
 #include "core/or/connection_edge.h"
 #include "core/or/extendinfo.h"
 #include "test/test.h"
+#include "core/mainloop/cpuworker.h"
 #include "core/mainloop/mainloop.h"
 #include "lib/memarea/memarea.h"
 #include "core/or/onion.h"
+#include "core/crypto/onion_crypto.h"
 #include "core/crypto/onion_ntor.h"
 #include "core/crypto/onion_fast.h"
 #include "core/crypto/onion_tap.h"
+#include "core/crypto/relay_crypto.h"
 #include "core/or/policies.h"
+#include "core/or/relay.h"
+#include "core/or/relay_crypto_offload.h"
 #include "lib/sandbox/sandbox.h"
 #include "app/config/statefile.h"
 #include "lib/crypt_ops/crypto_curve25519.h"
 #include "feature/nodelist/networkstatus.h"
 
+#include "core/or/cell_st.h"
 #include "core/or/extend_info_st.h"
 #include "core/or/or_circuit_st.h"
 #include "feature/relay/onion_queue.h"
+#include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/workqueue.h"
+#include "lib/thread/threads.h"
+#include "lib/time/compat_time.h"
+#include "test/fakechans.h"
 
 /** Run unit tests for the onion handshake code. */
 static void
@@ -266,6 +280,89 @@ test_ntor_handshake(void *arg)
   dimap_free(s_keymap, NULL);
 }
 
+#define N_BATCH_HANDSHAKES 5
+
+/** Run a batch of server-side handshakes, some of them ntor, some of them
+ * not, some of them bad, and make sure that each one gets the answer it
+ * would have gotten on its own. */
+static void
+test_ntor_handshake_batch(void *arg)
+{
+  ntor_handshake_state_t *c_ntor[N_BATCH_HANDSHAKES];
+  fast_handshake_state_t *c_fast = NULL;
+  uint8_t c_buf[N_BATCH_HANDSHAKES][NTOR_ONIONSKIN_LEN];
+  uint8_t c_keys[CPATH_KEY_MATERIAL_LEN];
+  server_onion_keys_t s_keys;
+  curve25519_keypair_t s_keypair;
+  onion_server_handshake_t hs[N_BATCH_HANDSHAKES];
+  uint8_t s_reply[N_BATCH_HANDSHAKES][CELL_PAYLOAD_SIZE];
+  uint8_t s_keys_out[N_BATCH_HANDSHAKES][CPATH_KEY_MATERIAL_LEN];
+  uint8_t s_nonce[N_BATCH_HANDSHAKES][DIGEST_LEN];
+  circuit_params_t s_params[N_BATCH_HANDSHAKES], ns_params;
+  int i;
+
+  (void) arg;
+  memset(c_ntor, 0, sizeof(c_ntor));
+  memset(&s_keys, 0, sizeof(s_keys));
+  memset(&ns_params, 0, sizeof(ns_params));
+  memset(hs, 0, sizeof(hs));
+
+  curve25519_keypair_generate(&s_keypair, 0);
+  dimap_add_entry(&s_keys.curve25519_key_map, s_keypair.pubkey.public_key,
+                  &s_keypair);
+  memcpy(s_keys.my_identity, "abcdefghijklmnopqrst", DIGEST_LEN);
+
+  /* 0, 1 and 4 are good ntor handshakes; 2 is a CREATE_FAST handshake; 3
+   * is an ntor handshake with a point of small order, which must not spoil
+   * the others. */
+  for (i = 0; i < N_BATCH_HANDSHAKES; ++i) {
+    hs[i].type = ONION_HANDSHAKE_TYPE_NTOR;
+    hs[i].onion_skin = c_buf[i];
+    hs[i].onionskin_len = NTOR_ONIONSKIN_LEN;
+    hs[i].ns_params = &ns_params;
+    hs[i].reply_out = s_reply[i];
+    hs[i].reply_out_maxlen = sizeof(s_reply[i]);
+    hs[i].keys_out = s_keys_out[i];
+    hs[i].key_out_len = sizeof(s_keys_out[i]);
+    hs[i].rend_nonce_out = s_nonce[i];
+    hs[i].negotiated_params_out = &s_params[i];
+    if (i == 2) {
+      hs[i].type = ONION_HANDSHAKE_TYPE_FAST;
+      hs[i].onionskin_len = CREATE_FAST_LEN;
+      tt_int_op(0, OP_EQ, fast_onionskin_create(&c_fast, c_buf[i]));
+    } else {
+      tt_int_op(0, OP_EQ, onion_skin_ntor_create(s_keys.my_identity,
+                                                 &s_keypair.pubkey,
+                                                 &c_ntor[i], c_buf[i]));
+    }
+  }
+  memset(c_buf[3] + DIGEST_LEN + DIGEST256_LEN, 0, CURVE25519_PUBKEY_LEN);
+
+  onion_skin_server_handshake_batch(hs, N_BATCH_HANDSHAKES, &s_keys);
+
+  tt_int_op(hs[2].result, OP_EQ, CREATED_FAST_LEN);
+  tt_int_op(0, OP_EQ, fast_client_handshake(c_fast, s_reply[2], c_keys,
+                                            sizeof(c_keys), NULL));
+  tt_mem_op(c_keys, OP_EQ, s_keys_out[2], sizeof(c_keys));
+  tt_int_op(hs[3].result, OP_EQ, -1);
+  for (i = 0; i < N_BATCH_HANDSHAKES; ++i) {
+    if (i == 2 || i == 3)
+      continue;
+    tt_int_op(hs[i].result, OP_EQ, NTOR_REPLY_LEN);
+    tt_int_op(0, OP_EQ, onion_skin_ntor_client_handshake(c_ntor[i],
+                                                         s_reply[i], c_keys,
+                                                         sizeof(c_keys),
+                                                         NULL));
+    tt_mem_op(c_keys, OP_EQ, s_keys_out[i], sizeof(c_keys));
+  }
+
+ done:
+  for (i = 0; i < N_BATCH_HANDSHAKES; ++i)
+    ntor_handshake_state_free(c_ntor[i]);
+  fast_handshake_state_free(c_fast);
+  dimap_free(s_keys.curve25519_key_map, NULL);
+}
+
 static void
 test_fast_handshake(void *arg)
 {
@@ -471,6 +568,517 @@ test_onion_queue_order(void *arg)
   tor_free(create_v3ntor2);
 }
 
+static void
+test_onion_batch_size(void *arg)
+{
+  (void)arg;
+
+  /* Under light load, every onionskin gets its own work item. */
+  tt_int_op(cpuworker_get_batch_size(0, 4), OP_EQ, 1);
+  tt_int_op(cpuworker_get_batch_size(1, 4), OP_EQ, 1);
+  tt_int_op(cpuworker_get_batch_size(4, 4), OP_EQ, 1);
+  /* Otherwise, every thread gets a share. */
+  tt_int_op(cpuworker_get_batch_size(5, 4), OP_EQ, 2);
+  tt_int_op(cpuworker_get_batch_size(12, 4), OP_EQ, 3);
+  tt_int_op(cpuworker_get_batch_size(7, 1), OP_EQ, 7);
+  tt_int_op(cpuworker_get_batch_size(7, 0), OP_EQ, 7);
+  /* But no work item is too large. */
+  tt_int_op(cpuworker_get_batch_size(1000, 4), OP_EQ, CPUWORKER_MAX_BATCH);
+  tt_int_op(cpuworker_get_batch_size(CPUWORKER_MAX_BATCH + 1, 1), OP_EQ,
+            CPUWORKER_MAX_BATCH);
+
+ done:
+  ;
+}
+
+/** Protects the onion_batch_* fields below, which the cpuworker threads
+ * share with test_onion_batch_cancel(). */
+static tor_mutex_t onion_batch_lock;
+/** Signalled when we open one of the gates below. */
+static tor_cond_t onion_batch_cond;
+/** How many threads are waiting behind a blocker job? */
+static int onion_batch_n_blocked = 0;
+/** How many onionskin batches have started to run? */
+static int onion_batch_n_started = 0;
+/** How many replies to gated jobs have we handled?  Main thread only. */
+static int onion_batch_n_replied = 0;
+/** True once the blocker jobs may finish. */
+static int onion_batch_blockers_open = 0;
+/** True once the onionskin batches may go on to run their handshakes. */
+static int onion_batch_batches_open = 0;
+
+/** A job that mock_cpuworker_queue_work_gated() queued, with the functions
+ * that the caller asked us to run for it. */
+typedef struct onion_batch_gated_t {
+  void *arg;
+  workqueue_reply_t (*fn)(void *, void *);
+  void (*reply_fn)(void *);
+} onion_batch_gated_t;
+#define ONION_BATCH_MAX_GATED 16
+/** The jobs that we have queued, in order. */
+static onion_batch_gated_t onion_batch_gated[ONION_BATCH_MAX_GATED];
+static int onion_batch_n_gated = 0;
+
+/** Return the most recent job that we queued for <b>arg</b>. */
+static onion_batch_gated_t *
+onion_batch_find_gated(void *arg)
+{
+  onion_batch_gated_t *found = NULL;
+  int i;
+  tor_mutex_acquire(&onion_batch_lock);
+  for (i = 0; i < onion_batch_n_gated; ++i) {
+    if (onion_batch_gated[i].arg == arg)
+      found = &onion_batch_gated[i];
+  }
+  tor_mutex_release(&onion_batch_lock);
+  tor_assert(found);
+  return found;
+}
+
+/** Worker function: keep a cpuworker thread busy until the test lets it
+ * go. */
+static workqueue_reply_t
+onion_batch_block_threadfn(void *state, void *arg)
+{
+  (void)state;
+  (void)arg;
+  tor_mutex_acquire(&onion_batch_lock);
+  ++onion_batch_n_blocked;
+  while (!onion_batch_blockers_open)
+    tor_cond_wait(&onion_batch_cond, &onion_batch_lock, NULL);
+  tor_mutex_release(&onion_batch_lock);
+  return WQ_RPL_REPLY;
+}
+
+static void
+onion_batch_block_replyfn(void *arg)
+{
+  (void)arg;
+}
+
+/** Worker function: note that a batch of onionskins has started, and wait
+ * for the test to let it run. */
+static workqueue_reply_t
+onion_batch_gated_threadfn(void *state, void *arg)
+{
+  tor_mutex_acquire(&onion_batch_lock);
+  ++onion_batch_n_started;
+  while (!onion_batch_batches_open)
+    tor_cond_wait(&onion_batch_cond, &onion_batch_lock, NULL);
+  tor_mutex_release(&onion_batch_lock);
+  return onion_batch_find_gated(arg)->fn(state, arg);
+}
+
+/** Reply function: run the real reply function for <b>arg</b>, and count
+ * the reply. */
+static void
+onion_batch_gated_replyfn(void *arg)
+{
+  onion_batch_find_gated(arg)->reply_fn(arg);
+  ++onion_batch_n_replied;
+}
+
+/** Mock for cpuworker_queue_work: queue the work for real, but hold each
+ * job in onion_batch_gated_threadfn() once it has started. */
+static workqueue_entry_t *
+mock_cpuworker_queue_work_gated(workqueue_priority_t priority,
+                                workqueue_reply_t (*fn)(void *, void *),
+                                void (*reply_fn)(void *),
+                                void *arg)
+{
+  tor_mutex_acquire(&onion_batch_lock);
+  tor_assert(onion_batch_n_gated < ONION_BATCH_MAX_GATED);
+  onion_batch_gated[onion_batch_n_gated].arg = arg;
+  onion_batch_gated[onion_batch_n_gated].fn = fn;
+  onion_batch_gated[onion_batch_n_gated].reply_fn = reply_fn;
+  ++onion_batch_n_gated;
+  tor_mutex_release(&onion_batch_lock);
+  return cpuworker_queue_work__real(priority, onion_batch_gated_threadfn,
+                                    onion_batch_gated_replyfn, arg);
+}
+
+/** Mock for circuit_mark_for_close_: remember why we closed the circuit,
+ * but don't actually close it, so that the test can look at it. */
+static void
+mock_circuit_mark_for_close_record(circuit_t *circ, int reason, int line,
+                                   const char *file)
+{
+  circ->marked_for_close = line;
+  circ->marked_for_close_file = file;
+  circ->marked_for_close_reason = reason;
+}
+
+/** Run the main loop for a moment, to handle any pending events and
+ * replies from the cpuworkers. */
+static void
+onion_batch_run_loop(void)
+{
+  const struct timeval tv = { 0, 1000 };
+  tor_libevent_exit_loop_after_delay(tor_libevent_get_base(), &tv);
+  tor_libevent_run_event_loop(tor_libevent_get_base(), 0);
+}
+
+/** Wait until *<b>var</b>, which is protected by onion_batch_lock, reaches
+ * <b>target</b>.  Return 0 on success, or -1 if we waited too long. */
+static int
+onion_batch_wait_for(const int *var, int target)
+{
+  int i, v;
+  for (i = 0; i < 10000; ++i) {
+    tor_mutex_acquire(&onion_batch_lock);
+    v = *var;
+    tor_mutex_release(&onion_batch_lock);
+    if (v >= target)
+      return 0;
+    onion_batch_run_loop();
+  }
+  return -1;
+}
+
+/** Open the gate at *<b>gate</b>, which is protected by onion_batch_lock. */
+static void
+onion_batch_open(int *gate)
+{
+  tor_mutex_acquire(&onion_batch_lock);
+  *gate = 1;
+  tor_cond_signal_all(&onion_batch_cond);
+  tor_mutex_release(&onion_batch_lock);
+}
+
+/** Return a CREATE_FAST cell that the cpuworkers will fail to answer. */
+static create_cell_t *
+onion_batch_bad_create_cell(void)
+{
+  create_cell_t *cc = tor_malloc_zero(sizeof(create_cell_t));
+  cc->cell_type = CELL_CREATE_FAST;
+  cc->handshake_type = ONION_HANDSHAKE_TYPE_FAST;
+  /* A zero-length onionskin makes the handshake fail, without needing any
+   * onion keys. */
+  cc->handshake_len = 0;
+  return cc;
+}
+
+/** Check that cancelling one circuit's handshake leaves the rest of its
+ * batch alone, whether or not the batch has started to run, and that every
+ * circuit that is still waiting gets its own answer. */
+static void
+test_onion_batch_cancel(void *arg)
+{
+#define N_BATCH_CIRCS 6
+  or_circuit_t *circs[N_BATCH_CIRCS];
+  channel_t *chan = NULL;
+  workqueue_entry_t *first_entry, *second_entry;
+  int i;
+  (void)arg;
+
+  memset(circs, 0, sizeof(circs));
+  tor_mutex_init(&onion_batch_lock);
+  tor_cond_init(&onion_batch_cond);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work_gated);
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close_record);
+
+  /* Two threads, so that our six circuits go out in two batches of three. */
+  get_options_mutable()->NumCPUs = 2;
+  cpuworker_init();
+  tt_uint_op(cpuworker_get_n_threads(), OP_EQ, 2);
+  tt_int_op(cpuworker_get_batch_size(N_BATCH_CIRCS, 2), OP_EQ, 3);
+
+  /* Keep both threads busy, so that our batches stay queued. */
+  for (i = 0; i < 2; ++i) {
+    tt_assert(cpuworker_queue_work__real(WQ_PRI_HIGH,
+                                         onion_batch_block_threadfn,
+                                         onion_batch_block_replyfn, NULL));
+  }
+  tt_int_op(onion_batch_wait_for(&onion_batch_n_blocked, 2), OP_EQ, 0);
+
+  chan = new_fake_channel();
+  for (i = 0; i < N_BATCH_CIRCS; ++i) {
+    /* Don't put the circuit on the channel's maps: the cpuworker code only
+     * checks that it has a channel. */
+    circs[i] = or_circuit_new(0, NULL);
+    circs[i]->p_chan = chan;
+    TO_CIRCUIT(circs[i])->purpose = CIRCUIT_PURPOSE_OR;
+    TO_CIRCUIT(circs[i])->state = CIRCUIT_STATE_ONIONSKIN_PENDING;
+    tt_int_op(assign_onionskin_to_cpuworker(circs[i],
+                                            onion_batch_bad_create_cell()),
+              OP_EQ, 0);
+    /* Nothing goes to the threads until the main loop runs again. */
+    tt_ptr_op(circs[i]->workqueue_entry, OP_EQ, NULL);
+  }
+  onion_batch_run_loop();
+
+  first_entry = circs[0]->workqueue_entry;
+  second_entry = circs[3]->workqueue_entry;
+  tt_assert(first_entry);
+  tt_assert(second_entry);
+  tt_ptr_op(first_entry, OP_NE, second_entry);
+  tt_ptr_op(circs[1]->workqueue_entry, OP_EQ, first_entry);
+  tt_ptr_op(circs[2]->workqueue_entry, OP_EQ, first_entry);
+  tt_ptr_op(circs[4]->workqueue_entry, OP_EQ, second_entry);
+  tt_ptr_op(circs[5]->workqueue_entry, OP_EQ, second_entry);
+
+  /* Cancel a circuit whose batch is still queued: the rest of its batch
+   * goes back on the queue without it. */
+  cpuworker_cancel_circ_handshake(circs[1]);
+  tt_ptr_op(circs[1]->workqueue_entry, OP_EQ, NULL);
+  tt_assert(circs[0]->workqueue_entry);
+  tt_ptr_op(circs[0]->workqueue_entry, OP_EQ, circs[2]->workqueue_entry);
+  tt_ptr_op(circs[4]->workqueue_entry, OP_EQ, second_entry);
+  circs[1]->p_chan = NULL;
+  circuit_free_(TO_CIRCUIT(circs[1]));
+  circs[1] = NULL;
+
+  /* Let both batches start. */
+  onion_batch_open(&onion_batch_blockers_open);
+  tt_int_op(onion_batch_wait_for(&onion_batch_n_started, 2), OP_EQ, 0);
+
+  /* Cancel a circuit whose batch is already running: we can't, so it keeps
+   * its entry, and freeing it leaves the memory for the reply to free. */
+  cpuworker_cancel_circ_handshake(circs[4]);
+  tt_ptr_op(circs[4]->workqueue_entry, OP_EQ, second_entry);
+  tt_ptr_op(circs[3]->workqueue_entry, OP_EQ, second_entry);
+  circs[4]->p_chan = NULL;
+  circuit_free_(TO_CIRCUIT(circs[4]));
+  tt_uint_op(circs[4]->base_.magic, OP_EQ, DEAD_CIRCUIT_MAGIC);
+  circs[4] = NULL;
+
+  /* Close one circuit ourselves before its answer arrives. */
+  circuit_mark_for_close(TO_CIRCUIT(circs[0]), END_CIRC_REASON_FINISHED);
+
+  onion_batch_open(&onion_batch_batches_open);
+  for (i = 0; i < 10000; ++i) {
+    if (!circs[0]->workqueue_entry && !circs[2]->workqueue_entry &&
+        !circs[3]->workqueue_entry && !circs[5]->workqueue_entry)
+      break;
+    onion_batch_run_loop();
+  }
+
+  /* Every remaining circuit got its own answer: the failed handshake closed
+   * the open ones, and left the one that we had closed alone. */
+  tt_ptr_op(circs[0]->workqueue_entry, OP_EQ, NULL);
+  tt_int_op(circs[0]->base_.marked_for_close_reason, OP_EQ,
+            END_CIRC_REASON_FINISHED);
+  tt_ptr_op(circs[2]->workqueue_entry, OP_EQ, NULL);
+  tt_int_op(circs[2]->base_.marked_for_close_reason, OP_EQ,
+            END_CIRC_REASON_TORPROTOCOL);
+  tt_ptr_op(circs[3]->workqueue_entry, OP_EQ, NULL);
+  tt_int_op(circs[3]->base_.marked_for_close_reason, OP_EQ,
+            END_CIRC_REASON_TORPROTOCOL);
+  tt_ptr_op(circs[5]->workqueue_entry, OP_EQ, NULL);
+  tt_int_op(circs[5]->base_.marked_for_close_reason, OP_EQ,
+            END_CIRC_REASON_TORPROTOCOL);
+
+ done:
+  onion_batch_open(&onion_batch_blockers_open);
+  onion_batch_open(&onion_batch_batches_open);
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(circuit_mark_for_close_);
+  for (i = 0; i < N_BATCH_CIRCS; ++i) {
+    if (circs[i] && !circs[i]->workqueue_entry) {
+      circs[i]->p_chan = NULL;
+      circuit_free_(TO_CIRCUIT(circs[i]));
+    }
+  }
+  free_fake_channel(chan);
+#undef N_BATCH_CIRCS
+}
+
+/** Key material for the circuits in the relay_crypto_* tests. */
+static const char RELAY_CRYPTO_KEYS[CPATH_KEY_MATERIAL_LEN] =
+  "'The worker thread is still busy with that cell', said Tom patiently.";
+/** The relay cells that reached circuit_receive_decrypted_relay_cell(). */
+static smartlist_t *relay_crypto_received = NULL;
+
+/** Mock for circuit_receive_decrypted_relay_cell: remember the cell. */
+static int
+mock_circuit_receive_decrypted_relay_cell_record(cell_t *cell,
+                                                 circuit_t *circ,
+                                                 cell_direction_t dir,
+                                                 crypt_path_t *layer_hint,
+                                                 char recognized)
+{
+  (void)circ;
+  (void)dir;
+  (void)layer_hint;
+  (void)recognized;
+  smartlist_add(relay_crypto_received, tor_memdup(cell, sizeof(cell_t)));
+  return 0;
+}
+
+/** Return a new OR circuit with forward crypto state, as a relay would have
+ * once the circuit was open. */
+static or_circuit_t *
+relay_crypto_circ_new(void)
+{
+  or_circuit_t *circ = or_circuit_new(0, NULL);
+  TO_CIRCUIT(circ)->purpose = CIRCUIT_PURPOSE_OR;
+  TO_CIRCUIT(circ)->state = CIRCUIT_STATE_OPEN;
+  relay_crypto_init(&circ->crypto, RELAY_CRYPTO_KEYS,
+                    sizeof(RELAY_CRYPTO_KEYS), 0, 0);
+  return circ;
+}
+
+/** Check that a DESTROY cell from behind doesn't overtake the relay cells
+ * that a worker is still decrypting: they get handled first, and the
+ * circuit closes afterwards. */
+static void
+test_relay_crypto_destroy_held(void *arg)
+{
+  or_circuit_t *circ = NULL, *ref = NULL;
+  channel_t *chan = NULL;
+  cell_t cells[3], expected[2], destroy;
+  crypt_path_t *layer_hint = NULL;
+  char recognized = 0;
+  int i;
+  (void)arg;
+
+  relay_crypto_received = smartlist_new();
+  tor_mutex_init(&onion_batch_lock);
+  tor_cond_init(&onion_batch_cond);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work_gated);
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close_record);
+  MOCK(circuit_receive_decrypted_relay_cell,
+       mock_circuit_receive_decrypted_relay_cell_record);
+
+  get_options_mutable()->NumCPUs = 1;
+  get_options_mutable()->RelayCryptoOffload = 1;
+  cpuworker_init();
+
+  chan = new_fake_channel();
+  circ = relay_crypto_circ_new();
+  circuit_set_p_circid_chan(circ, 7, chan);
+  /* A circuit with the same keys tells us what the cells decrypt to. */
+  ref = relay_crypto_circ_new();
+  for (i = 0; i < 3; ++i) {
+    crypto_rand((char *)&cells[i], sizeof(cells[i]));
+    cells[i].circ_id = 7;
+    cells[i].command = CELL_RELAY;
+  }
+  for (i = 0; i < 2; ++i) {
+    memcpy(&expected[i], &cells[i], sizeof(cell_t));
+    tt_int_op(relay_decrypt_cell(TO_CIRCUIT(ref), &expected[i],
+                                 CELL_DIRECTION_OUT, &layer_hint,
+                                 &recognized), OP_EQ, 0);
+  }
+
+  /* A worker starts on the first cell; the second waits behind it. */
+  tt_int_op(circuit_receive_relay_cell(&cells[0], TO_CIRCUIT(circ),
+                                       CELL_DIRECTION_OUT), OP_EQ, 0);
+  tt_int_op(onion_batch_wait_for(&onion_batch_n_started, 1), OP_EQ, 0);
+  tt_int_op(circuit_receive_relay_cell(&cells[1], TO_CIRCUIT(circ),
+                                       CELL_DIRECTION_OUT), OP_EQ, 0);
+
+  /* The DESTROY waits for them. */
+  memset(&destroy, 0, sizeof(destroy));
+  destroy.circ_id = 7;
+  destroy.command = CELL_DESTROY;
+  destroy.payload[0] = END_CIRC_REASON_FINISHED;
+  command_process_cell(chan, &destroy);
+  tt_assert(circ->relay_crypto_destroy_held);
+  tt_int_op(TO_CIRCUIT(circ)->marked_for_close, OP_EQ, 0);
+  tt_ptr_op(circ->p_chan, OP_EQ, chan);
+
+  /* Anything after the DESTROY is dropped. */
+  tt_int_op(circuit_receive_relay_cell(&cells[2], TO_CIRCUIT(circ),
+                                       CELL_DIRECTION_OUT), OP_EQ, 0);
+  tt_int_op(smartlist_len(circ->relay_crypto_pending), OP_EQ, 1);
+
+  onion_batch_open(&onion_batch_batches_open);
+  for (i = 0; i < 10000; ++i) {
+    if (TO_CIRCUIT(circ)->marked_for_close)
+      break;
+    onion_batch_run_loop();
+  }
+
+  /* Both cells arrived, in order, and then the circuit closed. */
+  tt_int_op(smartlist_len(relay_crypto_received), OP_EQ, 2);
+  for (i = 0; i < 2; ++i) {
+    cell_t *c = smartlist_get(relay_crypto_received, i);
+    tt_mem_op(c->payload, OP_EQ, expected[i].payload, CELL_PAYLOAD_SIZE);
+  }
+  tt_int_op(TO_CIRCUIT(circ)->marked_for_close_reason, OP_EQ,
+            END_CIRC_REASON_DESTROYED);
+  tt_ptr_op(circ->relay_crypto_job, OP_EQ, NULL);
+  tt_assert(!circ->relay_crypto_destroy_held);
+  tt_ptr_op(circ->p_chan, OP_EQ, NULL);
+
+ done:
+  onion_batch_open(&onion_batch_batches_open);
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(circuit_mark_for_close_);
+  UNMOCK(circuit_receive_decrypted_relay_cell);
+  if (circ && !circ->relay_crypto_job) {
+    circuit_set_p_circid_chan(circ, 0, NULL);
+    circuit_free_(TO_CIRCUIT(circ));
+  }
+  if (ref)
+    circuit_free_(TO_CIRCUIT(ref));
+  free_fake_channel(chan);
+  SMARTLIST_FOREACH(relay_crypto_received, cell_t *, c, tor_free(c));
+  smartlist_free(relay_crypto_received);
+}
+
+/** Check that a circuit that is freed while both an onionskin job and a
+ * relay crypto job are running stays around until both have replied. */
+static void
+test_relay_crypto_dead_two_jobs(void *arg)
+{
+  or_circuit_t *circ = NULL;
+  channel_t *chan = NULL;
+  cell_t cell;
+  (void)arg;
+
+  relay_crypto_received = smartlist_new();
+  tor_mutex_init(&onion_batch_lock);
+  tor_cond_init(&onion_batch_cond);
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work_gated);
+  MOCK(circuit_mark_for_close_, mock_circuit_mark_for_close_record);
+  MOCK(circuit_receive_decrypted_relay_cell,
+       mock_circuit_receive_decrypted_relay_cell_record);
+
+  get_options_mutable()->NumCPUs = 2;
+  get_options_mutable()->RelayCryptoOffload = 1;
+  cpuworker_init();
+
+  chan = new_fake_channel();
+  circ = relay_crypto_circ_new();
+  circ->p_chan = chan;
+  TO_CIRCUIT(circ)->state = CIRCUIT_STATE_ONIONSKIN_PENDING;
+  tt_int_op(assign_onionskin_to_cpuworker(circ,
+                                          onion_batch_bad_create_cell()),
+            OP_EQ, 0);
+  onion_batch_run_loop();
+  tt_assert(circ->workqueue_entry);
+
+  crypto_rand((char *)&cell, sizeof(cell));
+  tt_int_op(circuit_receive_relay_cell(&cell, TO_CIRCUIT(circ),
+                                       CELL_DIRECTION_OUT), OP_EQ, 0);
+  tt_assert(circ->relay_crypto_job);
+  tt_int_op(onion_batch_wait_for(&onion_batch_n_started, 2), OP_EQ, 0);
+
+  /* Neither job can be cancelled now: both have to reply before the
+   * circuit's memory goes away. */
+  circ->p_chan = NULL;
+  circuit_free_(TO_CIRCUIT(circ));
+  tt_uint_op(circ->base_.magic, OP_EQ, DEAD_CIRCUIT_MAGIC);
+  tt_int_op(circ->n_dead_worker_refs, OP_EQ, 2);
+
+  onion_batch_open(&onion_batch_batches_open);
+  tt_int_op(onion_batch_wait_for(&onion_batch_n_replied, 2), OP_EQ, 0);
+  tt_int_op(relay_crypto_n_cells_allocated, OP_EQ, 0);
+  /* The dead circuit's cell was never handled. */
+  tt_int_op(smartlist_len(relay_crypto_received), OP_EQ, 0);
+
+ done:
+  onion_batch_open(&onion_batch_batches_open);
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(circuit_mark_for_close_);
+  UNMOCK(circuit_receive_decrypted_relay_cell);
+  free_fake_channel(chan);
+  SMARTLIST_FOREACH(relay_crypto_received, cell_t *, c, tor_free(c));
+  smartlist_free(relay_crypto_received);
+}
+
 static int32_t cbtnummodes = 10;
 
 static int32_t
@@ -744,7 +1352,12 @@ static struct testcase_t test_array[] = {
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
   ENT(onion_queue_order),
+  ENT(onion_batch_size),
+  FORK(onion_batch_cancel),
+  FORK(relay_crypto_destroy_held),
+  FORK(relay_crypto_dead_two_jobs),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
+  { "ntor_handshake_batch", test_ntor_handshake_batch, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
   FORK(circuit_timeout_xm_alpha),
@@ -4,9 +4,12 @@
 /* See LICENSE for licensing information */
 
 #define BUFFERS_PRIVATE
+#define BUFFERS_URING_PRIVATE
 #define PROTO_HTTP_PRIVATE
 #include "core/or/or.h"
 #include "lib/buf/buffers.h"
+#include "lib/net/buffers_net.h"
+#include "lib/net/buffers_uring.h"
 #include "lib/tls/buffers_tls.h"
 #include "lib/tls/tortls.h"
 #include "lib/compress/compress.h"
@@ -832,6 +835,344 @@ test_buffers_find_contentlen(void *arg)
   ;
 }
 
+static void
+test_buffer_peek_contiguous(void *arg)
+{
+  (void)arg;
+  buf_t *buf;
+  char *mem = tor_malloc(16384);
+  const char *cp;
+  buf = buf_new_with_capacity(4096);
+  tt_ptr_op(buf, OP_NE, NULL);
+  crypto_rand(mem, 16384);
+
+  tt_ptr_op(buf_peek_contiguous(buf, 0), OP_EQ, NULL);
+  tt_ptr_op(buf_peek_contiguous(buf, 1), OP_EQ, NULL);
+
+  /* Everything is in one chunk. */
+  buf_add(buf, mem, 3000);
+  cp = buf_peek_contiguous(buf, 514);
+  tt_ptr_op(cp, OP_NE, NULL);
+  tt_mem_op(cp, OP_EQ, mem, 514);
+  cp = buf_peek_contiguous(buf, 3000);
+  tt_ptr_op(cp, OP_NE, NULL);
+  tt_mem_op(cp, OP_EQ, mem, 3000);
+  tt_ptr_op(buf_peek_contiguous(buf, 3001), OP_EQ, NULL);
+
+  /* Fill the first chunk, and spill into a second one. */
+  buf_add(buf, mem+3000, 13000);
+  tt_int_op(buf_datalen(buf), OP_EQ, 16000);
+  buf_drain(buf, 514*5);
+  cp = buf_peek_contiguous(buf, 514);
+  tt_ptr_op(cp, OP_NE, NULL);
+  tt_mem_op(cp, OP_EQ, mem+514*5, 514);
+
+  /* Now leave part of a cell at the end of the first chunk, so that the
+   * next cell straddles the two chunks. */
+  {
+    size_t headlen = 0, off;
+    char tmp[514];
+    while (buf_peek_contiguous(buf, headlen + 1))
+      ++headlen;
+    tt_int_op(headlen, OP_LT, buf_datalen(buf));
+    buf_drain(buf, headlen - 100);
+    tt_ptr_op(buf_peek_contiguous(buf, 100), OP_NE, NULL);
+    tt_ptr_op(buf_peek_contiguous(buf, 101), OP_EQ, NULL);
+    tt_ptr_op(buf_peek_contiguous(buf, 514), OP_EQ, NULL);
+    off = 16000 - buf_datalen(buf);
+    buf_peek(buf, tmp, sizeof(tmp));
+    tt_mem_op(tmp, OP_EQ, mem+off, sizeof(tmp));
+  }
+
+ done:
+  buf_free(buf);
+  tor_free(mem);
+}
+
+static void
+test_buffers_socket_io(void *arg)
+{
+  const bool use_iovecs = !strcmp((const char *)arg, "iovecs");
+  const bool saved_use_iovecs = buf_net_use_iovecs;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *out = NULL, *in = NULL;
+  char *mem = tor_malloc(65536);
+  char *got = tor_malloc(65536);
+  uint64_t n_calls;
+  int eof = 0, err = 0, i, n_chunks = 0;
+  const chunk_t *chunk;
+
+  buf_net_use_iovecs = use_iovecs;
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[1]), OP_EQ, 0);
+
+  /* Put 64 KB on a buffer, in lots of small chunks. */
+  crypto_rand(mem, 65536);
+  out = buf_new_with_capacity(4096);
+  for (i = 0; i < 128; ++i)
+    buf_add(out, mem + i*512, 512);
+  for (chunk = out->head; chunk; chunk = chunk->next)
+    ++n_chunks;
+  tt_int_op(n_chunks, OP_GT, 4);
+
+  n_calls = buf_net_n_syscalls;
+  tt_int_op(buf_flush_to_socket(out, fds[0], buf_datalen(out)), OP_EQ,
+            65536);
+  n_calls = buf_net_n_syscalls - n_calls;
+  tt_int_op(buf_datalen(out), OP_EQ, 0);
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_WRITEV) && !defined(_WIN32)
+  if (use_iovecs)
+    tt_u64_op(n_calls, OP_EQ, 1);
+  else
+#endif
+    tt_u64_op(n_calls, OP_EQ, n_chunks);
+
+  /* Read it back, into a buffer whose tail chunk is partly full. */
+  in = buf_new_with_capacity(4096);
+  buf_add(in, "abc", 3);
+  while (buf_datalen(in) < 65536 + 3) {
+    int r = buf_read_from_socket(in, fds[1], 65536 + 3 - buf_datalen(in),
+                                 &eof, &err);
+    tt_int_op(r, OP_GT, 0);
+  }
+  tt_int_op(eof, OP_EQ, 0);
+  tt_int_op(buf_datalen(in), OP_EQ, 65536 + 3);
+  buf_assert_ok(in);
+  buf_get_bytes(in, got, 3);
+  tt_mem_op(got, OP_EQ, "abc", 3);
+  buf_get_bytes(in, got, 65536);
+  tt_mem_op(got, OP_EQ, mem, 65536);
+
+  /* Nothing more to read. */
+  tt_int_op(buf_read_from_socket(in, fds[1], 4096, &eof, &err), OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 0);
+  buf_assert_ok(in);
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && !defined(_WIN32)
+  /* readv() doesn't leave an empty chunk behind. */
+  if (use_iovecs)
+    tt_ptr_op(in->head, OP_EQ, NULL);
+#endif
+
+  /* Nor does a read that fits in the tail chunk, when we asked for more. */
+  buf_clear(in);
+  buf_add(in, "abc", 3);
+  chunk = in->tail;
+  tt_int_op(tor_socket_send(fds[0], "xyz", 3, 0), OP_EQ, 3);
+  tt_int_op(buf_read_from_socket(in, fds[1],
+                                 CHUNK_REMAINING_CAPACITY(chunk) + 4096,
+                                 &eof, &err), OP_EQ, 3);
+  buf_assert_ok(in);
+  tt_int_op(buf_datalen(in), OP_EQ, 6);
+  tt_ptr_op(in->head, OP_EQ, chunk);
+  tt_ptr_op(in->tail, OP_EQ, chunk);
+  buf_clear(in);
+
+  /* EOF is noticed. */
+  tor_close_socket(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  tt_int_op(buf_read_from_socket(in, fds[1], 4096, &eof, &err), OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 1);
+
+ done:
+  buf_net_use_iovecs = saved_use_iovecs;
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  buf_free(out);
+  buf_free(in);
+  tor_free(mem);
+  tor_free(got);
+}
+
+#define N_URING_PAIRS 8
+
+static void
+test_buffers_uring(void *arg)
+{
+  tor_socket_t fds[N_URING_PAIRS][2];
+  buf_t *out[N_URING_PAIRS], *in[N_URING_PAIRS];
+  int idx[N_URING_PAIRS];
+  buf_uring_t *ring = NULL;
+  char *mem = tor_malloc(65536);
+  char *got = tor_malloc(65536);
+  uint64_t n_calls;
+  int eof, err, i, j;
+  (void)arg;
+
+  memset(fds, 0xff, sizeof(fds));
+  memset(out, 0, sizeof(out));
+  memset(in, 0, sizeof(in));
+
+  ring = buf_uring_new(16);
+  if (!ring)
+    tt_skip();
+
+  crypto_rand(mem, 65536);
+  for (i = 0; i < N_URING_PAIRS; ++i) {
+    tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]), OP_EQ, 0);
+    tt_int_op(set_socket_nonblocking(fds[i][0]), OP_EQ, 0);
+    tt_int_op(set_socket_nonblocking(fds[i][1]), OP_EQ, 0);
+    /* A different amount of data for each socket, in small chunks. */
+    out[i] = buf_new_with_capacity(4096);
+    for (j = 0; j <= i; ++j)
+      buf_add(out[i], mem + j*1024, 1024);
+    in[i] = buf_new_with_capacity(4096);
+    buf_add(in[i], "abc", 3);
+  }
+
+  /* Write to every socket with one system call. */
+  for (i = 0; i < N_URING_PAIRS; ++i) {
+    idx[i] = buf_uring_add_flush(ring, out[i], fds[i][0],
+                                 buf_datalen(out[i]));
+    tt_int_op(idx[i], OP_GE, 0);
+  }
+  n_calls = buf_uring_get_n_syscalls(ring);
+  tt_int_op(buf_uring_run(ring), OP_EQ, 0);
+  tt_u64_op(buf_uring_get_n_syscalls(ring) - n_calls, OP_EQ, 1);
+  for (i = 0; i < N_URING_PAIRS; ++i) {
+    err = 0;
+    tt_assert(buf_uring_op_is_done(ring, idx[i]));
+    tt_int_op(buf_uring_get_flush_result(ring, idx[i], &err), OP_EQ,
+              (i+1)*1024);
+    tt_int_op(buf_datalen(out[i]), OP_EQ, 0);
+  }
+  buf_uring_clear(ring);
+
+  /* Read from every socket with one system call. */
+  for (i = 0; i < N_URING_PAIRS; ++i) {
+    idx[i] = buf_uring_add_read(ring, in[i], fds[i][1], 65536);
+    tt_int_op(idx[i], OP_GE, 0);
+  }
+  tt_int_op(buf_uring_run(ring), OP_EQ, 0);
+  for (i = 0; i < N_URING_PAIRS; ++i) {
+    eof = err = 0;
+    tt_int_op(buf_uring_get_read_result(ring, idx[i], &eof, &err), OP_EQ,
+              (i+1)*1024);
+    tt_int_op(eof, OP_EQ, 0);
+    buf_assert_ok(in[i]);
+    tt_int_op(buf_datalen(in[i]), OP_EQ, (i+1)*1024 + 3);
+    buf_get_bytes(in[i], got, 3);
+    tt_mem_op(got, OP_EQ, "abc", 3);
+    buf_get_bytes(in[i], got, (i+1)*1024);
+    tt_mem_op(got, OP_EQ, mem, (i+1)*1024);
+  }
+  buf_uring_clear(ring);
+
+  /* Nothing more to read on the first socket; EOF on the second. */
+  tor_close_socket(fds[1][0]);
+  fds[1][0] = TOR_INVALID_SOCKET;
+  idx[0] = buf_uring_add_read(ring, in[0], fds[0][1], 4096);
+  idx[1] = buf_uring_add_read(ring, in[1], fds[1][1], 4096);
+  tt_int_op(buf_uring_run(ring), OP_EQ, 0);
+  eof = err = 0;
+  tt_int_op(buf_uring_get_read_result(ring, idx[0], &eof, &err), OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 0);
+  tt_int_op(buf_uring_get_read_result(ring, idx[1], &eof, &err), OP_EQ, 0);
+  tt_int_op(eof, OP_EQ, 1);
+  buf_uring_clear(ring);
+
+  /* The ring only holds so many operations at once. */
+  for (i = 0; i < 64; ++i) {
+    if (buf_uring_add_read(ring, in[0], fds[0][1], 4096) < 0)
+      break;
+  }
+  tt_int_op(i, OP_LT, 64);
+  buf_uring_clear(ring);
+
+ done:
+  for (i = 0; i < N_URING_PAIRS; ++i) {
+    for (j = 0; j < 2; ++j) {
+      if (SOCKET_OK(fds[i][j]))
+        tor_close_socket(fds[i][j]);
+    }
+    buf_free(out[i]);
+    buf_free(in[i]);
+  }
+  buf_uring_free(ring);
+  tor_free(mem);
+  tor_free(got);
+}
+
+static int uring_enter_n_failed = 0;
+
+/** Mock for sys_io_uring_enter(): the first time we're asked to submit
+ * anything, submit only one operation, then fail. */
+static int
+mock_sys_io_uring_enter_fail_once(int fd, unsigned to_submit,
+                                  unsigned min_complete, unsigned flags)
+{
+  if (to_submit > 1 && uring_enter_n_failed == 0) {
+    ++uring_enter_n_failed;
+    if (sys_io_uring_enter__real(fd, 1, 0, 0) != 1)
+      return -2;
+    errno = EINVAL;
+    return -1;
+  }
+  return sys_io_uring_enter__real(fd, to_submit, min_complete, flags);
+}
+
+static void
+test_buffers_uring_cancel(void *arg)
+{
+  tor_socket_t fds[2][2];
+  buf_t *in[2] = { NULL, NULL };
+  int idx[2];
+  buf_uring_t *ring = NULL;
+  char mem[1024];
+  int eof = 0, err = 0, i, j;
+  (void)arg;
+
+  memset(fds, 0xff, sizeof(fds));
+  ring = buf_uring_new(16);
+  if (!ring)
+    tt_skip();
+
+  crypto_rand(mem, sizeof(mem));
+  for (i = 0; i < 2; ++i) {
+    tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds[i]), OP_EQ, 0);
+    tt_int_op(set_socket_nonblocking(fds[i][1]), OP_EQ, 0);
+    tt_int_op(write_all_to_socket(fds[i][0], mem, sizeof(mem)), OP_EQ,
+              sizeof(mem));
+    in[i] = buf_new();
+    idx[i] = buf_uring_add_read(ring, in[i], fds[i][1], 4096);
+    tt_int_op(idx[i], OP_GE, 0);
+  }
+
+  /* The kernel takes the first read, then io_uring_enter() fails: we must
+   * not return until the first read is done, and the kernel must never see
+   * the second. */
+  MOCK(sys_io_uring_enter, mock_sys_io_uring_enter_fail_once);
+  tt_int_op(buf_uring_run(ring), OP_EQ, -1);
+  tt_int_op(uring_enter_n_failed, OP_EQ, 1);
+  tt_assert(buf_uring_op_is_done(ring, idx[0]));
+  tt_int_op(buf_uring_get_read_result(ring, idx[0], &eof, &err), OP_EQ,
+            sizeof(mem));
+  tt_int_op(buf_datalen(in[0]), OP_EQ, sizeof(mem));
+  tt_assert(! buf_uring_op_is_done(ring, idx[1]));
+  tt_int_op(buf_datalen(in[1]), OP_EQ, 0);
+  buf_assert_ok(in[1]);
+  buf_uring_clear(ring);
+
+  /* The ring is no good any more, but the socket still has its data. */
+  tt_int_op(buf_uring_add_read(ring, in[1], fds[1][1], 4096), OP_EQ, -1);
+  tt_int_op(buf_read_from_socket(in[1], fds[1][1], 4096, &eof, &err),
+            OP_EQ, sizeof(mem));
+
+ done:
+  UNMOCK(sys_io_uring_enter);
+  uring_enter_n_failed = 0;
+  for (i = 0; i < 2; ++i) {
+    for (j = 0; j < 2; ++j) {
+      if (SOCKET_OK(fds[i][j]))
+        tor_close_socket(fds[i][j]);
+    }
+    buf_free(in[i]);
+  }
+  buf_uring_free(ring);
+}
+
 static void
 test_buffer_peek_startswith(void *arg)
 {
@@ -864,6 +1205,13 @@ struct testcase_t buffer_tests[] = {
   { "pullup", test_buffer_pullup, TT_FORK, NULL, NULL },
   { "move_all", test_buffers_move_all, 0, NULL, NULL },
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
+  { "peek_contiguous", test_buffer_peek_contiguous, 0, NULL, NULL },
+  { "socket_io", test_buffers_socket_io, 0,
+    &passthrough_setup, (char*)"iovecs" },
+  { "socket_io_per_chunk", test_buffers_socket_io, 0,
+    &passthrough_setup, (char*)"per_chunk" },
+  { "uring", test_buffers_uring, 0, NULL, NULL },
+  { "uring_cancel", test_buffers_uring_cancel, TT_FORK, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
@@ -15,6 +15,7 @@
 
 #include "app/config/config.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
 #include "feature/dirauth/dirauth_sys.h"
 #include "feature/dircommon/directory.h"
 #include "feature/nodelist/microdesc.h"
@@ -28,6 +29,8 @@
 
 #include "app/config/or_options_st.h"
 #include "core/or/connection_st.h"
+#include "core/or/edge_connection_st.h"
+#include "core/or/entry_connection_st.h"
 #include "feature/dirauth/dirauth_options_st.h"
 #include "feature/nodelist/microdesc_st.h"
 #include "feature/nodelist/networkstatus_st.h"
@@ -451,6 +454,115 @@ test_bwmgt_dir_conn_global_write_low(void *arg)
   UNMOCK(get_options);
 }
 
+static smartlist_t *started_reading = NULL;
+
+static void
+mock_connection_start_reading(connection_t *conn)
+{
+  smartlist_add(started_reading, conn);
+}
+
+static void
+mock_connection_stop_reading(connection_t *conn)
+{
+  (void)conn;
+}
+
+/* Connections blocked on bandwidth are woken up once their buckets have
+ * refilled, without looking at the other connections. */
+static void
+test_bwmgt_blocked_conns(void *arg)
+{
+  entry_connection_t *full = NULL, *empty = NULL, *idle = NULL;
+  token_bucket_rw_t *bucket;
+  (void)arg;
+
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(UINT64_C(1000) * 1000000000);
+  MOCK(connection_start_reading, mock_connection_start_reading);
+  MOCK(connection_stop_reading, mock_connection_stop_reading);
+  started_reading = smartlist_new();
+  tor_init_connection_lists();
+  connection_bucket_init();
+
+  full = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  empty = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  idle = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  ENTRY_TO_EDGE_CONN(full)->is_dns_request = 1;
+  ENTRY_TO_EDGE_CONN(empty)->is_dns_request = 1;
+  ENTRY_TO_EDGE_CONN(idle)->is_dns_request = 1;
+  tt_int_op(connection_add(ENTRY_TO_CONN(full)), OP_EQ, 0);
+  tt_int_op(connection_add(ENTRY_TO_CONN(empty)), OP_EQ, 0);
+  tt_int_op(connection_add(ENTRY_TO_CONN(idle)), OP_EQ, 0);
+
+  /* One stream has used up its own read bucket, and is 4 seconds of
+   * refill in debt. */
+  bucket = &ENTRY_TO_EDGE_CONN(empty)->bucket;
+  token_bucket_rw_init(bucket, 1000, 1000, monotime_coarse_get_stamp());
+  token_bucket_rw_dec_read(bucket, 5000);
+
+  connection_consider_empty_read_buckets(ENTRY_TO_CONN(full));
+  connection_consider_empty_read_buckets(ENTRY_TO_CONN(empty));
+  tt_int_op(ENTRY_TO_CONN(full)->read_blocked_on_bw, OP_EQ, 0);
+  tt_int_op(ENTRY_TO_CONN(empty)->read_blocked_on_bw, OP_EQ, 1);
+  connection_read_bw_exhausted(ENTRY_TO_CONN(full), true);
+  tt_int_op(ENTRY_TO_CONN(full)->read_blocked_on_bw, OP_EQ, 1);
+  tt_int_op(ENTRY_TO_CONN(full)->bw_blocked_index, OP_EQ, 1);
+  tt_int_op(ENTRY_TO_CONN(empty)->bw_blocked_index, OP_EQ, 0);
+  tt_int_op(ENTRY_TO_CONN(idle)->bw_blocked_index, OP_EQ, -1);
+
+  /* The stream whose buckets aren't empty wakes up; the other one stays
+   * blocked until its bucket refills. */
+  reenable_blocked_connections_cb(NULL, NULL);
+  tt_int_op(smartlist_len(started_reading), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(started_reading, 0), OP_EQ, ENTRY_TO_CONN(full));
+  tt_int_op(ENTRY_TO_CONN(full)->read_blocked_on_bw, OP_EQ, 0);
+  tt_int_op(ENTRY_TO_CONN(full)->bw_blocked_index, OP_EQ, -1);
+  tt_int_op(ENTRY_TO_CONN(empty)->read_blocked_on_bw, OP_EQ, 1);
+  tt_int_op(ENTRY_TO_CONN(empty)->bw_blocked_index, OP_EQ, 0);
+
+  monotime_coarse_set_mock_time_nsec(UINT64_C(1002) * 1000000000);
+  reenable_blocked_connections_cb(NULL, NULL);
+  tt_int_op(smartlist_len(started_reading), OP_EQ, 1);
+
+  monotime_coarse_set_mock_time_nsec(UINT64_C(1005) * 1000000000);
+  reenable_blocked_connections_cb(NULL, NULL);
+  tt_int_op(smartlist_len(started_reading), OP_EQ, 2);
+  tt_ptr_op(smartlist_get(started_reading, 1), OP_EQ, ENTRY_TO_CONN(empty));
+  tt_int_op(ENTRY_TO_CONN(empty)->read_blocked_on_bw, OP_EQ, 0);
+  tt_int_op(ENTRY_TO_CONN(empty)->bw_blocked_index, OP_EQ, -1);
+
+  /* A blocked connection that goes away takes itself off the list. */
+  connection_read_bw_exhausted(ENTRY_TO_CONN(full), true);
+  connection_read_bw_exhausted(ENTRY_TO_CONN(idle), true);
+  tt_int_op(ENTRY_TO_CONN(idle)->bw_blocked_index, OP_EQ, 1);
+  connection_remove(ENTRY_TO_CONN(full));
+  connection_free_minimal(ENTRY_TO_CONN(full));
+  full = NULL;
+  tt_int_op(ENTRY_TO_CONN(idle)->bw_blocked_index, OP_EQ, 0);
+  reenable_blocked_connections_cb(NULL, NULL);
+  tt_int_op(smartlist_len(started_reading), OP_EQ, 3);
+  tt_ptr_op(smartlist_get(started_reading, 2), OP_EQ, ENTRY_TO_CONN(idle));
+
+ done:
+  UNMOCK(connection_start_reading);
+  UNMOCK(connection_stop_reading);
+  if (full) {
+    connection_remove(ENTRY_TO_CONN(full));
+    connection_free_minimal(ENTRY_TO_CONN(full));
+  }
+  if (empty) {
+    connection_remove(ENTRY_TO_CONN(empty));
+    connection_free_minimal(ENTRY_TO_CONN(empty));
+  }
+  if (idle) {
+    connection_remove(ENTRY_TO_CONN(idle));
+    connection_free_minimal(ENTRY_TO_CONN(idle));
+  }
+  smartlist_free(started_reading);
+  monotime_disable_test_mocking();
+}
+
 #define BWMGT(name)                                          \
   { #name, test_bwmgt_ ## name , TT_FORK, NULL, NULL }
 
@@ -462,5 +574,6 @@ struct testcase_t bwmgt_tests[] = {
   BWMGT(token_buf_helpers),
 
   BWMGT(dir_conn_global_write_low),
+  BWMGT(blocked_conns),
   END_OF_TESTCASES
 };
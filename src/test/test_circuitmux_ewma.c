@@ -3,10 +3,15 @@
 
 #define CIRCUITMUX_PRIVATE
 #define CIRCUITMUX_EWMA_PRIVATE
+#define CIRCUITMUX_LOGEWMA_PRIVATE
+
+#include <math.h>
 
 #include "core/or/or.h"
 #include "core/or/circuitmux.h"
 #include "core/or/circuitmux_ewma.h"
+#include "core/or/circuitmux_logewma.h"
+#include "lib/crypt_ops/crypto_rand.h"
 
 #include "test/fakechans.h"
 #include "test/fakecircs.h"
@@ -185,6 +190,165 @@ test_cmux_ewma_policy_data(void *arg)
   ewma_policy.free_cmux_data(&cmux, pol_data);
 }
 
+static void
+test_cmux_ewma_logewma_add_log(void *arg)
+{
+  (void) arg;
+
+  tt_double_op(fabs(logewma_add_log(-INFINITY, 0.0)), OP_LT, 1e-12);
+  tt_double_op(fabs(logewma_add_log(0.0, 0.0) - log(2.0)), OP_LT, 1e-12);
+  tt_double_op(fabs(logewma_add_log(log(3.0), log(5.0)) - log(8.0)),
+               OP_LT, 1e-12);
+  /* Big values mustn't overflow. */
+  tt_double_op(fabs(logewma_add_log(1000.0, 1000.0) - (1000.0 + log(2.0))),
+               OP_LT, 1e-9);
+  tt_double_op(fabs(logewma_add_log(1e6, 0.0) - 1e6), OP_LT, 1e-9);
+
+ done:
+  ;
+}
+
+/** Start of the mocked monotonic time in the tests below. */
+#define START_NSEC (INT64_C(1000) * 1000 * 1000 * 1000)
+
+/** Make <b>nsec</b> the mocked time, and restart both EWMA clocks. */
+static void
+reset_cmux_ewma_clocks(int64_t nsec)
+{
+  monotime_coarse_set_mock_time_nsec(nsec);
+  circuitmux_ewma_free_all();
+  circuitmux_logewma_free_all();
+  cell_ewma_initialize_ticks();
+  cmux_ewma_set_options(NULL, NULL);
+}
+
+static void
+test_cmux_ewma_logewma_decay(void *arg)
+{
+  circuitmux_t cmux; /* garbage */
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuit_t circ[2]; /* garbage */
+  circuitmux_policy_circ_data_t *circ_data[2] = { NULL, NULL };
+  circuit_t *first, *second;
+  double decay;
+  int i;
+
+  (void) arg;
+
+  monotime_enable_test_mocking();
+  reset_cmux_ewma_clocks(START_NSEC);
+  decay = logewma_get_decay();
+
+  pol_data = logewma_policy.alloc_cmux_data(&cmux);
+  tt_assert(pol_data);
+  tt_uint_op(pol_data->magic, OP_EQ, LOGEWMA_POL_DATA_MAGIC);
+  for (i = 0; i < 2; ++i) {
+    circ_data[i] = logewma_policy.alloc_circ_data(&cmux, pol_data, &circ[i],
+                                                  CELL_DIRECTION_OUT, 42);
+    tt_uint_op(circ_data[i]->magic, OP_EQ, LOGEWMA_POL_CIRC_DATA_MAGIC);
+    logewma_policy.notify_circ_active(&cmux, pol_data, &circ[i],
+                                      circ_data[i]);
+  }
+
+  /* Send 10 cells on the first circuit we're given, and 1 on the other. */
+  first = logewma_policy.pick_active_circuit(&cmux, pol_data);
+  tt_assert(first);
+  i = (first == &circ[0]) ? 0 : 1;
+  logewma_policy.notify_xmit_cells(&cmux, pol_data, first, circ_data[i], 10);
+  second = logewma_policy.pick_active_circuit(&cmux, pol_data);
+  tt_ptr_op(second, OP_NE, first);
+  logewma_policy.notify_xmit_cells(&cmux, pol_data, second,
+                                   circ_data[1-i], 1);
+  tt_ptr_op(logewma_policy.pick_active_circuit(&cmux, pol_data),
+            OP_EQ, second);
+
+  /* Ten halflives later, those 10 cells count for less than one new one. */
+  monotime_coarse_set_mock_time_nsec(START_NSEC +
+                                     INT64_C(300) * 1000 * 1000 * 1000);
+  tt_double_op(fabs(logewma_get_decay() - decay - 10 * log(2.0)),
+               OP_LT, 1e-9);
+  logewma_policy.notify_xmit_cells(&cmux, pol_data, second,
+                                   circ_data[1-i], 1);
+  tt_ptr_op(logewma_policy.pick_active_circuit(&cmux, pol_data),
+            OP_EQ, first);
+
+  /* Deactivating the head leaves the other circuit. */
+  logewma_policy.notify_circ_inactive(&cmux, pol_data, first, circ_data[i]);
+  tt_ptr_op(logewma_policy.pick_active_circuit(&cmux, pol_data),
+            OP_EQ, second);
+
+ done:
+  for (i = 0; i < 2; ++i)
+    logewma_policy.free_circ_data(&cmux, pol_data, &circ[i], circ_data[i]);
+  logewma_policy.free_cmux_data(&cmux, pol_data);
+  monotime_disable_test_mocking();
+}
+
+/** Number of circuits in the logewma_matches_ewma test. */
+#define N_MATCH_CIRCS 64
+
+static void
+test_cmux_ewma_logewma_matches_ewma(void *arg)
+{
+  circuitmux_t cmux; /* garbage */
+  circuitmux_policy_data_t *ewma_pol = NULL, *log_pol = NULL;
+  circuit_t *circs = NULL;
+  circuitmux_policy_circ_data_t *ewma_circ[N_MATCH_CIRCS];
+  circuitmux_policy_circ_data_t *log_circ[N_MATCH_CIRCS];
+  int64_t now = START_NSEC;
+  int i, step;
+
+  (void) arg;
+
+  memset(ewma_circ, 0, sizeof(ewma_circ));
+  memset(log_circ, 0, sizeof(log_circ));
+  circs = tor_calloc(N_MATCH_CIRCS, sizeof(circuit_t));
+
+  monotime_enable_test_mocking();
+  reset_cmux_ewma_clocks(now);
+
+  ewma_pol = ewma_policy.alloc_cmux_data(&cmux);
+  log_pol = logewma_policy.alloc_cmux_data(&cmux);
+  for (i = 0; i < N_MATCH_CIRCS; ++i) {
+    ewma_circ[i] = ewma_policy.alloc_circ_data(&cmux, ewma_pol, &circs[i],
+                                               CELL_DIRECTION_OUT, 1);
+    log_circ[i] = logewma_policy.alloc_circ_data(&cmux, log_pol, &circs[i],
+                                                 CELL_DIRECTION_OUT, 1);
+    ewma_policy.notify_circ_active(&cmux, ewma_pol, &circs[i], ewma_circ[i]);
+    logewma_policy.notify_circ_active(&cmux, log_pol, &circs[i],
+                                      log_circ[i]);
+  }
+
+  /* Send random numbers of cells over several minutes, crossing many EWMA
+   * ticks, and make sure that both policies always agree on which circuit
+   * goes next. */
+  for (step = 0; step < 5000; ++step) {
+    circuit_t *c1 = ewma_policy.pick_active_circuit(&cmux, ewma_pol);
+    circuit_t *c2 = logewma_policy.pick_active_circuit(&cmux, log_pol);
+    unsigned n_cells = 1 + crypto_rand_int(1000);
+    tt_ptr_op(c1, OP_EQ, c2);
+    i = (int)(c1 - circs);
+
+    ewma_policy.notify_xmit_cells(&cmux, ewma_pol, c1, ewma_circ[i],
+                                  n_cells);
+    logewma_policy.notify_xmit_cells(&cmux, log_pol, c2, log_circ[i],
+                                     n_cells);
+
+    now += crypto_rand_int(100) * INT64_C(1000000);
+    monotime_coarse_set_mock_time_nsec(now);
+  }
+
+ done:
+  for (i = 0; i < N_MATCH_CIRCS; ++i) {
+    ewma_policy.free_circ_data(&cmux, ewma_pol, &circs[i], ewma_circ[i]);
+    logewma_policy.free_circ_data(&cmux, log_pol, &circs[i], log_circ[i]);
+  }
+  ewma_policy.free_cmux_data(&cmux, ewma_pol);
+  logewma_policy.free_cmux_data(&cmux, log_pol);
+  tor_free(circs);
+  monotime_disable_test_mocking();
+}
+
 static void *
 cmux_ewma_setup_test(const struct testcase_t *tc)
 {
@@ -223,6 +387,9 @@ struct testcase_t circuitmux_ewma_tests[] = {
   TEST_CMUX_EWMA(policy_circ_data),
   TEST_CMUX_EWMA(notify_circ),
   TEST_CMUX_EWMA(xmit_cell),
+  TEST_CMUX_EWMA(logewma_add_log),
+  TEST_CMUX_EWMA(logewma_decay),
+  TEST_CMUX_EWMA(logewma_matches_ewma),
 
   END_OF_TESTCASES
 };
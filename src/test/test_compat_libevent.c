@@ -8,6 +8,7 @@
 #include "test/test.h"
 
 #include "lib/evloop/compat_libevent.h"
+#include "lib/evloop/timers.h"
 
 #include <event2/event.h>
 
@@ -175,11 +176,107 @@ test_compat_libevent_postloop_events(void *arg)
   periodic_timer_free(timed);
 }
 
+static void
+timer_wheel_cb(tor_timer_t *t, void *arg, const struct monotime_t *now)
+{
+  int *fired = arg;
+  (void)t;
+  (void)now;
+  ++*fired;
+}
+
+/* Callback for the timer at index 0 of an array of three: it disables the
+ * one at index 1 and reschedules itself 100 units after 1040 for every time
+ * it fired. */
+struct wheel_resched_arg {
+  tor_timer_wheel_t *wheel;
+  tor_timer_t *timers[3];
+  int fired;
+};
+
+static void
+timer_wheel_resched_cb(tor_timer_t *t, void *arg,
+                       const struct monotime_t *now)
+{
+  struct wheel_resched_arg *ra = arg;
+  (void)now;
+  ++ra->fired;
+  timer_wheel_disable(ra->wheel, ra->timers[1]);
+  timer_wheel_schedule(ra->wheel, t, 1040 + 100 * ra->fired);
+}
+
+static void
+test_compat_libevent_timer_wheel(void *arg)
+{
+  tor_timer_wheel_t *wheel = NULL;
+  struct wheel_resched_arg ra;
+  int fired[3] = { 0, 0, 0 };
+  int i;
+  (void)arg;
+
+  memset(&ra, 0, sizeof(ra));
+  wheel = timer_wheel_new(1000);
+  for (i = 0; i < 3; ++i)
+    ra.timers[i] = timer_new(timer_wheel_cb, &fired[i]);
+
+  /* Nothing is due yet. */
+  timer_wheel_schedule(wheel, ra.timers[0], 1010);
+  timer_wheel_schedule(wheel, ra.timers[1], 1020);
+  timer_wheel_schedule(wheel, ra.timers[2], 100000);
+  timer_wheel_run(wheel, 1009);
+  tt_int_op(fired[0], OP_EQ, 0);
+
+  /* Timers fire once, when their time comes, even if we skip past it. */
+  timer_wheel_run(wheel, 1025);
+  tt_int_op(fired[0], OP_EQ, 1);
+  tt_int_op(fired[1], OP_EQ, 1);
+  tt_int_op(fired[2], OP_EQ, 0);
+  timer_wheel_run(wheel, 1030);
+  tt_int_op(fired[0], OP_EQ, 1);
+  tt_int_op(fired[1], OP_EQ, 1);
+
+  /* Times in the past mean "as soon as possible"; rescheduling a timer
+   * replaces its old time; disabled timers don't fire. */
+  timer_wheel_schedule(wheel, ra.timers[0], 5);
+  timer_wheel_schedule(wheel, ra.timers[2], 1031);
+  timer_wheel_schedule(wheel, ra.timers[1], 1031);
+  timer_wheel_disable(wheel, ra.timers[1]);
+  timer_wheel_disable(wheel, ra.timers[1]);
+  timer_wheel_run(wheel, 1031);
+  tt_int_op(fired[0], OP_EQ, 2);
+  tt_int_op(fired[1], OP_EQ, 1);
+  tt_int_op(fired[2], OP_EQ, 1);
+
+  /* Callbacks can disable other timers and reschedule their own. */
+  ra.wheel = wheel;
+  timer_set_cb(ra.timers[0], timer_wheel_resched_cb, &ra);
+  timer_wheel_schedule(wheel, ra.timers[0], 1040);
+  timer_wheel_schedule(wheel, ra.timers[1], 1050);
+  timer_wheel_run(wheel, 1040);
+  tt_int_op(ra.fired, OP_EQ, 1);
+  timer_wheel_run(wheel, 1100);
+  tt_int_op(ra.fired, OP_EQ, 1);
+  tt_int_op(fired[1], OP_EQ, 1);
+  timer_wheel_run(wheel, 1140);
+  tt_int_op(ra.fired, OP_EQ, 2);
+
+  /* Freeing the wheel leaves its timers unscheduled, so we can free them. */
+  timer_wheel_schedule(wheel, ra.timers[2], 2000);
+  timer_wheel_free(wheel);
+  tt_ptr_op(wheel, OP_EQ, NULL);
+
+ done:
+  timer_wheel_free(wheel);
+  for (i = 0; i < 3; ++i)
+    timer_free(ra.timers[i]);
+}
+
 struct testcase_t compat_libevent_tests[] = {
   { "logging_callback", test_compat_libevent_logging_callback,
     TT_FORK, NULL, NULL },
   { "header_version", test_compat_libevent_header_version, 0, NULL, NULL },
   { "postloop_events", test_compat_libevent_postloop_events,
     TT_FORK, NULL, NULL },
+  { "timer_wheel", test_compat_libevent_timer_wheel, 0, NULL, NULL },
   END_OF_TESTCASES
 };
@@ -14,6 +14,7 @@
 #include "app/config/or_options_st.h"
 #include "core/mainloop/connection.h"
 #include "core/or/connection_edge.h"
+#include "feature/hibernate/hibernate.h"
 #include "feature/hs/hs_common.h"
 #include "core/mainloop/mainloop.h"
 #include "feature/nodelist/microdesc.h"
@@ -21,11 +22,15 @@
 #include "feature/nodelist/networkstatus.h"
 #include "feature/dircommon/directory.h"
 #include "core/or/connection_or.h"
+#include "core/or/channel.h"
+#include "core/or/channeltls.h"
+#include "core/or/scheduler.h"
 #include "lib/net/resolve.h"
 #include "lib/evloop/compat_libevent.h"
 
 #include "test/test_connection.h"
 #include "test/test_helpers.h"
+#include "test/fakechans.h"
 
 #include "feature/dircommon/dir_connection_st.h"
 #include "core/or/entry_connection_st.h"
@@ -775,6 +780,76 @@ test_conn_haproxy_proxy_connect(void *arg)
   tor_free(buf);
 }
 
+static void
+mock_mark_for_close(connection_t *conn, int line, const char *file)
+{
+  (void) line;
+  (void) file;
+
+  conn->marked_for_close = 1;
+}
+
+static int
+mock_we_are_hibernating(void)
+{
+  return 0;
+}
+
+/* Test that an OR connection with no circuits is closed by its expiry
+ * timer once its idle timeout has passed, and not before, and that the
+ * per-second housekeeping doesn't close it. */
+static void
+test_conn_or_expire_idle(void *arg)
+{
+  or_connection_t *or_conn = NULL;
+  channel_t *chan;
+  const time_t now = 1600000000;
+  (void) arg;
+
+  MOCK(connection_mark_for_close_internal_, mock_mark_for_close);
+  MOCK(scheduler_release_channel, scheduler_release_channel_mock);
+  MOCK(we_are_hibernating, mock_we_are_hibernating);
+  get_options_mutable()->KeepalivePeriod = 300;
+  update_approx_time(now);
+  or_conn = or_connection_new(CONN_TYPE_OR, AF_INET);
+  tor_addr_parse(&TO_CONN(or_conn)->addr, "18.0.0.1");
+  TO_CONN(or_conn)->address = tor_strdup("18.0.0.1");
+  chan = channel_tls_handle_incoming(or_conn);
+  TO_CONN(or_conn)->state = OR_CONN_STATE_OPEN;
+  TO_CONN(or_conn)->timestamp_last_write_allowed = now;
+  or_conn->timestamp_lastempty = now;
+  or_conn->idle_timeout = 100;
+  chan->timestamp_last_had_circuits = now;
+  TO_CONN(or_conn)->conn_array_index = smartlist_len(get_connection_array());
+  smartlist_add(get_connection_array(), TO_CONN(or_conn));
+  connection_or_schedule_expiry(or_conn);
+
+  run_connection_housekeeping(TO_CONN(or_conn)->conn_array_index, now + 100);
+  tt_assert(!TO_CONN(or_conn)->marked_for_close);
+
+  connection_or_expire_idle(now + 1);
+  connection_or_expire_idle(now + 99);
+  tt_assert(!TO_CONN(or_conn)->marked_for_close);
+
+  /* A new circuit pushes the deadline back. */
+  chan->timestamp_last_had_circuits = now + 50;
+  connection_or_expire_idle(now + 100);
+  tt_assert(!TO_CONN(or_conn)->marked_for_close);
+  connection_or_expire_idle(now + 150);
+  tt_assert(TO_CONN(or_conn)->marked_for_close);
+
+ done:
+  if (or_conn) {
+    smartlist_remove(get_connection_array(), TO_CONN(or_conn));
+    TO_CONN(or_conn)->conn_array_index = -1;
+    connection_free_minimal(TO_CONN(or_conn));
+  }
+  connection_or_free_all();
+  UNMOCK(connection_mark_for_close_internal_);
+  UNMOCK(scheduler_release_channel);
+  UNMOCK(we_are_hibernating);
+}
+
 static node_t test_node;
 
 static node_t *
@@ -1010,5 +1085,6 @@ struct testcase_t connection_tests[] = {
   //CONNECTION_TESTCASE(func_suffix, TT_FORK, setup_func_pair),
   { "failed_orconn_tracker", test_failed_orconn_tracker, TT_FORK, NULL, NULL },
   { "describe", test_conn_describe, TT_FORK, NULL, NULL },
+  { "or_expire_idle", test_conn_or_expire_idle, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
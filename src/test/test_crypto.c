@@ -470,6 +470,52 @@ test_crypto_aes_ctr_testvec(void *arg)
   crypto_cipher_free(c);
 }
 
+/** Check that crypto_cipher_crypt_inplace_multi() gives the same results as
+ * crypto_cipher_crypt_inplace() on each buffer in turn. */
+static void
+test_crypto_aes_inplace_multi(void *arg)
+{
+  crypto_cipher_t *c1 = NULL, *c2 = NULL;
+  const size_t lens[] = { 1, 15, 16, 509, 4096, 5000 };
+  char *bufs[20], *expected[20];
+  char key[CIPHER_KEY_LEN];
+  unsigned i;
+  int j;
+  (void)arg;
+
+  memset(bufs, 0, sizeof(bufs));
+  memset(expected, 0, sizeof(expected));
+  crypto_rand(key, sizeof(key));
+  c1 = crypto_cipher_new(key);
+  c2 = crypto_cipher_new(key);
+
+  for (i = 0; i < ARRAY_LENGTH(lens); ++i) {
+    const size_t len = lens[i];
+    for (int n = 0; n <= 20; n += 5) {
+      for (j = 0; j < n; ++j) {
+        bufs[j] = tor_malloc(len);
+        crypto_rand(bufs[j], len);
+        expected[j] = tor_memdup(bufs[j], len);
+        crypto_cipher_crypt_inplace(c1, expected[j], len);
+      }
+      crypto_cipher_crypt_inplace_multi(c2, bufs, len, n);
+      for (j = 0; j < n; ++j) {
+        tt_mem_op(bufs[j], OP_EQ, expected[j], len);
+        tor_free(bufs[j]);
+        tor_free(expected[j]);
+      }
+    }
+  }
+
+ done:
+  for (j = 0; j < 20; ++j) {
+    tor_free(bufs[j]);
+    tor_free(expected[j]);
+  }
+  crypto_cipher_free(c1);
+  crypto_cipher_free(c2);
+}
+
 /** Run unit tests for our SHA-1 functionality */
 static void
 test_crypto_sha(void *arg)
@@ -2110,6 +2156,51 @@ test_crypto_curve25519_wrappers(void *arg)
   ;
 }
 
+static void
+test_crypto_curve25519_batch(void *arg)
+{
+  const int max = 40;
+  curve25519_secret_key_t *seckeys = tor_calloc(max, sizeof(*seckeys));
+  curve25519_public_key_t *pubkeys = tor_calloc(max, sizeof(*pubkeys));
+  uint8_t *expected = tor_calloc(max, CURVE25519_OUTPUT_LEN);
+  uint8_t *got = tor_calloc(max, CURVE25519_OUTPUT_LEN);
+  const curve25519_secret_key_t *skp[40];
+  const curve25519_public_key_t *pkp[40];
+  uint8_t *outp[40];
+  int i, n;
+  (void)arg;
+
+  for (i = 0; i < max; ++i) {
+    curve25519_secret_key_generate(&seckeys[i], 0);
+    if (i % 7 == 3) {
+      /* A point of small order: the result should be zero, and shouldn't
+       * spoil the results for the rest of the batch. */
+      memset(pubkeys[i].public_key, 0, CURVE25519_PUBKEY_LEN);
+    } else {
+      crypto_rand((char*)pubkeys[i].public_key, CURVE25519_PUBKEY_LEN);
+    }
+    curve25519_handshake(expected + i*CURVE25519_OUTPUT_LEN,
+                         &seckeys[i], &pubkeys[i]);
+    skp[i] = &seckeys[i];
+    pkp[i] = &pubkeys[i];
+    outp[i] = got + i*CURVE25519_OUTPUT_LEN;
+  }
+  tt_assert(fast_mem_is_zero((char*)expected + 3*CURVE25519_OUTPUT_LEN,
+                             CURVE25519_OUTPUT_LEN));
+
+  for (n = 0; n <= max; ++n) {
+    memset(got, 0xff, max * CURVE25519_OUTPUT_LEN);
+    curve25519_handshake_batch(outp, skp, pkp, n);
+    tt_mem_op(got, OP_EQ, expected, n * CURVE25519_OUTPUT_LEN);
+  }
+
+ done:
+  tor_free(seckeys);
+  tor_free(pubkeys);
+  tor_free(expected);
+  tor_free(got);
+}
+
 static void
 test_crypto_curve25519_encode(void *arg)
 {
@@ -3216,6 +3307,7 @@ struct testcase_t crypto_tests[] = {
     &passthrough_setup, (void*)"192" },
   { "aes256_ctr_testvec", test_crypto_aes_ctr_testvec, 0,
     &passthrough_setup, (void*)"256" },
+  { "aes_inplace_multi", test_crypto_aes_inplace_multi, 0, NULL, NULL },
   CRYPTO_LEGACY(sha),
   CRYPTO_LEGACY(pk),
   { "pk_fingerprints", test_crypto_pk_fingerprints, TT_FORK, NULL, NULL },
@@ -3244,6 +3336,7 @@ struct testcase_t crypto_tests[] = {
   { "curve25519_basepoint",
     test_crypto_curve25519_basepoint, TT_FORK, NULL, NULL },
   { "curve25519_wrappers", test_crypto_curve25519_wrappers, 0, NULL, NULL },
+  { "curve25519_batch", test_crypto_curve25519_batch, 0, NULL, NULL },
   { "curve25519_encode", test_crypto_curve25519_encode, 0, NULL, NULL },
   { "curve25519_persist", test_crypto_curve25519_persist, 0, NULL, NULL },
   ED25519_TEST(simple, 0),
@@ -3799,6 +3799,31 @@ test_dir_v3_networkstatus(void *arg)
                        test_routerstatus_for_v3ns);
 }
 
+/** Run the V3 networkstatus tests again, with the router-status entries of
+ * every vote and consensus tokenized a range at a time, as we do for large
+ * documents. */
+static void
+test_dir_v3_networkstatus_parallel(void *arg)
+{
+  const size_t range_lens[] = { 0, 300, 4096 };
+  unsigned i;
+  (void)arg;
+
+  ns_parallel_min_len = 0;
+  for (i = 0; i < ARRAY_LENGTH(range_lens); ++i) {
+    ns_parallel_range_len = range_lens[i];
+    test_a_networkstatus(dir_common_gen_routerstatus_for_v3ns,
+                         vote_tweaks_for_v3ns,
+                         test_vrs_for_v3ns,
+                         test_consensus_for_v3ns,
+                         test_routerstatus_for_v3ns);
+    sr_state_free_all();
+  }
+
+  ns_parallel_min_len = NS_PARALLEL_MIN_LEN;
+  ns_parallel_range_len = NS_PARALLEL_RANGE_LEN;
+}
+
 static void
 test_dir_scale_bw(void *testdata)
 {
@@ -3945,6 +3970,84 @@ test_dir_random_weighted(void *testdata)
   ;
 }
 
+static void
+test_dir_random_weighted_alias(void *testdata)
+{
+  int hist_alias[10], hist_scan[10];
+  const double vals[10] = {3,1,2,4,6,0,7,5,8,9};
+  const double zeros[5] = {0,0,0,0,0};
+  const double bad[3] = {1,-1,1};
+  uint64_t inp_u64[10];
+  weighted_alias_t *wa = NULL;
+  const double total = 45;
+  const int n = 50000;
+  double max_sq_error, chi_sq;
+  int i, choice;
+  (void) testdata;
+
+  memset(hist_alias, 0, sizeof(hist_alias));
+  memset(hist_scan, 0, sizeof(hist_scan));
+  for (i = 0; i < 10; ++i)
+    inp_u64[i] = (uint64_t) vals[i];
+
+  wa = weighted_alias_new(vals, 10);
+  tt_assert(wa);
+  for (i = 0; i < n; ++i) {
+    choice = weighted_alias_choose(wa);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 10);
+    hist_alias[choice]++;
+    hist_scan[choose_array_element_by_weight(inp_u64, 10)]++;
+  }
+
+  /* The alias table should choose each element about as often as its
+   * weight says... */
+  max_sq_error = 0;
+  for (i = 0; i < 10; ++i) {
+    int expected = (int)(n*vals[i]/total);
+    double frac_diff = 0, sq;
+    TT_BLATHER(("  %d : %5d vs %5d (scan: %5d)\n", (int)vals[i],
+                hist_alias[i], expected, hist_scan[i]));
+    if (expected)
+      frac_diff = (hist_alias[i] - expected) / ((double)expected);
+    else
+      tt_int_op(hist_alias[i], OP_EQ, 0);
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+
+  /* ...and its histogram should be indistinguishable from the one that the
+   * cumulative scan gives us.  With 8 degrees of freedom, a chi-squared
+   * statistic above 40 has a probability of less than one in 100000. */
+  chi_sq = 0;
+  for (i = 0; i < 10; ++i) {
+    int sum = hist_alias[i] + hist_scan[i];
+    int diff = hist_alias[i] - hist_scan[i];
+    if (sum)
+      chi_sq += ((double)diff) * diff / sum;
+  }
+  TT_BLATHER(("chi-squared: %f\n", chi_sq));
+  tt_double_op(chi_sq, OP_LT, 40);
+  weighted_alias_free(wa);
+
+  /* A singleton always gets chosen. */
+  wa = weighted_alias_new(vals, 1);
+  tt_assert(wa);
+  for (i = 0; i < 100; ++i)
+    tt_int_op(weighted_alias_choose(wa), OP_EQ, 0);
+  weighted_alias_free(wa);
+
+  /* We can't build a table with no weight, or with a negative weight. */
+  tt_ptr_op(weighted_alias_new(zeros, 5), OP_EQ, NULL);
+  tt_ptr_op(weighted_alias_new(bad, 3), OP_EQ, NULL);
+  tt_ptr_op(weighted_alias_new(vals, 0), OP_EQ, NULL);
+
+ done:
+  weighted_alias_free(wa);
+}
+
 /* Function pointers for test_dir_clip_unmeasured_bw_kb() */
 
 static uint32_t alternate_clip_bw = 0;
@@ -7241,7 +7344,9 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(param_voting),
   DIR(param_voting_lookup, 0),
   DIR_LEGACY(v3_networkstatus),
+  DIR(v3_networkstatus_parallel, TT_FORK),
   DIR(random_weighted, 0),
+  DIR(random_weighted_alias, 0),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
   DIR_LEGACY(clip_unmeasured_bw_kb_alt),
@@ -13,6 +13,7 @@
 #include "app/config/config.h"
 #include "lib/confmgt/confmgt.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/mainloop.h"
 #include "core/or/connection_edge.h"
 #include "feature/nodelist/nodelist.h"
 
@@ -767,6 +768,88 @@ test_entryconn_rewrite_onion_v3(void *arg)
   /* 'conn' is cleaned by handler */
 }
 
+static smartlist_t *expired_conns = NULL;
+
+static void
+mock_connection_mark_unattached_ap_(entry_connection_t *conn, int endreason,
+                                    int line, const char *file)
+{
+  (void)endreason;
+  (void)line;
+  (void)file;
+  smartlist_add(expired_conns, conn);
+}
+
+/* Streams are only looked at when their expiry timer says they might have
+ * waited too long. */
+static void
+test_entryconn_ap_expiry(void *arg)
+{
+  entry_connection_t *young = NULL, *old = NULL, *unlisted = NULL;
+  const time_t now = 1700000000;
+  (void)arg;
+
+  tor_init_connection_lists();
+  MOCK(connection_mark_unattached_ap_, mock_connection_mark_unattached_ap_);
+  expired_conns = smartlist_new();
+  get_options_mutable()->SocksTimeout = 120;
+  update_approx_time(now);
+
+  young = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  old = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  unlisted = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  ENTRY_TO_CONN(young)->timestamp_created = now;
+  ENTRY_TO_CONN(old)->timestamp_created = now - 200;
+  ENTRY_TO_CONN(unlisted)->timestamp_created = now - 200;
+  ENTRY_TO_EDGE_CONN(young)->is_dns_request = 1;
+  ENTRY_TO_EDGE_CONN(old)->is_dns_request = 1;
+  tt_int_op(connection_add(ENTRY_TO_CONN(young)), OP_EQ, 0);
+  tt_int_op(connection_add(ENTRY_TO_CONN(old)), OP_EQ, 0);
+
+  /* Controllers that never attach a stream rely on us to time it out. */
+  connection_entry_set_controller_wait(young);
+  connection_entry_set_controller_wait(old);
+  connection_entry_set_controller_wait(unlisted);
+
+  connection_ap_expire_beginning_at(now);
+  tt_int_op(smartlist_len(expired_conns), OP_EQ, 0);
+
+  /* The old stream is past its deadline; the others aren't, or aren't ours
+   * to expire. */
+  connection_ap_expire_beginning_at(now + 1);
+  tt_int_op(smartlist_len(expired_conns), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(expired_conns, 0), OP_EQ, old);
+
+  /* A stream that we didn't close gets looked at again a second later. */
+  connection_ap_expire_beginning_at(now + 2);
+  tt_int_op(smartlist_len(expired_conns), OP_EQ, 2);
+
+  /* Open streams don't expire. */
+  ENTRY_TO_CONN(old)->state = AP_CONN_STATE_OPEN;
+  connection_ap_expire_beginning_at(now + 119);
+  tt_int_op(smartlist_len(expired_conns), OP_EQ, 2);
+
+  /* The young stream reaches its SocksTimeout. */
+  connection_ap_expire_beginning_at(now + 120);
+  tt_int_op(smartlist_len(expired_conns), OP_EQ, 3);
+  tt_ptr_op(smartlist_get(expired_conns, 2), OP_EQ, young);
+
+ done:
+  UNMOCK(connection_mark_unattached_ap_);
+  if (young) {
+    connection_remove(ENTRY_TO_CONN(young));
+    connection_free_minimal(ENTRY_TO_CONN(young));
+  }
+  if (old) {
+    connection_remove(ENTRY_TO_CONN(old));
+    connection_free_minimal(ENTRY_TO_CONN(old));
+  }
+  if (unlisted)
+    connection_free_minimal(ENTRY_TO_CONN(unlisted));
+  smartlist_free(expired_conns);
+  connection_edge_free_all();
+}
+
 #define REWRITE(name)                           \
   { #name, test_entryconn_##name, TT_FORK, &test_rewrite_setup, NULL }
 
@@ -788,6 +871,7 @@ struct testcase_t entryconn_tests[] = {
   REWRITE(rewrite_mapaddress_automap_onion3),
   REWRITE(rewrite_mapaddress_automap_onion4),
   REWRITE(rewrite_onion_v3),
+  { "ap_expiry", test_entryconn_ap_expiry, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -12,7 +12,9 @@
 #include "app/config/config.h"
 #include "lib/geoip/geoip.h"
 #include "feature/stats/geoip_stats.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "test/test.h"
+#include "test/log_test_helpers.h"
 
   /* Record odd numbered fake-IPs using ipv6, even numbered fake-IPs
    * using ipv4.  Since our fake geoip database is the same between
@@ -564,6 +566,161 @@ test_geoip_load_2nd_file(void *arg)
   tor_free(fname_empty);
 }
 
+static void
+test_geoip_load_cache(void *arg)
+{
+  (void)arg;
+  char *fname = tor_strdup(get_fname("geoip_src"));
+  char *fname6 = tor_strdup(get_fname("geoip6_src"));
+  char *cache = tor_strdup(get_fname("geoip_cache"));
+  char *cache6 = tor_strdup(get_fname("geoip6_cache"));
+  char *contents = NULL;
+  size_t len;
+  struct in6_addr iaddr6;
+  int country, country6;
+
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, GEOIP_CONTENT, 1));
+  tt_int_op(0, OP_EQ, write_str_to_file(fname6,
+      "2001:4860::,2001:4860:ffff:ffff:ffff:ffff:ffff:ffff,US\n"
+      "2001:4878:129::,2001:4878:129:ffff:ffff:ffff:ffff:ffff,CR\n", 1));
+  tor_inet_pton(AF_INET6, "2001:4878:129::77", &iaddr6);
+
+  /* The first load parses the files and writes the caches. */
+  setup_capture_of_logs(LOG_NOTICE);
+  tt_int_op(0, OP_EQ, geoip_load_file_with_cache(AF_INET, fname, cache,
+                                                 LOG_WARN));
+  tt_int_op(0, OP_EQ, geoip_load_file_with_cache(AF_INET6, fname6, cache6,
+                                                 LOG_WARN));
+  expect_log_msg_containing("Parsing GEOIP IPv4 file");
+  expect_log_msg_containing("Parsing GEOIP IPv6 file");
+  teardown_capture_of_logs();
+  country = geoip_get_country_by_ipv4(0x08080808);
+  tt_str_op(geoip_get_country_name(country), OP_EQ, "us");
+  country6 = geoip_get_country_by_ipv6(&iaddr6);
+  tt_str_op(geoip_get_country_name(country6), OP_EQ, "cr");
+  tt_int_op(file_status(cache), OP_EQ, FN_FILE);
+  tt_int_op(file_status(cache6), OP_EQ, FN_FILE);
+
+  /* Loading again, even with a fresh country list, uses the caches, and
+   * gives the same answers and digests. */
+  geoip_free_all();
+  setup_capture_of_logs(LOG_NOTICE);
+  tt_int_op(0, OP_EQ, geoip_load_file_with_cache(AF_INET6, fname6, cache6,
+                                                 LOG_WARN));
+  tt_int_op(0, OP_EQ, geoip_load_file_with_cache(AF_INET, fname, cache,
+                                                 LOG_WARN));
+  expect_log_msg_containing("Loaded GEOIP IPv4 data");
+  expect_log_msg_containing("Loaded GEOIP IPv6 data");
+  expect_no_log_msg_containing("Parsing GEOIP");
+  teardown_capture_of_logs();
+  country = geoip_get_country_by_ipv4(0x08080808);
+  tt_str_op(geoip_get_country_name(country), OP_EQ, "us");
+  tt_int_op(geoip_get_country_by_ipv4(0x01020304), OP_EQ, 0);
+  country6 = geoip_get_country_by_ipv6(&iaddr6);
+  tt_str_op(geoip_get_country_name(country6), OP_EQ, "cr");
+  contents = read_file_to_str(fname, RFTS_BIN, NULL);
+  {
+    char d[DIGEST_LEN];
+    crypto_digest(d, contents, strlen(contents));
+    tt_str_op(hex_str(d, DIGEST_LEN), OP_EQ, geoip_db_digest(AF_INET));
+  }
+  tor_free(contents);
+
+  /* A damaged cache gets rebuilt. */
+  geoip_free_all();
+  contents = read_file_to_str(cache, RFTS_BIN, NULL);
+  tt_assert(contents);
+  len = 4096;
+  tt_int_op(0, OP_EQ, write_bytes_to_file(cache, contents, len, 1));
+  setup_capture_of_logs(LOG_NOTICE);
+  tt_int_op(0, OP_EQ, geoip_load_file_with_cache(AF_INET, fname, cache,
+                                                 LOG_WARN));
+  expect_log_msg_containing("Parsing GEOIP IPv4 file");
+  teardown_capture_of_logs();
+  country = geoip_get_country_by_ipv4(0x08080808);
+  tt_str_op(geoip_get_country_name(country), OP_EQ, "us");
+
+  /* So does a cache for a different file. */
+  geoip_free_all();
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, "134744064,134744319,DE\n",
+                                        1));
+  setup_capture_of_logs(LOG_NOTICE);
+  tt_int_op(0, OP_EQ, geoip_load_file_with_cache(AF_INET, fname, cache,
+                                                 LOG_WARN));
+  expect_log_msg_containing("Parsing GEOIP IPv4 file");
+  teardown_capture_of_logs();
+  country = geoip_get_country_by_ipv4(0x08080808);
+  tt_str_op(geoip_get_country_name(country), OP_EQ, "de");
+
+ done:
+  teardown_capture_of_logs();
+  tor_free(contents);
+  tor_free(fname);
+  tor_free(fname6);
+  tor_free(cache);
+  tor_free(cache6);
+}
+
+/** Compare lookups in a table built from random, overlapping ranges with a
+ * search of the entries that went into it. */
+static void
+test_geoip_table_random(void *arg)
+{
+  (void)arg;
+  const int n_entries = 2000;
+  uint32_t *lows = tor_calloc(n_entries, sizeof(uint32_t));
+  uint32_t *highs = tor_calloc(n_entries, sizeof(uint32_t));
+  int *countries = tor_calloc(n_entries, sizeof(int));
+  int i, j;
+
+  for (i = 0; i < n_entries; ++i) {
+    char line[64];
+    char cc[3];
+    /* Cluster the ranges in a few /16s, so that some share a /16, some
+     * span several, and a few overlap. */
+    lows[i] = (crypto_rand_int(8) << 24) | crypto_rand_int(1<<24);
+    highs[i] = lows[i] + (crypto_rand_int(4) ?
+                          crypto_rand_int(1<<12) : crypto_rand_int(1<<20));
+    cc[0] = 'a' + crypto_rand_int(26);
+    cc[1] = 'a' + crypto_rand_int(26);
+    cc[2] = '\0';
+    tor_snprintf(line, sizeof(line), "%u,%u,%s", lows[i], highs[i], cc);
+    tt_int_op(0, OP_EQ, geoip_parse_entry(line, AF_INET));
+    countries[i] = geoip_get_country(cc);
+  }
+
+  for (i = 0; i < 20000; ++i) {
+    uint32_t addr;
+    int expected = 0, best = -1;
+    switch (crypto_rand_int(3)) {
+      case 0:
+        addr = lows[crypto_rand_int(n_entries)];
+        break;
+      case 1:
+        addr = highs[crypto_rand_int(n_entries)] + 1;
+        break;
+      default:
+        addr = crypto_rand_u32() >> crypto_rand_int(8);
+        break;
+    }
+    /* Where ranges overlap, the one that starts first wins. */
+    for (j = 0; j < n_entries; ++j) {
+      if (lows[j] <= addr && addr <= highs[j] &&
+          (best < 0 || lows[j] < lows[best])) {
+        best = j;
+      }
+    }
+    if (best >= 0)
+      expected = countries[best];
+    tt_int_op(expected, OP_EQ, geoip_get_country_by_ipv4(addr));
+  }
+
+ done:
+  tor_free(lows);
+  tor_free(highs);
+  tor_free(countries);
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -575,6 +732,8 @@ struct testcase_t geoip_tests[] = {
   { "load_file", test_geoip_load_file, TT_FORK, NULL, NULL },
   { "load_file6", test_geoip6_load_file, TT_FORK, NULL, NULL },
   { "load_2nd_file", test_geoip_load_2nd_file, TT_FORK, NULL, NULL },
+  { "load_cache", test_geoip_load_cache, TT_FORK, NULL, NULL },
+  { "table_random", test_geoip_table_random, TT_FORK, NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -7,6 +7,8 @@
  */
 
 #define CONFIG_PRIVATE
+#define CONNECTION_PRIVATE
+#define CONNECTION_URING_PRIVATE
 #define MAINLOOP_PRIVATE
 #define STATEFILE_PRIVATE
 
@@ -17,11 +19,14 @@
 
 #include "core/or/or.h"
 #include "core/mainloop/connection.h"
+#include "core/mainloop/connection_uring.h"
 #include "core/mainloop/mainloop.h"
 #include "core/mainloop/mainloop_state_st.h"
 #include "core/mainloop/mainloop_sys.h"
 #include "core/mainloop/netstatus.h"
+#include "core/or/connection_edge.h"
 
+#include "core/or/connection_st.h"
 #include "feature/hs/hs_service.h"
 
 #include "app/config/config.h"
@@ -369,6 +374,132 @@ test_mainloop_dormant_save_state(void *arg)
   tor_free(state);
 }
 
+#define N_URING_CONNS 4
+
+/** The connections that mock_conn_handle_readable() and
+ * mock_conn_handle_writable() were called for, and the results that they
+ * found. */
+static smartlist_t *uring_handled = NULL;
+static int uring_results[N_URING_CONNS];
+/** If set, the next call to mock_conn_handle_readable() removes this
+ * connection from the batch. */
+static connection_t *uring_victim = NULL;
+
+static void
+mock_conn_handle_readable(connection_t *conn)
+{
+  int result = -100, eof = 0, err = 0;
+  if (!connection_uring_take_read_result(conn, &result, &eof, &err))
+    result = -100;
+  uring_results[smartlist_len(uring_handled)] = result;
+  smartlist_add(uring_handled, conn);
+  if (uring_victim) {
+    connection_uring_forget(uring_victim);
+    uring_victim = NULL;
+  }
+}
+
+static void
+mock_conn_handle_writable(connection_t *conn)
+{
+  int result = -100;
+  if (!connection_uring_take_write_result(conn, &result))
+    result = -100;
+  uring_results[smartlist_len(uring_handled)] = result;
+  smartlist_add(uring_handled, conn);
+}
+
+static void
+test_mainloop_uring_batch(void *arg)
+{
+  connection_t *conns[N_URING_CONNS];
+  tor_socket_t peers[N_URING_CONNS];
+  char buf[64];
+  int i;
+  (void)arg;
+
+  memset(conns, 0, sizeof(conns));
+  memset(peers, 0xff, sizeof(peers));
+  uring_handled = smartlist_new();
+  MOCK(conn_handle_readable, mock_conn_handle_readable);
+  MOCK(conn_handle_writable, mock_conn_handle_writable);
+  tor_init_connection_lists();
+  get_options_mutable()->UseIOUring = 1;
+  connection_bucket_init();
+
+  for (i = 0; i < N_URING_CONNS; ++i) {
+    tor_socket_t fds[2];
+    tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+    tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+    conns[i] = connection_new(CONN_TYPE_EXIT, AF_INET);
+    conns[i]->state = EXIT_CONN_STATE_OPEN;
+    conns[i]->s = fds[0];
+    peers[i] = fds[1];
+    tt_int_op(connection_add(conns[i]), OP_EQ, 0);
+    connection_start_reading(conns[i]);
+    tor_snprintf(buf, sizeof(buf), "hello %d", i);
+    tt_int_op(tor_socket_send(peers[i], buf, strlen(buf), 0), OP_EQ,
+              strlen(buf));
+  }
+
+  /* Queue the reads in an odd order; the batch keeps that order. */
+  if (!connection_uring_queue(conns[2], false))
+    tt_skip();
+  for (i = 0; i < N_URING_CONNS; ++i) {
+    if (i != 2)
+      tt_int_op(connection_uring_queue(conns[i], false), OP_EQ, 1);
+  }
+  /* Queueing the same read twice does nothing. */
+  tt_int_op(connection_uring_queue(conns[0], false), OP_EQ, 1);
+
+  /* A connection that we free before the batch runs drops out of it... */
+  connection_uring_forget(conns[1]);
+  tt_ptr_op(conns[1]->uring, OP_EQ, NULL);
+  /* ... and so does one that we free while the batch is being handled. */
+  uring_victim = conns[3];
+
+  connection_uring_run_batch(NULL, NULL);
+  tt_int_op(smartlist_len(uring_handled), OP_EQ, 2);
+  tt_ptr_op(smartlist_get(uring_handled, 0), OP_EQ, conns[2]);
+  tt_ptr_op(smartlist_get(uring_handled, 1), OP_EQ, conns[0]);
+  tt_int_op(uring_results[0], OP_EQ, 7);
+  tt_int_op(uring_results[1], OP_EQ, 7);
+  tt_int_op(buf_datalen(conns[0]->inbuf), OP_EQ, 7);
+  tt_int_op(buf_datalen(conns[2]->inbuf), OP_EQ, 7);
+  buf_get_bytes(conns[2]->inbuf, buf, 7);
+  tt_mem_op(buf, OP_EQ, "hello 2", 7);
+  /* The victim's read happened, but nobody handled it. */
+  tt_ptr_op(conns[3]->uring, OP_EQ, NULL);
+  tt_int_op(buf_datalen(conns[1]->inbuf), OP_EQ, 0);
+
+  /* Writes work the same way. */
+  smartlist_clear(uring_handled);
+  connection_buf_add("abcdef", 6, conns[0]);
+  connection_start_writing(conns[0]);
+  tt_int_op(connection_uring_queue(conns[0], true), OP_EQ, 1);
+  connection_uring_run_batch(NULL, NULL);
+  tt_int_op(smartlist_len(uring_handled), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(uring_handled, 0), OP_EQ, conns[0]);
+  tt_int_op(uring_results[0], OP_EQ, 6);
+  tt_int_op(buf_datalen(conns[0]->outbuf), OP_EQ, 0);
+  tt_int_op(tor_socket_recv(peers[0], buf, sizeof(buf), 0), OP_EQ, 6);
+  tt_mem_op(buf, OP_EQ, "abcdef", 6);
+
+ done:
+  UNMOCK(conn_handle_readable);
+  UNMOCK(conn_handle_writable);
+  for (i = 0; i < N_URING_CONNS; ++i) {
+    if (conns[i]) {
+      connection_remove(conns[i]);
+      connection_free_minimal(conns[i]);
+    }
+    if (SOCKET_OK(peers[i]))
+      tor_close_socket(peers[i]);
+  }
+  connection_uring_free_all();
+  smartlist_free(uring_handled);
+}
+
 #define MAINLOOP_TEST(name) \
   { #name, test_mainloop_## name , TT_FORK, NULL, NULL }
 
@@ -379,5 +510,6 @@ struct testcase_t mainloop_tests[] = {
   MAINLOOP_TEST(check_participation),
   MAINLOOP_TEST(dormant_load_state),
   MAINLOOP_TEST(dormant_save_state),
+  MAINLOOP_TEST(uring_batch),
   END_OF_TESTCASES
 };
@@ -354,6 +354,17 @@ test_store(void *arg)
   tt_int_op(metrics_store_hist_entry_get_count(entry), OP_EQ, 4);
   tt_int_op(metrics_store_hist_entry_get_sum(entry), OP_EQ, 53);
 
+  /* Overwrite everything with a histogram kept elsewhere. */
+  {
+    const uint64_t values[] = { 2, 5, 7 };
+    metrics_store_hist_entry_set(entry, values, bucket_count, 8, 1234);
+    tt_int_op(metrics_store_hist_entry_get_value(entry, 10), OP_EQ, 2);
+    tt_int_op(metrics_store_hist_entry_get_value(entry, 20), OP_EQ, 5);
+    tt_int_op(metrics_store_hist_entry_get_value(entry, 3000), OP_EQ, 7);
+    tt_int_op(metrics_store_hist_entry_get_count(entry), OP_EQ, 8);
+    tt_int_op(metrics_store_hist_entry_get_sum(entry), OP_EQ, 1234);
+  }
+
   /* Ensure this resets all buckets back to 0. */
   metrics_store_entry_reset(entry);
   for (size_t i = 0; i < bucket_count; ++i) {
@@ -5,6 +5,7 @@
 #include "core/or/or.h"
 
 #define DIRVOTE_PRIVATE
+#define MICRODESC_PRIVATE
 #include "app/config/config.h"
 #include "feature/dirauth/dirvote.h"
 #include "feature/dirparse/microdesc_parse.h"
@@ -264,6 +265,145 @@ test_md_cache(void *data)
   tor_free(encoded_family);
 }
 
+/* Make sure that we can load the cache file from its index, that we parse
+ * the microdescriptors we load that way when we look them up, that we can
+ * append the journal to the cache file, and that we ignore stale indices. */
+static void
+test_md_cache_index(void *data)
+{
+  or_options_t *options = NULL;
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL;
+  microdesc_t *md1, *md2, *md3;
+  char d1[DIGEST256_LEN], d2[DIGEST256_LEN], d3[DIGEST256_LEN];
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  const time_t now = time(NULL);
+  char *fn = NULL, *s = NULL, *s2 = NULL;
+  char *encoded_family = NULL;
+  off_t md1_off;
+  (void)data;
+
+  options = get_options_mutable();
+  tor_free(options->CacheDirectory);
+  options->CacheDirectory = tor_strdup(get_fname("md_datadir_test_idx"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->CacheDirectory, 0700));
+#endif
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->CacheDirectory);
+
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d2, test_md2, strlen(test_md2), DIGEST_SHA256);
+  crypto_digest256(d3, test_md3_noannotation, strlen(test_md3_noannotation),
+                   DIGEST_SHA256);
+
+  /* Put md1 and md2 in the cache file. */
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md2, NULL, SAVED_NOWHERE, 0,
+                                  now - 3600, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  smartlist_free(added);
+  added = NULL;
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+
+  /* Reload: we should use the index, and parse nothing until asked. */
+  microdesc_free_all();
+  setup_capture_of_logs(LOG_INFO);
+  mc = get_microdesc_cache();
+  expect_log_msg_containing(
+                       "Loaded 2 microdescriptors from the cache index.");
+  teardown_capture_of_logs();
+
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  md2 = microdesc_cache_lookup_by_digest256(mc, d2);
+  tt_assert(md1);
+  tt_assert(md2);
+  tt_assert(! md1->fields_pending);
+  tt_int_op(md1->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(md1->bodylen, OP_EQ, strlen(test_md1));
+  tt_mem_op(md1->body, OP_EQ, test_md1, strlen(test_md1));
+  tt_assert(md1->onion_pkey);
+  tt_assert(md1->onion_curve25519_pkey);
+  tt_int_op(md1->last_listed, OP_EQ, now);
+  tt_int_op(md2->last_listed, OP_EQ, now - 3600);
+  md1_off = md1->off;
+
+  /* Add md3 to the journal, and append it to the cache file. */
+  added = microdescs_add_to_cache(mc, test_md3_noannotation, NULL,
+                                  SAVED_NOWHERE, 0, now, NULL);
+  tt_int_op(1, OP_EQ, smartlist_len(added));
+  md3 = smartlist_get(added, 0);
+  smartlist_free(added);
+  added = NULL;
+  tt_int_op(md3->saved_location, OP_EQ, SAVED_IN_JOURNAL);
+  tt_int_op(microdesc_cache_append_journal(mc), OP_EQ, 0);
+  tt_int_op(md3->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(md1->off, OP_EQ, md1_off);
+
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  tt_mem_op(md1->body, OP_EQ, s + md1->off, strlen(test_md1));
+  tt_mem_op(md2->body, OP_EQ, s + md2->off, strlen(test_md2));
+  tt_mem_op(md3->body, OP_EQ, s + md3->off, strlen(test_md3_noannotation));
+  tor_free(s);
+  tor_asprintf(&s2, "%s.new", fn);
+  s = read_file_to_str(s2, RFTS_BIN, NULL);
+  tt_str_op(s, OP_EQ, "");
+  tor_free(s);
+
+  /* The index should cover the appended microdescriptor too. */
+  microdesc_free_all();
+  setup_capture_of_logs(LOG_INFO);
+  mc = get_microdesc_cache();
+  expect_log_msg_containing(
+                       "Loaded 3 microdescriptors from the cache index.");
+  teardown_capture_of_logs();
+  md3 = microdesc_cache_lookup_by_digest256(mc, d3);
+  tt_assert(md3);
+  encoded_family = nodefamily_format(md3->family);
+  tt_str_op(encoded_family, OP_EQ, "nodex nodey nodez");
+
+  /* If the index doesn't match the cache file, ignore it. */
+  microdesc_free_all();
+  tor_free(s2);
+  tor_asprintf(&s2, "%s.idx", fn);
+  {
+    size_t len;
+    struct stat st;
+    s = read_file_to_str(s2, RFTS_BIN, &st);
+    tt_assert(s);
+    len = (size_t) st.st_size;
+    tt_int_op(len, OP_GT, 64);
+    s[24] ^= 1; /* Change the digest of the cache file. */
+    tt_int_op(0, OP_EQ, write_bytes_to_file(s2, s, len, 1));
+    tor_free(s);
+  }
+  setup_capture_of_logs(LOG_INFO);
+  mc = get_microdesc_cache();
+  expect_no_log_msg_containing("from the cache index");
+  teardown_capture_of_logs();
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d1));
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d2));
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d3));
+
+ done:
+  teardown_capture_of_logs();
+  if (options)
+    tor_free(options->CacheDirectory);
+  microdesc_free_all();
+  smartlist_free(added);
+  tor_free(s);
+  tor_free(s2);
+  tor_free(fn);
+  tor_free(encoded_family);
+}
+
 static const char truncated_md[] =
   "@last-listed 2013-08-08 19:02:59\n"
   "onion-key\n"
@@ -923,6 +1063,7 @@ test_md_corrupt_desc(void *arg)
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
+  { "cache_index", test_md_cache_index, TT_FORK, NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
   { "parse_id_ed25519", test_md_parse_id_ed25519, 0, NULL, NULL },
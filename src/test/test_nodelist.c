@@ -14,8 +14,11 @@
 #include "lib/crypt_ops/crypto_format.h"
 #include "feature/nodelist/describe.h"
 #include "feature/nodelist/networkstatus.h"
+#include "feature/nodelist/node_select.h"
+#include "feature/nodelist/node_table.h"
 #include "feature/nodelist/nodefamily.h"
 #include "feature/nodelist/nodelist.h"
+#include "feature/nodelist/routerlist.h"
 #include "feature/nodelist/torcert.h"
 
 #include "core/or/extend_info_st.h"
@@ -241,6 +244,289 @@ test_nodelist_ed_id(void *arg)
 #undef N_NODES
 }
 
+static void
+test_nodelist_node_table(void *arg)
+{
+#define N_NODES 6
+  routerstatus_t *rs[N_NODES];
+  networkstatus_t *ns;
+  smartlist_t *sl = smartlist_new();
+  const node_t *nodes[N_NODES];
+  const node_table_t *table;
+  node_t fake_node;
+  int i, j;
+  static const int crn_flags[] = {
+    0, CRN_NEED_UPTIME, CRN_NEED_CAPACITY, CRN_NEED_GUARD,
+    CRN_NEED_UPTIME|CRN_NEED_CAPACITY|CRN_NEED_GUARD, CRN_RENDEZVOUS_V3,
+    CRN_CONFLUX,
+  };
+  (void)arg;
+
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->flavor = FLAV_MICRODESC;
+  ns->routerstatus_list = smartlist_new();
+  dummy_ns = ns;
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(networkstatus_get_latest_consensus_by_flavor,
+       mock_networkstatus_get_latest_consensus_by_flavor);
+
+  for (i = 0; i < N_NODES; ++i) {
+    rs[i] = tor_malloc_zero(sizeof(*rs[i]));
+    crypto_rand(rs[i]->identity_digest, sizeof(rs[i]->identity_digest));
+    rs[i]->is_valid = rs[i]->is_flagged_running = 1;
+    rs[i]->has_bandwidth = 1;
+    rs[i]->bandwidth_kb = 100 * (i + 1);
+    rs[i]->pv.protocols_known = 1;
+    rs[i]->pv.supports_extend2_cells = 1;
+    smartlist_add(ns->routerstatus_list, rs[i]);
+  }
+  /* 0 is a fast, stable guard; 1 is fast; 2 isn't running; 3 can't do
+   * EXTEND2; 4 is an exit and supports conflux; 5 is a guard with a
+   * guardfraction and no bandwidth. */
+  rs[0]->is_fast = rs[0]->is_stable = rs[0]->is_possible_guard = 1;
+  rs[1]->is_fast = 1;
+  rs[2]->is_flagged_running = 0;
+  rs[3]->pv.supports_extend2_cells = 0;
+  rs[4]->is_exit = 1;
+  rs[4]->pv.supports_conflux = 1;
+  rs[5]->is_possible_guard = 1;
+  rs[5]->has_guardfraction = 1;
+  rs[5]->guardfraction_percentage = 40;
+  rs[5]->has_bandwidth = 0;
+
+  nodelist_set_consensus(ns);
+  for (i = 0; i < N_NODES; ++i) {
+    nodes[i] = node_get_by_id(rs[i]->identity_digest);
+    tt_assert(nodes[i]);
+  }
+
+  setup_full_capture_of_logs(LOG_WARN);
+  table = node_table_get();
+  expect_single_log_msg_containing("Consensus is missing some bandwidths");
+  teardown_capture_of_logs();
+  tt_int_op(table->n_nodes, OP_EQ, N_NODES);
+  for (i = 0; i < N_NODES; ++i) {
+    j = node_table_get_idx(table, nodes[i]);
+    tt_int_op(j, OP_GE, 0);
+    tt_int_op(table->flags[j], OP_EQ, node_table_compute_flags(nodes[i]));
+  }
+  j = node_table_get_idx(table, nodes[0]);
+  tt_int_op(table->bandwidth[j], OP_EQ, 100000);
+  tt_int_op(table->flags[j] & NODE_TABLE_GUARD, OP_NE, 0);
+  tt_int_op(table->flags[j] & NODE_TABLE_EXIT, OP_EQ, 0);
+  j = node_table_get_idx(table, nodes[4]);
+  tt_int_op(table->flags[j] & NODE_TABLE_EXIT, OP_NE, 0);
+  tt_int_op(table->flags[j] & NODE_TABLE_CONFLUX, OP_NE, 0);
+  j = node_table_get_idx(table, nodes[3]);
+  tt_int_op(table->flags[j] & NODE_TABLE_USABLE, OP_EQ, 0);
+  j = node_table_get_idx(table, nodes[5]);
+  tt_int_op(table->bandwidth[j], OP_EQ, 30000);
+  tt_int_op(table->flags[j] & NODE_TABLE_GUARDFRACTION, OP_NE, 0);
+  tt_int_op(table->guardfraction_pct[j], OP_EQ, 40);
+
+  /* A node that isn't in the nodelist gets the same answer as if it were. */
+  memcpy(&fake_node, nodes[0], sizeof(fake_node));
+  fake_node.nodelist_idx = -1;
+  tt_int_op(node_table_get_idx(table, &fake_node), OP_EQ, -1);
+  tt_assert(router_can_choose_node(&fake_node, CRN_NEED_GUARD));
+  fake_node.is_running = 0;
+  tt_assert(!router_can_choose_node(&fake_node, 0));
+
+  /* The scan over the table finds exactly the nodes that
+   * router_can_choose_node() accepts. */
+  for (j = 0; j < (int)ARRAY_LENGTH(crn_flags); ++j) {
+    smartlist_clear(sl);
+    router_add_running_nodes_to_smartlist(sl, crn_flags[j]);
+    for (i = 0; i < N_NODES; ++i) {
+      tt_int_op(smartlist_contains(sl, nodes[i]), OP_EQ,
+                router_can_choose_node(nodes[i], crn_flags[j]));
+    }
+  }
+  smartlist_clear(sl);
+  router_add_running_nodes_to_smartlist(sl, 0);
+  tt_int_op(smartlist_len(sl), OP_EQ, 4);
+  smartlist_clear(sl);
+  router_add_running_nodes_to_smartlist(sl, CRN_NEED_GUARD);
+  tt_int_op(smartlist_len(sl), OP_EQ, 2);
+  smartlist_clear(sl);
+  router_add_running_nodes_to_smartlist(sl, CRN_CONFLUX);
+  tt_int_op(smartlist_len(sl), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(sl, 0), OP_EQ, nodes[4]);
+
+  /* Marking a node down rebuilds the table. */
+  router_set_status(rs[0]->identity_digest, 0);
+  tt_assert(!router_can_choose_node(nodes[0], 0));
+  smartlist_clear(sl);
+  router_add_running_nodes_to_smartlist(sl, CRN_NEED_GUARD);
+  tt_int_op(smartlist_len(sl), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(sl, 0), OP_EQ, nodes[5]);
+
+ done:
+  teardown_capture_of_logs();
+  smartlist_free(sl);
+  nodelist_free_all();
+  SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, r, tor_free(r));
+  smartlist_clear(ns->routerstatus_list);
+  networkstatus_vote_free(ns);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(networkstatus_get_latest_consensus_by_flavor);
+#undef N_NODES
+}
+
+static void
+test_nodelist_node_alias_choice(void *arg)
+{
+#define N_NODES 5
+  routerstatus_t *rs[N_NODES];
+  networkstatus_t *ns;
+  smartlist_t *excluded = smartlist_new();
+  smartlist_t *candidates = smartlist_new();
+  const node_t *nodes[N_NODES];
+  int hist_alias[N_NODES], hist_scan[N_NODES];
+  const int n = 20000;
+  double chi_sq;
+  int i, j;
+  (void)arg;
+
+  memset(hist_alias, 0, sizeof(hist_alias));
+  memset(hist_scan, 0, sizeof(hist_scan));
+
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->flavor = FLAV_MICRODESC;
+  ns->routerstatus_list = smartlist_new();
+  dummy_ns = ns;
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(networkstatus_get_latest_consensus_by_flavor,
+       mock_networkstatus_get_latest_consensus_by_flavor);
+
+  for (i = 0; i < N_NODES; ++i) {
+    rs[i] = tor_malloc_zero(sizeof(*rs[i]));
+    crypto_rand(rs[i]->identity_digest, sizeof(rs[i]->identity_digest));
+    rs[i]->is_valid = rs[i]->is_flagged_running = 1;
+    rs[i]->has_bandwidth = 1;
+    rs[i]->bandwidth_kb = 100 * (i + 1);
+    smartlist_add(ns->routerstatus_list, rs[i]);
+  }
+  nodelist_set_consensus(ns);
+  for (i = 0; i < N_NODES; ++i) {
+    nodes[i] = node_get_by_id(rs[i]->identity_digest);
+    tt_assert(nodes[i]);
+  }
+
+  /* Exclude the first node, and compare what we choose from the rest with
+   * what the cumulative scan chooses from the same nodes. */
+  smartlist_add(excluded, (void *)nodes[0]);
+  for (i = 1; i < N_NODES; ++i)
+    smartlist_add(candidates, (void *)nodes[i]);
+  for (i = 0; i < n; ++i) {
+    const node_t *choice = router_choose_random_node(excluded, NULL, 0);
+    const node_t *expected = node_sl_choose_by_bandwidth(candidates,
+                                                         WEIGHT_FOR_MID);
+    for (j = 0; j < N_NODES; ++j) {
+      if (choice == nodes[j])
+        hist_alias[j]++;
+      if (expected == nodes[j])
+        hist_scan[j]++;
+    }
+  }
+  tt_int_op(hist_alias[0], OP_EQ, 0);
+  /* With 3 degrees of freedom, a chi-squared statistic above 25 has a
+   * probability of less than one in 50000. */
+  chi_sq = 0;
+  for (j = 1; j < N_NODES; ++j) {
+    int sum = hist_alias[j] + hist_scan[j];
+    int diff = hist_alias[j] - hist_scan[j];
+    TT_BLATHER(("  %d: %5d vs %5d\n", j, hist_alias[j], hist_scan[j]));
+    tt_int_op(sum, OP_GT, 0);
+    chi_sq += ((double)diff) * diff / sum;
+  }
+  tt_double_op(chi_sq, OP_LT, 25);
+
+  /* If every node is excluded, we fall back to the slow path, and find
+   * nothing. */
+  smartlist_add_all(excluded, candidates);
+  setup_full_capture_of_logs(LOG_WARN);
+  tt_ptr_op(router_choose_random_node(excluded, NULL, 0), OP_EQ, NULL);
+  expect_single_log_msg_containing("No available nodes");
+
+ done:
+  teardown_capture_of_logs();
+  smartlist_free(excluded);
+  smartlist_free(candidates);
+  nodelist_free_all();
+  SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, r, tor_free(r));
+  smartlist_clear(ns->routerstatus_list);
+  networkstatus_vote_free(ns);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(networkstatus_get_latest_consensus_by_flavor);
+#undef N_NODES
+}
+
+static void
+test_nodelist_node_alias_invalidate(void *arg)
+{
+  routerstatus_t *rs[2];
+  networkstatus_t *ns;
+  const node_t *guard;
+  int i, n_guard;
+  (void)arg;
+
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->flavor = FLAV_MICRODESC;
+  ns->routerstatus_list = smartlist_new();
+  /* Never choose a guard as a middle node. */
+  ns->weight_params = smartlist_new();
+  smartlist_split_string(ns->weight_params,
+                         "Wmg=0 Wmm=10000 Wme=10000 Wmd=10000 "
+                         "Wgb=10000 Wmb=10000 Web=10000 Wdb=10000",
+                         " ", 0, 0);
+  dummy_ns = ns;
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+  MOCK(networkstatus_get_latest_consensus_by_flavor,
+       mock_networkstatus_get_latest_consensus_by_flavor);
+
+  for (i = 0; i < 2; ++i) {
+    rs[i] = tor_malloc_zero(sizeof(*rs[i]));
+    crypto_rand(rs[i]->identity_digest, sizeof(rs[i]->identity_digest));
+    rs[i]->is_valid = rs[i]->is_flagged_running = 1;
+    rs[i]->has_bandwidth = 1;
+    rs[i]->bandwidth_kb = 100;
+    smartlist_add(ns->routerstatus_list, rs[i]);
+  }
+  rs[0]->is_possible_guard = 1;
+  nodelist_set_consensus(ns);
+  guard = node_get_by_id(rs[0]->identity_digest);
+  tt_assert(guard);
+
+  for (i = 0; i < 100; ++i)
+    tt_ptr_op(router_choose_random_node(NULL, NULL, 0), OP_NE, guard);
+
+  /* Change the weights without touching the nodes, as a consensus with the
+   * same relays would.  Once we've been told, we use the new weights. */
+  tor_free(smartlist_get(ns->weight_params, 0));
+  smartlist_set(ns->weight_params, 0, tor_strdup("Wmg=10000"));
+  node_select_invalidate();
+  n_guard = 0;
+  for (i = 0; i < 1000; ++i) {
+    if (router_choose_random_node(NULL, NULL, 0) == guard)
+      ++n_guard;
+  }
+  /* We expect about 500. */
+  tt_int_op(n_guard, OP_GT, 300);
+  tt_int_op(n_guard, OP_LT, 700);
+
+ done:
+  nodelist_free_all();
+  SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, r, tor_free(r));
+  smartlist_clear(ns->routerstatus_list);
+  networkstatus_vote_free(ns);
+  UNMOCK(networkstatus_get_latest_consensus);
+  UNMOCK(networkstatus_get_latest_consensus_by_flavor);
+}
+
 static void
 test_nodelist_nodefamily(void *arg)
 {
@@ -1426,6 +1712,9 @@ struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
   NODE(node_is_dir, TT_FORK),
   NODE(ed_id, TT_FORK),
+  NODE(node_table, TT_FORK),
+  NODE(node_alias_choice, TT_FORK),
+  NODE(node_alias_invalidate, TT_FORK),
   NODE(nodefamily, TT_FORK),
   NODE(nodefamily_parse_err, TT_FORK),
   NODE(nodefamily_lookup, TT_FORK),
@@ -8,11 +8,13 @@
 #include "app/config/config.h"
 #include "core/or/circuitbuild.h"
 #include "core/or/policies.h"
+#include "core/or/policy_trie.h"
 #include "core/or/extendinfo.h"
 #include "feature/dirparse/policy_parse.h"
 #include "feature/hs/hs_common.h"
 #include "feature/hs/hs_descriptor.h"
 #include "feature/relay/router.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/encoding/confline.h"
 #include "test/test.h"
 #include "test/log_test_helpers.h"
@@ -2662,6 +2664,156 @@ test_policies_fascist_firewall_choose_address(void *arg)
   UNMOCK(get_options);
 }
 
+/** Helper: set *<b>addr</b> to a random address that shares a prefix of
+ * random length with <b>base</b>. */
+static void
+test_policy_trie_random_addr(tor_addr_t *addr, const tor_addr_t *base)
+{
+  if (tor_addr_family(base) == AF_INET) {
+    const int keep = crypto_rand_int(33);
+    uint32_t a = tor_addr_to_ipv4h(base);
+    uint32_t mask = keep ? (UINT32_MAX << (32 - keep)) : 0;
+    a = (a & mask) | (crypto_rand_u32() & ~mask);
+    tor_addr_from_ipv4h(addr, a);
+  } else {
+    uint8_t a[16];
+    const int keep = crypto_rand_int(129);
+    memcpy(a, tor_addr_to_in6_addr8(base), 16);
+    crypto_rand((char *) a + keep / 8, 16 - keep / 8);
+    if (keep % 8 && keep < 128) {
+      const uint8_t mask = 0xff << (8 - keep % 8);
+      a[keep / 8] = (tor_addr_to_in6_addr8(base)[keep / 8] & mask) |
+        (a[keep / 8] & ~mask);
+    }
+    tor_addr_from_ipv6_bytes(addr, a);
+  }
+}
+
+/** Helper: return a random port from near the edges of the port ranges in
+ * <b>policy</b>, or from anywhere. */
+static uint16_t
+test_policy_trie_random_port(const smartlist_t *policy)
+{
+  int port;
+  if (smartlist_len(policy) && crypto_rand_int(4)) {
+    const addr_policy_t *p = smartlist_choose(policy);
+    port = (crypto_rand_int(2) ? p->prt_min : p->prt_max) +
+      crypto_rand_int(3) - 1;
+  } else {
+    port = crypto_rand_int(65536);
+  }
+  return (uint16_t) CLAMP(1, port, 65535);
+}
+
+static void
+test_policies_trie(void *arg)
+{
+  smartlist_t *policy = NULL;
+  addr_policy_trie_t *trie = NULL;
+  addr_policy_t *p;
+  tor_addr_t bases[4], addr;
+  routerinfo_t ri;
+  int i, j, malformed_list;
+  (void) arg;
+
+  memset(&ri, 0, sizeof(ri));
+  tor_addr_parse(&bases[0], "10.20.30.40");
+  tor_addr_parse(&bases[1], "198.51.100.7");
+  tor_addr_parse(&bases[2], "[2001:db8:1234::5]");
+  tor_addr_parse(&bases[3], "[fe80::1:2:3]");
+
+  /* A real exit policy, with a long reject list in front. */
+  policy = smartlist_new();
+  for (i = 0; i < 64; ++i) {
+    char line[64];
+    tor_snprintf(line, sizeof(line), "reject 203.0.%d.0/%d:*", i,
+                 24 + i % 9);
+    p = router_parse_addr_policy_item_from_string(line, -1,
+                                                  &malformed_list);
+    tt_assert(p);
+    smartlist_add(policy, p);
+  }
+  tt_int_op(0, OP_EQ, policies_parse_exit_policy(NULL, &policy,
+                                                 EXIT_POLICY_IPV6_ENABLED |
+                                                 EXIT_POLICY_REJECT_PRIVATE |
+                                                 EXIT_POLICY_ADD_DEFAULT,
+                                                 NULL));
+  trie = addr_policy_trie_new(policy);
+  tt_assert(trie);
+  tor_addr_parse(&addr, "203.0.0.9");
+  tt_int_op(ADDR_POLICY_REJECTED, OP_EQ,
+            addr_policy_trie_lookup(trie, &addr, 443));
+  tor_addr_parse(&addr, "203.0.8.9");
+  tt_int_op(ADDR_POLICY_ACCEPTED, OP_EQ,
+            addr_policy_trie_lookup(trie, &addr, 443));
+  tt_int_op(ADDR_POLICY_REJECTED, OP_EQ,
+            addr_policy_trie_lookup(trie, &addr, 25));
+  tor_addr_parse(&addr, "192.168.1.1");
+  tt_int_op(ADDR_POLICY_REJECTED, OP_EQ,
+            addr_policy_trie_lookup(trie, &addr, 443));
+  tor_addr_parse(&addr, "[2001:db8::1]");
+  tt_int_op(ADDR_POLICY_ACCEPTED, OP_EQ,
+            addr_policy_trie_lookup(trie, &addr, 443));
+  tt_int_op(ADDR_POLICY_REJECTED, OP_EQ,
+            addr_policy_trie_lookup(trie, &addr, 25));
+
+  /* Routers compile their exit policy on first use. */
+  ri.exit_policy = policy;
+  tt_int_op(ADDR_POLICY_REJECTED, OP_EQ,
+            compare_tor_addr_to_router_exit_policy(&addr, 25, &ri));
+  tt_assert(ri.exit_policy_trie_built);
+  tt_assert(ri.exit_policy_trie);
+  tt_int_op(ADDR_POLICY_PROBABLY_ACCEPTED, OP_EQ,
+            compare_tor_addr_to_router_exit_policy(&addr, 0, &ri));
+  addr_policy_trie_free(ri.exit_policy_trie);
+  addr_policy_trie_free(trie);
+  addr_policy_list_free(policy);
+
+  /* Random policies, with rules clustered around a few addresses so that
+   * they overlap, must give the same answers as walking the list. */
+  for (i = 0; i < 50; ++i) {
+    const int n_rules = crypto_rand_int(200);
+    policy = smartlist_new();
+    for (j = 0; j < n_rules; ++j) {
+      const tor_addr_t *base = &bases[crypto_rand_int(4)];
+      p = tor_malloc_zero(sizeof(addr_policy_t));
+      p->policy_type = crypto_rand_int(2) ? ADDR_POLICY_ACCEPT :
+        ADDR_POLICY_REJECT;
+      test_policy_trie_random_addr(&p->addr, base);
+      p->maskbits = crypto_rand_int(tor_addr_family(base) == AF_INET ?
+                                    40 : 136);
+      p->prt_min = crypto_rand_int(4) ? 1 + crypto_rand_int(1024) : 1;
+      p->prt_max = crypto_rand_int(4) ?
+        p->prt_min + crypto_rand_int(64) : 65535;
+      smartlist_add(policy, p);
+    }
+    trie = addr_policy_trie_new(policy);
+    tt_assert(trie);
+    for (j = 0; j < 2000; ++j) {
+      const uint16_t port = test_policy_trie_random_port(policy);
+      test_policy_trie_random_addr(&addr, &bases[crypto_rand_int(4)]);
+      tt_int_op(compare_tor_addr_to_addr_policy(&addr, port, policy),
+                OP_EQ, addr_policy_trie_lookup(trie, &addr, port));
+    }
+    addr_policy_trie_free(trie);
+    addr_policy_list_free(policy);
+  }
+
+  /* We don't compile policies with rules for other kinds of address. */
+  policy = smartlist_new();
+  p = tor_malloc_zero(sizeof(addr_policy_t));
+  p->policy_type = ADDR_POLICY_REJECT;
+  tor_addr_make_unspec(&p->addr);
+  p->prt_min = 1;
+  p->prt_max = 65535;
+  smartlist_add(policy, p);
+  tt_ptr_op(addr_policy_trie_new(policy), OP_EQ, NULL);
+
+ done:
+  addr_policy_trie_free(trie);
+  addr_policy_list_free(policy);
+}
+
 #undef TEST_IPV4_ADDR_STR
 #undef TEST_IPV6_ADDR_STR
 #undef TEST_IPV4_OR_PORT
@@ -2687,5 +2839,6 @@ struct testcase_t policy_tests[] = {
     test_policies_fascist_firewall_allows_address, 0, NULL, NULL },
   { "reachable_addr_choose",
     test_policies_fascist_firewall_choose_address, 0, NULL, NULL },
+  { "trie", test_policies_trie, 0, NULL, NULL },
   END_OF_TESTCASES
 };
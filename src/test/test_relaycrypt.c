@@ -12,6 +12,8 @@
 #include "lib/crypt_ops/crypto_rand.h"
 #include "core/or/relay.h"
 #include "core/crypto/relay_crypto.h"
+#define RELAY_CRYPTO_OFFLOAD_PRIVATE
+#include "core/or/relay_crypto_offload.h"
 #include "core/or/crypt_path.h"
 #include "core/or/cell_st.h"
 #include "core/or/or_circuit_st.h"
@@ -181,12 +183,226 @@ test_relaycrypt_inbound(void *arg)
   ;
 }
 
+/* Remove and free the first cell in <b>job</b>, as the reply function
+ * would once it had handled it. */
+static void
+drop_first_cell(relay_crypto_job_t *job)
+{
+  cell_t *c = smartlist_get(job->cells, 0);
+  smartlist_del_keeporder(job->cells, 0);
+  tor_free(c);
+  --job->n_decrypted;
+}
+
+/* Check that a worker decrypting a run of outbound cells for a relay stops
+ * right after the first cell that it recognizes, and that the cells it has
+ * already decrypted aren't decrypted again. */
+static void
+test_relaycrypt_offload_batch(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  tt_assert(cs);
+
+  relay_header_t rh;
+  cell_t orig[8];
+  relay_crypto_job_t job;
+  int i;
+
+  memset(&job, 0, sizeof(job));
+  job.cells = smartlist_new();
+
+  for (i = 0; i < 8; ++i) {
+    crypto_rand((char *)&orig[i], sizeof(orig[i]));
+    relay_header_unpack(&rh, orig[i].payload);
+    rh.recognized = 0;
+    memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(orig[i].payload, &rh);
+
+    cell_t *c = tor_memdup(&orig[i], sizeof(cell_t));
+    /* Cells 0 and 1 are for the middle hop; the rest are for the last. */
+    relay_encrypt_cell_outbound(c, cs->origin_circ,
+                                i < 2 ? cs->origin_circ->cpath->next :
+                                cs->origin_circ->cpath->prev);
+    smartlist_add(job.cells, c);
+  }
+
+  /* The first hop recognizes nothing. */
+  job.cipher = cs->or_circ[0]->crypto.f_crypto;
+  job.digest = cs->or_circ[0]->crypto.f_digest;
+  tt_int_op(relay_crypto_job_threadfn(NULL, &job), OP_EQ, WQ_RPL_REPLY);
+  tt_int_op(job.n_processed, OP_EQ, 8);
+  tt_int_op(job.recognized, OP_EQ, 0);
+
+  /* The second hop stops at each of the first two cells. */
+  job.n_decrypted = 0;
+  job.cipher = cs->or_circ[1]->crypto.f_crypto;
+  job.digest = cs->or_circ[1]->crypto.f_digest;
+  relay_crypto_job_threadfn(NULL, &job);
+  tt_int_op(job.n_processed, OP_EQ, 1);
+  tt_int_op(job.recognized, OP_EQ, 1);
+  tt_mem_op(orig[0].payload, OP_EQ,
+            ((cell_t*)smartlist_get(job.cells, 0))->payload,
+            CELL_PAYLOAD_SIZE);
+  drop_first_cell(&job);
+
+  relay_crypto_job_threadfn(NULL, &job);
+  tt_int_op(job.n_processed, OP_EQ, 1);
+  tt_int_op(job.recognized, OP_EQ, 1);
+  tt_mem_op(orig[1].payload, OP_EQ,
+            ((cell_t*)smartlist_get(job.cells, 0))->payload,
+            CELL_PAYLOAD_SIZE);
+  drop_first_cell(&job);
+
+  /* Nothing else is for the middle hop, so it decrypts the rest. */
+  relay_crypto_job_threadfn(NULL, &job);
+  tt_int_op(job.n_processed, OP_EQ, 6);
+  tt_int_op(job.recognized, OP_EQ, 0);
+
+  /* The last hop recognizes each of the remaining cells in turn. */
+  job.n_decrypted = 0;
+  job.cipher = cs->or_circ[2]->crypto.f_crypto;
+  job.digest = cs->or_circ[2]->crypto.f_digest;
+  for (i = 2; i < 8; ++i) {
+    relay_crypto_job_threadfn(NULL, &job);
+    tt_int_op(job.n_processed, OP_EQ, 1);
+    tt_int_op(job.recognized, OP_EQ, 1);
+    tt_mem_op(orig[i].payload, OP_EQ,
+              ((cell_t*)smartlist_get(job.cells, 0))->payload,
+              CELL_PAYLOAD_SIZE);
+    drop_first_cell(&job);
+  }
+
+ done:
+  if (job.cells) {
+    SMARTLIST_FOREACH(job.cells, cell_t *, c, tor_free(c));
+    smartlist_free(job.cells);
+  }
+}
+
+static smartlist_t *received_cells = NULL;
+static smartlist_t *received_recognized = NULL;
+
+static int
+mock_circuit_receive_decrypted_relay_cell(cell_t *cell, circuit_t *circ,
+                                          cell_direction_t cell_direction,
+                                          crypt_path_t *layer_hint,
+                                          char recognized)
+{
+  (void) circ;
+  (void) cell_direction;
+  (void) layer_hint;
+  smartlist_add(received_cells, tor_memdup(cell, sizeof(cell_t)));
+  smartlist_add(received_recognized, (void *)(intptr_t) recognized);
+  return 0;
+}
+
+/* Test that once too many cells are waiting for a worker on a circuit, we
+ * decrypt them all in the main thread, in order, and that the waiting
+ * cells count towards our queue allocation. */
+static void
+test_relaycrypt_offload_pending_cap(void *arg)
+{
+  testing_circuitset_t *cs = arg;
+  const int n_cells = RELAY_CRYPTO_PENDING_MAX;
+  relay_header_t rh;
+  cell_t *orig = tor_calloc(n_cells, sizeof(cell_t));
+  const size_t base_alloc = relay_crypto_offload_get_total_allocation();
+  int i;
+
+  received_cells = smartlist_new();
+  received_recognized = smartlist_new();
+  tt_assert(cs);
+  or_circuit_t *or_circ = cs->or_circ[1];
+
+  MOCK(circuit_receive_decrypted_relay_cell,
+       mock_circuit_receive_decrypted_relay_cell);
+
+  or_circ->relay_crypto_pending = smartlist_new();
+  for (i = 0; i < n_cells; ++i) {
+    crypt_path_t *layer_hint = NULL;
+    char recognized = 0;
+    crypto_rand((char *)&orig[i], sizeof(orig[i]));
+    relay_header_unpack(&rh, orig[i].payload);
+    rh.recognized = 0;
+    memset(rh.integrity, 0, sizeof(rh.integrity));
+    relay_header_pack(orig[i].payload, &rh);
+
+    cell_t *c = tor_memdup(&orig[i], sizeof(cell_t));
+    /* Cells 0 and 1 are for the middle hop; the rest are for the last. */
+    relay_encrypt_cell_outbound(c, cs->origin_circ,
+                                i < 2 ? cs->origin_circ->cpath->next :
+                                cs->origin_circ->cpath->prev);
+    tt_int_op(0, OP_EQ, relay_decrypt_cell(TO_CIRCUIT(cs->or_circ[0]), c,
+                                           CELL_DIRECTION_OUT, &layer_hint,
+                                           &recognized));
+    tt_int_op(recognized, OP_EQ, 0);
+    if (i < n_cells - 1) {
+      /* Pretend that these arrived while a worker was busy. */
+      smartlist_add(or_circ->relay_crypto_pending, c);
+      ++relay_crypto_n_cells_allocated;
+    } else {
+      tt_int_op(relay_crypto_offload_get_total_allocation(), OP_EQ,
+                base_alloc + (n_cells - 1) * sizeof(cell_t));
+      /* The last cell fills the pending list: we handle everything here. */
+      tt_int_op(1, OP_EQ, relay_crypto_offload_cell(TO_CIRCUIT(or_circ), c,
+                                                    CELL_DIRECTION_OUT));
+      tor_free(c);
+    }
+  }
+
+  tt_ptr_op(or_circ->relay_crypto_job, OP_EQ, NULL);
+  tt_assert(!or_circ->relay_crypto_pending ||
+            smartlist_len(or_circ->relay_crypto_pending) == 0);
+  tt_int_op(or_circ->relay_crypto_n_decrypted, OP_EQ, 0);
+  tt_int_op(relay_crypto_offload_get_total_allocation(), OP_EQ, base_alloc);
+
+  tt_int_op(smartlist_len(received_cells), OP_EQ, n_cells);
+  for (i = 0; i < n_cells; ++i) {
+    cell_t *c = smartlist_get(received_cells, i);
+    char recognized = (char)(intptr_t) smartlist_get(received_recognized, i);
+    if (i < 2) {
+      tt_int_op(recognized, OP_EQ, 1);
+    } else {
+      /* Make sure that the last hop sees the cells in the right order. */
+      crypt_path_t *layer_hint = NULL;
+      tt_int_op(recognized, OP_EQ, 0);
+      tt_int_op(0, OP_EQ, relay_decrypt_cell(TO_CIRCUIT(cs->or_circ[2]), c,
+                                             CELL_DIRECTION_OUT, &layer_hint,
+                                             &recognized));
+      tt_int_op(recognized, OP_EQ, 1);
+    }
+    tt_mem_op(orig[i].payload, OP_EQ, c->payload, CELL_PAYLOAD_SIZE);
+  }
+
+  /* The OOM handler can free the cells that are waiting. */
+  smartlist_free(or_circ->relay_crypto_pending);
+  or_circ->relay_crypto_pending = smartlist_new();
+  for (i = 0; i < 3; ++i) {
+    smartlist_add(or_circ->relay_crypto_pending,
+                  tor_memdup(&orig[i], sizeof(cell_t)));
+    ++relay_crypto_n_cells_allocated;
+  }
+  tt_int_op(relay_crypto_offload_free_pending(or_circ), OP_EQ,
+            3 * sizeof(cell_t));
+  tt_ptr_op(or_circ->relay_crypto_pending, OP_EQ, NULL);
+  tt_int_op(relay_crypto_offload_get_total_allocation(), OP_EQ, base_alloc);
+
+ done:
+  UNMOCK(circuit_receive_decrypted_relay_cell);
+  tor_free(orig);
+  SMARTLIST_FOREACH(received_cells, cell_t *, c, tor_free(c));
+  smartlist_free(received_cells);
+  smartlist_free(received_recognized);
+}
+
 #define TEST(name) \
   { # name, test_relaycrypt_ ## name, 0, &relaycrypt_setup, NULL }
 
 struct testcase_t relaycrypt_tests[] = {
   TEST(outbound),
   TEST(inbound),
+  TEST(offload_batch),
+  TEST(offload_pending_cap),
   END_OF_TESTCASES
 };
 
@@ -248,6 +248,65 @@ test_routerkeys_ed_certs(void *args)
   tor_free(base64);
 }
 
+static void
+test_routerkeys_ed_certs_batch(void *arg)
+{
+  (void)arg;
+  ed25519_keypair_t kp1, kp2;
+  tor_cert_t *certs[6] = {NULL};
+  const ed25519_public_key_t *pubkeys[6];
+  int okay[6];
+  time_t now = 1412094534;
+  int i;
+
+  tt_int_op(0,OP_EQ,ed25519_keypair_generate(&kp1, 0));
+  tt_int_op(0,OP_EQ,ed25519_keypair_generate(&kp2, 0));
+
+  for (i = 0; i < 6; ++i) {
+    tor_cert_t *cert = tor_cert_create_ed25519(&kp1, 5, &kp2.pubkey, now,
+                                               i == 2 ? 3600 : 86400,
+                                               i == 4 ? 0 :
+                                               CERT_FLAG_INCLUDE_SIGNING_KEY);
+    tt_assert(cert);
+    certs[i] = tor_cert_parse(cert->encoded, cert->encoded_len);
+    tor_cert_free(cert);
+    tt_assert(certs[i]);
+    pubkeys[i] = &kp1.pubkey;
+  }
+  /* 1 is signed by the wrong key; 2 has expired; 3 and 5 use their
+   * included signing keys; 4 has no signing key at all. */
+  pubkeys[1] = &kp2.pubkey;
+  pubkeys[3] = pubkeys[4] = pubkeys[5] = NULL;
+
+  tt_int_op(tor_cert_checksig_batch(certs, pubkeys, 6, now + 3*3600, okay),
+            OP_EQ, -3);
+  tt_int_op(okay[0], OP_EQ, 1);
+  tt_int_op(okay[1], OP_EQ, 0);
+  tt_int_op(okay[2], OP_EQ, 0);
+  tt_int_op(okay[3], OP_EQ, 1);
+  tt_int_op(okay[4], OP_EQ, 0);
+  tt_int_op(okay[5], OP_EQ, 1);
+  tt_str_op(tor_cert_describe_signature_status(certs[0]), OP_EQ, "okay");
+  tt_str_op(tor_cert_describe_signature_status(certs[1]), OP_EQ,
+            "mis-signed");
+  tt_str_op(tor_cert_describe_signature_status(certs[2]), OP_EQ, "expired");
+  tt_str_op(tor_cert_describe_signature_status(certs[4]), OP_EQ,
+            "unchecked");
+  tt_int_op(certs[3]->cert_valid, OP_EQ, 1);
+
+  /* Once they have all expired, nothing checks out. */
+  tt_int_op(tor_cert_checksig_batch(certs, pubkeys, 6, now + 2*86400, NULL),
+            OP_EQ, -6);
+  tt_int_op(certs[0]->cert_expired, OP_EQ, 1);
+
+  tt_int_op(tor_cert_checksig_batch(certs, pubkeys, 0, now, NULL),
+            OP_EQ, 0);
+
+ done:
+  for (i = 0; i < 6; ++i)
+    tor_cert_free(certs[i]);
+}
+
 static void
 test_routerkeys_ed_key_create(void *arg)
 {
@@ -742,6 +801,7 @@ struct testcase_t routerkeys_tests[] = {
   TEST(write_fingerprint, TT_FORK),
   TEST(write_ed25519_identity, TT_FORK),
   TEST(ed_certs, TT_FORK),
+  TEST(ed_certs_batch, 0),
   TEST(ed_key_create, TT_FORK),
   TEST(ed_key_init_basic, TT_FORK),
   TEST(ed_key_init_split, TT_FORK),
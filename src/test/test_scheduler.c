@@ -13,10 +13,12 @@
 #include "lib/evloop/compat_libevent.h"
 #include "core/or/channel.h"
 #include "core/or/channeltls.h"
+#include "core/or/cell_queue_st.h"
 #include "core/mainloop/connection.h"
 #include "feature/nodelist/networkstatus.h"
 #define SCHEDULER_PRIVATE
 #include "core/or/scheduler.h"
+#include "lib/net/socketpair.h"
 
 /* Test suite stuff */
 #include "test/test.h"
@@ -1265,6 +1267,178 @@ test_scheduler_kist_pending_list(void *arg)
   UNMOCK(channel_should_write_to_kernel);
 }
 
+#ifdef HAVE_KIST_SUPPORT
+static void
+test_scheduler_kist_sock_info(void *arg)
+{
+  socket_table_ent_t ent;
+  monotime_coarse_t start, now;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_socket_t udp = TOR_INVALID_SOCKET, listener = TOR_INVALID_SOCKET;
+  struct sockaddr_in sin;
+  char buf[4096];
+
+  (void) arg;
+
+  memset(&ent, 0, sizeof(ent));
+  monotime_coarse_get(&start);
+
+  /* Info we never read is always stale. */
+  tt_assert(kist_socket_info_is_stale(&ent, &start));
+
+  /* Otherwise, keep it for one round trip... */
+  ent.info_valid = 1;
+  ent.info_updated = start;
+  ent.rtt = 50 * 1000;
+  tt_assert(!kist_socket_info_is_stale(&ent, &start));
+  monotime_coarse_add_msec(&now, &start, 49);
+  tt_assert(!kist_socket_info_is_stale(&ent, &now));
+  monotime_coarse_add_msec(&now, &start, 50);
+  tt_assert(kist_socket_info_is_stale(&ent, &now));
+  /* ... but not for too long... */
+  ent.rtt = 10 * 1000 * 1000;
+  monotime_coarse_add_msec(&now, &start, 249);
+  tt_assert(!kist_socket_info_is_stale(&ent, &now));
+  monotime_coarse_add_msec(&now, &start, 250);
+  tt_assert(kist_socket_info_is_stale(&ent, &now));
+  /* ... and not at all when the round trip is shorter than a msec. */
+  ent.rtt = 500;
+  tt_assert(kist_socket_info_is_stale(&ent, &start));
+
+  /* TCP_NOTSENT_LOWAT tracks the congestion window, within bounds. */
+  ent.cwnd = 10;
+  ent.mss = 1448;
+  tt_uint_op(kist_notsent_lowat_target(&ent), OP_EQ, 14480);
+  ent.cwnd = 1;
+  ent.mss = 536;
+  tt_uint_op(kist_notsent_lowat_target(&ent), OP_EQ,
+             CELL_MAX_NETWORK_SIZE * 8);
+
+  /* Read real values from a loopback TCP connection, which is what the
+   * ersatz socketpair gives us. */
+  if (tor_ersatz_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    tt_skip();
+  memset(buf, 'x', sizeof(buf));
+  tt_int_op(send(fds[0], buf, sizeof(buf), 0), OP_EQ, sizeof(buf));
+  memset(&ent, 0, sizeof(ent));
+  tt_int_op(kist_read_socket_info(fds[0], &ent), OP_EQ, 0);
+  tt_uint_op(ent.cwnd, OP_GT, 0);
+  tt_uint_op(ent.mss, OP_GT, 0);
+  /* We can ask for the outqueue on its own, as the adaptive run interval
+   * does when the rest of the info is fresh. */
+  ent.notsent = UINT32_MAX;
+  tt_int_op(kist_read_socket_notsent(fds[0], &ent), OP_EQ, 0);
+  tt_uint_op(ent.notsent, OP_LE, sizeof(buf));
+
+  /* We can tell which call failed: TCP_INFO doesn't work on UDP sockets... */
+  udp = tor_open_socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  tt_assert(SOCKET_OK(udp));
+  tt_int_op(kist_read_socket_info(udp, &ent), OP_EQ,
+            KIST_SOCK_INFO_ERR_TCP_INFO);
+
+  /* ... and SIOCOUTQNSD doesn't work on listening TCP sockets. */
+  listener = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  tt_assert(SOCKET_OK(listener));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  tt_int_op(bind(listener, (struct sockaddr *) &sin, sizeof(sin)), OP_EQ, 0);
+  tt_int_op(listen(listener, 1), OP_EQ, 0);
+  tt_int_op(kist_read_socket_info(listener, &ent), OP_EQ,
+            KIST_SOCK_INFO_ERR_NOTSENT);
+  tt_int_op(errno, OP_EQ, EINVAL);
+  tt_int_op(kist_read_socket_notsent(listener, &ent), OP_EQ, -1);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket_simple(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket_simple(fds[1]);
+  if (SOCKET_OK(udp))
+    tor_close_socket_simple(udp);
+  if (SOCKET_OK(listener))
+    tor_close_socket_simple(listener);
+}
+#endif /* defined(HAVE_KIST_SUPPORT) */
+
+static void
+test_scheduler_kist_adaptive(void *arg)
+{
+  uint64_t bucket_values[KIST_QUEUE_DELAY_N_BUCKETS];
+  uint64_t count;
+  int64_t sum;
+  packed_cell_t cell;
+  scheduler_t *kist = get_kist_scheduler();
+
+  (void) arg;
+
+  /* Run more often when the outqueues ran dry... */
+  tt_int_op(kist_next_run_interval(10, 0, 10), OP_EQ, 8);
+  /* ... or when cells wait and the kernel could take more... */
+  tt_int_op(kist_next_run_interval(10, 30, 50), OP_EQ, 8);
+  tt_int_op(kist_next_run_interval(10, 30, -1), OP_EQ, 8);
+  /* ... but not below the floor. */
+  tt_int_op(kist_next_run_interval(2, 30, 0), OP_EQ, 2);
+  /* Run less often when the kernel has plenty and cells don't wait... */
+  tt_int_op(kist_next_run_interval(10, 5, 90), OP_EQ, 11);
+  tt_int_op(kist_next_run_interval(KIST_SCHED_RUN_INTERVAL_MAX, 5, 90),
+            OP_EQ, KIST_SCHED_RUN_INTERVAL_MAX);
+  /* ... and leave it alone otherwise. */
+  tt_int_op(kist_next_run_interval(10, 30, 90), OP_EQ, 10);
+  tt_int_op(kist_next_run_interval(10, 5, 50), OP_EQ, 10);
+  tt_int_op(kist_next_run_interval(10, 5, -1), OP_EQ, 10);
+
+  MOCK(get_options, mock_get_options);
+  clear_options();
+  mocked_options.KISTSchedRunInterval = 10;
+  mocked_options.KISTAdaptiveRunInterval = 1;
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(UINT64_C(1000000000));
+  channels_pending = smartlist_new();
+
+  kist->init();
+  tt_int_op(sched_run_interval, OP_EQ, 10);
+
+  /* Cells that waited 30 msec land in the 50 msec bucket. */
+  memset(&cell, 0, sizeof(cell));
+  cell.inserted_timestamp = monotime_coarse_get_stamp();
+  monotime_coarse_set_mock_time_nsec(UINT64_C(1030000000));
+  for (int i = 0; i < 4; i++)
+    scheduler_kist_note_queue_delay(&cell);
+  scheduler_kist_get_queue_delays(bucket_values, &count, &sum);
+  tt_u64_op(bucket_values[4], OP_EQ, 0);
+  tt_u64_op(bucket_values[5], OP_EQ, 4);
+  tt_u64_op(bucket_values[KIST_QUEUE_DELAY_N_BUCKETS - 1], OP_EQ, 4);
+  tt_u64_op(count, OP_EQ, 4);
+  /* Stamps are coarse: each delay may be a msec short. */
+  tt_i64_op(sum, OP_GE, 4 * 29);
+  tt_i64_op(sum, OP_LE, 4 * 30);
+
+  /* Nothing changes until the end of the period... */
+  kist->run();
+  tt_int_op(sched_run_interval, OP_EQ, 10);
+  /* ... and then we run more often, since cells waited too long. */
+  monotime_coarse_set_mock_time_nsec(UINT64_C(1300000000));
+  kist->run();
+  tt_int_op(sched_run_interval, OP_EQ, 8);
+  tt_int_op(scheduler_kist_get_run_interval(), OP_EQ, 8);
+
+  /* Reloading the options keeps what we have adapted to... */
+  kist->on_new_options();
+  tt_int_op(sched_run_interval, OP_EQ, 8);
+  /* ... unless we aren't supposed to adapt anymore. */
+  mocked_options.KISTAdaptiveRunInterval = 0;
+  kist->on_new_options();
+  tt_int_op(sched_run_interval, OP_EQ, 10);
+
+ done:
+  kist->free_all();
+  smartlist_free(channels_pending);
+  channels_pending = NULL;
+  monotime_disable_test_mocking();
+  UNMOCK(get_options);
+}
+
 struct testcase_t scheduler_tests[] = {
   { "compare_channels", test_scheduler_compare_channels,
     TT_FORK, NULL, NULL },
@@ -1276,6 +1450,10 @@ struct testcase_t scheduler_tests[] = {
   { "should_use_kist", test_scheduler_can_use_kist, TT_FORK, NULL, NULL },
   { "kist_pending_list", test_scheduler_kist_pending_list, TT_FORK,
     NULL, NULL },
+#ifdef HAVE_KIST_SUPPORT
+  { "kist_sock_info", test_scheduler_kist_sock_info, 0, NULL, NULL },
+#endif
+  { "kist_adaptive", test_scheduler_kist_adaptive, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -18,14 +18,23 @@
 #include "lib/log/log.h"
 #include "app/config/config.h"
 #include "lib/crypt_ops/compat_openssl.h"
+#include "lib/crypt_ops/crypto_rand.h"
 #include "lib/tls/x509.h"
 #include "lib/tls/x509_internal.h"
 #include "lib/tls/tortls.h"
 #include "lib/tls/tortls_st.h"
 #include "lib/tls/tortls_internal.h"
 #include "lib/encoding/pem.h"
+#include "lib/buf/buffers.h"
+#include "lib/net/address.h"
+#include "lib/net/socket.h"
+#include "lib/tls/buffers_tls.h"
 #include "app/config/or_state_st.h"
 
+#ifdef ENABLE_OPENSSL
+#include <openssl/ssl.h>
+#endif
+
 #include "test/test.h"
 #include "test/log_test_helpers.h"
 #include "test/test_tortls.h"
@@ -585,6 +594,179 @@ test_tortls_cert_matches_key(void *ignored)
   UNMOCK(tor_tls_get_peer_cert);
 }
 
+/** Open a TCP connection to ourselves on localhost, and put both ends in
+ * <b>s_out</b>.  Return 0 on success and -1 on failure. */
+static int
+open_loopback_tcp_pair(tor_socket_t s_out[2])
+{
+  tor_socket_t listener = TOR_INVALID_SOCKET;
+  struct sockaddr_storage ss;
+  socklen_t len;
+  tor_addr_t addr;
+  int result = -1;
+
+  s_out[0] = s_out[1] = TOR_INVALID_SOCKET;
+  tor_addr_parse(&addr, "127.0.0.1");
+  len = tor_addr_to_sockaddr(&addr, 0, (struct sockaddr *)&ss, sizeof(ss));
+  listener = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(listener) ||
+      bind(listener, (struct sockaddr *)&ss, len) < 0 ||
+      listen(listener, 1) < 0 ||
+      tor_getsockname(listener, (struct sockaddr *)&ss, &len) < 0)
+    goto done;
+  s_out[0] = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (!SOCKET_OK(s_out[0]) ||
+      connect(s_out[0], (struct sockaddr *)&ss, len) < 0)
+    goto done;
+  s_out[1] = tor_accept_socket(listener, NULL, NULL);
+  if (!SOCKET_OK(s_out[1]) ||
+      set_socket_nonblocking(s_out[0]) < 0 ||
+      set_socket_nonblocking(s_out[1]) < 0)
+    goto done;
+  result = 0;
+ done:
+  if (SOCKET_OK(listener))
+    tor_close_socket(listener);
+  if (result < 0) {
+    if (SOCKET_OK(s_out[0]))
+      tor_close_socket(s_out[0]);
+    if (SOCKET_OK(s_out[1]))
+      tor_close_socket(s_out[1]);
+  }
+  return result;
+}
+
+/** Handshake over a real loopback connection, asking for kernel TLS iff
+ * <b>use_ktls</b> is true, and send <b>n</b> bytes from <b>data</b> each
+ * way.  If <b>key_update</b> is true and we negotiated TLS 1.3, the client
+ * first asks the server to update its keys, and the server must answer.
+ * Return 0 if the bytes all arrived intact, and -1 otherwise. */
+static int
+tls_loopback_transfer(int use_ktls, int key_update, const char *data,
+                      size_t n)
+{
+  tor_socket_t s[2];
+  tor_tls_t *tls[2] = { NULL, NULL };
+  buf_t *outbuf[2] = { NULL, NULL }, *inbuf[2] = { NULL, NULL };
+  char *received = NULL;
+  int done[2] = { 0, 0 };
+  int i, iter, result = -1;
+
+  if (open_loopback_tcp_pair(s) < 0)
+    return -1;
+
+  /* The tor_tls_t objects own their sockets from now on. */
+  for (i = 0; i < 2; ++i) {
+    tls[i] = tor_tls_new(s[i], i /* the accepted end is the server */);
+    if (!tls[i]) {
+      tor_close_socket(s[i]);
+      goto done;
+    }
+    if (use_ktls)
+      tor_tls_enable_ktls(tls[i]);
+    outbuf[i] = buf_new();
+    inbuf[i] = buf_new();
+    buf_add(outbuf[i], data, n);
+  }
+
+  for (iter = 0; iter < 1000 && !(done[0] && done[1]); ++iter) {
+    for (i = 0; i < 2; ++i) {
+      if (done[i])
+        continue;
+      int r = tor_tls_handshake(tls[i]);
+      if (r == TOR_TLS_DONE)
+        done[i] = 1;
+      else if (r != TOR_TLS_WANTREAD && r != TOR_TLS_WANTWRITE)
+        goto done;
+    }
+  }
+  if (!(done[0] && done[1]))
+    goto done;
+
+#if defined(ENABLE_OPENSSL) && defined(SSL_KEY_UPDATE_REQUESTED)
+  if (key_update && SSL_version(tls[0]->ssl) >= TLS1_3_VERSION &&
+      SSL_key_update(tls[0]->ssl, SSL_KEY_UPDATE_REQUESTED) != 1)
+    goto done;
+#else
+  (void)key_update;
+#endif
+
+  for (iter = 0; iter < 100000; ++iter) {
+    if (buf_datalen(inbuf[0]) == n && buf_datalen(inbuf[1]) == n)
+      break;
+    for (i = 0; i < 2; ++i) {
+      int r;
+      if (buf_datalen(outbuf[i])) {
+        r = buf_flush_to_tls(outbuf[i], tls[i], buf_datalen(outbuf[i]));
+        if (r < 0 && r != TOR_TLS_WANTREAD && r != TOR_TLS_WANTWRITE)
+          goto done;
+      }
+      r = buf_read_from_tls(inbuf[!i], tls[!i], n);
+      if (r < 0 && r != TOR_TLS_WANTREAD && r != TOR_TLS_WANTWRITE)
+        goto done;
+    }
+  }
+
+  received = tor_malloc(n);
+  for (i = 0; i < 2; ++i) {
+    size_t n_read, n_written;
+    if (buf_datalen(inbuf[i]) != n)
+      goto done;
+    buf_get_bytes(inbuf[i], received, n);
+    if (fast_memneq(received, data, n))
+      goto done;
+    /* Bytes that the kernel encrypted still count as written. */
+    tor_tls_get_n_raw_bytes(tls[i], &n_read, &n_written);
+    if (n_written < n)
+      goto done;
+  }
+#if defined(ENABLE_OPENSSL) && defined(SSL_KEY_UPDATE_REQUESTED)
+  /* The server has sent its own KeyUpdate, even if the kernel is
+   * encrypting its records. */
+  if (SSL_get_key_update_type(tls[1]->ssl) != SSL_KEY_UPDATE_NONE)
+    goto done;
+#endif
+  result = 0;
+
+ done:
+  for (i = 0; i < 2; ++i) {
+    tor_tls_free(tls[i]);
+    buf_free(outbuf[i]);
+    buf_free(inbuf[i]);
+  }
+  tor_free(received);
+  return result;
+}
+
+static void
+test_tortls_ktls_loopback(void *arg)
+{
+  (void)arg;
+  crypto_pk_t *pk1 = NULL, *pk2 = NULL;
+  const size_t n = 300*1000;
+  char *data = tor_malloc(n);
+  pk1 = pk_generate(2);
+  pk2 = pk_generate(0);
+  crypto_rand(data, n);
+
+  int r = tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER,
+                               pk1, pk2, 86400);
+  tt_int_op(r, OP_EQ, 0);
+
+  /* Whether or not the kernel can take over our records, asking it to
+   * must not change what arrives at the other end. */
+  tt_int_op(tls_loopback_transfer(0, 0, data, n), OP_EQ, 0);
+  tt_int_op(tls_loopback_transfer(1, 0, data, n), OP_EQ, 0);
+  /* Nor must it stop OpenSSL from answering a KeyUpdate. */
+  tt_int_op(tls_loopback_transfer(0, 1, data, n), OP_EQ, 0);
+  tt_int_op(tls_loopback_transfer(1, 1, data, n), OP_EQ, 0);
+
+ done:
+  tor_free(data);
+  crypto_pk_free(pk1);
+  crypto_pk_free(pk2);
+}
+
 #define LOCAL_TEST_CASE(name, flags)                            \
   { #name, test_tortls_##name, (flags|TT_FORK), NULL, NULL }
 
@@ -606,5 +788,6 @@ struct testcase_t tortls_tests[] = {
   LOCAL_TEST_CASE(bridge_init, TT_FORK),
   LOCAL_TEST_CASE(verify, TT_FORK),
   LOCAL_TEST_CASE(cert_matches_key, 0),
+  LOCAL_TEST_CASE(ktls_loopback, 0),
   END_OF_TESTCASES
 };
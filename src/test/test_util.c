@@ -21,6 +21,7 @@
 #include "test/test.h"
 #include "test/test_helpers.h"
 #include "lib/memarea/memarea.h"
+#include "lib/memarea/mempool.h"
 #include "lib/process/waitpid.h"
 #include "lib/process/process_win32.h"
 #include "test/log_test_helpers.h"
@@ -4056,6 +4057,95 @@ test_util_memarea(void *arg)
   tor_free(malloced_ptr);
 }
 
+/** Run unit tests for our fixed-size pool allocator. */
+static void
+test_util_mempool(void *arg)
+{
+  mp_pool_t *pool = NULL;
+  smartlist_t *items = smartlist_new();
+  size_t allocated, used, allocated_full;
+  int i;
+  (void)arg;
+
+  pool = mp_pool_new(24, 10, 2);
+  mp_pool_assert_ok(pool);
+  mp_pool_get_stats(pool, &allocated, &used);
+  tt_int_op(allocated, OP_EQ, 0);
+  tt_int_op(used, OP_EQ, 0);
+
+  /* Fill five chunks, and write to every item. */
+  for (i = 0; i < 50; ++i) {
+    char *item = mp_pool_get(pool);
+    tt_ptr_op(item, OP_NE, NULL);
+    tt_int_op(((uintptr_t)item) % 8, OP_EQ, 0);
+    memset(item, i, 24);
+    smartlist_add(items, item);
+  }
+  mp_pool_assert_ok(pool);
+  tt_int_op(mp_pool_get_n_used(pool), OP_EQ, 50);
+  mp_pool_get_stats(pool, &allocated_full, &used);
+  tt_int_op(used, OP_GE, 50*24);
+  tt_int_op(allocated_full, OP_GE, used);
+  tt_int_op(mp_pool_get_empty_allocation(pool), OP_EQ, 0);
+
+  /* Items don't overlap. */
+  for (i = 0; i < 50; ++i) {
+    char expected[24];
+    memset(expected, i, sizeof(expected));
+    tt_mem_op(smartlist_get(items, i), OP_EQ, expected, sizeof(expected));
+  }
+
+  /* Free every other item: nothing becomes empty. */
+  for (i = 0; i < 50; i += 2) {
+    mp_pool_release(smartlist_get(items, i));
+    smartlist_set(items, i, NULL);
+  }
+  mp_pool_assert_ok(pool);
+  tt_int_op(mp_pool_get_n_used(pool), OP_EQ, 25);
+  mp_pool_get_stats(pool, &allocated, &used);
+  tt_int_op(allocated, OP_EQ, allocated_full);
+  tt_int_op(mp_pool_get_empty_allocation(pool), OP_EQ, 0);
+
+  /* Reallocating reuses the freed items. */
+  for (i = 0; i < 50; i += 2) {
+    smartlist_set(items, i, mp_pool_get(pool));
+  }
+  mp_pool_assert_ok(pool);
+  mp_pool_get_stats(pool, &allocated, &used);
+  tt_int_op(allocated, OP_EQ, allocated_full);
+
+  /* Free everything: we keep two empty chunks, and free the rest. */
+  SMARTLIST_FOREACH(items, char *, item, mp_pool_release(item));
+  smartlist_clear(items);
+  mp_pool_assert_ok(pool);
+  tt_int_op(mp_pool_get_n_used(pool), OP_EQ, 0);
+  mp_pool_get_stats(pool, &allocated, &used);
+  tt_int_op(used, OP_EQ, 0);
+  tt_int_op(allocated, OP_EQ, allocated_full * 2 / 5);
+  tt_int_op(mp_pool_get_empty_allocation(pool), OP_EQ, allocated);
+
+  /* The empty chunks get used again. */
+  smartlist_add(items, mp_pool_get(pool));
+  mp_pool_assert_ok(pool);
+  mp_pool_get_stats(pool, &allocated, &used);
+  tt_int_op(allocated, OP_EQ, allocated_full * 2 / 5);
+  tt_int_op(mp_pool_get_empty_allocation(pool), OP_EQ, allocated / 2);
+
+  /* Cleaning releases them. */
+  tt_int_op(mp_pool_clean(pool, 0), OP_EQ, allocated / 2);
+  mp_pool_assert_ok(pool);
+  tt_int_op(mp_pool_get_empty_allocation(pool), OP_EQ, 0);
+  tt_int_op(mp_pool_clean(pool, 0), OP_EQ, 0);
+
+  SMARTLIST_FOREACH(items, char *, item, mp_pool_release(item));
+  smartlist_clear(items);
+  mp_pool_assert_ok(pool);
+
+ done:
+  mp_pool_free(pool);
+  smartlist_free(items);
+}
+
 /** Run unit tests for utility functions to get file names relative to
  * the data directory. */
 static void
@@ -5379,6 +5469,51 @@ test_util_eat_whitespace(void *ptr)
   ;
 }
 
+/**
+ * Test the whitespace finder, at every offset and length, so that we cover
+ * both the vectorized and the bytewise scans.
+ */
+static void
+test_util_find_whitespace(void *ptr)
+{
+  const char ws[] = { ' ', '\t', '\r', '\n', '#', '\0' };
+  char str[80];
+  size_t i, len, pos;
+
+  (void)ptr;
+
+  /* No whitespace: stop at eos, and never look past it. */
+  memset(str, 'x', sizeof(str));
+  for (len = 0; len < sizeof(str); ++len) {
+    tt_ptr_op(str + len,OP_EQ, find_whitespace_eos(str, str + len));
+    tt_ptr_op(str + 1 + len/2,OP_EQ,
+              find_whitespace_eos(str + 1, str + 1 + len/2));
+  }
+
+  /* One whitespace character, anywhere in the string. */
+  for (i = 0; i < sizeof(ws); ++i) {
+    for (pos = 0; pos < 70; ++pos) {
+      memset(str, 'x', sizeof(str));
+      str[pos] = ws[i];
+      str[75] = '\0';
+      tt_ptr_op(str + pos,OP_EQ, find_whitespace(str));
+      tt_ptr_op(str + pos,OP_EQ, find_whitespace_eos(str, str + 75));
+      tt_ptr_op(str + pos,OP_EQ, find_whitespace_eos(str, str + pos + 1));
+      tt_ptr_op(str + pos,OP_EQ, find_whitespace_eos(str, str + pos));
+    }
+  }
+
+  /* The first of several. */
+  strlcpy(str, "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA BBBB\tCCCC",
+          sizeof(str));
+  tt_ptr_op(str + 43,OP_EQ, find_whitespace(str));
+  tt_ptr_op(str + 43,OP_EQ, find_whitespace_eos(str, str + strlen(str)));
+  tt_ptr_op(str + 48,OP_EQ, find_whitespace_eos(str + 44, str + strlen(str)));
+
+ done:
+  ;
+}
+
 /** Return a newly allocated smartlist containing the lines of text in
  * <b>lines</b>.  The returned strings are heap-allocated, and must be
  * freed by the caller.
@@ -6990,6 +7125,7 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(gzip_compression_bomb, TT_FORK),
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(memarea),
+  UTIL_TEST(mempool, 0),
   UTIL_LEGACY(control_formats),
   UTIL_LEGACY(mmap),
   UTIL_TEST(sscanf, TT_FORK),
@@ -7019,6 +7155,7 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(format_dec_number, 0),
   UTIL_TEST(n_bits_set, 0),
   UTIL_TEST(eat_whitespace, 0),
+  UTIL_TEST(find_whitespace, 0),
   UTIL_TEST(sl_new_from_text_lines, 0),
   UTIL_TEST(envnames, 0),
   UTIL_TEST(make_environment, 0),
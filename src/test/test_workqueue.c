@@ -13,6 +13,7 @@
 #include "lib/evloop/compat_libevent.h"
 #include "lib/intmath/weakrng.h"
 #include "lib/crypt_ops/crypto_init.h"
+#include "lib/time/compat_time.h"
 
 #include <stdio.h>
 
@@ -25,6 +26,8 @@ static int opt_n_inflight = 1000;
 static int opt_n_lowwater = 250;
 static int opt_n_cancel = 0;
 static int opt_ratio_rsa = 5;
+static int opt_stress = 0;
+static int opt_steal = 0;
 
 #ifdef TRACK_RESPONSES
 tor_mutex_t bitmap_mutex;
@@ -122,6 +125,15 @@ workqueue_do_ecdh(void *state, void *work)
   return WQ_RPL_REPLY;
 }
 
+static workqueue_reply_t
+workqueue_do_nothing(void *state, void *work)
+{
+  rsa_work_t *rw = work;
+  (void)state;
+  mark_handled(rw->serial);
+  return WQ_RPL_REPLY;
+}
+
 static workqueue_reply_t
 workqueue_shutdown_error(void *state, void *work)
 {
@@ -193,6 +205,13 @@ handle_reply_shutdown(void *arg)
 static workqueue_entry_t *
 add_work(threadpool_t *tp)
 {
+  if (opt_stress) {
+    /* No work at all: we're measuring how fast replies come back. */
+    rsa_work_t *w = tor_malloc_zero(sizeof(*w));
+    w->serial = n_sent++;
+    return threadpool_queue_work(tp, workqueue_do_nothing, handle_reply, w);
+  }
+
   int add_rsa =
     opt_ratio_rsa == 0 ||
     tor_weak_random_range(&weak_rng, opt_ratio_rsa) == 0;
@@ -309,13 +328,256 @@ replysock_readable_cb(threadpool_t *tp)
     // Anything we add after starting the shutdown must not be executed.
     threadpool_queue_work(tp, workqueue_shutdown_error,
                           handle_reply_shutdown, NULL);
-    {
+    if (opt_stress) {
+      tor_libevent_exit_loop_after_callback(tor_libevent_get_base());
+    } else {
       struct timeval limit = { 2, 0 };
       tor_libevent_exit_loop_after_delay(tor_libevent_get_base(), &limit);
     }
   }
 }
 
+/* Work stealing test: keep every thread but one busy, and check that the
+ * free thread runs all the work, wherever it was queued, in priority
+ * order. */
+
+/** Protects all the steal_* fields below, which the workers share with
+ * the main thread. */
+static tor_mutex_t steal_lock;
+/** Signalled whenever the main thread lets a blocked work item go. */
+static tor_cond_t steal_cond;
+/** How many blocking items have started? */
+static int steal_n_blocked = 0;
+/** Which thread's blocking item may finish, or STEAL_RELEASE_ALL. */
+static int steal_released = -1;
+#define STEAL_RELEASE_ALL INT_MAX
+/** Is the item that holds the released thread allowed to finish?  Has it
+ * started? */
+static int steal_hold_released = 0;
+static int steal_hold_started = 0;
+/** How many ordinary items have run? */
+static int steal_seq = 0;
+/** How many replies have we handled? */
+static int steal_n_replies = 0;
+
+#define STEAL_KIND_NORMAL 0
+#define STEAL_KIND_BLOCK 1
+#define STEAL_KIND_HOLD 2
+
+typedef struct steal_work_t {
+  int kind;
+  workqueue_priority_t prio;
+  /** Set by the worker: the thread that ran this item, and where it came
+   * in the order of ordinary items. */
+  int thread_id;
+  int seq;
+  int ran;
+} steal_work_t;
+
+static void *
+new_steal_state(void *arg)
+{
+  static int next_id = 0;
+  int *id = tor_malloc(sizeof(int));
+  (void)arg;
+  /* The pool makes its threads' states in order, from the main thread. */
+  *id = next_id++;
+  return id;
+}
+
+static void
+free_steal_state(void *arg)
+{
+  tor_free(arg);
+}
+
+static workqueue_reply_t
+workqueue_do_steal(void *state, void *work)
+{
+  steal_work_t *w = work;
+  const int id = *(int *)state;
+
+  tor_mutex_acquire(&steal_lock);
+  w->thread_id = id;
+  w->ran = 1;
+  if (w->kind == STEAL_KIND_BLOCK) {
+    ++steal_n_blocked;
+    while (steal_released != id && steal_released != STEAL_RELEASE_ALL)
+      tor_cond_wait(&steal_cond, &steal_lock, NULL);
+  } else if (w->kind == STEAL_KIND_HOLD) {
+    steal_hold_started = 1;
+    while (!steal_hold_released)
+      tor_cond_wait(&steal_cond, &steal_lock, NULL);
+  }
+  w->seq = steal_seq++;
+  tor_mutex_release(&steal_lock);
+  return WQ_RPL_REPLY;
+}
+
+static workqueue_reply_t
+workqueue_do_steal_shutdown(void *state, void *work)
+{
+  (void)work;
+  tor_free(state);
+  return WQ_RPL_SHUTDOWN;
+}
+
+static void
+handle_steal_reply(void *arg)
+{
+  (void)arg;
+  ++steal_n_replies;
+}
+
+/** Wait up to ten seconds for *<b>var</b>, which is protected by
+ * steal_lock, to reach <b>target</b>, handling replies from <b>rq</b>
+ * meanwhile.  Return 0 if it does, and -1 if not. */
+static int
+steal_wait_for(replyqueue_t *rq, const int *var, int target)
+{
+  int i, val;
+  for (i = 0; i < 10000; ++i) {
+    replyqueue_process(rq);
+    tor_mutex_acquire(&steal_lock);
+    val = *var;
+    tor_mutex_release(&steal_lock);
+    if (val >= target)
+      return 0;
+    tor_sleep_msec(1);
+  }
+  printf("Timed out: %d vs %d\n", val, target);
+  return -1;
+}
+
+#define N_STEAL_PER_PRIO 32
+
+/** Run the work stealing test on a new threadpool with <b>n_threads</b>
+ * threads, whose reply queue uses the alert sockets allowed by
+ * <b>as_flags</b>.  Return 0 on success, 77 if we can't make the reply
+ * queue, and 1 on failure. */
+static int
+run_steal_test(uint32_t as_flags, int n_threads)
+{
+  const workqueue_priority_t prios[] = { WQ_PRI_LOW, WQ_PRI_MED, WQ_PRI_HIGH };
+  const int n_work = N_STEAL_PER_PRIO * 3 + 1;
+  steal_work_t *blockers, *work;
+  workqueue_entry_t **ents;
+  replyqueue_t *rq;
+  threadpool_t *tp;
+  int i, n_cancelled = 0, ok = 1;
+  int last_seq[WQ_PRI_LOW+1], first_seq[WQ_PRI_LOW+1];
+  /* Thread 1 always takes the highest priority work available. */
+  const int free_thread = 1;
+
+  rq = replyqueue_new(as_flags);
+  if (as_flags && rq == NULL)
+    return 77; // 77 means "skipped".
+  tor_assert(rq);
+  tor_mutex_init(&steal_lock);
+  tor_cond_init(&steal_cond);
+  tp = threadpool_new(n_threads, rq, new_steal_state, free_steal_state,
+                      NULL);
+  tor_assert(tp);
+
+  blockers = tor_calloc(n_threads, sizeof(steal_work_t));
+  work = tor_calloc(n_work, sizeof(steal_work_t));
+  ents = tor_calloc(n_work, sizeof(workqueue_entry_t *));
+
+  /* Occupy every thread. */
+  for (i = 0; i < n_threads; ++i) {
+    blockers[i].kind = STEAL_KIND_BLOCK;
+    threadpool_queue_work(tp, workqueue_do_steal, handle_steal_reply,
+                          &blockers[i]);
+  }
+  if (steal_wait_for(rq, &steal_n_blocked, n_threads) < 0)
+    return 1;
+
+  /* Queue lowest priority first: each item lands on a random thread's
+   * queue.  One last high-priority item will hold its thread. */
+  for (i = 0; i < n_work - 1; ++i) {
+    work[i].prio = prios[i / N_STEAL_PER_PRIO];
+    ents[i] = threadpool_queue_work_priority(tp, work[i].prio,
+                                             workqueue_do_steal,
+                                             handle_steal_reply, &work[i]);
+  }
+  work[i].prio = WQ_PRI_HIGH;
+  work[i].kind = STEAL_KIND_HOLD;
+  ents[i] = threadpool_queue_work_priority(tp, work[i].prio,
+                                           workqueue_do_steal,
+                                           handle_steal_reply, &work[i]);
+
+  /* Nothing has started, so we can cancel anything. */
+  for (i = N_STEAL_PER_PRIO; i < 2 * N_STEAL_PER_PRIO; i += 2) {
+    if (workqueue_entry_cancel(ents[i]) != &work[i]) {
+      printf("Couldn't cancel pending work %d\n", i);
+      return 1;
+    }
+    ents[i] = NULL;
+    ++n_cancelled;
+  }
+
+  /* Let one thread go.  Once it has taken the holding item, that item is
+   * not pending any more, even if it was on another thread's queue. */
+  tor_mutex_acquire(&steal_lock);
+  steal_released = free_thread;
+  tor_cond_signal_all(&steal_cond);
+  tor_mutex_release(&steal_lock);
+  if (steal_wait_for(rq, &steal_hold_started, 1) < 0)
+    return 1;
+  if (workqueue_entry_cancel(ents[n_work - 1]) != NULL) {
+    puts("Cancelled work that had started");
+    return 1;
+  }
+  tor_mutex_acquire(&steal_lock);
+  steal_hold_released = 1;
+  tor_cond_signal_all(&steal_cond);
+  tor_mutex_release(&steal_lock);
+
+  if (steal_wait_for(rq, &steal_n_replies, 1 + n_work - n_cancelled) < 0)
+    return 1;
+
+  for (i = WQ_PRI_HIGH; i <= WQ_PRI_LOW; ++i) {
+    first_seq[i] = INT_MAX;
+    last_seq[i] = -1;
+  }
+  for (i = 0; i < n_work; ++i) {
+    if (!ents[i]) {
+      if (work[i].ran) {
+        printf("Cancelled work %d ran anyway\n", i);
+        ok = 0;
+      }
+      continue;
+    }
+    if (!work[i].ran || work[i].thread_id != free_thread) {
+      printf("Work %d ran on thread %d, not %d\n", i,
+             work[i].ran ? work[i].thread_id : -1, free_thread);
+      ok = 0;
+    }
+    first_seq[work[i].prio] = MIN(first_seq[work[i].prio], work[i].seq);
+    last_seq[work[i].prio] = MAX(last_seq[work[i].prio], work[i].seq);
+  }
+  if (last_seq[WQ_PRI_HIGH] > first_seq[WQ_PRI_MED] ||
+      last_seq[WQ_PRI_MED] > first_seq[WQ_PRI_LOW]) {
+    puts("Work ran out of priority order");
+    ok = 0;
+  }
+
+  tor_mutex_acquire(&steal_lock);
+  steal_released = STEAL_RELEASE_ALL;
+  tor_cond_signal_all(&steal_cond);
+  tor_mutex_release(&steal_lock);
+  if (steal_wait_for(rq, &steal_n_replies,
+                     n_threads + n_work - n_cancelled) < 0)
+    return 1;
+  threadpool_queue_update(tp, NULL, workqueue_do_steal_shutdown, NULL, NULL);
+
+  tor_free(blockers);
+  tor_free(work);
+  tor_free(ents);
+  puts(ok ? "OK" : "FAIL");
+  return ok ? 0 : 1;
+}
+
 static void
 help(void)
 {
@@ -329,16 +591,94 @@ help(void)
      "  -L <lowwater> Add items whenever fewer than this many are pending\n"
      "  -C <cancel>   Try to cancel N items of every batch that we add\n"
      "  -R <ratio>    Make one out of this many items be a slow (RSA) one\n"
+     "  -S            Stress the reply queue: run empty items with 1, 2,\n"
+     "                4, ... -T threads (default 64), and report replies\n"
+     "                per second for each\n"
+     "  -W            Test work stealing, priorities, and cancellation\n"
+     "                while all but one of the -T threads are busy\n"
      "  --no-{eventfd2,eventfd,pipe2,pipe,socketpair}\n"
      "                Disable one of the alert_socket backends.");
 }
 
-int
-main(int argc, char **argv)
+/** Run opt_n_items items of work on a new threadpool with <b>n_threads</b>
+ * threads, whose reply queue uses the alert sockets allowed by
+ * <b>as_flags</b>.  Return 0 on success, 77 if we can't make the reply
+ * queue, and 1 on failure. */
+static int
+run_workqueue(uint32_t as_flags, int n_threads)
 {
   replyqueue_t *rq;
   threadpool_t *tp;
+  monotime_t start, end;
   int i;
+
+  n_sent = rsa_sent = ecdh_sent = 0;
+  n_received = n_received_previously = 0;
+  n_failed_cancel = n_successful_cancel = 0;
+  shutting_down = 0;
+
+  rq = replyqueue_new(as_flags);
+  if (as_flags && rq == NULL)
+    return 77; // 77 means "skipped".
+
+  tor_assert(rq);
+  tp = threadpool_new(n_threads,
+                      rq, new_state, free_state, NULL);
+  tor_assert(tp);
+
+  {
+    int r = threadpool_register_reply_event(tp,
+                                            replysock_readable_cb);
+    tor_assert(r == 0);
+  }
+
+#ifdef TRACK_RESPONSES
+  handled = bitarray_init_zero(opt_n_items);
+  received = bitarray_init_zero(opt_n_items);
+  tor_mutex_init(&bitmap_mutex);
+  handled_len = opt_n_items;
+#endif /* defined(TRACK_RESPONSES) */
+
+  monotime_get(&start);
+  for (i = 0; i < opt_n_inflight; ++i) {
+    if (! add_work(tp)) {
+      puts("Couldn't add work.");
+      return 1;
+    }
+  }
+
+  {
+    struct timeval limit = { 180, 0 };
+    tor_libevent_exit_loop_after_delay(tor_libevent_get_base(), &limit);
+  }
+
+  tor_libevent_run_event_loop(tor_libevent_get_base(), 0);
+  monotime_get(&end);
+
+  if (n_sent != opt_n_items || n_received+n_successful_cancel != n_sent) {
+    printf("%d vs %d\n", n_sent, opt_n_items);
+    printf("%d+%d vs %d\n", n_received, n_successful_cancel, n_sent);
+    puts("FAIL");
+    return 1;
+  } else if (no_shutdown) {
+    puts("Accepted work after shutdown\n");
+    puts("FAIL");
+  } else if (opt_stress) {
+    const int64_t usec = monotime_diff_usec(&start, &end);
+    printf("%2d threads: %d replies in %.3f sec: %.0f replies/sec\n",
+           n_threads, n_received, usec / 1e6,
+           usec ? n_received * 1e6 / usec : 0.0);
+  } else {
+    puts("OK");
+  }
+  return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+  int i, r;
+  int opt_n_threads_set = 0;
   tor_libevent_cfg_t evcfg;
   uint32_t as_flags = 0;
 
@@ -347,6 +687,7 @@ main(int argc, char **argv)
       opt_verbose = 1;
     } else if (!strcmp(argv[i], "-T") && i+1<argc) {
       opt_n_threads = atoi(argv[++i]);
+      opt_n_threads_set = 1;
     } else if (!strcmp(argv[i], "-N") && i+1<argc) {
       opt_n_items = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-I") && i+1<argc) {
@@ -357,6 +698,10 @@ main(int argc, char **argv)
       opt_ratio_rsa = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-C") && i+1<argc) {
       opt_n_cancel = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-S")) {
+      opt_stress = 1;
+    } else if (!strcmp(argv[i], "-W")) {
+      opt_steal = 1;
     } else if (!strcmp(argv[i], "--no-eventfd2")) {
       as_flags |= ASOCKS_NOEVENTFD2;
     } else if (!strcmp(argv[i], "--no-eventfd")) {
@@ -376,7 +721,10 @@ main(int argc, char **argv)
     }
   }
 
-  if (opt_n_threads < 1 ||
+  if (opt_stress && !opt_n_threads_set)
+    opt_n_threads = 64;
+
+  if (opt_n_threads < 1 || (opt_steal && opt_n_threads < 2) ||
       opt_n_items < 1 || opt_n_inflight < 1 || opt_n_lowwater < 0 ||
       opt_n_cancel > opt_n_inflight || opt_n_inflight > MAX_INFLIGHT ||
       opt_ratio_rsa < 0) {
@@ -390,6 +738,7 @@ main(int argc, char **argv)
 
   init_logging(1);
   network_init();
+  monotime_init();
   if (crypto_global_init(1, NULL, NULL) < 0) {
     printf("Couldn't initialize crypto subsystem; exiting.\n");
     return 1;
@@ -399,57 +748,21 @@ main(int argc, char **argv)
     return 1;
   }
 
-  rq = replyqueue_new(as_flags);
-  if (as_flags && rq == NULL)
-    return 77; // 77 means "skipped".
-
-  tor_assert(rq);
-  tp = threadpool_new(opt_n_threads,
-                      rq, new_state, free_state, NULL);
-  tor_assert(tp);
-
   crypto_seed_weak_rng(&weak_rng);
 
   memset(&evcfg, 0, sizeof(evcfg));
   tor_libevent_initialize(&evcfg);
 
-  {
-    int r = threadpool_register_reply_event(tp,
-                                            replysock_readable_cb);
-    tor_assert(r == 0);
-  }
-
-#ifdef TRACK_RESPONSES
-  handled = bitarray_init_zero(opt_n_items);
-  received = bitarray_init_zero(opt_n_items);
-  tor_mutex_init(&bitmap_mutex);
-  handled_len = opt_n_items;
-#endif /* defined(TRACK_RESPONSES) */
-
-  for (i = 0; i < opt_n_inflight; ++i) {
-    if (! add_work(tp)) {
-      puts("Couldn't add work.");
-      return 1;
-    }
-  }
-
-  {
-    struct timeval limit = { 180, 0 };
-    tor_libevent_exit_loop_after_delay(tor_libevent_get_base(), &limit);
-  }
-
-  tor_libevent_run_event_loop(tor_libevent_get_base(), 0);
-
-  if (n_sent != opt_n_items || n_received+n_successful_cancel != n_sent) {
-    printf("%d vs %d\n", n_sent, opt_n_items);
-    printf("%d+%d vs %d\n", n_received, n_successful_cancel, n_sent);
-    puts("FAIL");
-    return 1;
-  } else if (no_shutdown) {
-    puts("Accepted work after shutdown\n");
-    puts("FAIL");
-  } else {
-    puts("OK");
-    return 0;
+  if (opt_steal)
+    return run_steal_test(as_flags, opt_n_threads);
+  if (!opt_stress)
+    return run_workqueue(as_flags, opt_n_threads);
+
+  for (i = 1; ; i *= 2) {
+    if (i > opt_n_threads)
+      i = opt_n_threads;
+    r = run_workqueue(as_flags, i);
+    if (r != 0 || i == opt_n_threads)
+      return r;
   }
 }